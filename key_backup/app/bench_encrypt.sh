@@ -0,0 +1,45 @@
+#!/bin/bash
+# Throughput of encryptData for a few file sizes (MB), block sizes (KiB) and
+# pipeline depths, e.g. BLOCKS="64 1024" DEPTHS="1 4" ./bench_encrypt.sh 16 64
+# Depth 1 runs read, device and write in turn, larger depths overlap them and
+# XOR the data with keystream the device made ahead, at the reported XOR rate.
+# The chunked GCM format is measured for every block size and WORKERS count,
+# sealed on the device (-g) and on the host under a wrapped data key (-e).
+
+SIZES=${@:-1 16 64}
+BLOCKS=${BLOCKS:-64 256 1024 4096}
+DEPTHS=${DEPTHS:-1 2 4 8}
+WORKERS=${WORKERS:-1 4}
+TMP_DIR=$(mktemp -d)
+trap "rm -rf $TMP_DIR" EXIT
+
+for size in $SIZES; do
+    dd if=/dev/urandom of=$TMP_DIR/data.bin bs=1M count=$size status=none
+    echo "== ${size} MB"
+    for block in $BLOCKS; do
+        for depth in $DEPTHS; do
+            echo -n "encrypt ${block} KiB x${depth}: "
+            ./encryptData -b $block -n $depth -i $TMP_DIR/data.bin -o $TMP_DIR/data.enc | tail -n 1
+            echo -n "decrypt ${block} KiB x${depth}: "
+            ./encryptData -b $block -n $depth -d -i $TMP_DIR/data.enc -o $TMP_DIR/data.dec | tail -n 1
+            if ! cmp -s $TMP_DIR/data.bin $TMP_DIR/data.dec; then
+                echo "round trip mismatch"
+                exit 1
+            fi
+        done
+        for workers in $WORKERS; do
+            echo -n "gcm encrypt ${block} KiB x${workers}: "
+            ./encryptData -g -b $block -j $workers -i $TMP_DIR/data.bin -o $TMP_DIR/data.gcm | tail -n 1
+            echo -n "gcm verify ${block} KiB x${workers}: "
+            ./encryptData -d -V -j $workers -i $TMP_DIR/data.gcm | tail -n 1
+            echo -n "envelope encrypt ${block} KiB x${workers}: "
+            ./encryptData -e -b $block -j $workers -i $TMP_DIR/data.bin -o $TMP_DIR/data.gcm | tail -n 1
+            echo -n "envelope decrypt ${block} KiB x${workers}: "
+            ./encryptData -d -j $workers -i $TMP_DIR/data.gcm -o $TMP_DIR/data.dec | tail -n 1
+            if ! cmp -s $TMP_DIR/data.bin $TMP_DIR/data.dec; then
+                echo "envelope round trip mismatch"
+                exit 1
+            fi
+        done
+    done
+done
@@ -0,0 +1,47 @@
+#!/bin/bash
+# Per-call latency of the key tools without and with keyService, e.g.
+# CALLS=1000 ./bench_keyd.sh
+# Each call opens its own device session, or its own connection to the
+# daemon, the way one run of hmacKey does. The run times below also count
+# process start-up.
+# With BULK_STORE the key store in that directory is first imported into the
+# standby at STANDBY (a server started with -s -P Server), many records per
+# connection, e.g. BULK_STORE=/data/primary STANDBY=10.0.0.2:4434 ./bench_keyd.sh
+
+CALLS=${CALLS:-200}
+RUNS=${RUNS:-20}
+export KEYBACKUP_SOCKET=${KEYBACKUP_SOCKET:-$(mktemp -u /tmp/keyService.XXXXXX)}
+
+runs() {
+    local start=$(date +%s%N)
+    for i in $(seq $RUNS); do
+        ./hmacKey > /dev/null || exit 1
+    done
+    echo "hmacKey $1: $(( ($(date +%s%N) - start) / RUNS / 1000 )) us per run"
+}
+
+if [ -n "$BULK_STORE" ]; then
+    if [ -z "$STANDBY" ]; then
+        echo "set STANDBY to the host:port of a standby"
+        exit 1
+    fi
+    out=$(./server -d $BULK_STORE -E $STANDBY) || exit 1
+    echo "$out" | grep "^Exported" || exit 1
+fi
+
+if ./keyService -t 1 | grep -q keyService; then
+    echo "stop the running keyService first"
+    exit 1
+fi
+./keyService -t $CALLS || exit 1
+runs "without keyService"
+
+./keyService > /dev/null &
+pid=$!
+trap "kill $pid 2> /dev/null" EXIT
+for i in $(seq 50); do
+    [ -S $KEYBACKUP_SOCKET ] && break
+    sleep 0.1
+done
+./keyService -t $CALLS || exit 1
+runs "through keyService"
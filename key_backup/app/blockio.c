@@ -0,0 +1,254 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      blockio.c
+ * @brief     Large-block file I/O for the data tools
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "blockio.h"
+
+int blockio_block_valid(size_t block_size)
+{
+    if (block_size < BLOCKIO_BLOCK_MIN || block_size > BLOCKIO_BLOCK_MAX ||
+        block_size % BLOCKIO_ALIGN != 0) {
+        APP_ERR("block size %zu is not a multiple of %d in [%d, %d]\n",
+            block_size, BLOCKIO_ALIGN, BLOCKIO_BLOCK_MIN, BLOCKIO_BLOCK_MAX);
+        return 0;
+    }
+    return 1;
+}
+
+/* Both names refer to one existing file */
+int blockio_same_file(const char *a, const char *b)
+{
+    struct stat st_a, st_b;
+
+    if (stat(a, &st_a) != 0 || stat(b, &st_b) != 0) {
+        return 0;
+    }
+    return st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+int blockio_is_stdio(const char *name)
+{
+    return name != NULL && strcmp(name, BLOCKIO_STDIO) == 0;
+}
+
+/* Pipes, FIFOs and terminals have no offsets */
+static int blockio_seekable(int fd)
+{
+    return lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+/**
+ * Files are read and written with pread/pwrite in whole blocks, so a block
+ * costs one system call each way and one device submission. Offsets are
+ * explicit, which lets the same descriptor serve in-place rewriting without
+ * any seeking.
+ *
+ * "-" stands for stdin or stdout, which like any other pipe are read and
+ * written in order. For stdout the data goes to a private copy of the
+ * descriptor and stdout itself is pointed at stderr, so that no message can
+ * end up inside the data.
+ */
+int blockio_open(blockio_st *bio, const char *read_file, const char *write_file, size_t block_size)
+{
+    struct stat st_r, st_w;
+
+    memset(bio, 0, sizeof(*bio));
+    bio->fd_r = bio->fd_w = -1;
+
+    if (blockio_block_valid(block_size) == 0) {
+        return -1;
+    }
+    bio->block_size = block_size;
+
+    bio->fd_r = blockio_is_stdio(read_file) ? dup(STDIN_FILENO) : open(read_file, O_RDONLY);
+    if (bio->fd_r < 0) {
+        APP_ERR("open %s fail, errno = %d\n", read_file, errno);
+        return -1;
+    }
+    if (fstat(bio->fd_r, &st_r) != 0) {
+        APP_ERR("stat %s fail, errno = %d\n", read_file, errno);
+        goto ERR;
+    }
+    bio->seq_r = !blockio_seekable(bio->fd_r);
+    bio->in_size = S_ISREG(st_r.st_mode) ? st_r.st_size : -1;
+
+    if (blockio_is_stdio(write_file)) {
+        fflush(stdout);
+        bio->fd_w = dup(STDOUT_FILENO);
+        if (bio->fd_w < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            APP_ERR("stdout fail, errno = %d\n", errno);
+            goto ERR;
+        }
+    }
+    // also catches other names for the input, which O_TRUNC would destroy
+    else if (stat(write_file, &st_w) == 0 &&
+        st_w.st_dev == st_r.st_dev && st_w.st_ino == st_r.st_ino) {
+        close(bio->fd_r);
+        bio->fd_r = open(read_file, O_RDWR);
+        if (bio->fd_r < 0) {
+            APP_ERR("open %s fail, errno = %d\n", read_file, errno);
+            return -1;
+        }
+        bio->fd_w = bio->fd_r;
+        bio->same_io = 1;
+        bio->rd_end = st_r.st_size;
+    }
+    else {
+        bio->fd_w = open(write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (bio->fd_w < 0) {
+            APP_ERR("open %s fail, errno = %d\n", write_file, errno);
+            goto ERR;
+        }
+    }
+    bio->seq_w = !blockio_seekable(bio->fd_w);
+    if (!bio->seq_r) {
+        posix_fadvise(bio->fd_r, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return 0;
+
+ERR:
+    if (bio->fd_w >= 0) {
+        close(bio->fd_w);
+        bio->fd_w = -1;
+    }
+    close(bio->fd_r);
+    bio->fd_r = -1;
+    return -1;
+}
+
+int blockio_close(blockio_st *bio)
+{
+    int ret = 0;
+
+    if (bio->fd_w >= 0 && bio->fd_w != bio->fd_r) {
+        if (close(bio->fd_w) != 0) {
+            APP_ERR("close fail, errno = %d\n", errno);
+            ret = -1;
+        }
+    }
+    if (bio->fd_r >= 0) {
+        if (close(bio->fd_r) != 0) {
+            APP_ERR("close fail, errno = %d\n", errno);
+            ret = -1;
+        }
+    }
+    bio->fd_r = bio->fd_w = -1;
+    return ret;
+}
+
+/* Page aligned, with room for what a stream update may return on top of a block */
+u8 *blockio_alloc(const blockio_st *bio)
+{
+    void *buf = NULL;
+
+    if (posix_memalign(&buf, BLOCKIO_ALIGN, bio->block_size + BLOCKIO_SLACK) != 0) {
+        APP_ERR("posix_memalign %zu fail\n", bio->block_size);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Fills a whole block unless the file ends first, returns 0 at end of file */
+ssize_t blockio_read(blockio_st *bio, u8 *buf)
+{
+    return blockio_read_len(bio, buf, bio->block_size);
+}
+
+ssize_t blockio_read_len(blockio_st *bio, u8 *buf, size_t size)
+{
+    size_t len = 0;
+    ssize_t n;
+
+    if (bio->same_io && (off_t)size > bio->rd_end - bio->rd_off) {
+        size = bio->rd_end - bio->rd_off;
+    }
+    while (len < size) {
+        // a pipe hands out whatever is there, keep reading until the block is full
+        n = bio->seq_r ? read(bio->fd_r, buf + len, size - len) :
+                         pread(bio->fd_r, buf + len, size - len, bio->rd_off + len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            APP_ERR("read fail, errno = %d\n", errno);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    bio->rd_off += len;
+    return len;
+}
+
+int blockio_write(blockio_st *bio, const u8 *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = bio->seq_w ? write(bio->fd_w, buf + done, len - done) :
+                         pwrite(bio->fd_w, buf + done, len - done, bio->wr_off + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            APP_ERR("write fail, errno = %d\n", errno);
+            return -1;
+        }
+        done += n;
+    }
+    bio->wr_off += len;
+    return 0;
+}
+
+/* In place, cut what is left of the input behind a shorter output */
+int blockio_truncate(blockio_st *bio)
+{
+    if (bio->same_io && bio->wr_off < bio->rd_off) {
+        if (ftruncate(bio->fd_w, bio->wr_off) != 0) {
+            APP_ERR("ftruncate fail, errno = %d\n", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      blockio.h
+ * @brief     Large-block file I/O for the data tools
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __BLOCKIO_H__
+#define __BLOCKIO_H__
+
+#include <sys/types.h>
+#include "libcore.h"
+
+#define BLOCKIO_BLOCK_MIN       (64 * 1024)
+#define BLOCKIO_BLOCK_MAX       (4 * 1024 * 1024)
+#define BLOCKIO_BLOCK_DEFAULT   (1024 * 1024)
+#define BLOCKIO_ALIGN           4096
+#define BLOCKIO_SLACK           16      /* a cipher block the stream may hand back late */
+#define BLOCKIO_STDIO           "-"     /* file name for stdin or stdout */
+
+typedef struct {
+    int fd_r;
+    int fd_w;
+    int same_io;                ///< input and output are the same file, written in place
+    int seq_r;                  ///< input is a pipe or terminal, read in order without offsets
+    int seq_w;
+    off_t in_size;              ///< input size at open, -1 for a pipe
+    size_t block_size;
+    off_t rd_off;
+    off_t rd_end;               ///< in place, input size at open, the output may grow past it
+    off_t wr_off;               ///< in place, only input already read may be overwritten
+} blockio_st;
+
+int blockio_block_valid(size_t block_size);
+int blockio_same_file(const char *a, const char *b);
+int blockio_is_stdio(const char *name);
+int blockio_open(blockio_st *bio, const char *read_file, const char *write_file, size_t block_size);
+int blockio_close(blockio_st *bio);
+u8 *blockio_alloc(const blockio_st *bio);
+ssize_t blockio_read(blockio_st *bio, u8 *buf);
+ssize_t blockio_read_len(blockio_st *bio, u8 *buf, size_t size);
+int blockio_write(blockio_st *bio, const u8 *buf, size_t len);
+int blockio_truncate(blockio_st *bio);
+
+#endif /* __BLOCKIO_H__ */
@@ -0,0 +1,384 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      bulk.c
+ * @brief     Streaming export of the whole key store to another server
+ * @copyright 2023 PUFsecurity
+ *
+ * Three stages connected by bounded rings, so disk reads, device work and
+ * network writes overlap:
+ *   reader  scans the key store segments (and legacy .bin files),
+ *   device  unwraps each record with the local export key and wraps it again
+ *           under the ECDH KEK shared with the destination,
+ *   sender  streams the records to the destination, which appends them to a
+ *           single archive segment and syncs it once at the end.
+ */
+
+#include <dirent.h>
+#include <time.h>
+
+#include "bulk.h"
+
+static void bulk_ring_init(bulk_ring_st *ring)
+{
+    memset(ring, 0, sizeof(bulk_ring_st));
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->not_empty, NULL);
+    pthread_cond_init(&ring->not_full, NULL);
+}
+
+static void bulk_ring_destroy(bulk_ring_st *ring)
+{
+    pthread_cond_destroy(&ring->not_full);
+    pthread_cond_destroy(&ring->not_empty);
+    pthread_mutex_destroy(&ring->lock);
+}
+
+static int bulk_ring_push(bulk_ring_st *ring, const wrap_packet_st *item)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    while ((ring->count == BULK_RING_RECORDS) && !ring->aborted) {
+        pthread_cond_wait(&ring->not_full, &ring->lock);
+    }
+    if (ring->aborted) {
+        ret = 1;
+        goto RET;
+    }
+    memcpy(&ring->items[(ring->head + ring->count) % BULK_RING_RECORDS], item, sizeof(wrap_packet_st));
+    ring->count++;
+    pthread_cond_signal(&ring->not_empty);
+RET:
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+// returns 1 once the ring is drained and closed, or aborted
+static int bulk_ring_pop(bulk_ring_st *ring, wrap_packet_st *item)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    while ((ring->count == 0) && !ring->closed && !ring->aborted) {
+        pthread_cond_wait(&ring->not_empty, &ring->lock);
+    }
+    if (ring->aborted || (ring->count == 0)) {
+        ret = 1;
+        goto RET;
+    }
+    memcpy(item, &ring->items[ring->head], sizeof(wrap_packet_st));
+    ring->head = (ring->head + 1) % BULK_RING_RECORDS;
+    ring->count--;
+    pthread_cond_signal(&ring->not_full);
+RET:
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+static void bulk_ring_close(bulk_ring_st *ring, int abort)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = 1;
+    if (abort) {
+        ring->aborted = 1;
+    }
+    pthread_cond_broadcast(&ring->not_empty);
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void bulk_abort(bulk_st *b)
+{
+    bulk_ring_close(&b->read_ring, 1);
+    bulk_ring_close(&b->send_ring, 1);
+}
+
+static int bulk_scan_cb(const keystore_record_st *rec, void *arg)
+{
+    bulk_st *b = (bulk_st *)arg;
+    wrap_packet_st item;
+
+    memset(&item, 0, sizeof(wrap_packet_st));
+    item.event = BULK_KEY;
+    item.generation = rec->generation;
+    memcpy(&item.wrap_key, &rec->wrap_key, sizeof(wrap_key_st));
+    if (bulk_ring_push(&b->read_ring, &item) != 0) {
+        return 1;
+    }
+    b->read++;
+    return 0;
+}
+
+/* Per-client .bin files from before the key store. Only clients without a
+ * key store generation are exported, as generation 1. */
+static int bulk_scan_legacy(bulk_st *b)
+{
+    keystore_st *ks = b->keystore;
+    char path[KEY_FILE_PATH_MAX + 256], macaddr[32], cipher[72], suffix[8];
+    struct dirent *entry;
+    wrap_packet_st item;
+    wrap_key_st probe;
+    uint32_t generation;
+    DIR *dir;
+    FILE *fp;
+    int ret = 0;
+
+    dir = opendir(ks->path[0] ? ks->path : ".");
+    if (dir == NULL) {
+        goto EXIT;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if ((sscanf(entry->d_name, "%31[0-9a-fA-F]_%64[0-9a-f]%7s", macaddr, cipher, suffix) != 3) ||
+            (strcmp(suffix, ".bin") != 0)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s", ks->path, entry->d_name);
+        memset(&item, 0, sizeof(wrap_packet_st));
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        ret = fread(&item.wrap_key, sizeof(wrap_key_st), 1, fp);
+        fclose(fp);
+        if (ret < 1) {
+            APP_WARN("%s is truncated, skipped\n", path);
+            continue;
+        }
+        memset(&probe, 0, sizeof(wrap_key_st));
+        memcpy(probe.cipher, item.wrap_key.cipher, sizeof(probe.cipher));
+        generation = KEYSTORE_LATEST;
+        if (keystore_get(ks, macaddr, &probe, &generation) == 0) {
+            continue;  // superseded by the key store
+        }
+        memset(item.wrap_key.macaddr, 0, sizeof(item.wrap_key.macaddr));
+        strcpy((char *)item.wrap_key.macaddr, macaddr);
+        item.event = BULK_KEY;
+        item.generation = 1;
+        if (bulk_ring_push(&b->read_ring, &item) != 0) {
+            ret = 1;
+            goto RET;
+        }
+        b->read++;
+        b->legacy++;
+    }
+    ret = 0;
+RET:
+    closedir(dir);
+EXIT:
+    return ret;
+}
+
+static void *bulk_reader(void *arg)
+{
+    bulk_st *b = (bulk_st *)arg;
+    int ret;
+
+    ret = keystore_scan(b->keystore, bulk_scan_cb, b);
+    if (ret == 0) {
+        ret = bulk_scan_legacy(b);
+    }
+    if (ret != 0) {
+        bulk_abort(b);
+    }
+    bulk_ring_close(&b->read_ring, 0);
+    return NULL;
+}
+
+static void *bulk_sender(void *arg)
+{
+    bulk_st *b = (bulk_st *)arg;
+    packet_st *packet = b->packet;
+
+    packet->send_buf_size = sizeof(wrap_packet_st);
+    while (bulk_ring_pop(&b->send_ring, (wrap_packet_st *)packet->send_buf) == 0) {
+        if (replica_send(packet) != 0) {
+            APP_ERR("send fail after %lu records\n", b->sent);
+            bulk_abort(b);
+            break;
+        }
+        b->sent++;
+    }
+    return NULL;
+}
+
+// device stage, runs in the caller's thread while it holds the device
+static pufs_status_t bulk_rewrap(bulk_st *b)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    wrap_packet_st item;
+    uint32_t keybits = 256;
+    uint32_t kekbits = 256;
+    uint32_t kwptype = AES_KW;
+
+    // the export KEK is the same for every record, derive it once
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, SERVER_WRAP_KEK_SLOT, kekbits,
+            PRF_HMAC, PUFSE_SHA_256, false,
+            NULL, 0, 1,
+            PUFKEY, SERVER_PUFSLOT_EXPORT, 256,
+            NULL, 0,  //salt
+            NULL, 0)); //info
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_kdf_hkdf_exp fail. check = %d \n", check);
+        goto RET;
+    }
+
+    while (bulk_ring_pop(&b->read_ring, &item) == 0) {
+        OPSTAT(pufs_import_wrapped_key, check = pufs_import_wrapped_key(
+                SSKEY, SERVER_KEY_SLOT, item.wrap_key.export_key,
+                keybits, SERVER_WRAP_KEK_SLOT, kekbits,
+                kwptype, NULL));
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("%s generation:[%u] unwrap fail. check = %d \n",
+                    item.wrap_key.macaddr, item.generation, check);
+            goto RET;
+        }
+        OPSTAT(pufs_export_wrapped_key, check = pufs_export_wrapped_key(
+                SSKEY, SERVER_KEY_SLOT, item.wrap_key.export_key,
+                keybits, SERVER_KEK_SLOT, kekbits,
+                kwptype, NULL));
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("pufs_export_wrapped_key_from_ka fail. check = %d \n", check);
+            goto RET;
+        }
+        item.wrap_key.export_key_size = 40;
+        sprintf(item.wrap_key.packet_name, "BULK_SERVER");
+        if (bulk_ring_push(&b->send_ring, &item) != 0) {
+            check = PUFS_ERROR;
+            goto RET;
+        }
+        b->rewrapped++;
+    }
+    pthread_mutex_lock(&b->read_ring.lock);
+    if (b->read_ring.aborted) {
+        check = PUFS_ERROR;
+    }
+    pthread_mutex_unlock(&b->read_ring.lock);
+RET:
+    return check;
+}
+
+int bulk_export(replica_st *rp, keystore_st *ks, const char *addr)
+{
+    struct timespec start, end;
+    pthread_t reader, sender;
+    result_packet_st *result;
+    packet_st packet;
+    pufs_status_t check;
+    bulk_st b;
+    double secs;
+    int sockfd, ret = 0;
+
+    ret = replica_add_standby(rp, addr);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    memset(&b, 0, sizeof(bulk_st));
+    b.keystore = ks;
+    b.packet = &packet;
+    bulk_ring_init(&b.read_ring);
+    bulk_ring_init(&b.send_ring);
+    replica_packet_init(&packet, ks);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sockfd = replica_connect(rp, &rp->standbys[rp->standby_num - 1], &packet.ssl);
+    if (sockfd < 0) {
+        ret = 1;
+        goto RET;
+    }
+    check = pufs_start(__func__);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_start fail, check = %d\n", check);
+        ret = 2;
+        goto CLOSE;
+    }
+    check = replica_handshake(&packet);
+    if (check != PUFS_SUCCESS) {
+        pufs_end(__func__);
+        ret = 3;
+        goto CLOSE;
+    }
+
+    if (pthread_create(&reader, NULL, bulk_reader, &b) != 0) {
+        pufs_end(__func__);
+        ret = 4;
+        goto CLOSE;
+    }
+    if (pthread_create(&sender, NULL, bulk_sender, &b) != 0) {
+        bulk_abort(&b);
+        pthread_join(reader, NULL);
+        pufs_end(__func__);
+        ret = 4;
+        goto CLOSE;
+    }
+    check = bulk_rewrap(&b);
+    pufs_end(__func__);
+    bulk_ring_close(&b.send_ring, check != PUFS_SUCCESS);
+    if (check != PUFS_SUCCESS) {
+        bulk_abort(&b);
+    }
+    pthread_join(reader, NULL);
+    pthread_join(sender, NULL);
+    if ((check != PUFS_SUCCESS) || b.send_ring.aborted) {
+        APP_ERR("export aborted: read %lu, rewrapped %lu, sent %lu\n", b.read, b.rewrapped, b.sent);
+        ret = 5;
+        goto CLOSE;
+    }
+
+    // the destination syncs its archive and confirms
+    result = (result_packet_st *)(packet.send_buf);
+    memset(result, 0, sizeof(result_packet_st));
+    result->event = FINAL_RESULT;
+    result->result = SERVER_SUCCESS;
+    strncpy(result->packet_name, "RESULT_BULK", 12);
+    packet.send_buf_size = sizeof(result_packet_st);
+    result = (result_packet_st *)(packet.recv_buf);
+    if ((replica_send(&packet) != 0) || (replica_recv(&packet) != 0) ||
+        (result->event != FINAL_RESULT) || (result->result != SERVER_SUCCESS)) {
+        APP_ERR("destination did not commit the archive\n");
+        ret = 6;
+        goto CLOSE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Exported %lu records (%lu legacy) to %s in %.2f s, %.0f records/s\n",
+            b.sent, b.legacy, addr, secs, secs > 0 ? b.sent / secs : 0.0);
+CLOSE:
+    if (sockfd >= 0) {
+        replica_close(packet.ssl, sockfd);
+    }
+RET:
+    bulk_ring_destroy(&b.send_ring);
+    bulk_ring_destroy(&b.read_ring);
+EXIT:
+    return ret;
+}
@@ -0,0 +1,73 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      bulk.h
+ * @brief     Streaming export of the whole key store to another server
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __BULK_H__
+#define __BULK_H__
+
+#include <pthread.h>
+#include "libcore.h"
+#include "keystore.h"
+#include "replica.h"
+
+#define BULK_RING_RECORDS            64      /* records in flight between two pipeline stages */
+
+typedef struct {
+    wrap_packet_st items[BULK_RING_RECORDS];
+    int head;
+    int count;
+    int closed;                         ///< producer is done
+    int aborted;                        ///< a stage failed, everybody stops
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} bulk_ring_st;
+
+typedef struct {
+    keystore_st *keystore;
+    packet_st *packet;
+    bulk_ring_st read_ring;             ///< stored records, reader -> device
+    bulk_ring_st send_ring;             ///< rewrapped records, device -> sender
+    unsigned long read;
+    unsigned long rewrapped;
+    unsigned long sent;
+    unsigned long legacy;
+} bulk_st;
+
+int bulk_export(replica_st *rp, keystore_st *ks, const char *addr);
+
+#endif /* __BULK_H__ */
@@ -38,11 +38,22 @@
 
 
 #include "libcore.h"
+#include "keyd.h"
 
 int main(void)
 {
     pufs_status_t ret = PUFS_SUCCESS;
-    ret = clear_key();
+    int fd;
+
+    // a running keyService owns the device
+    fd = keyd_connect();
+    if (fd >= 0) {
+        ret = keyd_clear_key(fd);
+        close(fd);
+    }
+    else {
+        ret = clear_key();
+    }
     if (ret == PUFS_SUCCESS) {
         printf("Clear Key OK\n");
     }
@@ -53,8 +64,6 @@ int main(void)
         printf("Clear Key FAIL!\n");
     }
 
-    STATISTICS_SHOW();
-
     return ret;
 }
 
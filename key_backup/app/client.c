@@ -505,9 +505,10 @@ EXIT:
 
 void usage(char *argv0)
 {
-    printf("Usage: %s [-a SERVER_IP] [-p SERVER_PORT] [-c PASSWD] [-m MAC_ADDR] [-r]\n", argv0);
+    printf("Usage: %s [-a SERVER_IP] [-p SERVER_PORT] [-c PASSWD] [-m MAC_ADDR] [-r] [-v GENERATION]\n", argv0);
     printf("    -r  restore key from server\n");
-    printf("    -m  MAC address\n\n");
+    printf("    -m  MAC address\n");
+    printf("    -v  key generation to restore, latest by default\n\n");
 }
 
 
@@ -523,7 +524,7 @@ int main(int argc, char *argv[])
     memset(&client_packet, 0, sizeof(packet_st));
 
     client_packet.cmd = BACKUP;
-    while ((opt = getopt(argc, argv, "a:p:c:rm:")) != -1) {
+    while ((opt = getopt(argc, argv, "a:p:c:rm:v:")) != -1) {
         switch (opt) {
             case 'a':
                 ipaddr = optarg;
@@ -549,6 +550,9 @@ int main(int argc, char *argv[])
             case 'r':
                 client_packet.cmd = RESTORE;
                 break;
+            case 'v':
+                client_packet.generation = strtoul(optarg, NULL, 10);
+                break;
             default:
                 usage(argv[0]);
                 goto EXIT;
@@ -580,7 +584,6 @@ int main(int argc, char *argv[])
     client_state_handle(&client_packet);
     free_ssl_connect(&client_packet.ssl, &ctx);
 EXIT:
-    STATISTICS_SHOW();
     return ret;
 }
 
@@ -52,6 +52,8 @@
 #include "pufs_kdf.h"
 #include "pufs_rt.h"
 #include "pufs_sp38a.h"
+#include "pufs_sp38d.h"
+#include "pufs_sp38e.h"
 
 #include "pufs_ka.h"
 #include "pufs_hmac.h"
@@ -69,10 +71,6 @@
 #define PASSWD_MAX 128
 #define KEY_FILE_PATH_MAX 128
 
-//pufs_pal_mutex *mutex;
-int mutex_lock;
-
-
 #define PUFS_TUPLE_BYTES_ARRAY_TO_POINT(array, point) {\
     (point)->out1 = (array).out1;    \
     (point)->out2 = (array).out2;    \
@@ -102,7 +100,9 @@ typedef enum {
     ECDH_EXCHANGE,
     BACKUP_KEY,
     RESTORE_KEY,
-    FINAL_RESULT
+    FINAL_RESULT,
+    REPLICATE_KEY,
+    BULK_KEY
 } server_event_t;
 
 typedef enum {
@@ -184,6 +184,7 @@ typedef struct _ATT_ {
 typedef struct _ATT_ {
     server_event_t event;
     wrap_key_st wrap_key;
+    uint32_t generation;       /* key store generation, 0 for the latest */
 } wrap_packet_st;
 
 typedef void (*CALLBACK)(void *);
@@ -199,6 +200,8 @@ typedef enum {
     RESTORE,
 } cmd_t;
 
+typedef struct keystore keystore_st;
+
 
 typedef struct _ATT_ {
     char recv_buf[RECV_BUF_MAX];
@@ -217,19 +220,24 @@ typedef struct _ATT_ {
     char key_file_path[KEY_FILE_PATH_MAX];
     cmd_t cmd;
     char macaddress[32];
+    keystore_st *keystore;
+    uint32_t generation;
 } packet_st;
 
 #define CLIENT_EPHEMERAL_PRIVATE_SLOT PRK_0  // CLIENT_EPHEMERAL_PRIVATE_SLOT
 #define CLIENT_STATIC_PRIVATE_SLOT PRK_1     // CLIENT_STATIC_PRIVATE_SLOT
 #define CLIENT_KEK_SLOT SK256_1              // Client kek slot
 #define CLIENT_KEY_SLOT SK256_3              // Client key slot
+#define CLIENT_XTS_SLOT SK256_2              // Client XTS tweak key, derived from the client key
+#define CLIENT_NAMED_SLOT_A SK256_0          // Client named keys, loaded on demand, see keyslot.h
+#define CLIENT_NAMED_SLOT_B SK256_2          // Client named keys, shared with the XTS slot, see keyslot_claim
 #define CLIENT_PUFSLOT_UID PUFSLOT_0         // Client UID
 #define CLIENT_PUFSLOT_ECDH PUFSLOT_1        // Client generate EDCH static private key
 #define CLIENT_PUFSLOT_AESKEY PUFSLOT_2      // Client generate AES key
 
 #define SERVER_EPHEMERAL_PRIVATE_SLOT PRK_2  // SERVER_EPHEMERAL_PRIVATE_SLOT
 #define SERVER_STATIC_PRIVATE_SLOT PRK_1     // SERVER_STATIC_PRIVATE_SLOT
-#define SERVER_WRAP_KEK_SLOT SK256_0         // SERVER wrap key slot for restore
+#define SERVER_WRAP_KEK_SLOT SK256_0         // SERVER key store wrap key slot
 #define SERVER_KEK_SLOT SK256_1              // SERVER kek slot
 #define SERVER_KEY_SLOT SK256_2              // SERVER key slot
 #define SERVER_PUFSLOT_ECDH PUFSLOT_1        // SERVER generate EDCH static private key
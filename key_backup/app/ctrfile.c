@@ -0,0 +1,358 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      ctrfile.c
+ * @brief     Seekable CTR files with parallel byte-range access
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "blockio.h"
+#include "ctrfile.h"
+#include "keyd.h"
+
+/**
+ * A CTR file is a ctr_file_header_st followed by the ciphertext, which has
+ * the size of the plaintext. Any byte range can be decrypted on its own with
+ * ctr_crypt_at, so ranges are cut into pieces of at most piece_size bytes
+ * and workers take pieces in any order, writing each at its place in the
+ * output. Device calls take turns on pufs_device_lock, or go to
+ * keyService instead when the caller connected to it.
+ */
+
+typedef struct {
+    ctrfile_st *cf;
+    u8 *in;
+    u8 *out;
+} ctrfile_worker_st;
+
+static double ctrfile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ctrfile_pread(int fd, u8 *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int ctrfile_pwrite(int fd, const u8 *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pwrite(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static pufs_status_t ctrfile_piece(ctrfile_worker_st *w, const ctrfile_piece_st *piece)
+{
+    ctrfile_st *cf = w->cf;
+    pufs_status_t check;
+    off_t in_off = piece->plain_off + (cf->decrypt ? sizeof(cf->header) : 0);
+    double start;
+
+    if (ctrfile_pread(cf->fd_in, w->in, piece->len, in_off) != 0) {
+        APP_ERR("read at %lld fail\n", (long long)in_off);
+        return PUFS_ERROR;
+    }
+    pufs_device_lock();
+    start = ctrfile_now();
+    if (cf->keyd >= 0) {
+        check = keyd_ctr_crypt_at(cf->keyd, &cf->header, cf->decrypt, piece->plain_off,
+            w->out, w->in, piece->len);
+    }
+    else {
+        check = ctr_crypt_at(&cf->header, cf->decrypt, piece->plain_off, w->out, w->in, piece->len);
+    }
+    cf->device_secs += ctrfile_now() - start;
+    pufs_device_unlock();
+    if (check != PUFS_SUCCESS) {
+        return check;
+    }
+    if (ctrfile_pwrite(cf->fd_out, w->out, piece->len, piece->out_off) != 0) {
+        APP_ERR("write at %llu fail, errno = %d\n", (unsigned long long)piece->out_off, errno);
+        return PUFS_ERROR;
+    }
+    return PUFS_SUCCESS;
+}
+
+static void *ctrfile_worker(void *arg)
+{
+    ctrfile_worker_st *w = arg;
+    ctrfile_st *cf = w->cf;
+    pufs_status_t check;
+    uint64_t index;
+
+    for (;;) {
+        pthread_mutex_lock(&cf->lock);
+        if (cf->error != PUFS_SUCCESS || cf->next >= cf->npieces) {
+            pthread_mutex_unlock(&cf->lock);
+            break;
+        }
+        index = cf->next++;
+        pthread_mutex_unlock(&cf->lock);
+
+        check = ctrfile_piece(w, &cf->pieces[index]);
+        if (check != PUFS_SUCCESS) {
+            pthread_mutex_lock(&cf->lock);
+            if (cf->error == PUFS_SUCCESS) {
+                cf->error = check;
+                cf->bad_offset = cf->pieces[index].plain_off;
+            }
+            pthread_mutex_unlock(&cf->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* 1 when path starts with a CTR file header */
+int ctrfile_probe(const char *path)
+{
+    ctr_file_header_st header;
+    int fd, ret = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (ctrfile_pread(fd, (u8 *)&header, sizeof(header), 0) == 0 && ctr_file_header_valid(&header)) {
+        ret = 1;
+    }
+    close(fd);
+    return ret;
+}
+
+/* Cuts the ranges into pieces, each range lands in the output right after the previous one */
+static int ctrfile_plan(ctrfile_st *cf, const ctrfile_range_st *ranges, int nranges)
+{
+    uint64_t total = 0, off, end, out_off = cf->decrypt ? 0 : sizeof(cf->header);
+    int i;
+
+    for (i = 0; i < nranges; i++) {
+        end = ranges[i].length == 0 ? cf->plain_size : ranges[i].offset + ranges[i].length;
+        if (ranges[i].offset > cf->plain_size || end > cf->plain_size || end < ranges[i].offset) {
+            APP_ERR("range %llu+%llu is beyond the %llu bytes of data\n",
+                (unsigned long long)ranges[i].offset, (unsigned long long)ranges[i].length,
+                (unsigned long long)cf->plain_size);
+            return -1;
+        }
+        total += (end - ranges[i].offset + cf->piece_size - 1) / cf->piece_size;
+    }
+    cf->pieces = malloc((total ? total : 1) * sizeof(*cf->pieces));
+    if (cf->pieces == NULL) {
+        APP_ERR("ctrfile plan alloc fail\n");
+        return -1;
+    }
+    for (i = 0; i < nranges; i++) {
+        end = ranges[i].length == 0 ? cf->plain_size : ranges[i].offset + ranges[i].length;
+        for (off = ranges[i].offset; off < end; off += cf->piece_size) {
+            ctrfile_piece_st *piece = &cf->pieces[cf->npieces++];
+
+            piece->plain_off = off;
+            piece->out_off = out_off;
+            piece->len = end - off < cf->piece_size ? end - off : cf->piece_size;
+            out_off += piece->len;
+        }
+    }
+    cf->out_size = out_off;
+    return 0;
+}
+
+/**
+ * Encryption takes the whole input and writes a new CTR file. Decryption
+ * writes the given plaintext ranges one after the other, or the whole file
+ * when nranges is 0.
+ */
+int ctrfile_open(ctrfile_st *cf, const char *read_file, const char *write_file, int decrypt,
+                 uint32_t piece_size, int threads, const ctrfile_range_st *ranges, int nranges)
+{
+    ctrfile_range_st whole = {0, 0};
+    struct stat st;
+
+    memset(cf, 0, sizeof(*cf));
+    cf->fd_in = cf->fd_out = -1;
+    cf->keyd = -1;
+    cf->decrypt = decrypt;
+    cf->threads = threads;
+    cf->piece_size = piece_size;
+    pthread_mutex_init(&cf->lock, NULL);
+
+    if (threads < 1 || threads > CTRFILE_THREADS_MAX) {
+        APP_ERR("threads %d is out of [1, %d]\n", threads, CTRFILE_THREADS_MAX);
+        return -1;
+    }
+    if (!blockio_block_valid(piece_size)) {
+        return -1;
+    }
+    if (blockio_same_file(read_file, write_file)) {
+        APP_ERR("CTR files cannot be written in place\n");
+        return -1;
+    }
+    if (nranges < 0 || nranges > CTRFILE_RANGES_MAX || (!decrypt && nranges > 0)) {
+        APP_ERR("ranges only apply to decryption, at most %d\n", CTRFILE_RANGES_MAX);
+        return -1;
+    }
+
+    cf->fd_in = open(read_file, O_RDONLY);
+    if (cf->fd_in < 0 || fstat(cf->fd_in, &st) != 0) {
+        APP_ERR("open %s fail, errno = %d\n", read_file, errno);
+        return -1;
+    }
+    if (decrypt) {
+        if (ctrfile_pread(cf->fd_in, (u8 *)&cf->header, sizeof(cf->header), 0) != 0 ||
+            !ctr_file_header_valid(&cf->header)) {
+            APP_ERR("%s is not a CTR file\n", read_file);
+            return -1;
+        }
+        cf->plain_size = st.st_size - sizeof(cf->header);
+    }
+    else {
+        cf->plain_size = st.st_size;
+    }
+    if (nranges == 0) {
+        ranges = &whole;
+        nranges = 1;
+    }
+    if (ctrfile_plan(cf, ranges, nranges) != 0) {
+        return -1;
+    }
+
+    cf->fd_out = open(write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (cf->fd_out < 0) {
+        APP_ERR("open %s fail, errno = %d\n", write_file, errno);
+        return -1;
+    }
+    return 0;
+}
+
+void ctrfile_close(ctrfile_st *cf)
+{
+    if (cf->fd_in >= 0) {
+        close(cf->fd_in);
+    }
+    if (cf->fd_out >= 0) {
+        close(cf->fd_out);
+    }
+    if (cf->keyd >= 0) {
+        close(cf->keyd);
+    }
+    cf->fd_in = cf->fd_out = cf->keyd = -1;
+    free(cf->pieces);
+    cf->pieces = NULL;
+    pthread_mutex_destroy(&cf->lock);
+}
+
+/* All pieces, spread over the workers. Needs a device session or keyService */
+pufs_status_t ctrfile_run(ctrfile_st *cf)
+{
+    ctrfile_worker_st workers[CTRFILE_THREADS_MAX];
+    pthread_t tids[CTRFILE_THREADS_MAX];
+    pufs_status_t check = PUFS_SUCCESS;
+    double start = ctrfile_now();
+    int i, started = 0;
+
+    memset(workers, 0, sizeof(workers));
+    if (!cf->decrypt) {
+        check = cf->keyd >= 0 ? keyd_ctr_file_header_new(cf->keyd, &cf->header) :
+            ctr_file_header_new(&cf->header);
+        if (check != PUFS_SUCCESS) {
+            goto RET;
+        }
+        if (ctrfile_pwrite(cf->fd_out, (const u8 *)&cf->header, sizeof(cf->header), 0) != 0) {
+            APP_ERR("write header fail, errno = %d\n", errno);
+            check = PUFS_ERROR;
+            goto RET;
+        }
+    }
+
+    for (i = 0; i < cf->threads; i++) {
+        workers[i].cf = cf;
+        workers[i].in = malloc(cf->piece_size);
+        workers[i].out = malloc(cf->piece_size + CTR_BLOCK_SIZE);
+        if (workers[i].in == NULL || workers[i].out == NULL ||
+            pthread_create(&tids[i], NULL, ctrfile_worker, &workers[i]) != 0) {
+            APP_ERR("ctrfile worker %d fail\n", i);
+            pthread_mutex_lock(&cf->lock);
+            cf->error = PUFS_ERROR;
+            pthread_mutex_unlock(&cf->lock);
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    for (i = 0; i < cf->threads; i++) {
+        free(workers[i].in);
+        free(workers[i].out);
+    }
+
+    check = cf->error;
+    if (check != PUFS_SUCCESS && started > 0) {
+        APP_ERR("data at %llu failed, check = %d\n", (unsigned long long)cf->bad_offset, check);
+    }
+RET:
+    cf->run_secs = ctrfile_now() - start;
+    return check;
+}
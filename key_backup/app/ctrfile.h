@@ -0,0 +1,91 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      ctrfile.h
+ * @brief     Seekable CTR files with parallel byte-range access
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __CTRFILE_H__
+#define __CTRFILE_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define CTRFILE_THREADS_DEFAULT 4
+#define CTRFILE_THREADS_MAX     16
+#define CTRFILE_RANGES_MAX      64
+
+/* Plaintext byte range, length 0 runs to the end of the file */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} ctrfile_range_st;
+
+/* Part of a range, one device call sequence */
+typedef struct {
+    uint64_t plain_off;
+    uint64_t out_off;
+    uint32_t len;
+} ctrfile_piece_st;
+
+typedef struct {
+    int fd_in;
+    int fd_out;
+    int decrypt;
+    int threads;
+    int keyd;                   ///< connection to keyService, -1 to use the device directly
+    uint32_t piece_size;
+    ctr_file_header_st header;
+    uint64_t plain_size;
+    ctrfile_piece_st *pieces;
+    uint64_t npieces;
+
+    // shared by the workers
+    uint64_t next;
+    pufs_status_t error;
+    uint64_t bad_offset;
+    pthread_mutex_t lock;
+
+    uint64_t out_size;
+    double run_secs;
+    double device_secs;
+} ctrfile_st;
+
+int ctrfile_probe(const char *path);
+int ctrfile_open(ctrfile_st *cf, const char *read_file, const char *write_file, int decrypt,
+                 uint32_t piece_size, int threads, const ctrfile_range_st *ranges, int nranges);
+void ctrfile_close(ctrfile_st *cf);
+pufs_status_t ctrfile_run(ctrfile_st *cf);
+
+#endif /* __CTRFILE_H__ */
@@ -0,0 +1,314 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      devlock.c
+ * @brief     Device arbitration between processes, granted in FIFO order
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "devlock.h"
+
+/**
+ * The queue file is mapped by every process and only changed under flock(),
+ * which is held for a few instructions at a time, never while waiting. A
+ * process takes the next ticket and owns the device once serving reaches it.
+ * Each ticket records the pid of its process, so the ticket of a process that
+ * died while waiting or holding the device is skipped by the next process
+ * that looks at the queue, and one that gave up waiting marks its ticket
+ * abandoned. A recycled pid can keep a dead ticket alive until that process
+ * exits too.
+ */
+#define DEVLOCK_BACKOFF_MIN_US  100
+#define DEVLOCK_BACKOFF_MAX_US  5000
+
+typedef enum {
+    DEVLOCK_FREE,
+    DEVLOCK_WAITING,
+    DEVLOCK_HOLDING,
+    DEVLOCK_ABANDONED,
+} devlock_state_t;
+
+typedef struct {
+    uint64_t ticket;
+    int32_t pid;
+    uint32_t state;
+} devlock_entry_st;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t next;              ///< ticket handed to the next process
+    uint64_t serving;           ///< ticket that owns the device, or next when it is free
+    devlock_stats_st stats;
+    devlock_entry_st queue[DEVLOCK_QUEUE];
+} devlock_shm_st;
+
+static uint64_t devlock_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void devlock_sleep(uint32_t us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+static int devlock_flock(int fd, int op)
+{
+    while (flock(fd, op) != 0) {
+        if (errno != EINTR) {
+            APP_ERR("flock fail, errno = %d\n", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int devlock_alive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+void devlock_init(devlock_st *dl)
+{
+    memset(dl, 0, sizeof(*dl));
+    dl->fd = -1;
+}
+
+int devlock_wait_secs(void)
+{
+    const char *env = getenv(DEVLOCK_WAIT_ENV);
+    int secs;
+
+    if (env == NULL || *env == '\0') {
+        return DEVLOCK_WAIT_DEFAULT;
+    }
+    secs = atoi(env);
+    return secs < 0 ? DEVLOCK_WAIT_DEFAULT : secs;
+}
+
+static int devlock_open(devlock_st *dl)
+{
+    const char *path = getenv(DEVLOCK_PATH_ENV);
+    devlock_shm_st *shm;
+    struct stat st;
+    int fd;
+
+    if (path == NULL || *path == '\0') {
+        path = DEVLOCK_PATH;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+    if (devlock_flock(fd, LOCK_EX) != 0) {
+        goto CLOSE;
+    }
+    if (fstat(fd, &st) != 0 ||
+        ((size_t)st.st_size < sizeof(*shm) && ftruncate(fd, sizeof(*shm)) != 0)) {
+        APP_ERR("size %s fail, errno = %d\n", path, errno);
+        goto UNLOCK;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        APP_ERR("mmap %s fail, errno = %d\n", path, errno);
+        goto UNLOCK;
+    }
+    // new file, or one of another layout
+    if (shm->magic != DEVLOCK_MAGIC || shm->size != sizeof(*shm)) {
+        memset(shm, 0, sizeof(*shm));
+        shm->magic = DEVLOCK_MAGIC;
+        shm->size = sizeof(*shm);
+    }
+    devlock_flock(fd, LOCK_UN);
+    dl->fd = fd;
+    dl->shm = shm;
+    return 0;
+
+UNLOCK:
+    devlock_flock(fd, LOCK_UN);
+CLOSE:
+    close(fd);
+    return -1;
+}
+
+/* Moves serving past tickets nobody will use, called under flock */
+static void devlock_advance(devlock_shm_st *shm)
+{
+    devlock_entry_st *e;
+
+    while (shm->serving < shm->next) {
+        e = &shm->queue[shm->serving % DEVLOCK_QUEUE];
+        if (e->ticket == shm->serving && (e->state == DEVLOCK_WAITING || e->state == DEVLOCK_HOLDING) &&
+            devlock_alive(e->pid)) {
+            break;
+        }
+        if (e->state == DEVLOCK_WAITING || e->state == DEVLOCK_HOLDING) {
+            shm->stats.recovered++;
+            APP_WARN("pid %d left the device queue without releasing it\n", e->pid);
+        }
+        e->state = DEVLOCK_FREE;
+        shm->serving++;
+    }
+}
+
+pufs_status_t devlock_acquire(devlock_st *dl, int wait_secs)
+{
+    devlock_shm_st *shm;
+    devlock_entry_st *e = NULL;
+    uint64_t start, waited;
+    uint32_t backoff = DEVLOCK_BACKOFF_MIN_US;
+
+    if (dl->fd < 0 && devlock_open(dl) != 0) {
+        return PUFS_ERROR;
+    }
+    shm = dl->shm;
+    start = devlock_now_us();
+    for (;;) {
+        if (devlock_flock(dl->fd, LOCK_EX) != 0) {
+            goto ABANDON;
+        }
+        devlock_advance(shm);
+        // join the queue, or only take a free device when not waiting
+        if (e == NULL && shm->next - shm->serving < DEVLOCK_QUEUE &&
+            (wait_secs > 0 || shm->next == shm->serving)) {
+            dl->ticket = shm->next++;
+            e = &shm->queue[dl->ticket % DEVLOCK_QUEUE];
+            e->ticket = dl->ticket;
+            e->pid = getpid();
+            e->state = DEVLOCK_WAITING;
+        }
+        if (e != NULL && shm->serving == dl->ticket) {
+            waited = devlock_now_us() - start;
+            e->state = DEVLOCK_HOLDING;
+            shm->stats.grants++;
+            if (backoff > DEVLOCK_BACKOFF_MIN_US) {
+                shm->stats.waits++;
+                shm->stats.wait_us += waited;
+                if (waited > shm->stats.wait_max_us) {
+                    shm->stats.wait_max_us = waited;
+                }
+            }
+            devlock_flock(dl->fd, LOCK_UN);
+            dl->held = 1;
+            return PUFS_SUCCESS;
+        }
+        if (devlock_now_us() - start >= (uint64_t)wait_secs * 1000000) {
+            if (e != NULL) {
+                e->state = DEVLOCK_ABANDONED;
+                devlock_advance(shm);
+            }
+            if (wait_secs > 0) {
+                shm->stats.timeouts++;
+            }
+            devlock_flock(dl->fd, LOCK_UN);
+            return E_BUSY;
+        }
+        devlock_flock(dl->fd, LOCK_UN);
+        devlock_sleep(backoff);
+        backoff = backoff * 2 > DEVLOCK_BACKOFF_MAX_US ? DEVLOCK_BACKOFF_MAX_US : backoff * 2;
+    }
+
+ABANDON:
+    // without the flock the ticket is left to devlock_advance of the others
+    if (e != NULL) {
+        e->state = DEVLOCK_ABANDONED;
+    }
+    return PUFS_ERROR;
+}
+
+void devlock_release(devlock_st *dl)
+{
+    devlock_shm_st *shm = dl->shm;
+    devlock_entry_st *e;
+
+    if (!dl->held) {
+        return;
+    }
+    e = &shm->queue[dl->ticket % DEVLOCK_QUEUE];
+    devlock_flock(dl->fd, LOCK_EX);
+    if (e->ticket == dl->ticket && e->state == DEVLOCK_HOLDING) {
+        e->state = DEVLOCK_FREE;
+        if (shm->serving == dl->ticket) {
+            shm->serving++;
+        }
+    }
+    devlock_advance(shm);
+    devlock_flock(dl->fd, LOCK_UN);
+    dl->held = 0;
+}
+
+void devlock_close(devlock_st *dl)
+{
+    devlock_release(dl);
+    if (dl->shm != NULL) {
+        munmap(dl->shm, sizeof(devlock_shm_st));
+    }
+    if (dl->fd >= 0) {
+        close(dl->fd);
+    }
+    devlock_init(dl);
+}
+
+int devlock_stats(devlock_st *dl, devlock_stats_st *stats)
+{
+    devlock_shm_st *shm;
+
+    if (dl->fd < 0 && devlock_open(dl) != 0) {
+        return -1;
+    }
+    shm = dl->shm;
+    if (devlock_flock(dl->fd, LOCK_EX) != 0) {
+        return -1;
+    }
+    devlock_advance(shm);
+    *stats = shm->stats;
+    stats->queued = shm->next - shm->serving;
+    devlock_flock(dl->fd, LOCK_UN);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      devlock.h
+ * @brief     Device arbitration between processes, granted in FIFO order
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __DEVLOCK_H__
+#define __DEVLOCK_H__
+
+#include "libcore.h"
+
+/* Queue shared by every process that opens the device, DEVLOCK_PATH_ENV overrides the path */
+#define DEVLOCK_PATH            "/run/keybackup.devlock"
+#define DEVLOCK_PATH_ENV        "KEYBACKUP_DEVICE_LOCK"
+#define DEVLOCK_WAIT_ENV        "KEYBACKUP_DEVICE_WAIT"     /* seconds, 0 to fail when busy */
+#define DEVLOCK_WAIT_DEFAULT    60
+#define DEVLOCK_MAGIC           0x4b4c4450                  ///< "PDLK"
+#define DEVLOCK_QUEUE           64                          /* processes waiting at most */
+
+/* Totals of all processes since the queue file was created */
+typedef struct {
+    uint64_t grants;            ///< device handed out
+    uint64_t waits;             ///< grants that had to queue
+    uint64_t wait_us;           ///< time spent queued by those
+    uint64_t wait_max_us;
+    uint64_t timeouts;          ///< gave up after the bounded wait, tries of a busy device not counted
+    uint64_t recovered;         ///< tickets of dead processes skipped
+    uint64_t queued;            ///< processes holding or waiting for the device now
+} devlock_stats_st;
+
+/* One per process, kept with its device session; any other instance can read the stats */
+typedef struct {
+    int fd;                     ///< queue file, -1 until devlock_acquire opens it
+    void *shm;
+    uint64_t ticket;
+    int held;
+} devlock_st;
+
+void devlock_init(devlock_st *dl);
+
+/* Waits for the device up to wait_secs, E_BUSY on timeout, 0 to only take a free device */
+pufs_status_t devlock_acquire(devlock_st *dl, int wait_secs);
+void devlock_release(devlock_st *dl);
+void devlock_close(devlock_st *dl);
+int devlock_wait_secs(void);
+
+int devlock_stats(devlock_st *dl, devlock_stats_st *stats);
+
+#endif /* __DEVLOCK_H__ */
@@ -38,29 +38,377 @@
 
 
 #include "libcore.h"
-#define BUF_SIZE 17
+#include <getopt.h>
+#include "blockio.h"
+#include "pipeline.h"
+#include "inplace.h"
+#include "gcmfile.h"
+#include "xts.h"
+#include "treecrypt.h"
+#include "keystream.h"
+#include "ctrfile.h"
+#include "keyd.h"
 
 void usage(char *argv0)
 {
-    fprintf(stderr, "Usage: %s [-d] [-i input_file] [-o output_file]\n", argv0);
-    fprintf(stderr, "   -d  decode\n\n");
+    fprintf(stderr, "Usage: %s [-d] [-L] [-m] [-g] [-e] [-c] [-R] [-V] [-k chunk] [-x] [-s sector] [-r first[:count]]\n"
+                    "       [--offset byte --length bytes ...] [-b block_kib] [-n blocks] [-j workers]\n"
+                    "       [-i input_file] [-o output_file]\n", argv0);
+    fprintf(stderr, "   -i, -o  a file name, or - for stdin or stdout (OFB stream only)\n");
+    fprintf(stderr, "   -d  decode, chunked GCM files are recognised by their header\n");
+    fprintf(stderr, "   -L  decode a file written by the 16-byte block version\n");
+    fprintf(stderr, "   -m  rewrite input_file in place through mmap, resumable after an interruption,\n"
+                    "       output_file must name the same file\n");
+    fprintf(stderr, "   -b  I/O and device block size in KiB, %d to %d (default %d)\n",
+        BLOCKIO_BLOCK_MIN / 1024, BLOCKIO_BLOCK_MAX / 1024, BLOCKIO_BLOCK_DEFAULT / 1024);
+    fprintf(stderr, "   -n  blocks in flight between reader, device and writer, and keystream blocks\n"
+                    "       made ahead, %d to %d (default %d), 1 runs without threads\n",
+        PIPELINE_DEPTH_MIN, PIPELINE_DEPTH_MAX, PIPELINE_DEPTH_DEFAULT);
+    fprintf(stderr, "   -g  encrypt to the authenticated chunked GCM format, -b is the chunk size\n");
+    fprintf(stderr, "   -e  like -g, but chunks are sealed on the host with a per-file data key,\n"
+                    "       stored in the header wrapped under the client key\n");
+    fprintf(stderr, "   -c  encrypt to the seekable CTR format, decode recognises it by its header\n");
+    fprintf(stderr, "   --offset, --length  decode only this plaintext range of a CTR file, length 0\n"
+                    "       or none runs to the end; up to %d ranges are written one after the other\n",
+        CTRFILE_RANGES_MAX);
+    fprintf(stderr, "   -R  input_file and output_file are directories, every file of the input tree\n"
+                    "       is written as a chunked GCM file (-e for envelope) to the mirrored tree,\n"
+                    "       -j files at a time\n");
+    fprintf(stderr, "   -V  only verify a chunked GCM file, no output_file\n");
+    fprintf(stderr, "   -k  decrypt only this chunk of a chunked GCM file\n");
+    fprintf(stderr, "   -x  XTS sector mode for disk images and block devices, size is kept and\n"
+                    "       output_file may be input_file, -b is the batch a worker takes\n");
+    fprintf(stderr, "   -s  XTS sector size, power of two from %d to %d (default %d)\n",
+        XTS_SECTOR_MIN, XTS_SECTOR_MAX, XTS_SECTOR_DEFAULT);
+    fprintf(stderr, "   -r  XTS sector range, count 0 or none runs to the end (default 0:0)\n");
+    fprintf(stderr, "   -j  chunked GCM, CTR, XTS or -R workers, 1 to %d (default %d)\n\n",
+        GCMFILE_THREADS_MAX, GCMFILE_THREADS_DEFAULT);
+}
+
+static pufs_status_t run_gcm(const char *read_file, const char *write_file, int decode,
+                             size_t chunk_size, int threads, long long chunk, int envelope)
+{
+    pufs_status_t ret = PUFS_ERROR;
+    gcmfile_st gf;
+    uint32_t len;
+    u8 *buf = NULL;
+    FILE *fp;
+
+    if (gcmfile_open(&gf, read_file, chunk >= 0 ? NULL : write_file, decode, chunk_size, threads, envelope) != 0) {
+        goto CLOSE;
+    }
+
+    ret = pufs_start(__func__);
+    if (ret != PUFS_SUCCESS)
+    {
+        APP_ERR("pufs_start fail, ret = %d\n", ret);
+        goto CLOSE;
+    }
+    enroll();
+
+    if (chunk >= 0) {
+        buf = malloc(gf.header.chunk_size);
+        ret = buf == NULL ? PUFS_ERROR : gcmfile_read_chunk(&gf, chunk, buf, &len);
+    }
+    else {
+        ret = gcmfile_run(&gf);
+    }
+    pufs_end(__func__);
+
+    if (ret != PUFS_SUCCESS) {
+        if (ret == PUFS_ERROR_INVALID) {
+            printf("Key is invalid!\n");
+        }
+        else {
+            printf("%s failed, the file is corrupted or the key is invalid!\n",
+                decode ? "Authentication" : "Encryption");
+        }
+        // nothing unauthenticated or half written is left behind
+        if (write_file != NULL && chunk < 0) {
+            unlink(write_file);
+        }
+        goto CLOSE;
+    }
+
+    if (chunk >= 0) {
+        fp = fopen(write_file, "wb");
+        if (fp == NULL || fwrite(buf, 1, len, fp) != len) {
+            APP_ERR("write %s fail.\n", write_file);
+            ret = PUFS_ERROR;
+        }
+        if (fp != NULL && fclose(fp) != 0) {
+            ret = PUFS_ERROR;
+        }
+        if (ret == PUFS_SUCCESS) {
+            printf("Decrypt chunk %lld OK, %u bytes\n", chunk, len);
+        }
+        goto CLOSE;
+    }
+    printf("%s data OK, %llu bytes in %.3f s, %.2f MB/s (%s, %llu chunks of %u KiB, %d workers, device busy %.0f%%)\n",
+        write_file == NULL ? "Verify" : (decode ? "Decrypt" : "Encrypt"),
+        (unsigned long long)gf.out_size, gf.run_secs,
+        gf.run_secs > 0 ? gf.out_size / gf.run_secs / 1e6 : 0.0,
+        gf.envelope ? "GCM envelope" : "GCM",
+        (unsigned long long)gf.chunks, gf.header.chunk_size / 1024, threads,
+        gf.run_secs > 0 ? 100 * gf.device_secs / gf.run_secs : 0.0);
+CLOSE:
+    free(buf);
+    gcmfile_close(&gf);
+    return ret;
+}
+
+static pufs_status_t run_ctr(const char *read_file, const char *write_file, int decode,
+                             size_t piece_size, int threads, const ctrfile_range_st *ranges, int nranges)
+{
+    pufs_status_t ret = PUFS_ERROR;
+    ctrfile_st cf;
+
+    if (ctrfile_open(&cf, read_file, write_file, decode, piece_size, threads, ranges, nranges) != 0) {
+        goto CLOSE;
+    }
+
+    // a running keyService owns the device, the pieces go through it
+    cf.keyd = keyd_connect();
+    if (cf.keyd < 0) {
+        ret = pufs_start(__func__);
+        if (ret != PUFS_SUCCESS)
+        {
+            APP_ERR("pufs_start fail, ret = %d\n", ret);
+            goto CLOSE;
+        }
+        enroll();
+    }
+
+    ret = ctrfile_run(&cf);
+    if (cf.keyd < 0) {
+        pufs_end(__func__);
+    }
+
+    if (ret == PUFS_ERROR_INVALID) {
+        printf("Key is invalid!\n");
+        goto CLOSE;
+    }
+    else if (ret != PUFS_SUCCESS) {
+        APP_ERR("%s failed, ret = %d\n", decode ? "decrypt" : "encrypt", ret);
+        goto CLOSE;
+    }
+    printf("%s data OK, %llu bytes in %.3f s, %.2f MB/s (CTR, %d ranges in %llu pieces, %d workers, device busy %.0f%%%s)\n",
+        decode ? "Decrypt" : "Encrypt", (unsigned long long)cf.out_size, cf.run_secs,
+        cf.run_secs > 0 ? cf.out_size / cf.run_secs / 1e6 : 0.0, nranges ? nranges : 1,
+        (unsigned long long)cf.npieces, threads,
+        cf.run_secs > 0 ? 100 * cf.device_secs / cf.run_secs : 0.0,
+        cf.keyd >= 0 ? ", through keyService" : "");
+CLOSE:
+    ctrfile_close(&cf);
+    return ret;
+}
+
+static pufs_status_t run_tree(const char *in_dir, const char *out_dir, int decode, int envelope,
+                              size_t chunk_size, int workers)
+{
+    pufs_status_t ret = PUFS_ERROR;
+    treecrypt_st tc;
+
+    if (treecrypt_open(&tc, in_dir, out_dir, decode, envelope, chunk_size, workers) != 0) {
+        goto CLOSE;
+    }
+
+    // one session for the whole tree
+    ret = pufs_start(__func__);
+    if (ret != PUFS_SUCCESS)
+    {
+        APP_ERR("pufs_start fail, ret = %d\n", ret);
+        goto CLOSE;
+    }
+    enroll();
+
+    ret = treecrypt_run(&tc);
+    pufs_end(__func__);
+
+    printf("%s %s, %u files, %llu bytes in %.3f s, %.2f MB/s (%s, %d workers, %u files stolen), %u failed\n",
+        decode ? "Decrypt" : "Encrypt", ret == PUFS_SUCCESS ? "tree OK" : "tree incomplete",
+        tc.done_files - tc.failed_files, (unsigned long long)tc.done_bytes, tc.run_secs,
+        tc.run_secs > 0 ? tc.done_bytes / tc.run_secs / 1e6 : 0.0,
+        decode ? "chunked GCM" : (envelope ? "GCM envelope" : "GCM"), workers, tc.stolen, tc.failed_files);
+CLOSE:
+    treecrypt_close(&tc);
+    return ret;
+}
+
+static pufs_status_t run_inplace(const char *file, int decode, int legacy, size_t block_size)
+{
+    pufs_status_t ret = PUFS_SUCCESS;
+    inplace_st ip;
+
+    ret = pufs_start(__func__);
+    if (ret != PUFS_SUCCESS)
+    {
+        APP_ERR("pufs_start fail, ret = %d\n", ret);
+        goto EXIT;
+    }
+    enroll();
+
+    ret = inplace_run(&ip, file, decode, legacy, block_size);
+    pufs_end(__func__);
+
+    if (ret == PUFS_ERROR_INVALID) {
+        printf("Key is invalid!\n");
+        goto EXIT;
+    }
+    else if (ret != PUFS_SUCCESS) {
+        APP_ERR("%s %s in place failed, rerun to resume\n", decode ? "decrypt" : "encrypt", file);
+        goto EXIT;
+    }
+    printf("%s data OK, %llu bytes in %.3f s, %.2f MB/s (in place, block %zu KiB, device busy %.0f%%)\n",
+        decode ? "Decrypt" : "Encrypt", (unsigned long long)ip.out_size, ip.run_secs,
+        ip.run_secs > 0 ? ip.out_size / ip.run_secs / 1e6 : 0.0, block_size / 1024,
+        ip.run_secs > 0 ? 100 * ip.crypt_secs / ip.run_secs : 0.0);
+EXIT:
+    return ret;
+}
+
+static pufs_status_t run_xts(const char *read_file, const char *write_file, int decode,
+                             uint32_t sector_size, size_t batch_size, int threads,
+                             unsigned long long first, unsigned long long count)
+{
+    pufs_status_t ret = PUFS_ERROR;
+    xts_st xs;
+
+    if (xts_open(&xs, read_file, write_file, decode, sector_size, batch_size, threads, first, count) != 0) {
+        goto CLOSE;
+    }
+
+    ret = pufs_start(__func__);
+    if (ret != PUFS_SUCCESS)
+    {
+        APP_ERR("pufs_start fail, ret = %d\n", ret);
+        goto CLOSE;
+    }
+    enroll();
+
+    ret = xts_run(&xs);
+    pufs_end(__func__);
+
+    if (ret == PUFS_ERROR_INVALID) {
+        printf("Key is invalid!\n");
+        goto CLOSE;
+    }
+    else if (ret != PUFS_SUCCESS) {
+        APP_ERR("%s failed at sector %llu\n",
+            decode ? "decrypt" : "encrypt", (unsigned long long)xs.bad_sector);
+        goto CLOSE;
+    }
+    printf("%s data OK, sectors %llu to %llu of %u bytes in %.3f s, %.2f MB/s (XTS, %d workers, device busy %.0f%%)\n",
+        decode ? "Decrypt" : "Encrypt", (unsigned long long)xs.first,
+        (unsigned long long)(xs.first + xs.count), sector_size, xs.run_secs,
+        xs.run_secs > 0 ? xs.count * sector_size / xs.run_secs / 1e6 : 0.0, threads,
+        xs.run_secs > 0 ? 100 * xs.device_secs / xs.run_secs : 0.0);
+CLOSE:
+    xts_close(&xs);
+    return ret;
+}
+
+static pufs_status_t stream_block(void *arg, u8 *out, uint32_t *outlen, const u8 *in, uint32_t inlen)
+{
+    return aes_stream_update((aes_stream_st *)arg, out, outlen, in, inlen);
 }
 
 int main(int argc, char *argv[])
 {
     pufs_status_t ret = PUFS_SUCCESS;
-    int opt, len, decode = 0, same_io = 0;
-    u8 buf[BUF_SIZE] = {0};
+    int opt, decode = 0, legacy = 0, in_place = 0, gcm = 0, verify = 0, xts = 0, envelope = 0, tree = 0, ctr = 0;
+    ctrfile_range_st ranges[CTRFILE_RANGES_MAX];
+    int nranges = 0;
+    static const struct option long_opts[] = {
+        {"offset", required_argument, NULL, 'O'},
+        {"length", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+    int depth = PIPELINE_DEPTH_DEFAULT;
+    int threads = GCMFILE_THREADS_DEFAULT;
+    long long chunk = -1;
+    uint32_t sector_size = XTS_SECTOR_DEFAULT;
+    unsigned long long first = 0, count = 0;
+    char *end;
+    uint32_t out_len;
+    size_t block_size = BLOCKIO_BLOCK_DEFAULT;
+    u8 final_buf[BLOCKIO_SLACK];
+    char xor_info[64] = "";
+    double busy;
+    blockio_st bio;
+    pipeline_st pl;
+    aes_stream_st stream = {0};
+    aes_file_header_st header;
 
-    FILE *fp_r, *fp_w;
     char *read_file = NULL;
     char *write_file = NULL;
 
-    while ((opt = getopt(argc, argv, "di:o:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "dLmgecRVk:xs:r:b:n:j:i:o:", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'd':
                 decode = 1;
                 break;
+            case 'L':
+                legacy = 1;
+                break;
+            case 'm':
+                in_place = 1;
+                break;
+            case 'g':
+                gcm = 1;
+                break;
+            case 'e':
+                gcm = envelope = 1;
+                break;
+            case 'c':
+                ctr = 1;
+                break;
+            case 'O':
+            case 'N':
+                // --offset opens a range, --length closes the open one or starts at 0
+                if (opt == 'O' || nranges == 0 || ranges[nranges - 1].length != 0) {
+                    if (nranges == CTRFILE_RANGES_MAX) {
+                        usage(argv[0]);
+                        goto EXIT;
+                    }
+                    ranges[nranges].offset = ranges[nranges].length = 0;
+                    nranges++;
+                }
+                if (opt == 'O') {
+                    ranges[nranges - 1].offset = strtoull(optarg, NULL, 10);
+                }
+                else {
+                    ranges[nranges - 1].length = strtoull(optarg, NULL, 10);
+                }
+                break;
+            case 'R':
+                tree = 1;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'k':
+                chunk = atoll(optarg);
+                break;
+            case 'x':
+                xts = 1;
+                break;
+            case 's':
+                sector_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                first = strtoull(optarg, &end, 10);
+                count = *end == ':' ? strtoull(end + 1, NULL, 10) : 0;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'b':
+                block_size = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'n':
+                depth = atoi(optarg);
+                break;
             case 'i':
                 read_file = optarg;
                 break;
@@ -73,96 +421,172 @@ int main(int argc, char *argv[])
         }
     }
 
-    if ((!read_file) || (!write_file)) {
+    // pipes only work for the OFB stream, the other modes seek
+    if ((blockio_is_stdio(read_file) || blockio_is_stdio(write_file)) &&
+        (xts || tree || gcm || ctr || nranges > 0 || in_place || verify || chunk >= 0)) {
         usage(argv[0]);
         goto EXIT;
     }
-
-    if (strcmp(read_file, write_file) == 0) {
-        same_io = 1;
-        fp_r = fp_w = fopen(read_file, "rb+");
-        if (fp_r == NULL) {
-            APP_ERR("fopen %s fail.\n", read_file);
+    if (xts) {
+        // gcm is also set by -e
+        if (!read_file || !write_file || legacy || in_place || gcm || ctr || tree ||
+            nranges > 0 || verify || chunk >= 0) {
+            usage(argv[0]);
             goto EXIT;
         }
+        ret = run_xts(read_file, write_file, decode, sector_size, block_size, threads, first, count);
+        goto EXIT;
     }
-    else {
-        fp_r = fopen(read_file, "r");
-        if (fp_r == NULL) {
-            APP_ERR("fopen %s fail.\n", read_file);
+    if (tree) {
+        if (!read_file || !write_file || legacy || in_place || ctr || nranges > 0 || verify || chunk >= 0) {
+            usage(argv[0]);
+            goto EXIT;
+        }
+        ret = run_tree(read_file, write_file, decode, envelope, block_size, threads);
+        goto EXIT;
+    }
+    if (decode && !legacy && read_file && !blockio_is_stdio(read_file) && gcmfile_probe(read_file)) {
+        gcm = 1;
+    }
+    if (decode && !legacy && read_file && !blockio_is_stdio(read_file) && ctrfile_probe(read_file)) {
+        ctr = 1;
+    }
+    if (ctr || nranges > 0) {
+        if (!read_file || !write_file || (nranges > 0 && !(decode && ctr)) ||
+            legacy || gcm || in_place || verify || chunk >= 0 || xts || tree) {
+            usage(argv[0]);
             goto EXIT;
         }
+        ret = run_ctr(read_file, write_file, decode, block_size, threads, ranges, nranges);
+        goto EXIT;
+    }
+    if ((!read_file) || (!write_file && !verify) || (legacy && !decode) ||
+        ((verify || chunk >= 0) && !(decode && gcm)) || (chunk >= 0 && (verify || !write_file)) || (gcm && (legacy || in_place))) {
+        usage(argv[0]);
+        goto EXIT;
+    }
+
+    if (gcm) {
+        ret = run_gcm(read_file, verify ? NULL : write_file, decode, block_size, threads, chunk, envelope);
+        goto EXIT;
+    }
 
-        fp_w = fopen(write_file, "wb");
-        if (fp_w == NULL) {
-            APP_ERR("fopen %s fail.\n", write_file);
-            fclose(fp_r);
+    if (in_place) {
+        if (!blockio_same_file(read_file, write_file) || !blockio_block_valid(block_size)) {
+            usage(argv[0]);
             goto EXIT;
         }
+        ret = run_inplace(read_file, decode, legacy, block_size);
+        goto EXIT;
+    }
+    if (!blockio_is_stdio(read_file) && inplace_pending(read_file)) {
+        APP_ERR("%s was interrupted during an in-place run, finish it with -m\n", read_file);
+        ret = PUFS_ERROR;
+        goto EXIT;
+    }
+
+    if (blockio_open(&bio, read_file, write_file, block_size) != 0) {
+        ret = PUFS_ERROR;
+        goto EXIT;
+    }
+    if (pipeline_init(&pl, &bio, depth) != 0) {
+        ret = PUFS_ERROR;
+        goto CLOSE;
+    }
+
+    if (decode && !legacy) {
+        if (blockio_read_len(&bio, (u8 *)&header, sizeof(header)) != sizeof(header)) {
+            APP_ERR("%s has no file header, use -L for files of the 16-byte version\n", read_file);
+            ret = PUFS_ERROR;
+            goto CLOSE;
+        }
+        if (memcmp(header.magic, GCMFILE_MAGIC, sizeof(header.magic)) == 0) {
+            APP_ERR("%s is a chunked GCM file, which can only be read from a named file\n", read_file);
+            ret = PUFS_ERROR;
+            goto CLOSE;
+        }
     }
 
     ret = pufs_start(__func__);
     if (ret != PUFS_SUCCESS)
     {
         APP_ERR("pufs_start fail, ret = %d\n", ret);
-        goto EXIT;
+        goto CLOSE;
     }
     enroll();
 
-    do {
-        memset(buf, 0, BUF_SIZE);
-        len = fread(buf, 1, BUF_SIZE - 1, fp_r);
-        if (len < 1) {
-            break;
+    if (legacy) {
+        ret = aes_stream_init_legacy(&stream);
+    }
+    else {
+        if (!decode) {
+            ret = aes_file_header_new(&header);
         }
-
-        if (decode == 0) {
-            ret = aes_enc((u8 *)buf, len);
-            if (ret == PUFS_ERROR_INVALID) {
-                printf("Key is invalid!\n");
-                goto RET;
-            }
-            else if (ret != PUFS_SUCCESS) {
-                APP_ERR("aes_enc failed, ret = %d", ret);
-                goto RET;
-            }
+        if (ret == PUFS_SUCCESS) {
+            ret = aes_stream_init(&stream, decode, &header);
         }
-        else {
-            ret = aes_dec((u8 *)buf, len);
-            if (ret == PUFS_ERROR_INVALID) {
-                printf("Key is invalid!\n");
-                goto RET;
-            }
-            else if (ret != PUFS_SUCCESS) {
-                APP_ERR("aes_dec failed, ret = %d", ret);
-                goto RET;
-            }
-        }
-
-        if (same_io) {
-            fseek(fp_w, ftell(fp_w) - len, SEEK_SET);
-        }
-        ret = fwrite(buf, 1, len, fp_w);
-        if (ret < 1) {
-            APP_ERR("fwrite fail. ret = %d\n", ret);
-            goto RET;
-        }
-    }while(len == BUF_SIZE - 1);
-    if (decode == 0)
-        printf("Encrypt data OK\n");
-    else
-        printf("Decrypt data OK\n");
+    }
+    if (ret == PUFS_ERROR_INVALID) {
+        printf("Key is invalid!\n");
+        goto RET;
+    }
+    else if (ret != PUFS_SUCCESS) {
+        APP_ERR("aes_stream_init failed, ret = %d", ret);
+        goto RET;
+    }
+
+    // the device makes keystream ahead, the blocks are only XORed on the host
+    if (!legacy && depth >= KEYSTREAM_DEPTH_MIN && bio.in_size != 0 &&
+        aes_stream_prefetch(&stream, block_size, depth, bio.in_size > 0 ? bio.in_size : 0) != PUFS_SUCCESS) {
+        APP_WARN("keystream prefetch unavailable, one device call per block");
+    }
+
+    ret = pipeline_run(&pl, (u8 *)&header, decode ? 0 : sizeof(header), stream_block, &stream);
+    if (ret == PUFS_ERROR_INVALID) {
+        printf("Key is invalid!\n");
+        goto RET;
+    }
+    else if (ret != PUFS_SUCCESS) {
+        APP_ERR("%s failed, ret = %d", decode ? "decrypt" : "encrypt", ret);
+        goto RET;
+    }
+
+    if (stream.prefetch != NULL) {
+        // all data is XORed, stop the producer before reading its numbers
+        keystream_stop(stream.prefetch);
+        // the producer runs on its own clock, a little before and after the pipeline
+        busy = stream.prefetch->run_secs > 0 ? stream.prefetch->device_secs / stream.prefetch->run_secs : 0.0;
+        snprintf(xor_info, sizeof(xor_info), ", %s XOR %.2f GB/s", xor_kernel_name(),
+            stream.prefetch->xor_secs > 0 ? stream.prefetch->xor_bytes / stream.prefetch->xor_secs / 1e9 : 0.0);
+    }
+    else {
+        busy = pl.run_secs > 0 ? pl.crypt_secs / pl.run_secs : 0.0;
+    }
+
+    out_len = sizeof(final_buf);
+    ret = aes_stream_final(&stream, final_buf, &out_len);
+    if (ret != PUFS_SUCCESS) {
+        APP_ERR("aes_stream_final failed, ret = %d", ret);
+        goto RET;
+    }
+    if (blockio_write(&bio, final_buf, out_len) != 0 || blockio_truncate(&bio) != 0) {
+        ret = PUFS_ERROR;
+        goto RET;
+    }
+
+    printf("%s data OK, %lld bytes in %.3f s, %.2f MB/s (block %zu KiB, %d in flight, device busy %.0f%%%s)\n",
+        decode ? "Decrypt" : "Encrypt", (long long)bio.wr_off, pl.run_secs,
+        pl.run_secs > 0 ? bio.wr_off / pl.run_secs / 1e6 : 0.0, block_size / 1024, depth,
+        100 * busy, xor_info);
     ret = 0;
 RET:
+    aes_stream_free(&stream);
     pufs_end(__func__);
-
-    fclose(fp_r);
-    if (same_io) goto EXIT;
-    fclose(fp_w);
+CLOSE:
+    pipeline_deinit(&pl);
+    if (blockio_close(&bio) != 0 && ret == 0) {
+        ret = PUFS_ERROR;
+    }
 EXIT:
-    STATISTICS_SHOW();
     return ret;
 }
-
-
-
@@ -0,0 +1,635 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      gcmfile.c
+ * @brief     Chunked AES-GCM file format
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include "blockio.h"
+#include "gcmfile.h"
+
+/**
+ * Every chunk is sealed and opened on its own, so workers take chunk indexes
+ * in any order and read and write at offsets computed from the index. The
+ * PUFse runs one operation at a time; workers hold pufs_device_lock only around
+ * their device calls and overlap everything else. Envelope files only use
+ * the device to derive the data key, and workers seal their chunks
+ * with OpenSSL in parallel.
+ */
+
+typedef struct {
+    gcmfile_st *gf;
+    pufs_sp38d_ctx *ctx;
+    EVP_CIPHER_CTX *evp;        ///< envelope files
+    u8 *in;
+    u8 *out;
+} gcmfile_worker_st;
+
+static double gcmfile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static off_t gcmfile_chunk_off(const gcmfile_st *gf, uint64_t index)
+{
+    return gf->header_len + index * (gf->header.chunk_size + GCMFILE_TAG_SIZE);
+}
+
+/* Plaintext bytes of chunk index */
+static uint32_t gcmfile_chunk_len(const gcmfile_st *gf, uint64_t index)
+{
+    uint64_t plain = gf->decrypt ? gf->out_size : gf->in_size;
+
+    if (index + 1 < gf->chunks) {
+        return gf->header.chunk_size;
+    }
+    return plain - index * gf->header.chunk_size;
+}
+
+static void gcmfile_iv(const gcmfile_st *gf, uint64_t index, u8 *iv)
+{
+    uint32_t ctr = index;
+
+    if (index + 1 == gf->chunks) {
+        ctr |= GCMFILE_LAST;
+    }
+    memcpy(iv, gf->header.nonce_base, GCMFILE_NONCE_SIZE);
+    iv[8] = ctr >> 24;
+    iv[9] = ctr >> 16;
+    iv[10] = ctr >> 8;
+    iv[11] = ctr;
+}
+
+static int gcmfile_pread(int fd, u8 *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int gcmfile_pwrite(int fd, const u8 *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pwrite(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* One device call sequence for a whole chunk, under the device lock */
+static pufs_status_t gcmfile_seal(gcmfile_worker_st *w, uint64_t index, uint32_t len)
+{
+    gcmfile_st *gf = w->gf;
+    pufs_status_t check = PUFS_SUCCESS;
+    u8 iv[GCMFILE_IV_SIZE];
+    uint32_t n, total = 0;
+    double start;
+
+    gcmfile_iv(gf, index, iv);
+    pufs_device_lock();
+    start = gcmfile_now();
+    OPSTAT(pufs_enc_gcm_init, check = pufs_enc_gcm_init(w->ctx, AES, SSKEY, CLIENT_KEY_SLOT, 256, iv, GCMFILE_IV_SIZE));
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    OPSTAT(pufs_enc_gcm_update, check = pufs_enc_gcm_update(w->ctx, NULL, &n, (const u8 *)&gf->header, gf->header_len));
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    if (len > 0) {
+        OPSTAT(pufs_enc_gcm_update, check = pufs_enc_gcm_update(w->ctx, w->out, &n, w->in, len));
+        if (check != PUFS_SUCCESS) {
+            goto RET;
+        }
+        total = n;
+    }
+    OPSTAT(pufs_enc_gcm_final, check = pufs_enc_gcm_final(w->ctx, w->out + total, &n, w->out + len, GCMFILE_TAG_SIZE));
+    total += n;
+    if (check == PUFS_SUCCESS && total != len) {
+        check = PUFS_ERROR;
+    }
+RET:
+    gf->device_secs += gcmfile_now() - start;
+    pufs_device_unlock();
+    return check;
+}
+
+static pufs_status_t gcmfile_open_chunk(gcmfile_worker_st *w, uint64_t index, uint32_t len)
+{
+    gcmfile_st *gf = w->gf;
+    pufs_status_t check = PUFS_SUCCESS;
+    u8 iv[GCMFILE_IV_SIZE];
+    uint32_t n, total = 0;
+    double start;
+
+    gcmfile_iv(gf, index, iv);
+    pufs_device_lock();
+    start = gcmfile_now();
+    OPSTAT(pufs_dec_gcm_init, check = pufs_dec_gcm_init(w->ctx, AES, SSKEY, CLIENT_KEY_SLOT, 256, iv, GCMFILE_IV_SIZE));
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    OPSTAT(pufs_dec_gcm_update, check = pufs_dec_gcm_update(w->ctx, NULL, &n, (const u8 *)&gf->header, gf->header_len));
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    if (len > 0) {
+        OPSTAT(pufs_dec_gcm_update, check = pufs_dec_gcm_update(w->ctx, w->out, &n, w->in, len));
+        if (check != PUFS_SUCCESS) {
+            goto RET;
+        }
+        total = n;
+    }
+    OPSTAT(pufs_dec_gcm_final, check = pufs_dec_gcm_final(w->ctx, w->out + total, &n, w->in + len, GCMFILE_TAG_SIZE));
+    total += n;
+    if (check == PUFS_SUCCESS && total != len) {
+        check = PUFS_ERROR;
+    }
+RET:
+    gf->device_secs += gcmfile_now() - start;
+    pufs_device_unlock();
+    return check;
+}
+
+/* Host side of an envelope chunk, same layout as the device one */
+static pufs_status_t gcmfile_host_chunk(gcmfile_worker_st *w, uint64_t index, uint32_t len)
+{
+    gcmfile_st *gf = w->gf;
+    const EVP_CIPHER *cipher = EVP_aes_256_gcm();
+    u8 iv[GCMFILE_IV_SIZE];
+    u8 *tag = gf->decrypt ? w->in + len : w->out + len;
+    int n, ok;
+
+    gcmfile_iv(gf, index, iv);
+    if (gf->decrypt) {
+        ok = EVP_DecryptInit_ex(w->evp, cipher, NULL, gf->dek, iv) &&
+             EVP_DecryptUpdate(w->evp, NULL, &n, (const u8 *)&gf->header, gf->header_len) &&
+             (len == 0 || EVP_DecryptUpdate(w->evp, w->out, &n, w->in, len)) &&
+             EVP_CIPHER_CTX_ctrl(w->evp, EVP_CTRL_GCM_SET_TAG, GCMFILE_TAG_SIZE, tag);
+        if (!ok) {
+            return PUFS_ERROR;
+        }
+        // only the final call checks the tag
+        return EVP_DecryptFinal_ex(w->evp, w->out + len, &n) > 0 ? PUFS_SUCCESS : E_VERFAIL;
+    }
+    ok = EVP_EncryptInit_ex(w->evp, cipher, NULL, gf->dek, iv) &&
+         EVP_EncryptUpdate(w->evp, NULL, &n, (const u8 *)&gf->header, gf->header_len) &&
+         (len == 0 || EVP_EncryptUpdate(w->evp, w->out, &n, w->in, len)) &&
+         EVP_EncryptFinal_ex(w->evp, w->out + len, &n) &&
+         EVP_CIPHER_CTX_ctrl(w->evp, EVP_CTRL_GCM_GET_TAG, GCMFILE_TAG_SIZE, tag);
+    return ok ? PUFS_SUCCESS : PUFS_ERROR;
+}
+
+static pufs_status_t gcmfile_seal_chunk(gcmfile_worker_st *w, uint64_t index, uint32_t len)
+{
+    return w->gf->envelope ? gcmfile_host_chunk(w, index, len) : gcmfile_seal(w, index, len);
+}
+
+static pufs_status_t gcmfile_unseal_chunk(gcmfile_worker_st *w, uint64_t index, uint32_t len)
+{
+    return w->gf->envelope ? gcmfile_host_chunk(w, index, len) : gcmfile_open_chunk(w, index, len);
+}
+
+static pufs_status_t gcmfile_chunk(gcmfile_worker_st *w, uint64_t index)
+{
+    gcmfile_st *gf = w->gf;
+    uint32_t len = gcmfile_chunk_len(gf, index);
+    off_t plain_off = index * (off_t)gf->header.chunk_size;
+    off_t chunk_off = gcmfile_chunk_off(gf, index);
+    pufs_status_t check;
+
+    if (!gf->decrypt) {
+        if (gcmfile_pread(gf->fd_in, w->in, len, plain_off) != 0) {
+            APP_ERR("read chunk %llu fail\n", (unsigned long long)index);
+            return PUFS_ERROR;
+        }
+        check = gcmfile_seal_chunk(w, index, len);
+        if (check != PUFS_SUCCESS) {
+            return check;
+        }
+        if (gcmfile_pwrite(gf->fd_out, w->out, len + GCMFILE_TAG_SIZE, chunk_off) != 0) {
+            APP_ERR("write chunk %llu fail, errno = %d\n", (unsigned long long)index, errno);
+            return PUFS_ERROR;
+        }
+        return PUFS_SUCCESS;
+    }
+
+    if (gcmfile_pread(gf->fd_in, w->in, len + GCMFILE_TAG_SIZE, chunk_off) != 0) {
+        APP_ERR("read chunk %llu fail\n", (unsigned long long)index);
+        return PUFS_ERROR;
+    }
+    check = gcmfile_unseal_chunk(w, index, len);
+    if (check != PUFS_SUCCESS) {
+        return check;
+    }
+    if (gf->fd_out >= 0 && gcmfile_pwrite(gf->fd_out, w->out, len, plain_off) != 0) {
+        APP_ERR("write chunk %llu fail, errno = %d\n", (unsigned long long)index, errno);
+        return PUFS_ERROR;
+    }
+    return PUFS_SUCCESS;
+}
+
+static int gcmfile_worker_init(gcmfile_worker_st *w, gcmfile_st *gf)
+{
+    size_t size = gf->header.chunk_size + GCMFILE_TAG_SIZE + BLOCKIO_SLACK;
+
+    memset(w, 0, sizeof(*w));
+    w->gf = gf;
+    if (gf->envelope) {
+        w->evp = EVP_CIPHER_CTX_new();
+    }
+    else {
+        w->ctx = pufs_sp38d_ctx_new();
+    }
+    w->in = malloc(size);
+    w->out = malloc(size);
+    if ((w->ctx == NULL && w->evp == NULL) || w->in == NULL || w->out == NULL) {
+        APP_ERR("gcmfile worker alloc fail\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void gcmfile_worker_deinit(gcmfile_worker_st *w)
+{
+    if (w->ctx != NULL) {
+        pufs_sp38d_ctx_free(w->ctx);
+    }
+    if (w->evp != NULL) {
+        EVP_CIPHER_CTX_free(w->evp);
+    }
+    free(w->in);
+    free(w->out);
+    memset(w, 0, sizeof(*w));
+}
+
+static void *gcmfile_worker(void *arg)
+{
+    gcmfile_worker_st *w = arg;
+    gcmfile_st *gf = w->gf;
+    pufs_status_t check;
+    uint64_t index;
+
+    for (;;) {
+        pthread_mutex_lock(&gf->lock);
+        if (gf->error != PUFS_SUCCESS || gf->next >= gf->chunks) {
+            pthread_mutex_unlock(&gf->lock);
+            break;
+        }
+        index = gf->next++;
+        pthread_mutex_unlock(&gf->lock);
+
+        check = gcmfile_chunk(w, index);
+        if (check != PUFS_SUCCESS) {
+            pthread_mutex_lock(&gf->lock);
+            if (gf->error == PUFS_SUCCESS) {
+                gf->error = check;
+                gf->bad_chunk = index;
+            }
+            pthread_mutex_unlock(&gf->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* 1 when path starts with a chunked GCM header */
+int gcmfile_probe(const char *path)
+{
+    gcmfile_header_st header;
+    int fd, ret = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (gcmfile_pread(fd, (u8 *)&header, sizeof(header), 0) == 0 &&
+        memcmp(header.magic, GCMFILE_MAGIC, sizeof(header.magic)) == 0) {
+        ret = 1;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Opens the files and works out the chunk layout. write_file may be NULL when
+ * decrypting, which only verifies; chunk_size and envelope only matter when
+ * encrypting, decryption takes them from the header.
+ */
+int gcmfile_open(gcmfile_st *gf, const char *read_file, const char *write_file, int decrypt,
+                 uint32_t chunk_size, int threads, int envelope)
+{
+    struct stat st;
+    uint64_t body, stride;
+
+    memset(gf, 0, sizeof(*gf));
+    gf->fd_in = gf->fd_out = -1;
+    gf->decrypt = decrypt;
+    gf->threads = threads;
+    pthread_mutex_init(&gf->lock, NULL);
+
+    if (threads < 1 || threads > GCMFILE_THREADS_MAX) {
+        APP_ERR("threads %d is out of [1, %d]\n", threads, GCMFILE_THREADS_MAX);
+        return -1;
+    }
+    if (write_file != NULL && blockio_same_file(read_file, write_file)) {
+        APP_ERR("GCM files cannot be written in place\n");
+        return -1;
+    }
+
+    gf->fd_in = open(read_file, O_RDONLY);
+    if (gf->fd_in < 0 || fstat(gf->fd_in, &st) != 0) {
+        APP_ERR("open %s fail, errno = %d\n", read_file, errno);
+        return -1;
+    }
+    gf->in_size = st.st_size;
+
+    if (decrypt) {
+        if (gcmfile_pread(gf->fd_in, (u8 *)&gf->header, GCMFILE_HEADER_V1, 0) != 0 ||
+            memcmp(gf->header.magic, GCMFILE_MAGIC, sizeof(gf->header.magic)) != 0 ||
+            (gf->header.version != GCMFILE_VERSION && gf->header.version != GCMFILE_VERSION_ENVELOPE) ||
+            gf->header.tag_len != GCMFILE_TAG_SIZE ||
+            gf->header.chunk_size < BLOCKIO_BLOCK_MIN || gf->header.chunk_size > BLOCKIO_BLOCK_MAX) {
+            APP_ERR("%s is not a chunked GCM file\n", read_file);
+            return -1;
+        }
+        gf->envelope = gf->header.version == GCMFILE_VERSION_ENVELOPE;
+        gf->header_len = gf->envelope ? sizeof(gf->header) : GCMFILE_HEADER_V1;
+        if (gf->envelope && gcmfile_pread(gf->fd_in, (u8 *)&gf->header + GCMFILE_HEADER_V1,
+                                gf->header_len - GCMFILE_HEADER_V1, GCMFILE_HEADER_V1) != 0) {
+            APP_ERR("%s is truncated\n", read_file);
+            return -1;
+        }
+        // every file has at least one chunk, the last one holds 0 to chunk_size bytes
+        stride = gf->header.chunk_size + GCMFILE_TAG_SIZE;
+        if (gf->in_size < gf->header_len + GCMFILE_TAG_SIZE) {
+            APP_ERR("%s is truncated\n", read_file);
+            return -1;
+        }
+        body = gf->in_size - gf->header_len;
+        gf->chunks = (body + stride - 1) / stride;
+        if (body - (gf->chunks - 1) * stride < GCMFILE_TAG_SIZE) {
+            APP_ERR("%s is truncated\n", read_file);
+            return -1;
+        }
+        gf->out_size = body - gf->chunks * GCMFILE_TAG_SIZE;
+    }
+    else {
+        if (!blockio_block_valid(chunk_size)) {
+            return -1;
+        }
+        memcpy(gf->header.magic, GCMFILE_MAGIC, sizeof(gf->header.magic));
+        gf->envelope = envelope;
+        gf->header.version = envelope ? GCMFILE_VERSION_ENVELOPE : GCMFILE_VERSION;
+        gf->header_len = envelope ? sizeof(gf->header) : GCMFILE_HEADER_V1;
+        gf->header.tag_len = GCMFILE_TAG_SIZE;
+        gf->header.chunk_size = chunk_size;
+        gf->chunks = gf->in_size == 0 ? 1 : (gf->in_size + chunk_size - 1) / chunk_size;
+        gf->out_size = gf->header_len + gf->in_size + gf->chunks * GCMFILE_TAG_SIZE;
+    }
+    if (gf->chunks > GCMFILE_LAST) {
+        APP_ERR("%s has too many chunks\n", read_file);
+        return -1;
+    }
+
+    if (write_file != NULL) {
+        gf->fd_out = open(write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (gf->fd_out < 0) {
+            APP_ERR("open %s fail, errno = %d\n", write_file, errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void gcmfile_close(gcmfile_st *gf)
+{
+    if (gf->fd_in >= 0) {
+        close(gf->fd_in);
+    }
+    if (gf->fd_out >= 0) {
+        close(gf->fd_out);
+    }
+    gf->fd_in = gf->fd_out = -1;
+    OPENSSL_cleanse(gf->dek, sizeof(gf->dek));
+    pthread_mutex_destroy(&gf->lock);
+}
+
+/* HMAC-SHA256 under the client key of the salt and a label byte */
+static pufs_status_t gcmfile_dek_hmac(gcmfile_st *gf, uint8_t label, pufs_dgst_st *md)
+{
+    uint8_t msg[GCMFILE_SALT_SIZE + 1];
+    pufs_status_t check;
+
+    memcpy(msg, gf->header.dek_salt, GCMFILE_SALT_SIZE);
+    msg[GCMFILE_SALT_SIZE] = label;
+    OPSTAT(pufs_hmac, check = pufs_hmac(md, msg, sizeof(msg), PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_hmac fail, check = %d\n", check);
+    }
+    return check;
+}
+
+/**
+ * Envelope data key. Encryption draws a random salt for the header; both
+ * directions derive the data key on the device as an HMAC of the salt under
+ * the client key, so the key never sits in a key slot and never leaves the
+ * device unwrapped as a key. A short check value, another HMAC of the salt,
+ * tells a file of another client key before any chunk fails.
+ */
+static pufs_status_t gcmfile_dek(gcmfile_st *gf)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    pufs_dgst_st md;
+    double start;
+
+    pufs_device_lock();
+    start = gcmfile_now();
+    if (!gf->decrypt) {
+        OPSTAT(pufs_rand, check = pufs_rand(gf->header.dek_salt, GCMFILE_SALT_SIZE / 4));
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("pufs_rand fail, check = %d\n", check);
+            goto RET;
+        }
+    }
+    check = gcmfile_dek_hmac(gf, 2, &md);
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    if (!gf->decrypt) {
+        memcpy(gf->header.dek_check, md.dgst, GCMFILE_CHECK_SIZE);
+    }
+    else if (CRYPTO_memcmp(gf->header.dek_check, md.dgst, GCMFILE_CHECK_SIZE) != 0) {
+        APP_ERR("data key check fail, the file is of another client key\n");
+        check = PUFS_ERROR_INVALID;
+        goto RET;
+    }
+    check = gcmfile_dek_hmac(gf, 1, &md);
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    memcpy(gf->dek, md.dgst, GCMFILE_DEK_SIZE);
+RET:
+    OPENSSL_cleanse(&md, sizeof(md));
+    gf->device_secs += gcmfile_now() - start;
+    pufs_device_unlock();
+    return check;
+}
+
+/* Whole file, chunks spread over the workers. Needs a device session */
+pufs_status_t gcmfile_run(gcmfile_st *gf)
+{
+    gcmfile_worker_st workers[GCMFILE_THREADS_MAX];
+    pthread_t tids[GCMFILE_THREADS_MAX];
+    pufs_status_t check = PUFS_SUCCESS;
+    double start = gcmfile_now();
+    int i, started = 0;
+
+    memset(workers, 0, sizeof(workers));
+    if (!gf->decrypt) {
+        pufs_device_lock();
+        OPSTAT(pufs_rand, check = pufs_rand(gf->header.nonce_base, GCMFILE_NONCE_SIZE / 4));
+        pufs_device_unlock();
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("pufs_rand fail, check = %d\n", check);
+            goto RET;
+        }
+    }
+    if (gf->envelope) {
+        check = gcmfile_dek(gf);
+        if (check != PUFS_SUCCESS) {
+            goto RET;
+        }
+    }
+    if (!gf->decrypt) {
+        if (gcmfile_pwrite(gf->fd_out, (const u8 *)&gf->header, gf->header_len, 0) != 0) {
+            APP_ERR("write header fail, errno = %d\n", errno);
+            check = PUFS_ERROR;
+            goto RET;
+        }
+    }
+
+    for (i = 0; i < gf->threads; i++) {
+        if (gcmfile_worker_init(&workers[i], gf) != 0 ||
+            pthread_create(&tids[i], NULL, gcmfile_worker, &workers[i]) != 0) {
+            pthread_mutex_lock(&gf->lock);
+            gf->error = PUFS_ERROR;
+            pthread_mutex_unlock(&gf->lock);
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    for (i = 0; i < gf->threads; i++) {
+        gcmfile_worker_deinit(&workers[i]);
+    }
+
+    check = gf->error;
+    if (check != PUFS_SUCCESS && started > 0) {
+        APP_ERR("chunk %llu of %llu failed, check = %d\n",
+            (unsigned long long)gf->bad_chunk, (unsigned long long)gf->chunks, check);
+    }
+RET:
+    gf->run_secs = gcmfile_now() - start;
+    return check;
+}
+
+/* Authenticates and decrypts only chunk index. out needs room for chunk_size bytes */
+pufs_status_t gcmfile_read_chunk(gcmfile_st *gf, uint64_t index, u8 *out, uint32_t *outlen)
+{
+    gcmfile_worker_st w;
+    pufs_status_t check = PUFS_ERROR;
+    uint32_t len;
+
+    if (!gf->decrypt || index >= gf->chunks) {
+        APP_ERR("chunk %llu is out of [0, %llu)\n",
+            (unsigned long long)index, (unsigned long long)gf->chunks);
+        return PUFS_ERROR;
+    }
+    if (gcmfile_worker_init(&w, gf) != 0) {
+        goto RET;
+    }
+    if (gf->envelope) {
+        check = gcmfile_dek(gf);
+        if (check != PUFS_SUCCESS) {
+            goto RET;
+        }
+        check = PUFS_ERROR;
+    }
+    len = gcmfile_chunk_len(gf, index);
+    if (gcmfile_pread(gf->fd_in, w.in, len + GCMFILE_TAG_SIZE, gcmfile_chunk_off(gf, index)) != 0) {
+        APP_ERR("read chunk %llu fail\n", (unsigned long long)index);
+        goto RET;
+    }
+    check = gcmfile_unseal_chunk(&w, index, len);
+    if (check == PUFS_SUCCESS) {
+        memcpy(out, w.out, len);
+        *outlen = len;
+    }
+RET:
+    gcmfile_worker_deinit(&w);
+    return check;
+}
@@ -0,0 +1,114 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      gcmfile.h
+ * @brief     Chunked AES-GCM file format
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __GCMFILE_H__
+#define __GCMFILE_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define GCMFILE_MAGIC           "PKBG"
+#define GCMFILE_VERSION         1
+#define GCMFILE_VERSION_ENVELOPE 2  /* data key salt in the header, chunks sealed on the host */
+#define GCMFILE_NONCE_SIZE      8
+#define GCMFILE_IV_SIZE         12
+#define GCMFILE_TAG_SIZE        16
+#define GCMFILE_HEADER_V1       32          /* header bytes of version 1 files */
+#define GCMFILE_DEK_SIZE        32
+#define GCMFILE_SALT_SIZE       32          /* data key = HMAC-SHA256(client key, salt || 1) */
+#define GCMFILE_CHECK_SIZE      8           /* HMAC-SHA256(client key, salt || 2), tells another client key */
+#define GCMFILE_LAST            0x80000000  /* set in the IV counter of the final chunk */
+#define GCMFILE_THREADS_DEFAULT 4
+#define GCMFILE_THREADS_MAX     16
+
+/**
+ * File header, also the AAD of every chunk. It is followed by the chunks,
+ * each chunk_size bytes of ciphertext (the last one may be shorter, even
+ * empty) and its tag. Chunk k uses the IV nonce_base || be32(k), with
+ * GCMFILE_LAST or'ed into the counter of the last chunk, so chunks cannot be
+ * reordered, dropped or appended without failing authentication.
+ *
+ * Version 1 stops at reserved2 and seals the chunks on the device with the
+ * client key. Version 2 (envelope) adds a random salt, from which the device
+ * derives a per-file data key under the client key, and seals the chunks on
+ * the host with it.
+ */
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t tag_len;
+    uint8_t reserved[2];
+    uint32_t chunk_size;
+    uint8_t nonce_base[GCMFILE_NONCE_SIZE];
+    uint8_t reserved2[12];
+    uint8_t dek_salt[GCMFILE_SALT_SIZE];
+    uint8_t dek_check[GCMFILE_CHECK_SIZE];
+    uint8_t reserved3[8];
+} gcmfile_header_st;
+
+typedef struct {
+    int fd_in;
+    int fd_out;                 ///< -1 when only verifying
+    int decrypt;
+    int threads;
+    int envelope;
+    gcmfile_header_st header;
+    uint32_t header_len;        ///< bytes of header on the file
+    uint8_t dek[GCMFILE_DEK_SIZE];
+    uint64_t in_size;
+    uint64_t chunks;
+
+    // shared by the workers
+    uint64_t next;
+    pufs_status_t error;
+    uint64_t bad_chunk;
+    pthread_mutex_t lock;
+
+    uint64_t out_size;
+    double run_secs;
+    double device_secs;
+} gcmfile_st;
+
+int gcmfile_probe(const char *path);
+int gcmfile_open(gcmfile_st *gf, const char *read_file, const char *write_file, int decrypt,
+                 uint32_t chunk_size, int threads, int envelope);
+void gcmfile_close(gcmfile_st *gf);
+pufs_status_t gcmfile_run(gcmfile_st *gf);
+pufs_status_t gcmfile_read_chunk(gcmfile_st *gf, uint64_t index, u8 *out, uint32_t *outlen);
+
+#endif /* __GCMFILE_H__ */
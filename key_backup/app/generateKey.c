@@ -38,30 +38,73 @@
 
 
 #include "libcore.h"
+#include "keyd.h"
+#include "keyslot.h"
+#include <getopt.h>
 
-int main(void)
+void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-K name]\n", argv0);
+    fprintf(stderr, "   without options, derive the client key into its slot\n");
+    fprintf(stderr, "   -K  create the named key name.key, wrapped under the client key, in %s\n",
+        KEYSLOT_DIR);
+    fprintf(stderr, "       or in $%s\n\n", KEYSLOT_DIR_ENV);
+}
+
+int main(int argc, char *argv[])
 {
     pufs_status_t ret = PUFS_SUCCESS;
+    const char *key = NULL;
+    int opt, fd;
 
-    ret = pufs_start(__func__);
-    if (ret != PUFS_SUCCESS)
-    {
-        APP_ERR("pufs_start fail, check = %d\n", ret);
-        goto EXIT;
+    while ((opt = getopt(argc, argv, "K:")) != -1) {
+        switch (opt) {
+            case 'K':
+                if (!keyslot_name_valid(optarg)) {
+                    fprintf(stderr, "bad key name %s\n", optarg);
+                    return PUFS_ERROR;
+                }
+                key = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return PUFS_ERROR;
+        }
     }
-    enroll();
 
-    ret = generate_key();
+    // a running keyService owns the device
+    fd = keyd_connect();
+    if (fd >= 0) {
+        ret = keyd_generate_key(fd, key);
+        close(fd);
+    }
+    else {
+        ret = pufs_start(__func__);
+        if (ret != PUFS_SUCCESS)
+        {
+            APP_ERR("pufs_start fail, check = %d\n", ret);
+            goto EXIT;
+        }
+        enroll();
+        if (key == NULL) {
+            ret = generate_key();
+        }
+        else {
+            ret = keyslot_create(key);
+        }
+        pufs_end(__func__);
+    }
     if (ret != PUFS_SUCCESS) {
         APP_ERR("generateKey failed, ret = %d", ret);
     }
+    else if (key != NULL) {
+        printf("Generate Key %s OK\n", key);
+    }
     else {
         printf("Generate Key OK\n");
     }
 
-    pufs_end(__func__);
 EXIT:
-    STATISTICS_SHOW();
     return ret;
 }
 
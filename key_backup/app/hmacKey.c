@@ -37,22 +37,146 @@
  */
 
 #include "libcore.h"
+#include <getopt.h>
+#include "blockio.h"
+#include "hmacfile.h"
+#include "keyd.h"
+#include "keyslot.h"
 #define BUF_SIZE 64
 
-int main(void)
+void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-a sha256|sha384|sha512] [-b block_kib] [-j jobs] [-K name] [file ...]\n", argv0);
+    fprintf(stderr, "   without files, print the HMAC of the key itself to check it is valid\n");
+    fprintf(stderr, "   file  HMAC of each file under the client key, - for stdin\n");
+    fprintf(stderr, "   -a  hash of the HMAC (default sha256)\n");
+    fprintf(stderr, "   -b  read and device block size in KiB, %d to %d (default %d)\n",
+        BLOCKIO_BLOCK_MIN / 1024, BLOCKIO_BLOCK_MAX / 1024, BLOCKIO_BLOCK_DEFAULT / 1024);
+    fprintf(stderr, "   -j  files at a time, 1 to %d (default %d)\n",
+        HMACFILE_JOBS_MAX, HMACFILE_JOBS_DEFAULT);
+    fprintf(stderr, "   -K  named key of keyslot to use instead of the client key, needs files\n\n");
+}
+
+static pufs_status_t run_files(char **paths, int npaths, pufs_hash_t hash, uint32_t block_size, int jobs,
+                              const char *key)
+{
+    pufs_status_t ret = PUFS_ERROR;
+    hmacfile_st hf;
+    int fd, i;
+    uint32_t j;
+
+    if (hmacfile_open(&hf, paths, npaths, hash, block_size, jobs) != 0) {
+        goto CLOSE;
+    }
+    hf.key = key;
+
+    // a running keyService owns the device
+    fd = keyd_connect();
+    if (fd >= 0) {
+        close(fd);
+        hf.keyd = 1;
+        ret = hmacfile_run(&hf);
+    }
+    else {
+        ret = pufs_start(__func__);
+        if (ret != PUFS_SUCCESS)
+        {
+            APP_ERR("pufs_start fail, ret = %d\n", ret);
+            goto CLOSE;
+        }
+        enroll();
+        ret = hmacfile_run(&hf);
+        pufs_end(__func__);
+    }
+
+    // in the order given, like sha256sum
+    for (i = 0; i < hf.nitems; i++) {
+        if (hf.items[i].status != PUFS_SUCCESS) {
+            fprintf(stderr, "%s: HMAC FAIL, ret = %d\n", hf.items[i].path, hf.items[i].status);
+            continue;
+        }
+        for (j = 0; j < hf.items[i].md.dlen; j++) {
+            printf("%02x", hf.items[i].md.dgst[j]);
+        }
+        printf("  %s\n", hf.items[i].path);
+    }
+    fprintf(stderr, "HMAC-%s of %d files, %llu bytes in %.3f s, %.2f MB/s (%d jobs, block %u KiB, ",
+        hmacfile_hash_name(hash), hf.nitems, (unsigned long long)hf.bytes, hf.run_secs,
+        hf.run_secs > 0 ? hf.bytes / hf.run_secs / 1e6 : 0.0, hf.jobs, block_size / 1024);
+    // round trips of the jobs overlap while they queue in keyService
+    if (hf.keyd) {
+        fprintf(stderr, "through keyService)\n");
+    }
+    else {
+        fprintf(stderr, "device busy %.0f%%)\n", hf.run_secs > 0 ? 100 * hf.device_secs / hf.run_secs : 0.0);
+    }
+CLOSE:
+    hmacfile_close(&hf);
+    return ret;
+}
+
+int main(int argc, char *argv[])
 {
     pufs_status_t ret = PUFS_SUCCESS;
     u8 buf[BUF_SIZE] = {0};
+    pufs_hash_t hash = PUFSE_SHA_256;
+    uint32_t block_size = BLOCKIO_BLOCK_DEFAULT;
+    int jobs = HMACFILE_JOBS_DEFAULT;
+    const char *key = NULL;
+    int opt, fd;
 
-    ret = pufs_start(__func__);
-    if (ret != PUFS_SUCCESS)
-    {
-        APP_ERR("pufs_start fail, ret = %d\n", ret);
+    while ((opt = getopt(argc, argv, "a:b:j:K:")) != -1) {
+        switch (opt) {
+            case 'a':
+                if (hmacfile_hash(optarg, &hash) != 0) {
+                    usage(argv[0]);
+                    return PUFS_ERROR;
+                }
+                break;
+            case 'b':
+                block_size = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'K':
+                if (!keyslot_name_valid(optarg)) {
+                    fprintf(stderr, "bad key name %s\n", optarg);
+                    return PUFS_ERROR;
+                }
+                key = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return PUFS_ERROR;
+        }
+    }
+    if (optind < argc) {
+        ret = run_files(argv + optind, argc - optind, hash, block_size, jobs, key);
         goto EXIT;
     }
-    enroll();
-    ret = hmac_key(buf, BUF_SIZE);
-    pufs_end(__func__);
+    if (key != NULL) {
+        usage(argv[0]);
+        return PUFS_ERROR;
+    }
+
+    // a running keyService owns the device
+    fd = keyd_connect();
+    if (fd >= 0) {
+        ret = keyd_hmac_key(fd, buf, BUF_SIZE);
+        close(fd);
+    }
+    else {
+        ret = pufs_start(__func__);
+        if (ret != PUFS_SUCCESS)
+        {
+            APP_ERR("pufs_start fail, ret = %d\n", ret);
+            goto EXIT;
+        }
+        enroll();
+        ret = hmac_key(buf, BUF_SIZE);
+        pufs_end(__func__);
+    }
 
     if (ret == PUFS_ERROR_INVALID) {
         printf("Key is invalid!\n");
@@ -69,7 +193,6 @@ int main(void)
     printf("\n");
 
 EXIT:
-    STATISTICS_SHOW();
     return ret;
 }
 
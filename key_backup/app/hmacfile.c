@@ -0,0 +1,447 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      hmacfile.c
+ * @brief     Device-keyed HMAC tags of files and stdin
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include "blockio.h"
+#include "hmacfile.h"
+#include "keyd.h"
+
+/**
+ * Each job takes the next file and streams it through an HMAC context under
+ * the client key. A reader thread fills one aligned block while the device
+ * digests the other, so a file costs its read time or its device time,
+ * whichever is larger. Jobs run their files at the same time and only take
+ * turns for the device calls themselves, on pufs_device_lock, or in
+ * keyService when it owns the device.
+ */
+
+enum { HMACFILE_INIT, HMACFILE_UPDATE, HMACFILE_FINAL };
+
+typedef struct {
+    int fd;
+    uint32_t block_size;
+    u8 *buf[2];
+    uint32_t len[2];
+    int full[2];
+    int error;
+    int stop;                   ///< the job gave up on the file
+    int stop_pipe[2];           ///< written on stop, wakes a reader waiting on a pipe
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} hmacfile_reader_st;
+
+static const struct {
+    const char *name;
+    pufs_hash_t hash;
+} hmacfile_hashes[] = {
+    { "sha256", PUFSE_SHA_256 },
+    { "sha384", PUFSE_SHA_384 },
+    { "sha512", PUFSE_SHA_512 },
+};
+
+static double hmacfile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int hmacfile_hash(const char *name, pufs_hash_t *hash)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(hmacfile_hashes) / sizeof(hmacfile_hashes[0]); i++) {
+        if (strcmp(name, hmacfile_hashes[i].name) == 0) {
+            *hash = hmacfile_hashes[i].hash;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *hmacfile_hash_name(pufs_hash_t hash)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(hmacfile_hashes) / sizeof(hmacfile_hashes[0]); i++) {
+        if (hmacfile_hashes[i].hash == hash) {
+            return hmacfile_hashes[i].name;
+        }
+    }
+    return "unknown";
+}
+
+/* A block is full or the file ended, short reads of pipes are filled up.
+ * Waits in poll rather than read, so that a stop ends the wait on a pipe
+ * whose writer keeps it open. */
+static ssize_t hmacfile_read(hmacfile_reader_st *rd, u8 *buf, size_t size)
+{
+    struct pollfd fds[2] = {
+        { .fd = rd->fd, .events = POLLIN },
+        { .fd = rd->stop_pipe[0], .events = POLLIN },
+    };
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < size) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (fds[1].revents != 0) {
+            errno = ECANCELED;
+            return -1;
+        }
+        n = read(rd->fd, buf + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void *hmacfile_reader(void *arg)
+{
+    hmacfile_reader_st *rd = arg;
+    unsigned long seq;
+    ssize_t n;
+    int k;
+
+    for (seq = 0; ; seq++) {
+        k = seq % 2;
+        pthread_mutex_lock(&rd->lock);
+        while (rd->full[k] && !rd->stop) {
+            pthread_cond_wait(&rd->cond, &rd->lock);
+        }
+        pthread_mutex_unlock(&rd->lock);
+        if (rd->stop) {
+            break;
+        }
+
+        n = hmacfile_read(rd, rd->buf[k], rd->block_size);
+
+        pthread_mutex_lock(&rd->lock);
+        if (n < 0) {
+            rd->error = errno;
+        }
+        else {
+            rd->len[k] = n;
+            rd->full[k] = 1;
+        }
+        pthread_cond_broadcast(&rd->cond);
+        pthread_mutex_unlock(&rd->lock);
+        // a short block is the last one
+        if (n < (ssize_t)rd->block_size) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static pufs_status_t hmacfile_device_call(hmacfile_st *hf, int keyd, hmac_stream_st *hs, int op,
+                                          const u8 *in, uint32_t len, pufs_dgst_st *md, double *secs)
+{
+    pufs_status_t check;
+    double start;
+
+    if (keyd >= 0) {
+        start = hmacfile_now();
+        check = op == HMACFILE_INIT ? keyd_hmac_init(keyd, hf->hash, hf->key) :
+                op == HMACFILE_UPDATE ? keyd_hmac_update(keyd, in, len) :
+                keyd_hmac_final(keyd, md);
+        *secs += hmacfile_now() - start;
+        return check;
+    }
+    pufs_device_lock();
+    start = hmacfile_now();
+    if (op == HMACFILE_INIT) {
+        check = hf->key != NULL ? hmac_stream_init_key(hs, hf->hash, hf->key) :
+                hmac_stream_init(hs, hf->hash, CLIENT_KEY_SLOT);
+    }
+    else {
+        check = op == HMACFILE_UPDATE ? hmac_stream_update(hs, in, len) : hmac_stream_final(hs, md);
+    }
+    *secs += hmacfile_now() - start;
+    pufs_device_unlock();
+    return check;
+}
+
+static pufs_status_t hmacfile_one(hmacfile_st *hf, hmacfile_item_st *item, int keyd,
+                                  u8 *bufs[2], double *secs)
+{
+    hmacfile_reader_st rd;
+    hmac_stream_st hs;
+    pufs_status_t check;
+    pthread_t tid;
+    unsigned long seq;
+    uint32_t len;
+    int k, err;
+
+    memset(&rd, 0, sizeof(rd));
+    memset(&hs, 0, sizeof(hs));
+    rd.block_size = hf->block_size;
+    rd.buf[0] = bufs[0];
+    rd.buf[1] = bufs[1];
+    rd.fd = blockio_is_stdio(item->path) ? STDIN_FILENO : open(item->path, O_RDONLY);
+    if (rd.fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", item->path, errno);
+        return PUFS_ERROR;
+    }
+    posix_fadvise(rd.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    check = hmacfile_device_call(hf, keyd, &hs, HMACFILE_INIT, NULL, 0, NULL, secs);
+    if (check != PUFS_SUCCESS) {
+        goto CLOSE;
+    }
+    if (pipe(rd.stop_pipe) != 0) {
+        APP_ERR("pipe fail, errno = %d\n", errno);
+        check = PUFS_ERROR;
+        goto FREE;
+    }
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+    if (pthread_create(&tid, NULL, hmacfile_reader, &rd) != 0) {
+        APP_ERR("pthread_create fail\n");
+        check = PUFS_ERROR;
+        goto DESTROY;
+    }
+
+    for (seq = 0; ; seq++) {
+        k = seq % 2;
+        pthread_mutex_lock(&rd.lock);
+        while (!rd.full[k] && !rd.error) {
+            pthread_cond_wait(&rd.cond, &rd.lock);
+        }
+        err = rd.full[k] ? 0 : rd.error;
+        len = rd.len[k];
+        pthread_mutex_unlock(&rd.lock);
+        if (err) {
+            APP_ERR("read %s fail, errno = %d\n", item->path, err);
+            check = PUFS_ERROR;
+            break;
+        }
+
+        if (len > 0) {
+            check = hmacfile_device_call(hf, keyd, &hs, HMACFILE_UPDATE, rd.buf[k], len, NULL, secs);
+            if (check != PUFS_SUCCESS) {
+                break;
+            }
+            item->size += len;
+        }
+
+        pthread_mutex_lock(&rd.lock);
+        rd.full[k] = 0;
+        pthread_cond_broadcast(&rd.cond);
+        pthread_mutex_unlock(&rd.lock);
+        if (len < hf->block_size) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&rd.lock);
+    rd.stop = 1;
+    pthread_cond_broadcast(&rd.cond);
+    pthread_mutex_unlock(&rd.lock);
+    // the reader may be waiting for input that never comes
+    if (write(rd.stop_pipe[1], "", 1) != 1) {
+        APP_ERR("stop reader fail, errno = %d\n", errno);
+    }
+    pthread_join(tid, NULL);
+
+    if (check == PUFS_SUCCESS) {
+        check = hmacfile_device_call(hf, keyd, &hs, HMACFILE_FINAL, NULL, 0, &item->md, secs);
+    }
+DESTROY:
+    pthread_cond_destroy(&rd.cond);
+    pthread_mutex_destroy(&rd.lock);
+    close(rd.stop_pipe[0]);
+    close(rd.stop_pipe[1]);
+FREE:
+    hmac_stream_free(&hs);
+CLOSE:
+    if (rd.fd != STDIN_FILENO) {
+        close(rd.fd);
+    }
+    return check;
+}
+
+static void *hmacfile_job(void *arg)
+{
+    hmacfile_st *hf = arg;
+    u8 *bufs[2] = { NULL, NULL };
+    double secs = 0;
+    int keyd = -1, index, i;
+
+    for (i = 0; i < 2; i++) {
+        if (posix_memalign((void **)&bufs[i], BLOCKIO_ALIGN, hf->block_size) != 0) {
+            bufs[i] = NULL;
+        }
+    }
+    if (hf->keyd) {
+        keyd = keyd_connect();
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&hf->lock);
+        if (hf->next >= hf->nitems) {
+            pthread_mutex_unlock(&hf->lock);
+            break;
+        }
+        index = hf->next++;
+        pthread_mutex_unlock(&hf->lock);
+
+        if (bufs[0] == NULL || bufs[1] == NULL || (hf->keyd && keyd < 0)) {
+            APP_ERR("%s: no buffers or no keyService\n", hf->items[index].path);
+            hf->items[index].status = PUFS_ERROR;
+            continue;
+        }
+        // one file failing leaves the others alone
+        hf->items[index].status = hmacfile_one(hf, &hf->items[index], keyd, bufs, &secs);
+        if (hf->items[index].status != PUFS_SUCCESS && keyd >= 0) {
+            // the stream on the connection is in an unknown state
+            close(keyd);
+            keyd = keyd_connect();
+        }
+        pthread_mutex_lock(&hf->lock);
+        hf->bytes += hf->items[index].size;
+        pthread_mutex_unlock(&hf->lock);
+    }
+
+    pthread_mutex_lock(&hf->lock);
+    hf->device_secs += secs;
+    pthread_mutex_unlock(&hf->lock);
+    if (keyd >= 0) {
+        close(keyd);
+    }
+    free(bufs[0]);
+    free(bufs[1]);
+    return NULL;
+}
+
+int hmacfile_open(hmacfile_st *hf, char **paths, int npaths, pufs_hash_t hash,
+                  uint32_t block_size, int jobs)
+{
+    int i, stdio = 0;
+
+    memset(hf, 0, sizeof(*hf));
+    pthread_mutex_init(&hf->lock, NULL);
+    hf->hash = hash;
+    hf->block_size = block_size;
+    hf->jobs = jobs;
+
+    if (jobs < 1 || jobs > HMACFILE_JOBS_MAX) {
+        APP_ERR("jobs %d is out of [1, %d]\n", jobs, HMACFILE_JOBS_MAX);
+        return -1;
+    }
+    if (!blockio_block_valid(block_size) || block_size > KEYD_DATA_MAX) {
+        return -1;
+    }
+    for (i = 0; i < npaths; i++) {
+        stdio += blockio_is_stdio(paths[i]);
+    }
+    if (npaths < 1 || stdio > 1) {
+        APP_ERR("give one or more files, and - for stdin at most once\n");
+        return -1;
+    }
+    hf->items = calloc(npaths, sizeof(*hf->items));
+    if (hf->items == NULL) {
+        return -1;
+    }
+    for (i = 0; i < npaths; i++) {
+        hf->items[i].path = paths[i];
+        hf->items[i].status = PUFS_ERROR;
+    }
+    hf->nitems = npaths;
+    if (hf->jobs > npaths) {
+        hf->jobs = npaths;
+    }
+    return 0;
+}
+
+void hmacfile_close(hmacfile_st *hf)
+{
+    free(hf->items);
+    hf->items = NULL;
+    pthread_mutex_destroy(&hf->lock);
+}
+
+/* Needs a device session, or keyd set. Returns the first failed status */
+pufs_status_t hmacfile_run(hmacfile_st *hf)
+{
+    pthread_t tids[HMACFILE_JOBS_MAX];
+    pufs_status_t check = PUFS_SUCCESS;
+    double start = hmacfile_now();
+    int i, started = 0;
+
+    for (i = 0; i < hf->jobs; i++) {
+        if (pthread_create(&tids[i], NULL, hmacfile_job, hf) != 0) {
+            APP_ERR("hmacfile job %d fail\n", i);
+            break;
+        }
+        started++;
+    }
+    // jobs that did start take the files of those that did not
+    if (started == 0) {
+        hmacfile_job(hf);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    hf->run_secs = hmacfile_now() - start;
+
+    for (i = 0; i < hf->nitems; i++) {
+        if (hf->items[i].status != PUFS_SUCCESS && check == PUFS_SUCCESS) {
+            check = hf->items[i].status;
+        }
+    }
+    return check;
+}
@@ -0,0 +1,80 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      hmacfile.h
+ * @brief     Device-keyed HMAC tags of files and stdin
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __HMACFILE_H__
+#define __HMACFILE_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define HMACFILE_JOBS_DEFAULT   4
+#define HMACFILE_JOBS_MAX       16
+
+typedef struct {
+    const char *path;           ///< BLOCKIO_STDIO for stdin
+    pufs_status_t status;
+    pufs_dgst_st md;
+    uint64_t size;
+} hmacfile_item_st;
+
+typedef struct {
+    hmacfile_item_st *items;
+    int nitems;
+    pufs_hash_t hash;
+    uint32_t block_size;
+    int jobs;
+    int keyd;                   ///< 1 to send the device work to keyService
+    const char *key;            ///< named key, see keyslot.h, NULL for the client key
+
+    // shared by the jobs
+    int next;
+    pthread_mutex_t lock;
+
+    uint64_t bytes;
+    double run_secs;
+    double device_secs;
+} hmacfile_st;
+
+int hmacfile_hash(const char *name, pufs_hash_t *hash);
+const char *hmacfile_hash_name(pufs_hash_t hash);
+int hmacfile_open(hmacfile_st *hf, char **paths, int npaths, pufs_hash_t hash,
+                  uint32_t block_size, int jobs);
+void hmacfile_close(hmacfile_st *hf);
+pufs_status_t hmacfile_run(hmacfile_st *hf);
+
+#endif /* __HMACFILE_H__ */
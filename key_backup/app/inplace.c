@@ -0,0 +1,544 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      inplace.c
+ * @brief     Resumable in-place encryption over memory-mapped windows
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blockio.h"
+#include "inplace.h"
+
+/**
+ * The file is encrypted block by block inside a mapped window, which is
+ * moved along the file, so files larger than the address space work. Output
+ * sits one file header after the input when encrypting (before it when
+ * decrypting), so a block's output overwrites input that later blocks still
+ * need. Before a block touches the file, its input and the input it is about
+ * to overwrite are journaled to <file>.ckpt; the block's output is msync'ed
+ * before the next journal replaces it. An interrupted run therefore leaves
+ * the journal behind, and running again replays the last block and goes on.
+ * When encrypting, the journal holds plaintext, so it is only ever readable
+ * by the owner and zeroed before it is removed.
+ */
+
+static double inplace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int inplace_paths(const char *path, char *ckpt_path, char *tmp_path)
+{
+    int n;
+
+    n = snprintf(ckpt_path, PATH_MAX, "%s%s", path, INPLACE_CKPT_SUFFIX);
+    if (n < 0 || n >= PATH_MAX) {
+        return -1;
+    }
+    if (tmp_path != NULL) {
+        n = snprintf(tmp_path, PATH_MAX, "%s%s.tmp", path, INPLACE_CKPT_SUFFIX);
+        if (n < 0 || n >= PATH_MAX) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* True when an interrupted in-place run left its journal behind */
+int inplace_pending(const char *path)
+{
+    char ckpt_path[PATH_MAX];
+
+    if (inplace_paths(path, ckpt_path, NULL) != 0) {
+        return 0;
+    }
+    return access(ckpt_path, F_OK) == 0;
+}
+
+static int inplace_write_all(int fd, const void *buf, size_t len)
+{
+    const u8 *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Overwrites a journal with zeros and unlinks it */
+static int inplace_wipe(const char *path)
+{
+    u8 zeros[4096] = {0};
+    struct stat st;
+    off_t left;
+    size_t n;
+    int fd, ret = -1;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        goto RET;
+    }
+    for (left = st.st_size; left > 0; left -= n) {
+        n = left < (off_t)sizeof(zeros) ? (size_t)left : sizeof(zeros);
+        if (inplace_write_all(fd, zeros, n) != 0) {
+            APP_ERR("wipe %s fail, errno = %d\n", path, errno);
+            goto RET;
+        }
+    }
+    if (fdatasync(fd) != 0 || unlink(path) != 0) {
+        APP_ERR("wipe %s fail, errno = %d\n", path, errno);
+        goto RET;
+    }
+    ret = 0;
+RET:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+/* Replaces the journal atomically, durable before the step may touch the file */
+static int inplace_ckpt_write(inplace_st *ip)
+{
+    int fd;
+
+    // a new file, so that a stale one cannot pass on wider permissions
+    if (unlink(ip->tmp_path) != 0 && errno != ENOENT) {
+        APP_ERR("unlink %s fail, errno = %d\n", ip->tmp_path, errno);
+        return -1;
+    }
+    fd = open(ip->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", ip->tmp_path, errno);
+        return -1;
+    }
+    if (inplace_write_all(fd, &ip->ckpt, sizeof(ip->ckpt)) != 0 ||
+        inplace_write_all(fd, ip->in_buf, ip->ckpt.len) != 0 ||
+        fdatasync(fd) != 0) {
+        APP_ERR("write %s fail, errno = %d\n", ip->tmp_path, errno);
+        close(fd);
+        inplace_wipe(ip->tmp_path);
+        return -1;
+    }
+    close(fd);
+    if (rename(ip->tmp_path, ip->ckpt_path) != 0 || fsync(ip->dir_fd) != 0) {
+        APP_ERR("rename %s fail, errno = %d\n", ip->ckpt_path, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* 1 with the journal and its step input loaded, 0 without a journal */
+static int inplace_ckpt_read(inplace_st *ip)
+{
+    int fd, ret = -1;
+    ssize_t n;
+
+    fd = open(ip->ckpt_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        APP_ERR("open %s fail, errno = %d\n", ip->ckpt_path, errno);
+        return -1;
+    }
+    n = read(fd, &ip->ckpt, sizeof(ip->ckpt));
+    if (n != sizeof(ip->ckpt) ||
+        memcmp(ip->ckpt.magic, INPLACE_CKPT_MAGIC, sizeof(ip->ckpt.magic)) != 0 ||
+        ip->ckpt.version != INPLACE_CKPT_VERSION ||
+        ip->ckpt.len > ip->block_size ||
+        ip->ckpt.carry_len > sizeof(ip->ckpt.carry)) {
+        APP_ERR("%s is not a valid checkpoint\n", ip->ckpt_path);
+        goto RET;
+    }
+    if (read(fd, ip->in_buf, ip->ckpt.len) != (ssize_t)ip->ckpt.len) {
+        APP_ERR("%s is truncated, was it written with another block size?\n", ip->ckpt_path);
+        goto RET;
+    }
+    ret = 1;
+RET:
+    close(fd);
+    return ret;
+}
+
+static int inplace_ckpt_remove(inplace_st *ip)
+{
+    if (inplace_wipe(ip->ckpt_path) != 0 || fsync(ip->dir_fd) != 0) {
+        APP_ERR("unlink %s fail, errno = %d\n", ip->ckpt_path, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* Moves the window so that it covers [off, off + len) */
+static u8 *inplace_map(inplace_st *ip, off_t off, size_t len)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start;
+    size_t wlen;
+
+    if (ip->win != NULL && off >= ip->win_off &&
+        off + (off_t)len <= ip->win_off + (off_t)ip->win_len) {
+        return ip->win + (off - ip->win_off);
+    }
+    if (ip->win != NULL) {
+        munmap(ip->win, ip->win_len);
+        ip->win = NULL;
+    }
+
+    start = off - off % page;
+    wlen = INPLACE_WINDOW;
+    if (wlen < off + len - start) {
+        wlen = off + len - start;
+    }
+    if (start + (off_t)wlen > ip->file_len) {
+        wlen = ip->file_len - start;
+    }
+    if (wlen == 0) {
+        return NULL;
+    }
+    ip->win = mmap(NULL, wlen, PROT_READ | PROT_WRITE, MAP_SHARED, ip->fd, start);
+    if (ip->win == MAP_FAILED) {
+        APP_ERR("mmap %zu bytes at %lld fail, errno = %d\n", wlen, (long long)start, errno);
+        ip->win = NULL;
+        return NULL;
+    }
+    madvise(ip->win, wlen, MADV_SEQUENTIAL);
+    ip->win_off = start;
+    ip->win_len = wlen;
+    return ip->win + (off - start);
+}
+
+static int inplace_sync(inplace_st *ip, off_t off, size_t len)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = off - ip->win_off;
+
+    start -= start % page;
+    if (len > 0 && msync(ip->win + start, off + len - ip->win_off - start, MS_SYNC) != 0) {
+        APP_ERR("msync fail, errno = %d\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* OFB cannot seek, a resumed run regenerates the keystream up to the journaled step */
+static pufs_status_t inplace_skip(inplace_st *ip, aes_stream_st *stream, uint64_t len)
+{
+    pufs_status_t ret = PUFS_SUCCESS;
+    uint32_t n, out_len;
+    u8 *zero;
+
+    zero = calloc(1, ip->block_size);
+    if (zero == NULL) {
+        return PUFS_ERROR;
+    }
+    while (len > 0 && ret == PUFS_SUCCESS) {
+        n = len < ip->block_size ? len : ip->block_size;
+        out_len = ip->block_size + BLOCKIO_SLACK;
+        ret = aes_stream_update(stream, ip->out_buf, &out_len, zero, n);
+        len -= n;
+    }
+    free(zero);
+    return ret;
+}
+
+static void inplace_close(inplace_st *ip)
+{
+    if (ip->win != NULL) {
+        munmap(ip->win, ip->win_len);
+        ip->win = NULL;
+    }
+    if (ip->fd >= 0) {
+        close(ip->fd);
+        ip->fd = -1;
+    }
+    if (ip->dir_fd >= 0) {
+        close(ip->dir_fd);
+        ip->dir_fd = -1;
+    }
+    free(ip->in_buf);
+    free(ip->out_buf);
+    ip->in_buf = ip->out_buf = NULL;
+}
+
+static int inplace_open(inplace_st *ip, const char *path, size_t block_size)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+
+    memset(ip, 0, sizeof(*ip));
+    ip->fd = ip->dir_fd = -1;
+    ip->path = path;
+    ip->block_size = block_size;
+
+    if (inplace_paths(path, ip->ckpt_path, ip->tmp_path) != 0) {
+        APP_ERR("path %s is too long\n", path);
+        return -1;
+    }
+    ip->fd = open(path, O_RDWR);
+    if (ip->fd < 0 || fstat(ip->fd, &st) != 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+    ip->file_len = st.st_size;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    ip->dir_fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (ip->dir_fd < 0) {
+        APP_ERR("open directory of %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    ip->in_buf = malloc(block_size);
+    ip->out_buf = malloc(block_size + 2 * BLOCKIO_SLACK);
+    if (ip->in_buf == NULL || ip->out_buf == NULL) {
+        APP_ERR("malloc fail\n");
+        return -1;
+    }
+    return 0;
+}
+
+pufs_status_t inplace_run(inplace_st *ip, const char *path, int decrypt, int legacy, size_t block_size)
+{
+    pufs_status_t ret = PUFS_ERROR;
+    inplace_ckpt_st *ckpt = &ip->ckpt;
+    aes_stream_st stream = {0};
+    uint32_t hdr_len = legacy ? 0 : sizeof(aes_file_header_st);
+    uint8_t carry[sizeof(aes_file_header_st)];
+    uint32_t carry_len = 0, len, out_len, n;
+    uint64_t pos, out_pos, end;
+    off_t lo, hi;
+    u8 *base;
+    int redo = 0, last;
+    double start = inplace_now(), t;
+
+    if (inplace_open(ip, path, block_size) != 0) {
+        goto RET;
+    }
+
+    switch (inplace_ckpt_read(ip)) {
+        case 1:
+            if (ckpt->decrypt != decrypt || ckpt->legacy != legacy) {
+                APP_ERR("%s was interrupted while %s, run that again\n", path,
+                    ckpt->decrypt ? (ckpt->legacy ? "decrypting with -L" : "decrypting") : "encrypting");
+                goto RET;
+            }
+            ip->resumed = 1;
+            redo = 1;
+            printf("Resuming %s at %llu of %llu bytes\n", path,
+                (unsigned long long)ckpt->pos, (unsigned long long)ckpt->size);
+            break;
+        case 0:
+            memset(ckpt, 0, sizeof(*ckpt));
+            memcpy(ckpt->magic, INPLACE_CKPT_MAGIC, sizeof(ckpt->magic));
+            ckpt->version = INPLACE_CKPT_VERSION;
+            ckpt->decrypt = decrypt;
+            ckpt->legacy = legacy;
+            ckpt->size = ip->file_len;
+            if (decrypt) {
+                ckpt->pos = hdr_len;
+                if (!legacy && pread(ip->fd, &ckpt->header, hdr_len, 0) != hdr_len) {
+                    APP_ERR("%s has no file header, use -L for files of the 16-byte version\n", path);
+                    goto RET;
+                }
+            }
+            else {
+                ckpt->out_pos = hdr_len;
+                carry_len = ckpt->size < hdr_len ? ckpt->size : hdr_len;
+                if (pread(ip->fd, carry, carry_len, 0) != carry_len) {
+                    APP_ERR("pread %s fail, errno = %d\n", path, errno);
+                    goto RET;
+                }
+                if (!legacy && aes_file_header_new(&ckpt->header) != PUFS_SUCCESS) {
+                    goto RET;
+                }
+            }
+            break;
+        default:
+            goto RET;
+    }
+    end = ckpt->size;
+    pos = ckpt->pos;
+    out_pos = ckpt->out_pos;
+
+    if (legacy) {
+        ret = aes_stream_init_legacy(&stream);
+    }
+    else {
+        ret = aes_stream_init(&stream, decrypt, &ckpt->header);
+    }
+    if (ret != PUFS_SUCCESS) {
+        goto RET;
+    }
+    ret = PUFS_ERROR;
+    if (ckpt->done) {
+        goto FINISH;
+    }
+    if (ip->resumed && inplace_skip(ip, &stream, pos - (decrypt ? hdr_len : 0)) != PUFS_SUCCESS) {
+        goto RET;
+    }
+
+    do {
+        if (!redo) {
+            // gather the step's input and the input it is going to overwrite
+            len = end - pos < block_size ? end - pos : block_size;
+            ckpt->pos = pos;
+            ckpt->out_pos = out_pos;
+            ckpt->len = len;
+            ckpt->carry_len = 0;
+            if (decrypt && len > 0) {
+                base = inplace_map(ip, pos, len);
+                if (base == NULL) {
+                    goto RET;
+                }
+                memcpy(ip->in_buf, base, len);
+            }
+            else if (!decrypt) {
+                memcpy(ip->in_buf, carry, carry_len);
+                ckpt->carry_len = end - pos - len < hdr_len ? end - pos - len : hdr_len;
+                if (len + ckpt->carry_len > carry_len) {
+                    base = inplace_map(ip, pos + carry_len, len + ckpt->carry_len - carry_len);
+                    if (base == NULL) {
+                        goto RET;
+                    }
+                    memcpy(ip->in_buf + carry_len, base, len - carry_len);
+                    memcpy(ckpt->carry, base + len - carry_len, ckpt->carry_len);
+                }
+            }
+            if (inplace_ckpt_write(ip) != 0) {
+                goto RET;
+            }
+        }
+        redo = 0;
+        len = ckpt->len;
+        last = ckpt->pos + len == end;
+
+        if (!decrypt && ip->file_len < (off_t)(end + hdr_len)) {
+            if (ftruncate(ip->fd, end + hdr_len) != 0) {
+                APP_ERR("ftruncate %s fail, errno = %d\n", path, errno);
+                goto RET;
+            }
+            ip->file_len = end + hdr_len;
+        }
+
+        t = inplace_now();
+        out_len = block_size + BLOCKIO_SLACK;
+        ret = aes_stream_update(&stream, ip->out_buf, &out_len, ip->in_buf, len);
+        if (ret == PUFS_SUCCESS && last) {
+            n = BLOCKIO_SLACK;
+            ret = aes_stream_final(&stream, ip->out_buf + out_len, &n);
+            out_len += n;
+        }
+        ip->crypt_secs += inplace_now() - t;
+        if (ret != PUFS_SUCCESS) {
+            goto RET;
+        }
+        ret = PUFS_ERROR;
+        // a held back partial block would not be in the next journal
+        if (!last && out_len != len) {
+            APP_ERR("stream returned %u of %u bytes\n", out_len, len);
+            goto RET;
+        }
+
+        lo = ckpt->out_pos < ckpt->pos ? ckpt->out_pos : ckpt->pos;
+        if (!decrypt && ckpt->pos == 0) {
+            lo = 0;
+        }
+        hi = ckpt->out_pos + out_len;
+        if (lo < hi) {
+            base = inplace_map(ip, lo, hi - lo);
+            if (base == NULL) {
+                goto RET;
+            }
+            if (!decrypt && ckpt->pos == 0) {
+                memcpy(base, &ckpt->header, hdr_len);
+            }
+            memcpy(base + (ckpt->out_pos - lo), ip->out_buf, out_len);
+            if (inplace_sync(ip, lo, hi - lo) != 0) {
+                goto RET;
+            }
+        }
+
+        pos = ckpt->pos + len;
+        out_pos = ckpt->out_pos + out_len;
+        carry_len = ckpt->carry_len;
+        memcpy(carry, ckpt->carry, carry_len);
+    } while (!last);
+
+    ckpt->done = 1;
+    ckpt->len = 0;
+    if (inplace_ckpt_write(ip) != 0) {
+        goto RET;
+    }
+
+FINISH:
+    aes_stream_free(&stream);
+    ip->out_size = decrypt ? end - hdr_len : end + hdr_len;
+    if (ftruncate(ip->fd, ip->out_size) != 0 || fsync(ip->fd) != 0) {
+        APP_ERR("ftruncate %s fail, errno = %d\n", path, errno);
+        goto RET;
+    }
+    if (inplace_ckpt_remove(ip) != 0) {
+        goto RET;
+    }
+    ret = PUFS_SUCCESS;
+RET:
+    if (ret != PUFS_SUCCESS && !decrypt && access(ip->ckpt_path, F_OK) == 0) {
+        APP_WARN("%s holds plaintext of the last block until the run completes\n", ip->ckpt_path);
+    }
+    aes_stream_free(&stream);
+    inplace_close(ip);
+    ip->run_secs = inplace_now() - start;
+    return ret;
+}
@@ -0,0 +1,96 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      inplace.h
+ * @brief     Resumable in-place encryption over memory-mapped windows
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __INPLACE_H__
+#define __INPLACE_H__
+
+#include <limits.h>
+#include "libcore.h"
+
+#define INPLACE_WINDOW          (64 * 1024 * 1024)  /* bytes mapped at a time */
+#define INPLACE_CKPT_MAGIC      "PKBC"
+#define INPLACE_CKPT_VERSION    1
+#define INPLACE_CKPT_SUFFIX     ".ckpt"
+
+/**
+ * Journal of the step in progress, kept next to the file as <file>.ckpt and
+ * followed by the step's input bytes. It is written before the step touches
+ * the file, so replaying it after a crash gives the same result.
+ */
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t decrypt;
+    uint8_t legacy;
+    uint8_t done;               ///< all data written, only the final truncate may be missing
+    uint64_t size;              ///< file size when the run started
+    uint64_t pos;               ///< input offset of the step
+    uint64_t out_pos;           ///< output offset of the step
+    uint32_t len;               ///< input bytes of the step
+    uint32_t carry_len;
+    uint8_t carry[sizeof(aes_file_header_st)];  ///< input right after the step, which the step overwrites
+    aes_file_header_st header;
+} inplace_ckpt_st;
+
+typedef struct {
+    const char *path;
+    char ckpt_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    int fd;
+    int dir_fd;
+    size_t block_size;
+
+    u8 *win;                    ///< current mapping of [win_off, win_off + win_len)
+    off_t win_off;
+    size_t win_len;
+    off_t file_len;
+
+    u8 *in_buf;
+    u8 *out_buf;
+    inplace_ckpt_st ckpt;
+    int resumed;
+    uint64_t out_size;
+
+    double run_secs;
+    double crypt_secs;
+} inplace_st;
+
+int inplace_pending(const char *path);
+pufs_status_t inplace_run(inplace_st *ip, const char *path, int decrypt, int legacy, size_t block_size);
+
+#endif /* __INPLACE_H__ */
@@ -0,0 +1,460 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keyService.c
+ * @brief     Daemon that owns the device and serves the tools over a Unix socket
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "keyd.h"
+#include "keyslot.h"
+#include "devlock.h"
+
+#define KEYD_BACKLOG        64
+#define KEYD_HMAC_SIZE      32
+#define KEYD_REPLY_MIN      DLEN_MAX
+
+/**
+ * The device session is opened once at start and kept. Each client gets a
+ * thread and may send any number of requests on its connection; requests
+ * of all clients take the device in turn under pufs_device_lock, so a call
+ * costs a socket round trip instead of a session open and close.
+ */
+static volatile sig_atomic_t keyd_stop = 0;
+
+static double keyd_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void keyd_signal(int sig __attribute__((unused)))
+{
+    keyd_stop = 1;
+}
+
+void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-p socket] [-t calls] [-q]\n", argv0);
+    fprintf(stderr, "   -p  socket path (default $%s or %s)\n", KEYD_SOCKET_ENV, KEYD_SOCKET_PATH);
+    fprintf(stderr, "   -t  do not serve, measure the latency of calls key HMACs the way the\n"
+                    "       tools run them now, through a running keyService or a session each\n");
+    fprintf(stderr, "   -q  do not serve, print how long processes queued for the device\n\n");
+}
+
+static pufs_status_t keyd_crypt(uint8_t op, const u8 *in, uint32_t inlen, u8 *out, uint32_t *outlen)
+{
+    ctr_file_header_st header;
+    uint64_t offset = 0;
+    uint32_t prefix = sizeof(header) + sizeof(offset);
+    int i;
+
+    if (inlen < prefix || inlen - prefix > KEYD_DATA_MAX) {
+        APP_WARN("bad crypt request of %u bytes\n", inlen);
+        return PUFS_ERROR;
+    }
+    memcpy(&header, in, sizeof(header));
+    if (!ctr_file_header_valid(&header)) {
+        APP_WARN("bad CTR header in request\n");
+        return PUFS_ERROR;
+    }
+    for (i = 0; i < 8; i++) {
+        offset |= (uint64_t)in[sizeof(header) + i] << (8 * i);
+    }
+    *outlen = inlen - prefix;
+    return ctr_crypt_at(&header, op == KEYD_OP_DECRYPT, offset, out, in + prefix, *outlen);
+}
+
+/* A connection may have one HMAC stream open, see hmac_stream_init */
+static pufs_status_t keyd_hmac_stream(uint8_t op, hmac_stream_st *hs, const u8 *in, uint32_t inlen,
+                                      u8 *out, uint32_t *outlen)
+{
+    pufs_status_t check;
+    pufs_dgst_st md;
+
+    char key[KEYSLOT_NAME_MAX + 1];
+
+    if (op == KEYD_OP_HMAC_INIT) {
+        hmac_stream_free(hs);
+        if (inlen < 1 || inlen > 1 + KEYSLOT_NAME_MAX) {
+            return PUFS_ERROR;
+        }
+        if (inlen == 1) {
+            return hmac_stream_init(hs, (pufs_hash_t)in[0], CLIENT_KEY_SLOT);
+        }
+        memcpy(key, in + 1, inlen - 1);
+        key[inlen - 1] = '\0';
+        return hmac_stream_init_key(hs, (pufs_hash_t)in[0], key);
+    }
+    if (hs->hmac_ctx == NULL) {
+        APP_WARN("no HMAC stream open\n");
+        return PUFS_ERROR;
+    }
+    if (op == KEYD_OP_HMAC_UPDATE) {
+        return hmac_stream_update(hs, in, inlen);
+    }
+    check = hmac_stream_final(hs, &md);
+    if (check == PUFS_SUCCESS) {
+        memcpy(out, md.dgst, md.dlen);
+        *outlen = md.dlen;
+    }
+    return check;
+}
+
+static pufs_status_t keyd_dispatch(uint8_t op, hmac_stream_st *hs, const u8 *in, uint32_t inlen,
+                                   u8 *out, uint32_t *outlen)
+{
+    char key[KEYSLOT_NAME_MAX + 1];
+    pufs_status_t check;
+
+    *outlen = 0;
+    pufs_device_lock();
+    switch (op) {
+        case KEYD_OP_HMAC:
+            check = hmac_key(out, KEYD_HMAC_SIZE);
+            *outlen = KEYD_HMAC_SIZE;
+            break;
+        case KEYD_OP_ENCRYPT:
+        case KEYD_OP_DECRYPT:
+            check = keyd_crypt(op, in, inlen, out, outlen);
+            break;
+        case KEYD_OP_GENERATE:
+            if (inlen == 0) {
+                check = keyslot_invalidate();
+                if (check == PUFS_SUCCESS) {
+                    check = generate_key();
+                }
+            }
+            else if (inlen <= KEYSLOT_NAME_MAX) {
+                memcpy(key, in, inlen);
+                key[inlen] = '\0';
+                check = keyslot_create(key);
+            }
+            else {
+                check = PUFS_ERROR;
+            }
+            break;
+        case KEYD_OP_CLEAR:
+            // clear_key() opens a session of its own, the daemon already has one
+            check = keyslot_invalidate();
+            if (check == PUFS_SUCCESS) {
+                OPSTAT(pufs_clear_key, check = pufs_clear_key(SSKEY, CLIENT_KEY_SLOT, 256));
+            }
+            break;
+        case KEYD_OP_CTR_HEADER:
+            check = ctr_file_header_new((ctr_file_header_st *)out);
+            *outlen = sizeof(ctr_file_header_st);
+            break;
+        case KEYD_OP_HMAC_INIT:
+        case KEYD_OP_HMAC_UPDATE:
+        case KEYD_OP_HMAC_FINAL:
+            check = keyd_hmac_stream(op, hs, in, inlen, out, outlen);
+            break;
+        default:
+            APP_WARN("unknown op %u\n", op);
+            check = E_UNSUPPORT;
+            break;
+    }
+    pufs_device_unlock();
+    if (check != PUFS_SUCCESS) {
+        *outlen = 0;
+    }
+    return check;
+}
+
+static void *keyd_client(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    keyd_msg_st msg;
+    hmac_stream_st hs;
+    pufs_status_t check;
+    u8 *in = NULL, *out = NULL, *p;
+    uint32_t cap = 0, outlen;
+
+    memset(&hs, 0, sizeof(hs));
+
+    while (keyd_read_full(fd, &msg, sizeof(msg)) == 0) {
+        if (msg.magic != KEYD_MAGIC || msg.version != KEYD_VERSION || msg.len > KEYD_PAYLOAD_MAX) {
+            APP_WARN("bad request header, closing the connection\n");
+            break;
+        }
+        // buffers grow to the largest request of this client
+        if (msg.len > cap || in == NULL) {
+            cap = msg.len > KEYD_REPLY_MIN ? msg.len : KEYD_REPLY_MIN;
+            p = realloc(in, cap);
+            if (p == NULL) {
+                break;
+            }
+            in = p;
+            p = realloc(out, cap);
+            if (p == NULL) {
+                break;
+            }
+            out = p;
+        }
+        if (keyd_read_full(fd, in, msg.len) != 0) {
+            break;
+        }
+        check = keyd_dispatch(msg.op, &hs, in, msg.len, out, &outlen);
+        if (keyd_send(fd, msg.op, (uint16_t)check, NULL, 0, out, outlen) != 0) {
+            break;
+        }
+    }
+    hmac_stream_free(&hs);
+    free(in);
+    free(out);
+    close(fd);
+    return NULL;
+}
+
+static int keyd_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        APP_ERR("socket path %s too long\n", path);
+        return -1;
+    }
+    fd = keyd_connect();
+    if (fd >= 0) {
+        APP_ERR("keyService already running on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    // nobody answers, so a socket file left behind is stale
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // only the owner may connect, the key is the owner's
+    mask = umask(0177);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        umask(mask);
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+    if (listen(fd, KEYD_BACKLOG) != 0) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+static int keyd_serve(const char *path)
+{
+    struct sigaction sa;
+    keyslot_stats_st stats;
+    pufs_status_t check;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int lfd, fd, ret = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    // no SA_RESTART, a signal has to break accept
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = keyd_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    lfd = keyd_listen(path);
+    if (lfd < 0) {
+        goto EXIT;
+    }
+    check = pufs_start(__func__);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_start fail, check = %d\n", check);
+        goto CLOSE;
+    }
+    enroll();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    printf("keyService listening on %s\n", path);
+    fflush(stdout);
+    while (!keyd_stop) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        if (pthread_create(&tid, &attr, keyd_client, (void *)(intptr_t)fd) != 0) {
+            APP_ERR("pthread_create fail\n");
+            close(fd);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    keyslot_get_stats(&stats);
+    printf("keyService stopping, named keys: %lu hits, %lu loads, %lu evictions, %lu busy\n",
+        stats.hits, stats.loads, stats.evictions, stats.busy);
+
+    // let a request on the device finish, later ones fail with the socket gone
+    pufs_device_lock();
+    pufs_end(__func__);
+    ret = 0;
+CLOSE:
+    close(lfd);
+    unlink(path);
+EXIT:
+    return ret;
+}
+
+static int keyd_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Every call opens its own connection or session, as one run of hmacKey does */
+static int keyd_bench(int calls)
+{
+    double *lat, start, sum = 0;
+    pufs_status_t check = PUFS_SUCCESS;
+    u8 buf[KEYD_HMAC_SIZE];
+    int i, fd, daemon;
+
+    lat = malloc(calls * sizeof(*lat));
+    if (lat == NULL) {
+        return 1;
+    }
+    fd = keyd_connect();
+    daemon = fd >= 0;
+    if (daemon) {
+        close(fd);
+    }
+    for (i = 0; i < calls && check == PUFS_SUCCESS; i++) {
+        start = keyd_now();
+        if (daemon) {
+            fd = keyd_connect();
+            check = fd < 0 ? PUFS_ERROR : keyd_hmac_key(fd, buf, sizeof(buf));
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        else {
+            check = pufs_start(__func__);
+            if (check == PUFS_SUCCESS) {
+                enroll();
+                check = hmac_key(buf, sizeof(buf));
+                pufs_end(__func__);
+            }
+        }
+        lat[i] = (keyd_now() - start) * 1e6;
+        sum += lat[i];
+    }
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("call %d fail, check = %d\n", i, check);
+        free(lat);
+        return 1;
+    }
+    qsort(lat, calls, sizeof(*lat), keyd_cmp);
+    printf("hmac %s: %d calls, avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        daemon ? "through keyService" : "with a session per call", calls, sum / calls,
+        lat[calls / 2], lat[(calls - 1) * 99 / 100], lat[calls - 1]);
+    free(lat);
+    return 0;
+}
+
+/* Totals of the cross-process device queue, see devlock.h */
+static int keyd_queue_stats(void)
+{
+    devlock_st dl;
+    devlock_stats_st st;
+    int ret;
+
+    devlock_init(&dl);
+    ret = devlock_stats(&dl, &st);
+    devlock_close(&dl);
+    if (ret != 0) {
+        return 1;
+    }
+    printf("device queue: %llu grants, %llu waited, avg wait %.1f ms, max wait %.1f ms, "
+        "%llu timeouts, %llu dead holders skipped\n",
+        (unsigned long long)st.grants, (unsigned long long)st.waits,
+        st.waits > 0 ? st.wait_us / 1e3 / st.waits : 0.0, st.wait_max_us / 1e3,
+        (unsigned long long)st.timeouts, (unsigned long long)st.recovered);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, calls = 0;
+
+    while ((opt = getopt(argc, argv, "p:t:q")) != -1) {
+        switch (opt) {
+            case 'p':
+                setenv(KEYD_SOCKET_ENV, optarg, 1);
+                break;
+            case 't':
+                calls = atoi(optarg);
+                if (calls <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'q':
+                return keyd_queue_stats();
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (calls > 0) {
+        return keyd_bench(calls);
+    }
+    return keyd_serve(keyd_socket_path());
+}
@@ -0,0 +1,296 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keyd.c
+ * @brief     Local key service protocol and client
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "keyd.h"
+
+/**
+ * The tools ask keyService first and only open a device session of their
+ * own when no daemon is running. A message is one sendmsg of the header,
+ * an optional prefix and the data, and a reply is read straight into the
+ * caller's buffer, so the client never copies the data.
+ */
+
+const char *keyd_socket_path(void)
+{
+    const char *path = getenv(KEYD_SOCKET_ENV);
+
+    return (path != NULL && path[0] != '\0') ? path : KEYD_SOCKET_PATH;
+}
+
+int keyd_read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, (u8 *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int keyd_discard(int fd, size_t len)
+{
+    u8 buf[4096];
+    size_t n;
+
+    while (len > 0) {
+        n = len < sizeof(buf) ? len : sizeof(buf);
+        if (keyd_read_full(fd, buf, n) != 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+int keyd_connect(void)
+{
+    struct sockaddr_un addr;
+    const char *path = keyd_socket_path();
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // no daemon or a stale socket: the caller runs the device itself
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int keyd_send(int fd, uint8_t op, uint16_t status, const u8 *prefix, uint32_t prefixlen,
+              const u8 *in, uint32_t inlen)
+{
+    keyd_msg_st msg;
+    struct iovec iov[3];
+    struct msghdr mh;
+    size_t left = sizeof(msg) + prefixlen + inlen;
+    ssize_t n;
+    int i = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = KEYD_MAGIC;
+    msg.version = KEYD_VERSION;
+    msg.op = op;
+    msg.status = status;
+    msg.len = prefixlen + inlen;
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = (void *)prefix;
+    iov[1].iov_len = prefixlen;
+    iov[2].iov_base = (void *)in;
+    iov[2].iov_len = inlen;
+
+    while (left > 0) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov + i;
+        mh.msg_iovlen = 3 - i;
+        n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        left -= n;
+        // skip what went out, a large request may take several calls
+        while (i < 3 && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if (i < 3) {
+            iov[i].iov_base = (u8 *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static pufs_status_t keyd_request(int fd, uint8_t op, const u8 *prefix, uint32_t prefixlen,
+                                  const u8 *in, uint32_t inlen,
+                                  u8 *out, uint32_t outmax, uint32_t *outlen)
+{
+    keyd_msg_st msg;
+
+    if (keyd_send(fd, op, 0, prefix, prefixlen, in, inlen) != 0) {
+        APP_ERR("send request %u to keyService fail\n", op);
+        return PUFS_ERROR;
+    }
+    if (keyd_read_full(fd, &msg, sizeof(msg)) != 0) {
+        APP_ERR("keyService closed the connection\n");
+        return PUFS_ERROR;
+    }
+    if (msg.magic != KEYD_MAGIC || msg.version != KEYD_VERSION || msg.op != op || msg.len > KEYD_PAYLOAD_MAX) {
+        APP_ERR("bad reply from keyService\n");
+        return PUFS_ERROR;
+    }
+    if (msg.len > outmax) {
+        // drop the payload so that the next reply starts at a header
+        APP_ERR("reply of %u bytes from keyService, expected at most %u\n", msg.len, outmax);
+        if (keyd_discard(fd, msg.len) != 0) {
+            APP_ERR("keyService closed the connection\n");
+        }
+        return PUFS_ERROR;
+    }
+    if (keyd_read_full(fd, out, msg.len) != 0) {
+        APP_ERR("keyService closed the connection\n");
+        return PUFS_ERROR;
+    }
+    if (outlen != NULL) {
+        *outlen = msg.len;
+    }
+    return (pufs_status_t)msg.status;
+}
+
+pufs_status_t keyd_call(int fd, uint8_t op, const u8 *in, uint32_t inlen,
+                        u8 *out, uint32_t outmax, uint32_t *outlen)
+{
+    return keyd_request(fd, op, NULL, 0, in, inlen, out, outmax, outlen);
+}
+
+pufs_status_t keyd_hmac_key(int fd, u8 *buf, uint32_t buf_size)
+{
+    pufs_status_t check;
+    u8 dgst[32];
+    uint32_t len;
+
+    check = keyd_call(fd, KEYD_OP_HMAC, NULL, 0, dgst, sizeof(dgst), &len);
+    if (check == PUFS_SUCCESS) {
+        memset(buf, 0, buf_size);
+        memcpy(buf, dgst, len < buf_size ? len : buf_size);
+    }
+    return check;
+}
+
+/* key NULL for the client key, else a named key to create, see keyslot.h */
+pufs_status_t keyd_generate_key(int fd, const char *key)
+{
+    return keyd_call(fd, KEYD_OP_GENERATE, (const u8 *)key, key == NULL ? 0 : strlen(key),
+        NULL, 0, NULL);
+}
+
+pufs_status_t keyd_clear_key(int fd)
+{
+    return keyd_call(fd, KEYD_OP_CLEAR, NULL, 0, NULL, 0, NULL);
+}
+
+pufs_status_t keyd_hmac_init(int fd, pufs_hash_t hash, const char *key)
+{
+    u8 h = (u8)hash;
+
+    return keyd_request(fd, KEYD_OP_HMAC_INIT, &h, 1, (const u8 *)key, key == NULL ? 0 : strlen(key),
+        NULL, 0, NULL);
+}
+
+pufs_status_t keyd_hmac_update(int fd, const u8 *in, uint32_t inlen)
+{
+    if (inlen > KEYD_DATA_MAX) {
+        APP_ERR("%u bytes is more than one keyService request\n", inlen);
+        return PUFS_ERROR;
+    }
+    return keyd_call(fd, KEYD_OP_HMAC_UPDATE, in, inlen, NULL, 0, NULL);
+}
+
+pufs_status_t keyd_hmac_final(int fd, pufs_dgst_st *md)
+{
+    pufs_status_t check;
+    uint32_t len;
+
+    memset(md, 0, sizeof(*md));
+    check = keyd_call(fd, KEYD_OP_HMAC_FINAL, NULL, 0, md->dgst, sizeof(md->dgst), &len);
+    md->dlen = len;
+    return check;
+}
+
+pufs_status_t keyd_ctr_file_header_new(int fd, ctr_file_header_st *header)
+{
+    pufs_status_t check;
+    uint32_t len;
+
+    check = keyd_call(fd, KEYD_OP_CTR_HEADER, NULL, 0, (u8 *)header, sizeof(*header), &len);
+    if (check == PUFS_SUCCESS && (len != sizeof(*header) || !ctr_file_header_valid(header))) {
+        APP_ERR("bad CTR header from keyService\n");
+        check = PUFS_ERROR;
+    }
+    return check;
+}
+
+pufs_status_t keyd_ctr_crypt_at(int fd, const ctr_file_header_st *header, int decrypt,
+                                uint64_t offset, u8 *out, const u8 *in, uint32_t len)
+{
+    u8 prefix[sizeof(ctr_file_header_st) + sizeof(uint64_t)];
+    pufs_status_t check;
+    uint32_t outlen;
+    int i;
+
+    if (len > KEYD_DATA_MAX) {
+        APP_ERR("%u bytes is more than one keyService request\n", len);
+        return PUFS_ERROR;
+    }
+    memcpy(prefix, header, sizeof(*header));
+    for (i = 0; i < 8; i++) {
+        prefix[sizeof(*header) + i] = (u8)(offset >> (8 * i));
+    }
+    check = keyd_request(fd, decrypt ? KEYD_OP_DECRYPT : KEYD_OP_ENCRYPT,
+        prefix, sizeof(prefix), in, len, out, len, &outlen);
+    if (check == PUFS_SUCCESS && outlen != len) {
+        APP_ERR("short reply from keyService\n");
+        check = PUFS_ERROR;
+    }
+    return check;
+}
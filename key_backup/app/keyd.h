@@ -0,0 +1,98 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keyd.h
+ * @brief     Local key service protocol and client
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __KEYD_H__
+#define __KEYD_H__
+
+#include "libcore.h"
+
+/* keyService listens here, KEYD_SOCKET_ENV overrides the path */
+#define KEYD_SOCKET_PATH    "/run/keyService.sock"
+#define KEYD_SOCKET_ENV     "KEYBACKUP_SOCKET"
+
+#define KEYD_MAGIC          0x444b4250      ///< "PBKD"
+#define KEYD_VERSION        1
+#define KEYD_DATA_MAX       (4 * 1024 * 1024)
+#define KEYD_PAYLOAD_MAX    (KEYD_DATA_MAX + sizeof(ctr_file_header_st) + sizeof(uint64_t))
+
+typedef enum {
+    KEYD_OP_HMAC = 1,       ///< reply: HMAC-SHA256 of the client key
+    KEYD_OP_ENCRYPT,        ///< ctr_file_header_st, le64 offset, data; reply: data
+    KEYD_OP_DECRYPT,
+    KEYD_OP_GENERATE,       ///< derive the client key into its slot, or a key name: create it
+    KEYD_OP_CLEAR,          ///< clear the client key slot
+    KEYD_OP_CTR_HEADER,     ///< reply: ctr_file_header_st with a new nonce
+    KEYD_OP_HMAC_INIT,      ///< u8 pufs_hash_t and a key name or nothing, starts the HMAC stream
+    KEYD_OP_HMAC_UPDATE,    ///< data
+    KEYD_OP_HMAC_FINAL,     ///< reply: the digest
+} keyd_op_t;
+
+/**
+ * Every request and reply is this header followed by len payload bytes.
+ * The socket is local, so fields are in host byte order. A reply carries
+ * the request op and the pufs_status_t of the operation.
+ */
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t op;
+    uint16_t status;
+    uint32_t len;
+} keyd_msg_st;
+
+const char *keyd_socket_path(void);
+int keyd_read_full(int fd, void *buf, size_t len);
+int keyd_send(int fd, uint8_t op, uint16_t status, const u8 *prefix, uint32_t prefixlen,
+              const u8 *in, uint32_t inlen);
+
+/* Connection to a running keyService, -1 when none is running */
+int keyd_connect(void);
+pufs_status_t keyd_call(int fd, uint8_t op, const u8 *in, uint32_t inlen,
+                        u8 *out, uint32_t outmax, uint32_t *outlen);
+
+pufs_status_t keyd_hmac_key(int fd, u8 *buf, uint32_t buf_size);
+pufs_status_t keyd_generate_key(int fd, const char *key);
+pufs_status_t keyd_clear_key(int fd);
+pufs_status_t keyd_hmac_init(int fd, pufs_hash_t hash, const char *key);
+pufs_status_t keyd_hmac_update(int fd, const u8 *in, uint32_t inlen);
+pufs_status_t keyd_hmac_final(int fd, pufs_dgst_st *md);
+pufs_status_t keyd_ctr_file_header_new(int fd, ctr_file_header_st *header);
+pufs_status_t keyd_ctr_crypt_at(int fd, const ctr_file_header_st *header, int decrypt,
+                                uint64_t offset, u8 *out, const u8 *in, uint32_t len);
+
+#endif /* __KEYD_H__ */
@@ -0,0 +1,404 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keyslot.c
+ * @brief     Named client keys loaded into key slots on demand
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "keyslot.h"
+
+/**
+ * A named key is either stored as <name>.key in the key directory, wrapped
+ * under the client key with AES-KW, or, when there is no such file, derived
+ * from the client key with HKDF and the name as info, so it needs no
+ * storage at all. Any number of names share the KEYSLOT_COUNT slots: a name
+ * stays loaded until the least recently used unpinned slot is needed for
+ * another one. Keys of this table are lost with the slots when the process
+ * ends; keyService keeps them loaded for all its clients.
+ */
+typedef struct {
+    pufs_ka_slot_t slot;
+    char name[KEYSLOT_NAME_MAX + 1];    ///< empty while the slot holds no named key
+    unsigned long last_use;
+    int pins;
+} keyslot_entry_st;
+
+static keyslot_entry_st keyslot_table[KEYSLOT_COUNT] = {
+    { CLIENT_NAMED_SLOT_A, "", 0, 0 },
+    { CLIENT_NAMED_SLOT_B, "", 0, 0 },
+};
+static unsigned long keyslot_clock;
+static keyslot_stats_st keyslot_counters;
+static pthread_mutex_t keyslot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void keyslot_wipe(u8 *buf, size_t len)
+{
+    volatile u8 *p = buf;
+
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+/* Letters, digits and . _ -, not starting with a dot */
+int keyslot_name_valid(const char *name)
+{
+    size_t i, len = strlen(name);
+
+    if (len == 0 || len > KEYSLOT_NAME_MAX || name[0] == '.') {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        if (!((name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+              (name[i] >= '0' && name[i] <= '9') || name[i] == '.' || name[i] == '_' || name[i] == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *keyslot_dir(void)
+{
+    const char *dir = getenv(KEYSLOT_DIR_ENV);
+
+    return (dir != NULL && dir[0] != '\0') ? dir : KEYSLOT_DIR;
+}
+
+static void keyslot_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s.key", keyslot_dir(), name);
+}
+
+/* 1 and the blob when name has a key file, 0 when it has none, -1 on errors */
+static int keyslot_read_blob(const char *name, u8 *blob)
+{
+    char path[MAX_PATH_LENGTH * 2];
+    ssize_t n;
+    int fd;
+
+    keyslot_path(name, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+    n = read(fd, blob, KEYSLOT_WRAPPED_SIZE);
+    close(fd);
+    if (n != KEYSLOT_WRAPPED_SIZE) {
+        APP_ERR("%s is not a wrapped key\n", path);
+        return -1;
+    }
+    return 1;
+}
+
+static pufs_status_t keyslot_load(const char *name, pufs_ka_slot_t slot)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    u8 blob[KEYSLOT_WRAPPED_SIZE];
+    char info[sizeof(KEYSLOT_INFO_PREFIX) + KEYSLOT_NAME_MAX];
+    int ret;
+
+    ret = keyslot_read_blob(name, blob);
+    if (ret < 0) {
+        return PUFS_ERROR;
+    }
+    if (ret > 0) {
+        OPSTAT(pufs_import_wrapped_key, check = pufs_import_wrapped_key(SSKEY, slot, blob, 256,
+            CLIENT_KEY_SLOT, 256, AES_KW, NULL));
+        if (check != PUFS_SUCCESS) {
+            // the key wrap integrity check fails under another client key
+            APP_ERR("pufs_import_wrapped_key %s fail, check = %d\n", name, check);
+            check = PUFS_ERROR_INVALID;
+        }
+        return check;
+    }
+
+    snprintf(info, sizeof(info), "%s%s", KEYSLOT_INFO_PREFIX, name);
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, slot, 256,
+            PRF_HMAC, PUFSE_SHA_256, false,
+            NULL, 0, 1,
+            SSKEY, CLIENT_KEY_SLOT, 256,
+            NULL, 0,  //salt
+            (const uint8_t *)info, strlen(info))); //info
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_kdf %s fail, check = %d\n", name, check);
+    }
+    return check;
+}
+
+/* Least recently used unpinned entry, empty ones first. Under keyslot_lock */
+static keyslot_entry_st *keyslot_victim(void)
+{
+    keyslot_entry_st *victim = NULL, *e;
+    int i;
+
+    for (i = 0; i < KEYSLOT_COUNT; i++) {
+        e = &keyslot_table[i];
+        if (e->pins > 0) {
+            continue;
+        }
+        if (e->name[0] == '\0') {
+            return e;
+        }
+        if (victim == NULL || e->last_use < victim->last_use) {
+            victim = e;
+        }
+    }
+    if (victim == NULL) {
+        keyslot_counters.busy++;
+        APP_ERR("all %d named key slots are in use\n", KEYSLOT_COUNT);
+    }
+    return victim;
+}
+
+static keyslot_entry_st *keyslot_find_slot(pufs_ka_slot_t slot)
+{
+    int i;
+
+    for (i = 0; i < KEYSLOT_COUNT; i++) {
+        if (keyslot_table[i].slot == slot) {
+            return &keyslot_table[i];
+        }
+    }
+    return NULL;
+}
+
+pufs_status_t keyslot_acquire(const char *name, pufs_ka_slot_t *slot)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    keyslot_entry_st *e = NULL;
+    int i;
+
+    if (!keyslot_name_valid(name)) {
+        APP_ERR("bad key name %s\n", name);
+        return E_INVALID;
+    }
+    pthread_mutex_lock(&keyslot_lock);
+    for (i = 0; i < KEYSLOT_COUNT; i++) {
+        if (strcmp(keyslot_table[i].name, name) == 0) {
+            e = &keyslot_table[i];
+            keyslot_counters.hits++;
+            goto PIN;
+        }
+    }
+    e = keyslot_victim();
+    if (e == NULL) {
+        check = E_BUSY;
+        goto RET;
+    }
+    if (e->name[0] != '\0') {
+        keyslot_counters.evictions++;
+    }
+    // the slot holds nothing usable until the load succeeded
+    e->name[0] = '\0';
+    check = keyslot_load(name, e->slot);
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    strcpy(e->name, name);
+    keyslot_counters.loads++;
+PIN:
+    e->pins++;
+    e->last_use = ++keyslot_clock;
+    *slot = e->slot;
+RET:
+    pthread_mutex_unlock(&keyslot_lock);
+    return check;
+}
+
+void keyslot_release(pufs_ka_slot_t slot)
+{
+    keyslot_entry_st *e;
+
+    pthread_mutex_lock(&keyslot_lock);
+    e = keyslot_find_slot(slot);
+    if (e != NULL && e->pins > 0) {
+        e->pins--;
+    }
+    pthread_mutex_unlock(&keyslot_lock);
+}
+
+/* Pinned without a name, so no named key is loaded there meanwhile */
+pufs_status_t keyslot_claim(pufs_ka_slot_t slot)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    keyslot_entry_st *e;
+
+    pthread_mutex_lock(&keyslot_lock);
+    e = keyslot_find_slot(slot);
+    if (e == NULL) {
+        goto RET;
+    }
+    if (e->pins > 0) {
+        keyslot_counters.busy++;
+        APP_ERR("slot %d is in use by %s\n", slot, e->name[0] != '\0' ? e->name : "another key");
+        check = E_BUSY;
+        goto RET;
+    }
+    e->name[0] = '\0';
+    e->pins++;
+RET:
+    pthread_mutex_unlock(&keyslot_lock);
+    return check;
+}
+
+/* Named keys come from the client key, so they are all stale once it changes */
+pufs_status_t keyslot_invalidate(void)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    int i;
+
+    pthread_mutex_lock(&keyslot_lock);
+    for (i = 0; i < KEYSLOT_COUNT; i++) {
+        if (keyslot_table[i].pins > 0 && keyslot_table[i].name[0] != '\0') {
+            keyslot_counters.busy++;
+            APP_ERR("%s is in use, the client key cannot change\n", keyslot_table[i].name);
+            check = E_BUSY;
+            goto RET;
+        }
+    }
+    for (i = 0; i < KEYSLOT_COUNT; i++) {
+        if (keyslot_table[i].pins == 0) {
+            keyslot_table[i].name[0] = '\0';
+        }
+    }
+RET:
+    pthread_mutex_unlock(&keyslot_lock);
+    return check;
+}
+
+static int keyslot_mkdir(const char *dir)
+{
+    char path[MAX_PATH_LENGTH * 2];
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s", dir);
+    for (i = 1; path[i] != '\0'; i++) {
+        if (path[i] == '/') {
+            path[i] = '\0';
+            if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            path[i] = '/';
+        }
+    }
+    return (mkdir(path, 0700) != 0 && errno != EEXIST) ? -1 : 0;
+}
+
+/**
+ * The key is made in a free slot, so it is loaded right away. The file is
+ * created exclusively, an existing key is never replaced.
+ */
+pufs_status_t keyslot_create(const char *name)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    keyslot_entry_st *e;
+    u8 key[KEYSLOT_KEY_SIZE];
+    u8 blob[KEYSLOT_WRAPPED_SIZE];
+    char path[MAX_PATH_LENGTH * 2];
+    int fd = -1;
+
+    if (!keyslot_name_valid(name)) {
+        APP_ERR("bad key name %s\n", name);
+        return E_INVALID;
+    }
+    if (keyslot_mkdir(keyslot_dir()) != 0) {
+        APP_ERR("mkdir %s fail, errno = %d\n", keyslot_dir(), errno);
+        return PUFS_ERROR;
+    }
+    keyslot_path(name, path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        APP_ERR("create %s fail, errno = %d\n", path, errno);
+        return PUFS_ERROR;
+    }
+
+    pthread_mutex_lock(&keyslot_lock);
+    e = keyslot_victim();
+    if (e == NULL) {
+        check = E_BUSY;
+        goto RET;
+    }
+    if (e->name[0] != '\0') {
+        keyslot_counters.evictions++;
+    }
+    e->name[0] = '\0';
+    OPSTAT(pufs_rand, check = pufs_rand(key, KEYSLOT_KEY_SIZE / 4));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_rand fail, check = %d\n", check);
+        goto RET;
+    }
+    OPSTAT(pufs_import_plaintext_key, check = pufs_import_plaintext_key(SSKEY, e->slot, key, 256));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_import_plaintext_key fail, check = %d\n", check);
+        goto RET;
+    }
+    OPSTAT(pufs_export_wrapped_key, check = pufs_export_wrapped_key(SSKEY, e->slot, blob, 256,
+        CLIENT_KEY_SLOT, 256, AES_KW, NULL));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_export_wrapped_key fail, check = %d\n", check);
+        goto RET;
+    }
+    if (write(fd, blob, sizeof(blob)) != (ssize_t)sizeof(blob) || fsync(fd) != 0) {
+        APP_ERR("write %s fail, errno = %d\n", path, errno);
+        check = PUFS_ERROR;
+        goto RET;
+    }
+    strcpy(e->name, name);
+    e->last_use = ++keyslot_clock;
+    keyslot_counters.loads++;
+RET:
+    pthread_mutex_unlock(&keyslot_lock);
+    keyslot_wipe(key, sizeof(key));
+    close(fd);
+    if (check != PUFS_SUCCESS) {
+        unlink(path);
+    }
+    return check;
+}
+
+void keyslot_get_stats(keyslot_stats_st *stats)
+{
+    pthread_mutex_lock(&keyslot_lock);
+    *stats = keyslot_counters;
+    pthread_mutex_unlock(&keyslot_lock);
+}
@@ -0,0 +1,76 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keyslot.h
+ * @brief     Named client keys loaded into key slots on demand
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __KEYSLOT_H__
+#define __KEYSLOT_H__
+
+#include "libcore.h"
+
+#define KEYSLOT_DIR             "/etc/keybackup/keys"   /* wrapped key files, <name>.key */
+#define KEYSLOT_DIR_ENV         "KEYBACKUP_KEYS"
+#define KEYSLOT_NAME_MAX        64
+#define KEYSLOT_KEY_SIZE        32
+#define KEYSLOT_WRAPPED_SIZE    40                      /* AES-KW of a 256-bit key */
+#define KEYSLOT_INFO_PREFIX     "keybackup key "
+#define KEYSLOT_COUNT           2
+
+typedef struct {
+    unsigned long hits;         ///< acquired while already loaded
+    unsigned long loads;        ///< derived or unwrapped into a slot
+    unsigned long evictions;    ///< loads that replaced another named key
+    unsigned long busy;         ///< every slot was in use
+} keyslot_stats_st;
+
+int keyslot_name_valid(const char *name);
+
+/* Slot holding the named key, pinned until keyslot_release. Needs a device session */
+pufs_status_t keyslot_acquire(const char *name, pufs_ka_slot_t *slot);
+void keyslot_release(pufs_ka_slot_t slot);
+
+/* The slot for another key, e.g. the XTS tweak key, until keyslot_release. E_BUSY while a named key there is in use */
+pufs_status_t keyslot_claim(pufs_ka_slot_t slot);
+
+/* Forget every loaded named key before the client key changes. E_BUSY while one is in use */
+pufs_status_t keyslot_invalidate(void);
+
+/* New random key, stored as <name>.key wrapped under the client key */
+pufs_status_t keyslot_create(const char *name);
+
+void keyslot_get_stats(keyslot_stats_st *stats);
+
+#endif /* __KEYSLOT_H__ */
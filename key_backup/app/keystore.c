@@ -0,0 +1,990 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keystore.c
+ * @brief     Versioned key store for the backup server
+ * @copyright 2023 PUFsecurity
+ *
+ * Backups are appended to segment files (keystore_NNNNNNNN.seg) as fixed size
+ * records. An in-memory index keeps the newest generations of every client,
+ * up to the retention limit. Older generations become dead records, which the
+ * background compactor reclaims by merging sealed segments into a new one.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "keystore.h"
+
+typedef struct {
+    keystore_client_st *client;
+    uint32_t generation;
+    keystore_loc_st old_loc;
+    uint32_t new_index;
+} keystore_move_st;
+
+static uint32_t keystore_crc32(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t crc = 0xffffffff;
+    size_t i;
+    int j;
+
+    for (i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t keystore_record_crc(const keystore_record_st *rec)
+{
+    keystore_record_st tmp;
+
+    memcpy(&tmp, rec, sizeof(keystore_record_st));
+    tmp.crc = 0;
+    return keystore_crc32(&tmp, sizeof(keystore_record_st));
+}
+
+int keystore_record_valid(const keystore_record_st *rec)
+{
+    return (rec->magic == KEYSTORE_MAGIC) && (rec->crc == keystore_record_crc(rec));
+}
+
+void keystore_segment_path(keystore_st *ks, uint32_t id, char *path)
+{
+    snprintf(path, KEYSTORE_SEGMENT_PATH_MAX, "%skeystore_%08u.seg", ks->path, id);
+}
+
+static unsigned int keystore_hash(const char *macaddr, const uint8_t *cipher)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 32 && macaddr[i]; i++) {
+        h = (h ^ (uint8_t)macaddr[i]) * 16777619u;
+    }
+    for (i = 0; i < 32; i++) {
+        h = (h ^ cipher[i]) * 16777619u;
+    }
+    return h % KEYSTORE_BUCKETS;
+}
+
+static keystore_client_st *keystore_lookup(keystore_st *ks, const char *macaddr,
+        const uint8_t *cipher, int create)
+{
+    unsigned int bucket = keystore_hash(macaddr, cipher);
+    keystore_client_st *client;
+
+    for (client = ks->buckets[bucket]; client != NULL; client = client->next) {
+        if ((strncmp(client->macaddr, macaddr, sizeof(client->macaddr)) == 0) &&
+            (memcmp(client->cipher, cipher, sizeof(client->cipher)) == 0)) {
+            return client;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    client = calloc(1, sizeof(keystore_client_st));
+    if (client == NULL) {
+        APP_ERR("calloc fail\n");
+        return NULL;
+    }
+    strncpy(client->macaddr, macaddr, sizeof(client->macaddr) - 1);
+    memcpy(client->cipher, cipher, sizeof(client->cipher));
+    client->next = ks->buckets[bucket];
+    ks->buckets[bucket] = client;
+    return client;
+}
+
+static keystore_segment_st *keystore_segment_find(keystore_st *ks, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < ks->segment_num; i++) {
+        if (ks->segments[i].id == id) {
+            return &ks->segments[i];
+        }
+    }
+    return NULL;
+}
+
+static keystore_segment_st *keystore_segment_add(keystore_st *ks, uint32_t id)
+{
+    keystore_segment_st *segments;
+
+    if (ks->segment_num == ks->segment_cap) {
+        segments = realloc(ks->segments, sizeof(keystore_segment_st) * (ks->segment_cap + 16));
+        if (segments == NULL) {
+            APP_ERR("realloc fail\n");
+            return NULL;
+        }
+        ks->segments = segments;
+        ks->segment_cap += 16;
+    }
+    memset(&ks->segments[ks->segment_num], 0, sizeof(keystore_segment_st));
+    ks->segments[ks->segment_num].id = id;
+    return &ks->segments[ks->segment_num++];
+}
+
+static void keystore_segment_remove(keystore_st *ks, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < ks->segment_num; i++) {
+        if (ks->segments[i].id == id) {
+            memmove(&ks->segments[i], &ks->segments[i + 1],
+                    sizeof(keystore_segment_st) * (ks->segment_num - i - 1));
+            ks->segment_num--;
+            return;
+        }
+    }
+}
+
+static void keystore_drop(keystore_st *ks, const keystore_loc_st *loc)
+{
+    keystore_segment_st *seg = keystore_segment_find(ks, loc->segment);
+
+    if (seg != NULL && seg->live > 0) {
+        seg->live--;
+    }
+}
+
+/* Insert a generation into the client's index, newest first. Whatever falls
+ * beyond the retention limit becomes a dead record in its segment. */
+static void keystore_index_add(keystore_st *ks, keystore_client_st *client, const keystore_loc_st *loc)
+{
+    int i, pos;
+
+    for (pos = 0; pos < client->num; pos++) {
+        if (client->gens[pos].generation == loc->generation) {
+            // duplicate left behind by an interrupted compaction
+            keystore_drop(ks, loc);
+            return;
+        }
+        if (client->gens[pos].generation < loc->generation) {
+            break;
+        }
+    }
+    if (pos >= ks->retention) {
+        keystore_drop(ks, loc);
+        return;
+    }
+    if (client->num == ks->retention) {
+        keystore_drop(ks, &client->gens[client->num - 1]);
+        client->num--;
+    }
+    for (i = client->num; i > pos; i--) {
+        client->gens[i] = client->gens[i - 1];
+    }
+    client->gens[pos] = *loc;
+    client->num++;
+    if (client->last_generation < loc->generation) {
+        client->last_generation = loc->generation;
+    }
+}
+
+static keystore_loc_st *keystore_index_find(keystore_client_st *client, uint32_t generation)
+{
+    int i;
+
+    if (client->num == 0) {
+        return NULL;
+    }
+    if (generation == KEYSTORE_LATEST) {
+        return &client->gens[0];
+    }
+    for (i = 0; i < client->num; i++) {
+        if (client->gens[i].generation == generation) {
+            return &client->gens[i];
+        }
+    }
+    return NULL;
+}
+
+static int keystore_read_record(keystore_st *ks, uint32_t id, uint32_t index, keystore_record_st *rec)
+{
+    char path[KEYSTORE_SEGMENT_PATH_MAX];
+    int fd, ret = 0;
+    ssize_t len;
+
+    keystore_segment_path(ks, id, path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        ret = 1;
+        goto EXIT;
+    }
+    OPSTAT(keystore_read, len = pread(fd, rec, sizeof(keystore_record_st), (off_t)index * sizeof(keystore_record_st)));
+    if ((len != sizeof(keystore_record_st)) || !keystore_record_valid(rec)) {
+        APP_ERR("%s record %u is corrupt\n", path, index);
+        ret = 2;
+    }
+    close(fd);
+EXIT:
+    return ret;
+}
+
+static int keystore_load_segment(keystore_st *ks, uint32_t id, int last)
+{
+    char path[KEYSTORE_SEGMENT_PATH_MAX];
+    keystore_record_st rec;
+    keystore_segment_st *seg;
+    keystore_client_st *client;
+    keystore_loc_st loc;
+    int fd, ret = 0;
+    ssize_t len;
+
+    keystore_segment_path(ks, id, path);
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        ret = 1;
+        goto EXIT;
+    }
+    seg = keystore_segment_add(ks, id);
+    if (seg == NULL) {
+        ret = 2;
+        goto RET;
+    }
+
+    while ((len = read(fd, &rec, sizeof(keystore_record_st))) == sizeof(keystore_record_st)) {
+        loc.generation = rec.generation;
+        loc.segment = id;
+        loc.index = seg->records++;
+        if (!keystore_record_valid(&rec)) {
+            APP_WARN("%s record %u is corrupt, skipped\n", path, loc.index);
+            continue;
+        }
+        seg->live++;
+        client = keystore_lookup(ks, (char *)rec.wrap_key.macaddr, rec.wrap_key.cipher, 1);
+        if (client == NULL) {
+            ret = 3;
+            goto RET;
+        }
+        keystore_index_add(ks, client, &loc);
+    }
+    if (len > 0 && last) {
+        // torn write at the tail of the active segment
+        APP_WARN("%s has a partial record, truncated\n", path);
+        if (ftruncate(fd, (off_t)seg->records * sizeof(keystore_record_st)) != 0) {
+            APP_ERR("ftruncate %s fail, errno = %d\n", path, errno);
+        }
+    }
+RET:
+    close(fd);
+EXIT:
+    return ret;
+}
+
+static int keystore_id_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int keystore_init(keystore_st *ks, const char *path, int retention)
+{
+    DIR *dir;
+    struct dirent *entry;
+    uint32_t *ids = NULL, *tmp, id;
+    int num = 0, cap = 0, i, len, ret = 0;
+    char suffix[8];
+    char seg_path[KEYSTORE_SEGMENT_PATH_MAX];
+    keystore_segment_st *seg;
+
+    memset(ks, 0, sizeof(keystore_st));
+    pthread_mutex_init(&ks->lock, NULL);
+    pthread_cond_init(&ks->cond, NULL);
+    ks->active_fd = -1;
+    ks->next_id = 1;
+    ks->retention = retention;
+    if (ks->retention < 1) {
+        ks->retention = 1;
+    }
+    if (ks->retention > KEYSTORE_RETENTION_MAX) {
+        ks->retention = KEYSTORE_RETENTION_MAX;
+    }
+    len = strlen(path);
+    if (len > KEY_FILE_PATH_MAX - 2) {
+        APP_ERR("path_len:[%d] too large!!\n", len);
+        ret = 1;
+        goto EXIT;
+    }
+    strcpy(ks->path, path);
+    if (len > 0 && ks->path[len - 1] != '/') {
+        ks->path[len] = '/';
+    }
+
+    dir = opendir(len > 0 ? ks->path : ".");
+    if (dir == NULL) {
+        APP_ERR("opendir %s fail, errno = %d\n", ks->path, errno);
+        ret = 2;
+        goto EXIT;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "keystore_%8u%7s", &id, suffix) != 2 ||
+            strcmp(suffix, ".seg") != 0) {
+            continue;
+        }
+        if (num == cap) {
+            tmp = realloc(ids, sizeof(uint32_t) * (cap + 64));
+            if (tmp == NULL) {
+                APP_ERR("realloc fail\n");
+                ret = 3;
+                break;
+            }
+            ids = tmp;
+            cap += 64;
+        }
+        ids[num++] = id;
+    }
+    closedir(dir);
+    if (ret != 0) {
+        goto RET;
+    }
+
+    if (num > 1) {
+        qsort(ids, num, sizeof(uint32_t), keystore_id_cmp);
+    }
+    for (i = 0; i < num; i++) {
+        ret = keystore_load_segment(ks, ids[i], i == num - 1);
+        if (ret != 0) {
+            goto RET;
+        }
+        ks->next_id = ids[i] + 1;
+    }
+
+    // keep appending to the newest segment while it has room
+    if (num > 0) {
+        seg = keystore_segment_find(ks, ids[num - 1]);
+        if (seg != NULL && seg->records < KEYSTORE_SEGMENT_RECORDS) {
+            keystore_segment_path(ks, seg->id, seg_path);
+            ks->active_fd = open(seg_path, O_RDWR);
+            ks->active_id = seg->id;
+        }
+    }
+    APP_INFO("%d segments loaded from %s, retention %d", num, len > 0 ? ks->path : ".", ks->retention);
+RET:
+    free(ids);
+EXIT:
+    return ret;
+}
+
+void keystore_deinit(keystore_st *ks)
+{
+    keystore_client_st *client, *next;
+    int i;
+
+    keystore_compactor_stop(ks);
+    if (ks->active_fd >= 0) {
+        close(ks->active_fd);
+        ks->active_fd = -1;
+    }
+    for (i = 0; i < KEYSTORE_BUCKETS; i++) {
+        for (client = ks->buckets[i]; client != NULL; client = next) {
+            next = client->next;
+            free(client);
+        }
+        ks->buckets[i] = NULL;
+    }
+    free(ks->segments);
+    ks->segments = NULL;
+    ks->segment_num = ks->segment_cap = 0;
+    pthread_cond_destroy(&ks->cond);
+    pthread_mutex_destroy(&ks->lock);
+}
+
+static int keystore_roll(keystore_st *ks)
+{
+    char path[KEYSTORE_SEGMENT_PATH_MAX];
+    uint32_t id = ks->next_id;
+
+    if (ks->active_fd >= 0) {
+        close(ks->active_fd);
+        ks->active_fd = -1;
+    }
+    keystore_segment_path(ks, id, path);
+    ks->active_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (ks->active_fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        return 1;
+    }
+    if (keystore_segment_add(ks, id) == NULL) {
+        close(ks->active_fd);
+        ks->active_fd = -1;
+        unlink(path);
+        return 2;
+    }
+    ks->next_id++;
+    ks->active_id = id;
+    return 0;
+}
+
+// caller holds ks->lock
+static int keystore_append(keystore_st *ks, const keystore_record_st *rec, keystore_loc_st *loc)
+{
+    keystore_segment_st *seg = NULL;
+    off_t offset;
+    ssize_t len;
+    int synced = 0;
+
+    if (ks->active_fd >= 0) {
+        seg = keystore_segment_find(ks, ks->active_id);
+    }
+    if (seg == NULL || (!ks->bulk && seg->records >= KEYSTORE_SEGMENT_RECORDS)) {
+        if (keystore_roll(ks) != 0) {
+            return 1;
+        }
+        seg = keystore_segment_find(ks, ks->active_id);
+    }
+
+    offset = (off_t)seg->records * sizeof(keystore_record_st);
+    OPSTAT(keystore_write, len = pwrite(ks->active_fd, rec, sizeof(keystore_record_st), offset));
+    // a bulk import is synced once, by keystore_bulk_end
+    if (len == sizeof(keystore_record_st) && !ks->bulk) {
+        OPSTAT(keystore_sync, synced = fdatasync(ks->active_fd));
+    }
+    if (len != sizeof(keystore_record_st) || synced != 0) {
+        APP_ERR("write segment %u fail, errno = %d\n", seg->id, errno);
+        if (ftruncate(ks->active_fd, offset) != 0) {
+            APP_ERR("ftruncate segment %u fail, errno = %d\n", seg->id, errno);
+        }
+        return 2;
+    }
+    loc->generation = rec->generation;
+    loc->segment = seg->id;
+    loc->index = seg->records++;
+    seg->live++;
+    return 0;
+}
+
+int keystore_put(keystore_st *ks, const char *macaddr, const wrap_key_st *wrap_key, uint32_t *generation)
+{
+    keystore_record_st rec, old;
+    keystore_client_st *client;
+    keystore_loc_st loc, *loc_old;
+    int ret = 0;
+
+    memset(&rec, 0, sizeof(keystore_record_st));
+    rec.magic = KEYSTORE_MAGIC;
+    rec.timestamp = (uint64_t)time(NULL);
+    memcpy(&rec.wrap_key, wrap_key, sizeof(wrap_key_st));
+    memset(rec.wrap_key.macaddr, 0, sizeof(rec.wrap_key.macaddr));
+    strncpy((char *)rec.wrap_key.macaddr, macaddr, sizeof(rec.wrap_key.macaddr) - 1);
+
+    pthread_mutex_lock(&ks->lock);
+    client = keystore_lookup(ks, (char *)rec.wrap_key.macaddr, rec.wrap_key.cipher, 1);
+    if (client == NULL) {
+        ret = 1;
+        goto RET;
+    }
+    if (generation && (*generation != KEYSTORE_LATEST)) {
+        // replicated record, keep the generation assigned by the primary
+        loc_old = keystore_index_find(client, *generation);
+        if (loc_old != NULL) {
+            // already stored, by an earlier batch or export, unless it is another key
+            ret = keystore_read_record(ks, loc_old->segment, loc_old->index, &old);
+            if ((ret == 0) && (memcmp(old.wrap_key.hmac_key, rec.wrap_key.hmac_key, 32) != 0)) {
+                APP_ERR("%s generation:[%u] is stored with another key\n", client->macaddr, *generation);
+                ret = KEYSTORE_CONFLICT;
+            }
+            goto RET;
+        }
+        rec.generation = *generation;
+    }
+    else {
+        rec.generation = client->last_generation + 1;
+    }
+    rec.crc = keystore_record_crc(&rec);
+    ret = keystore_append(ks, &rec, &loc);
+    if (ret != 0) {
+        goto RET;
+    }
+    keystore_index_add(ks, client, &loc);
+    if (generation) {
+        *generation = rec.generation;
+    }
+    APP_DBG("(%d) %s generation:[%u] segment:[%u]\n", __LINE__, client->macaddr, loc.generation, loc.segment);
+RET:
+    pthread_mutex_unlock(&ks->lock);
+    return ret;
+}
+
+// where a generation is stored right now, 1 for an unknown client, 2 for an unknown generation
+static int keystore_locate(keystore_st *ks, const char *macaddr, const uint8_t *cipher,
+                           uint32_t generation, keystore_loc_st *at)
+{
+    keystore_client_st *client;
+    keystore_loc_st *loc;
+    int ret = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    client = keystore_lookup(ks, macaddr, cipher, 0);
+    if (client == NULL) {
+        ret = 1;
+        goto RET;
+    }
+    loc = keystore_index_find(client, generation);
+    if (loc == NULL) {
+        ret = 2;
+        goto RET;
+    }
+    *at = *loc;
+RET:
+    pthread_mutex_unlock(&ks->lock);
+    return ret;
+}
+
+int keystore_get(keystore_st *ks, const char *macaddr, wrap_key_st *wrap_key, uint32_t *generation)
+{
+    keystore_record_st rec;
+    keystore_loc_st at, now;
+    int ret = 0, tries;
+
+    // the segment is read without the lock, retried when the compactor moved the record meanwhile
+    for (tries = 0; ; tries++) {
+        ret = keystore_locate(ks, macaddr, wrap_key->cipher, *generation, &at);
+        if (ret == 2) {
+            APP_ERR("%s generation:[%u] not found\n", macaddr, *generation);
+        }
+        if (ret != 0) {
+            ret = 1;
+            goto RET;
+        }
+        ret = keystore_read_record(ks, at.segment, at.index, &rec);
+        if (ret == 0) {
+            break;
+        }
+        if ((tries == KEYSTORE_GET_RETRIES) ||
+            (keystore_locate(ks, macaddr, wrap_key->cipher, *generation, &now) != 0) ||
+            ((now.segment == at.segment) && (now.index == at.index))) {
+            goto RET;
+        }
+    }
+    memcpy(wrap_key, &rec.wrap_key, sizeof(wrap_key_st));
+    *generation = rec.generation;
+RET:
+    return ret;
+}
+
+/* Start an import archive: every put until keystore_bulk_end goes into one
+ * new segment, without the size limit and the per-record sync. */
+int keystore_bulk_begin(keystore_st *ks)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    if (ks->bulk) {
+        goto RET;
+    }
+    ret = keystore_roll(ks);
+    if (ret != 0) {
+        goto RET;
+    }
+    ks->bulk = 1;
+    APP_INFO("import archive segment %u", ks->active_id);
+RET:
+    pthread_mutex_unlock(&ks->lock);
+    return ret;
+}
+
+int keystore_bulk_end(keystore_st *ks)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    if (!ks->bulk) {
+        goto RET;
+    }
+    ks->bulk = 0;
+    OPSTAT(keystore_sync, ret = fdatasync(ks->active_fd));
+    if (ret != 0) {
+        APP_ERR("fdatasync segment %u fail, errno = %d\n", ks->active_id, errno);
+        ret = 1;
+    }
+RET:
+    pthread_mutex_unlock(&ks->lock);
+    return ret;
+}
+
+void keystore_session_begin(keystore_st *ks)
+{
+    pthread_mutex_lock(&ks->lock);
+    ks->sessions++;
+    pthread_mutex_unlock(&ks->lock);
+}
+
+void keystore_session_end(keystore_st *ks)
+{
+    pthread_mutex_lock(&ks->lock);
+    ks->sessions--;
+    pthread_mutex_unlock(&ks->lock);
+}
+
+int keystore_busy(keystore_st *ks)
+{
+    int busy;
+
+    pthread_mutex_lock(&ks->lock);
+    busy = ks->sessions;
+    pthread_mutex_unlock(&ks->lock);
+    return busy;
+}
+
+/* Wait until no foreground session is in flight, then sleep one rate slot.
+ * Returns non-zero when the compactor is asked to stop. */
+static int keystore_throttle(keystore_st *ks)
+{
+    int busy, stop;
+
+    do {
+        pthread_mutex_lock(&ks->lock);
+        busy = ks->sessions;
+        stop = ks->stop;
+        pthread_mutex_unlock(&ks->lock);
+        if (stop) {
+            return 1;
+        }
+        usleep(busy ? 10000 : 1000000 / KEYSTORE_COMPACT_RATE);
+    } while (busy);
+    return 0;
+}
+
+static int keystore_record_live(keystore_st *ks, const keystore_record_st *rec,
+        uint32_t id, uint32_t index, keystore_client_st **client)
+{
+    keystore_loc_st *loc;
+
+    *client = keystore_lookup(ks, (char *)rec->wrap_key.macaddr, rec->wrap_key.cipher, 0);
+    if (*client == NULL) {
+        return 0;
+    }
+    loc = keystore_index_find(*client, rec->generation);
+    return (loc != NULL) && (loc->generation == rec->generation) &&
+           (loc->segment == id) && (loc->index == index);
+}
+
+/* Hand every live record to cb, segment by segment with large sequential
+ * reads. Records that die while the scan runs may still be reported. */
+int keystore_scan(keystore_st *ks, keystore_scan_cb cb, void *arg)
+{
+    char path[KEYSTORE_SEGMENT_PATH_MAX];
+    keystore_record_st *recs = NULL;
+    keystore_client_st *client;
+    uint32_t *ids = NULL, index;
+    int num, i, n, k, live, fd, ret = 0;
+    ssize_t len;
+
+    recs = malloc(sizeof(keystore_record_st) * KEYSTORE_SCAN_RECORDS);
+    pthread_mutex_lock(&ks->lock);
+    num = ks->segment_num;
+    ids = malloc(sizeof(uint32_t) * (num + 1));
+    for (i = 0; (ids != NULL) && (i < num); i++) {
+        ids[i] = ks->segments[i].id;
+    }
+    pthread_mutex_unlock(&ks->lock);
+    if ((recs == NULL) || (ids == NULL)) {
+        APP_ERR("malloc fail\n");
+        ret = 1;
+        goto EXIT;
+    }
+
+    for (i = 0; i < num; i++) {
+        keystore_segment_path(ks, ids[i], path);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;  // compacted away since the snapshot
+        }
+        index = 0;
+        while ((len = read(fd, recs, sizeof(keystore_record_st) * KEYSTORE_SCAN_RECORDS)) > 0) {
+            n = len / sizeof(keystore_record_st);
+            for (k = 0; k < n; k++, index++) {
+                if (!keystore_record_valid(&recs[k])) {
+                    continue;
+                }
+                pthread_mutex_lock(&ks->lock);
+                live = keystore_record_live(ks, &recs[k], ids[i], index, &client);
+                pthread_mutex_unlock(&ks->lock);
+                if (live && (cb(&recs[k], arg) != 0)) {
+                    ret = 2;
+                    close(fd);
+                    goto EXIT;
+                }
+            }
+        }
+        close(fd);
+    }
+EXIT:
+    free(ids);
+    free(recs);
+    return ret;
+}
+
+int keystore_record_is_live(keystore_st *ks, const keystore_record_st *rec, uint32_t id, uint32_t index)
+{
+    keystore_client_st *client;
+    int live;
+
+    pthread_mutex_lock(&ks->lock);
+    live = keystore_record_live(ks, rec, id, index, &client);
+    pthread_mutex_unlock(&ks->lock);
+    return live;
+}
+
+// copy of the segment table, the caller frees it
+int keystore_segments(keystore_st *ks, keystore_segment_st **segs)
+{
+    int num;
+
+    pthread_mutex_lock(&ks->lock);
+    num = ks->segment_num;
+    *segs = malloc(sizeof(keystore_segment_st) * (num + 1));
+    if (*segs == NULL) {
+        num = -1;
+    }
+    else {
+        memcpy(*segs, ks->segments, sizeof(keystore_segment_st) * num);
+    }
+    pthread_mutex_unlock(&ks->lock);
+    return num;
+}
+
+// a segment file the store knows about, including a merge being written
+int keystore_segment_known(keystore_st *ks, uint32_t id)
+{
+    int known;
+
+    pthread_mutex_lock(&ks->lock);
+    known = (keystore_segment_find(ks, id) != NULL) || (id == ks->compacting);
+    pthread_mutex_unlock(&ks->lock);
+    return known;
+}
+
+int keystore_compact(keystore_st *ks)
+{
+    uint32_t victims[KEYSTORE_COMPACT_SEGMENTS], records[KEYSTORE_COMPACT_SEGMENTS];
+    uint32_t out_id, out_records = 0, index;
+    char path[KEYSTORE_SEGMENT_PATH_MAX];
+    keystore_move_st *moves = NULL, *tmp;
+    keystore_record_st rec;
+    keystore_client_st *client;
+    keystore_segment_st *seg, *out;
+    keystore_loc_st *loc;
+    int num = 0, i, live, fd = -1, move_num = 0, move_cap = 0, ret = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    for (i = 0; i < ks->segment_num && num < KEYSTORE_COMPACT_SEGMENTS; i++) {
+        seg = &ks->segments[i];
+        if ((ks->active_fd >= 0 && seg->id == ks->active_id) || seg->live == seg->records) {
+            continue;
+        }
+        victims[num] = seg->id;
+        // a segment without live records is dropped without reading it
+        records[num] = seg->live ? seg->records : 0;
+        num++;
+    }
+    out_id = ks->next_id;
+    if (num > 0) {
+        ks->next_id++;
+        ks->compacting = out_id;
+    }
+    pthread_mutex_unlock(&ks->lock);
+    if (num == 0) {
+        goto EXIT;
+    }
+
+    keystore_segment_path(ks, out_id, path);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        ret = 1;
+        goto EXIT;
+    }
+
+    for (i = 0; i < num; i++) {
+        for (index = 0; index < records[i]; index++) {
+            if (keystore_throttle(ks)) {
+                ret = 2;
+                goto ABORT;
+            }
+            if (keystore_read_record(ks, victims[i], index, &rec) != 0) {
+                continue;
+            }
+            pthread_mutex_lock(&ks->lock);
+            live = keystore_record_live(ks, &rec, victims[i], index, &client);
+            pthread_mutex_unlock(&ks->lock);
+            if (!live) {
+                continue;
+            }
+            if (pwrite(fd, &rec, sizeof(keystore_record_st),
+                       (off_t)out_records * sizeof(keystore_record_st)) != sizeof(keystore_record_st)) {
+                APP_ERR("write %s fail, errno = %d\n", path, errno);
+                ret = 3;
+                goto ABORT;
+            }
+            if (move_num == move_cap) {
+                tmp = realloc(moves, sizeof(keystore_move_st) * (move_cap + 64));
+                if (tmp == NULL) {
+                    ret = 4;
+                    goto ABORT;
+                }
+                moves = tmp;
+                move_cap += 64;
+            }
+            moves[move_num].client = client;
+            moves[move_num].generation = rec.generation;
+            moves[move_num].old_loc.generation = rec.generation;
+            moves[move_num].old_loc.segment = victims[i];
+            moves[move_num].old_loc.index = index;
+            moves[move_num].new_index = out_records++;
+            move_num++;
+        }
+    }
+    if (fdatasync(fd) != 0) {
+        APP_ERR("fdatasync %s fail, errno = %d\n", path, errno);
+        ret = 5;
+        goto ABORT;
+    }
+    close(fd);
+    fd = -1;
+
+    // switch the index over to the merged segment
+    pthread_mutex_lock(&ks->lock);
+    out = keystore_segment_add(ks, out_id);
+    if (out == NULL) {
+        pthread_mutex_unlock(&ks->lock);
+        ret = 6;
+        goto ABORT;
+    }
+    out->records = out_records;
+    for (i = 0; i < move_num; i++) {
+        loc = keystore_index_find(moves[i].client, moves[i].generation);
+        if (loc == NULL || loc->segment != moves[i].old_loc.segment ||
+            loc->index != moves[i].old_loc.index) {
+            continue;  // superseded while we were copying
+        }
+        loc->segment = out_id;
+        loc->index = moves[i].new_index;
+        out->live++;
+    }
+    for (i = 0; i < num; i++) {
+        keystore_segment_remove(ks, victims[i]);
+    }
+    live = out->live;
+    if (live == 0) {
+        keystore_segment_remove(ks, out_id);
+    }
+    ks->compacted += move_num;
+    ks->reclaimed += num;
+    pthread_mutex_unlock(&ks->lock);
+
+    for (i = 0; i < num; i++) {
+        keystore_segment_path(ks, victims[i], path);
+        unlink(path);
+    }
+    if (live == 0) {
+        keystore_segment_path(ks, out_id, path);
+        unlink(path);
+    }
+    APP_INFO("merged %d segments into %u, %d live records", num, out_id, live);
+    goto EXIT;
+
+ABORT:
+    if (fd >= 0) {
+        close(fd);
+    }
+    keystore_segment_path(ks, out_id, path);
+    unlink(path);
+EXIT:
+    if (num > 0) {
+        pthread_mutex_lock(&ks->lock);
+        ks->compacting = 0;
+        pthread_mutex_unlock(&ks->lock);
+    }
+    free(moves);
+    return ret;
+}
+
+static void *keystore_compactor_main(void *arg)
+{
+    keystore_st *ks = (keystore_st *)arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ks->lock);
+    while (!ks->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += KEYSTORE_COMPACT_INTERVAL;
+        pthread_cond_timedwait(&ks->cond, &ks->lock, &ts);
+        if (ks->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&ks->lock);
+        keystore_compact(ks);
+        pthread_mutex_lock(&ks->lock);
+    }
+    pthread_mutex_unlock(&ks->lock);
+    return NULL;
+}
+
+int keystore_compactor_start(keystore_st *ks)
+{
+    int ret;
+
+    ks->stop = 0;
+    ret = pthread_create(&ks->compactor, NULL, keystore_compactor_main, ks);
+    if (ret != 0) {
+        APP_ERR("pthread_create fail, ret = %d\n", ret);
+        return ret;
+    }
+    ks->compactor_running = 1;
+    return 0;
+}
+
+void keystore_compactor_stop(keystore_st *ks)
+{
+    if (!ks->compactor_running) {
+        return;
+    }
+    pthread_mutex_lock(&ks->lock);
+    ks->stop = 1;
+    pthread_cond_signal(&ks->cond);
+    pthread_mutex_unlock(&ks->lock);
+    pthread_join(ks->compactor, NULL);
+    ks->compactor_running = 0;
+}
@@ -0,0 +1,135 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keystore.h
+ * @brief     Versioned key store for the backup server
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __KEYSTORE_H__
+#define __KEYSTORE_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define KEYSTORE_MAGIC               0x3153424b  /* "KBS1" */
+#define KEYSTORE_RETENTION_DEFAULT   4
+#define KEYSTORE_RETENTION_MAX       16
+#define KEYSTORE_BUCKETS             256
+#define KEYSTORE_SEGMENT_RECORDS     256     /* records before the active segment is sealed */
+#define KEYSTORE_COMPACT_INTERVAL    5       /* seconds between compactor passes */
+#define KEYSTORE_COMPACT_RATE        64      /* records copied per second at most */
+#define KEYSTORE_COMPACT_SEGMENTS    8       /* sealed segments merged per pass */
+#define KEYSTORE_LATEST              0       /* generation 0 selects the newest backup */
+#define KEYSTORE_SCAN_RECORDS        64      /* records per read while scanning a segment */
+#define KEYSTORE_SEGMENT_PATH_MAX    (KEY_FILE_PATH_MAX + 32)
+#define KEYSTORE_GET_RETRIES         3       /* reads of a record the compactor keeps moving */
+#define KEYSTORE_CONFLICT            3       /* keystore_put: the generation is stored with another key */
+
+/**
+ * @brief On-disk record. Segments are plain arrays of these.
+ */
+typedef struct _ATT_ {
+    uint32_t magic;
+    uint32_t generation;
+    uint64_t timestamp;
+    uint32_t crc;                       ///< crc32 of the record with crc zeroed
+    uint32_t reserved;
+    wrap_key_st wrap_key;
+} keystore_record_st;
+
+typedef struct {
+    uint32_t generation;
+    uint32_t segment;
+    uint32_t index;                     ///< record index inside the segment
+} keystore_loc_st;
+
+typedef struct keystore_client {
+    struct keystore_client *next;
+    char macaddr[32];
+    uint8_t cipher[32];
+    uint32_t last_generation;
+    int num;                            ///< valid entries in gens, newest first
+    keystore_loc_st gens[KEYSTORE_RETENTION_MAX];
+} keystore_client_st;
+
+typedef struct {
+    uint32_t id;
+    uint32_t records;
+    uint32_t live;
+} keystore_segment_st;
+
+struct keystore {
+    char path[KEY_FILE_PATH_MAX];
+    int retention;
+    pthread_mutex_t lock;
+    keystore_client_st *buckets[KEYSTORE_BUCKETS];
+    keystore_segment_st *segments;      ///< sorted by id
+    int segment_num;
+    int segment_cap;
+    uint32_t next_id;
+    int active_fd;
+    uint32_t active_id;
+    int sessions;                       ///< foreground sessions in flight
+    int bulk;                           ///< appending to an import archive
+    uint32_t compacting;                ///< segment being written by the compactor, 0 if none
+    int compactor_running;
+    int stop;
+    pthread_t compactor;
+    pthread_cond_t cond;
+    unsigned long compacted;
+    unsigned long reclaimed;
+};
+
+typedef int (*keystore_scan_cb)(const keystore_record_st *rec, void *arg);
+
+int keystore_init(keystore_st *ks, const char *path, int retention);
+void keystore_deinit(keystore_st *ks);
+int keystore_put(keystore_st *ks, const char *macaddr, const wrap_key_st *wrap_key, uint32_t *generation);
+int keystore_get(keystore_st *ks, const char *macaddr, wrap_key_st *wrap_key, uint32_t *generation);
+int keystore_bulk_begin(keystore_st *ks);
+int keystore_bulk_end(keystore_st *ks);
+int keystore_scan(keystore_st *ks, keystore_scan_cb cb, void *arg);
+void keystore_session_begin(keystore_st *ks);
+void keystore_session_end(keystore_st *ks);
+int keystore_busy(keystore_st *ks);
+int keystore_compactor_start(keystore_st *ks);
+void keystore_compactor_stop(keystore_st *ks);
+int keystore_compact(keystore_st *ks);
+void keystore_segment_path(keystore_st *ks, uint32_t id, char *path);
+int keystore_record_valid(const keystore_record_st *rec);
+int keystore_record_is_live(keystore_st *ks, const keystore_record_st *rec, uint32_t id, uint32_t index);
+int keystore_segments(keystore_st *ks, keystore_segment_st **segs);
+int keystore_segment_known(keystore_st *ks, uint32_t id);
+
+#endif /* __KEYSTORE_H__ */
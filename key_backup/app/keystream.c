@@ -0,0 +1,346 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keystream.c
+ * @brief     OFB keystream prefetch and vectorized XOR
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <time.h>
+#include <openssl/crypto.h>
+#include "keystream.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define XOR_NEON 1
+#endif
+
+/**
+ * OFB keystream does not depend on the data, so the device can run ahead of
+ * it: the producer encrypts zero blocks, which yields the keystream itself,
+ * into a ring of depth blocks while the caller XORs earlier blocks on the
+ * host. Device latency then only shows when the producer falls behind.
+ */
+
+static double keystream_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void xor_tail(u8 *out, const u8 *in, const u8 *key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        out[i] = in[i] ^ key[i];
+    }
+}
+
+#if XOR_X86
+__attribute__((target("avx2")))
+static void xor_avx2(u8 *out, const u8 *in, const u8 *key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 128 <= len; i += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(in + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(in + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(in + i + 96));
+
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(key + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(key + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(key + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(key + i + 96)));
+        _mm256_storeu_si256((__m256i *)(out + i), a0);
+        _mm256_storeu_si256((__m256i *)(out + i + 32), a1);
+        _mm256_storeu_si256((__m256i *)(out + i + 64), a2);
+        _mm256_storeu_si256((__m256i *)(out + i + 96), a3);
+    }
+    for (; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i *)(out + i),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(in + i)),
+                             _mm256_loadu_si256((const __m256i *)(key + i))));
+    }
+    xor_tail(out + i, in + i, key + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void xor_sse2(u8 *out, const u8 *in, const u8 *key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(in + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(in + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *)(in + i + 48));
+
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(key + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(key + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(key + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(key + i + 48)));
+        _mm_storeu_si128((__m128i *)(out + i), a0);
+        _mm_storeu_si128((__m128i *)(out + i + 16), a1);
+        _mm_storeu_si128((__m128i *)(out + i + 32), a2);
+        _mm_storeu_si128((__m128i *)(out + i + 48), a3);
+    }
+    for (; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i *)(out + i),
+            _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)),
+                          _mm_loadu_si128((const __m128i *)(key + i))));
+    }
+    xor_tail(out + i, in + i, key + i, len - i);
+}
+#elif XOR_NEON
+static void xor_neon(u8 *out, const u8 *in, const u8 *key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        uint8x16_t a0 = veorq_u8(vld1q_u8(in + i), vld1q_u8(key + i));
+        uint8x16_t a1 = veorq_u8(vld1q_u8(in + i + 16), vld1q_u8(key + i + 16));
+        uint8x16_t a2 = veorq_u8(vld1q_u8(in + i + 32), vld1q_u8(key + i + 32));
+        uint8x16_t a3 = veorq_u8(vld1q_u8(in + i + 48), vld1q_u8(key + i + 48));
+
+        vst1q_u8(out + i, a0);
+        vst1q_u8(out + i + 16, a1);
+        vst1q_u8(out + i + 32, a2);
+        vst1q_u8(out + i + 48, a3);
+    }
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(out + i, veorq_u8(vld1q_u8(in + i), vld1q_u8(key + i)));
+    }
+    xor_tail(out + i, in + i, key + i, len - i);
+}
+#endif
+
+/* Widest XOR kernel of the CPU, out may be in */
+void xor_bytes(u8 *out, const u8 *in, const u8 *key, size_t len)
+{
+#if XOR_X86
+    if (__builtin_cpu_supports("avx2")) {
+        xor_avx2(out, in, key, len);
+    }
+    else {
+        xor_sse2(out, in, key, len);
+    }
+#elif XOR_NEON
+    xor_neon(out, in, key, len);
+#else
+    xor_tail(out, in, key, len);
+#endif
+}
+
+const char *xor_kernel_name(void)
+{
+#if XOR_X86
+    return __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2";
+#elif XOR_NEON
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
+
+static void *keystream_producer(void *arg)
+{
+    keystream_st *ks = arg;
+    pufs_status_t check = PUFS_SUCCESS;
+    uint32_t outlen;
+    u8 *block;
+    double start;
+
+    for (;;) {
+        pthread_mutex_lock(&ks->lock);
+        while (!ks->stop && (ks->produced - ks->consumed >= (uint64_t)ks->depth ||
+                             (ks->limit != 0 && ks->produced * ks->block_size >= ks->limit))) {
+            pthread_cond_wait(&ks->cond, &ks->lock);
+        }
+        if (ks->stop) {
+            pthread_mutex_unlock(&ks->lock);
+            break;
+        }
+        block = ks->ring + (ks->produced % ks->depth) * ks->block_size;
+        pthread_mutex_unlock(&ks->lock);
+
+        // the slot is free until produced moves past it
+        start = keystream_now();
+        pufs_device_lock();
+        if (ks->decrypt) {
+            OPSTAT(pufs_dec_ofb_update, check = pufs_dec_ofb_update(ks->ctx, block, &outlen, ks->zeros, ks->block_size));
+        }
+        else {
+            OPSTAT(pufs_enc_ofb_update, check = pufs_enc_ofb_update(ks->ctx, block, &outlen, ks->zeros, ks->block_size));
+        }
+        pufs_device_unlock();
+        if (check == PUFS_SUCCESS && outlen != ks->block_size) {
+            check = PUFS_ERROR;
+        }
+
+        pthread_mutex_lock(&ks->lock);
+        ks->device_secs += keystream_now() - start;
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("keystream block %llu fail, check = %d\n", (unsigned long long)ks->produced, check);
+            ks->error = check;
+            pthread_cond_broadcast(&ks->cond);
+            pthread_mutex_unlock(&ks->lock);
+            break;
+        }
+        ks->produced++;
+        pthread_cond_broadcast(&ks->cond);
+        pthread_mutex_unlock(&ks->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the producer on an OFB stream the caller has just initialized; from
+ * here on only the producer may use ctx. block_size must be a multiple of 16
+ * so that every device call returns whole blocks. A known limit keeps the
+ * producer from running the device past the end of the data; the consumer
+ * lifts it if the data turns out longer.
+ */
+pufs_status_t keystream_start(keystream_st *ks, pufs_sp38a_ctx *ctx, int decrypt,
+                              uint32_t block_size, int depth, uint64_t limit)
+{
+    memset(ks, 0, sizeof(*ks));
+    ks->ctx = ctx;
+    ks->decrypt = decrypt;
+    ks->block_size = block_size;
+    ks->depth = depth;
+    ks->limit = limit;
+    ks->start = keystream_now();
+
+    if (depth < KEYSTREAM_DEPTH_MIN || depth > KEYSTREAM_DEPTH_MAX ||
+        block_size == 0 || block_size % AES_IV_SIZE != 0) {
+        APP_ERR("keystream depth %d or block %u is invalid\n", depth, block_size);
+        return PUFS_ERROR;
+    }
+    ks->ring = malloc((size_t)depth * block_size);
+    ks->zeros = calloc(1, block_size);
+    if (ks->ring == NULL || ks->zeros == NULL) {
+        APP_ERR("keystream alloc fail\n");
+        goto ERR;
+    }
+    pthread_mutex_init(&ks->lock, NULL);
+    pthread_cond_init(&ks->cond, NULL);
+    if (pthread_create(&ks->tid, NULL, keystream_producer, ks) != 0) {
+        APP_ERR("keystream thread fail\n");
+        pthread_cond_destroy(&ks->cond);
+        pthread_mutex_destroy(&ks->lock);
+        goto ERR;
+    }
+    return PUFS_SUCCESS;
+ERR:
+    free(ks->ring);
+    free(ks->zeros);
+    ks->ring = ks->zeros = NULL;
+    return PUFS_ERROR;
+}
+
+/* XORs the next len bytes of keystream into out, waiting for the producer as needed */
+pufs_status_t keystream_xor(keystream_st *ks, u8 *out, const u8 *in, uint32_t len)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    uint32_t n;
+    u8 *block;
+    double start;
+
+    while (len > 0) {
+        pthread_mutex_lock(&ks->lock);
+        while (ks->produced == ks->consumed && ks->error == PUFS_SUCCESS) {
+            if (ks->limit != 0) {
+                ks->limit = 0;
+                pthread_cond_broadcast(&ks->cond);
+            }
+            pthread_cond_wait(&ks->cond, &ks->lock);
+        }
+        check = ks->produced == ks->consumed ? ks->error : PUFS_SUCCESS;
+        block = ks->ring + (ks->consumed % ks->depth) * ks->block_size;
+        pthread_mutex_unlock(&ks->lock);
+        if (check != PUFS_SUCCESS) {
+            return check;
+        }
+
+        n = ks->block_size - ks->pos;
+        if (n > len) {
+            n = len;
+        }
+        start = keystream_now();
+        xor_bytes(out, in, block + ks->pos, n);
+        ks->xor_secs += keystream_now() - start;
+        ks->xor_bytes += n;
+        ks->pos += n;
+        out += n;
+        in += n;
+        len -= n;
+
+        if (ks->pos == ks->block_size) {
+            ks->pos = 0;
+            pthread_mutex_lock(&ks->lock);
+            ks->consumed++;
+            pthread_cond_broadcast(&ks->cond);
+            pthread_mutex_unlock(&ks->lock);
+        }
+    }
+    return PUFS_SUCCESS;
+}
+
+/* Stops the producer, keystream blocks made ahead of the data are discarded. Can be called again */
+void keystream_stop(keystream_st *ks)
+{
+    if (ks->ring == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&ks->lock);
+    ks->stop = 1;
+    pthread_cond_broadcast(&ks->cond);
+    pthread_mutex_unlock(&ks->lock);
+    pthread_join(ks->tid, NULL);
+    ks->run_secs = keystream_now() - ks->start;
+    pthread_cond_destroy(&ks->cond);
+    pthread_mutex_destroy(&ks->lock);
+    // the ring held keystream, a memset before free may be optimized away
+    OPENSSL_cleanse(ks->ring, (size_t)ks->depth * ks->block_size);
+    free(ks->ring);
+    free(ks->zeros);
+    ks->ring = ks->zeros = NULL;
+}
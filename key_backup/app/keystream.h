@@ -0,0 +1,87 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      keystream.h
+ * @brief     OFB keystream prefetch and vectorized XOR
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __KEYSTREAM_H__
+#define __KEYSTREAM_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define KEYSTREAM_DEPTH_MIN     2
+#define KEYSTREAM_DEPTH_MAX     16
+
+/**
+ * Ring of keystream blocks. A producer thread runs the OFB stream over
+ * zero blocks on the device, the consumer XORs data with the blocks in
+ * order and hands them back.
+ */
+struct keystream_s {
+    pufs_sp38a_ctx *ctx;        ///< initialized OFB stream, owned by the caller
+    int decrypt;
+    int depth;
+    uint32_t block_size;
+    u8 *ring;
+    u8 *zeros;
+
+    uint64_t produced;          ///< blocks, under lock
+    uint64_t consumed;
+    uint32_t pos;               ///< bytes used of the current block, consumer only
+    uint64_t limit;             ///< keystream bytes needed, 0 when unknown
+    int stop;
+    pufs_status_t error;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    double start;
+    double run_secs;            ///< from start to stop
+    double device_secs;         ///< producer time on the device
+    double xor_secs;            ///< consumer time in the XOR kernel
+    uint64_t xor_bytes;
+};
+typedef struct keystream_s keystream_st;
+
+const char *xor_kernel_name(void);
+void xor_bytes(u8 *out, const u8 *in, const u8 *key, size_t len);
+
+pufs_status_t keystream_start(keystream_st *ks, pufs_sp38a_ctx *ctx, int decrypt,
+                              uint32_t block_size, int depth, uint64_t limit);
+pufs_status_t keystream_xor(keystream_st *ks, u8 *out, const u8 *in, uint32_t len);
+void keystream_stop(keystream_st *ks);
+
+#endif /* __KEYSTREAM_H__ */
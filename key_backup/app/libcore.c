@@ -37,6 +37,10 @@
  */
 
 #include "libcore.h"
+#include "keystore.h"
+#include "keystream.h"
+#include "keyslot.h"
+#include "devlock.h"
 
 pufs_status_t client_import_wrap(packet_st *packet)
 {
@@ -50,19 +54,17 @@ pufs_status_t client_import_wrap(packet_st *packet)
     pufs_dgst_st md;
     pufs_bytes_st *key_hmac = PUFS_BYTES_ALLOC(64);
 
-    STATISTICS_FUNC("pufs_import_wrapped_key");
-    check = pufs_import_wrapped_key(
+    OPSTAT(pufs_import_wrapped_key, check = pufs_import_wrapped_key(
             SSKEY, CLIENT_KEY_SLOT, out,
             keybits, CLIENT_KEK_SLOT, kekbits,
-            kwptype, NULL);
+            kwptype, NULL));
 
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_import_wrapped_key_to_ka fail. check = %d \n", check);
         goto RET;
     }
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_hmac fail, check = %d", check);
         goto RET;
@@ -73,6 +75,9 @@ pufs_status_t client_import_wrap(packet_st *packet)
     ret = memcmp(wrap_packet->wrap_key.hmac_key, key_hmac->out, 32);
     if (ret == 0) {
         printf("Restore OK\n");
+        if (wrap_packet->generation) {
+            printf("Key generation: %u\n", wrap_packet->generation);
+        }
     }
     else {
         printf("Restore Fail!\n");
@@ -96,19 +101,16 @@ pufs_status_t server_import_wrap(packet_st *packet)
     pufs_dgst_st md;
     pufs_bytes_st *key_hmac = PUFS_BYTES_ALLOC(64);
 
-    STATISTICS_FUNC("pufs_import_wrapped_key");
-
-    check = pufs_import_wrapped_key(
+    OPSTAT(pufs_import_wrapped_key, check = pufs_import_wrapped_key(
             SSKEY, SERVER_KEY_SLOT, out,
             keybits, SERVER_KEK_SLOT, kekbits,
-            kwptype, NULL);
+            kwptype, NULL));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_import_wrapped_key_to_ka fail. check = %d \n", check);
         goto RET;
     }
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, SERVER_KEY_SLOT, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, SERVER_KEY_SLOT, 256));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_hmac fail, check = %d", check);
         goto RET;
@@ -140,12 +142,12 @@ pufs_status_t client_require_wrap_packet(packet_st *packet)
     packet->send_buf_size = sizeof(wrap_packet_st);
     sprintf(wrap_key->packet_name, "RESTORE_CLIENT");
     sprintf((char*)wrap_key->macaddr, "%s", packet->macaddress);
+    wrap_packet->generation = packet->generation;
     wrap_key->export_key_size = 40;
     wrap_key->hmac_key_size = 32;
     wrap_key->cipher_size = 32;
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SWKEY, packet->passwd, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SWKEY, packet->passwd, 256));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_hmac cipher_hmac fail, ret = %d", check);
         goto RET;
@@ -183,8 +185,7 @@ pufs_status_t client_wrap_packet(packet_st *packet)
         goto EXIT;
     }
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&cipher_hmac, NULL, 0, PUFSE_SHA_256, SWKEY, packet->passwd, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&cipher_hmac, NULL, 0, PUFSE_SHA_256, SWKEY, packet->passwd, 256));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_hmac cipher_hmac fail, ret = %d", check);
         goto RET;
@@ -192,17 +193,15 @@ pufs_status_t client_wrap_packet(packet_st *packet)
     memcpy(wrap_packet->wrap_key.cipher, cipher_hmac.dgst, 32);
     wrap_packet->event = BACKUP_KEY;
 
-    STATISTICS_FUNC("pufs_export_wrapped_key");
-    check = pufs_export_wrapped_key(
+    OPSTAT(pufs_export_wrapped_key, check = pufs_export_wrapped_key(
             SSKEY, CLIENT_KEY_SLOT, out,
             keybits, CLIENT_KEK_SLOT, kekbits,
-            kwptype, NULL);
+            kwptype, NULL));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_export_wrapped_key_from_ka fail. check = %d \n", check);
         goto RET;
     }
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&key_hmac, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&key_hmac, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_hmac fail, ret = %d", check);
         goto RET;
@@ -233,11 +232,10 @@ pufs_status_t server_wrap_packet(packet_st *packet)
 
     wrap_packet->event = RESTORE_KEY;
 
-    STATISTICS_FUNC("pufs_export_wrapped_key");
-    check = pufs_export_wrapped_key(
+    OPSTAT(pufs_export_wrapped_key, check = pufs_export_wrapped_key(
             SSKEY, SERVER_KEY_SLOT, out,
             keybits, SERVER_KEK_SLOT, kekbits,
-            kwptype, NULL);
+            kwptype, NULL));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_export_wrapped_key_from_ka fail. check = %d \n", check);
         goto RET;
@@ -323,6 +321,43 @@ EXIT:
 }
 
 
+static int save_to_keystore(packet_st *packet)
+{
+    int ret;
+    wrap_packet_st *wrap_packet = (wrap_packet_st *)(packet->recv_buf);
+
+    packet->generation = wrap_packet->generation;
+    ret = keystore_put(packet->keystore, packet->macaddress, &wrap_packet->wrap_key, &packet->generation);
+    if (ret != 0) {
+        APP_ERR("keystore_put fail. ret = %d\n", ret);
+        goto EXIT;
+    }
+    APP_DBG("(%d) %s generation:[%u]\n", __LINE__, packet->macaddress, packet->generation);
+EXIT:
+    return ret;
+}
+
+
+static int read_from_keystore(packet_st *packet)
+{
+    int ret;
+    char macaddr[32] = {0};
+    wrap_packet_st *wrap_packet = (wrap_packet_st *)(packet->recv_buf);
+    uint32_t generation = wrap_packet->generation;
+
+    memcpy(macaddr, wrap_packet->wrap_key.macaddr, sizeof(macaddr) - 1);
+    ret = keystore_get(packet->keystore, macaddr, &wrap_packet->wrap_key, &generation);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    wrap_packet->generation = generation;
+    packet->generation = generation;
+    APP_DBG("(%d) %s generation:[%u]\n", __LINE__, macaddr, generation);
+EXIT:
+    return ret;
+}
+
+
 pufs_status_t server_export_to_file(packet_st *packet)
 {
     pufs_status_t check = PUFS_SUCCESS;
@@ -333,29 +368,34 @@ pufs_status_t server_export_to_file(packet_st *packet)
     uint32_t kekbits = 256;
     uint32_t kwptype = AES_KW;
 
-    STATISTICS_FUNC("pufs_kdf");
-    check = pufs_kdf(SSKEY, SERVER_KEK_SLOT, kekbits,
+    // SERVER_KEK_SLOT keeps the session KEK for the next record of the connection
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, SERVER_WRAP_KEK_SLOT, kekbits,
             PRF_HMAC, PUFSE_SHA_256, false,
             NULL, 0, 1,
             PUFKEY, SERVER_PUFSLOT_EXPORT, 256,
             NULL, 0,  //salt
-            NULL, 0); //info
+            NULL, 0)); //info
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_kdf_hkdf_exp fail. check = %d \n", check);
         goto RET;
     }
 
-    STATISTICS_FUNC("pufs_export_wrapped_key");
-    check = pufs_export_wrapped_key(
+    OPSTAT(pufs_export_wrapped_key, check = pufs_export_wrapped_key(
             SSKEY, SERVER_KEY_SLOT, out,
-            keybits, SERVER_KEK_SLOT, kekbits,
-            kwptype, NULL);
+            keybits, SERVER_WRAP_KEK_SLOT, kekbits,
+            kwptype, NULL));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_export_wrapped_key_from_ka fail. check = %d \n", check);
         goto RET;
     }
+
+    if (packet->keystore) {
+        check = save_to_keystore(packet);
+    }
+    else {
+        check = save_to_file(packet);
+    }
 RET:
-    check = save_to_file(packet);
     return check;
 }
 
@@ -366,9 +406,24 @@ pufs_status_t server_import_from_file(packet_st *packet)
     pufs_status_t check = PUFS_SUCCESS;
     wrap_packet_st *wrap_packet = (wrap_packet_st *)(packet->recv_buf);
     wrap_key_st *wrap_key = &(wrap_packet->wrap_key);
-    check = read_from_file(packet);
+
+    if (packet->recv_buf_size < (int)sizeof(wrap_packet_st)) {
+        // clients older than the key store end the packet before generation
+        wrap_packet->generation = KEYSTORE_LATEST;
+    }
+    if (packet->keystore) {
+        check = read_from_keystore(packet);
+        if ((check != 0) && (wrap_packet->generation == KEYSTORE_LATEST)) {
+            // backups taken before the key store existed
+            check = read_from_file(packet);
+        }
+    }
+    else {
+        check = read_from_file(packet);
+    }
     if (check != 0) {
-        APP_ERR("read_from_file fail. check = %d\n", check);
+        APP_ERR("read key fail. check = %d\n", check);
+        goto RET;
     }
 
     memcpy(packet->send_buf, packet->recv_buf, sizeof(wrap_packet_st));
@@ -378,23 +433,21 @@ pufs_status_t server_import_from_file(packet_st *packet)
     uint32_t kekbits = 256;
     uint32_t kwptype = AES_KW;
 
-    STATISTICS_FUNC("pufs_kdf");
-    check = pufs_kdf(SSKEY, SERVER_WRAP_KEK_SLOT, kekbits,
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, SERVER_WRAP_KEK_SLOT, kekbits,
             PRF_HMAC, PUFSE_SHA_256, false,
             NULL, 0, 1,
             PUFKEY, SERVER_PUFSLOT_EXPORT, 256,
             NULL, 0,  //salt
-            NULL, 0); //info
+            NULL, 0)); //info
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_kdf_hkdf_exp fail. check = %d \n", check);
         goto RET;
     }
 
-    STATISTICS_FUNC("pufs_import_wrapped_key");
-    check = pufs_import_wrapped_key(
+    OPSTAT(pufs_import_wrapped_key, check = pufs_import_wrapped_key(
             SSKEY, SERVER_KEY_SLOT, out,
             keybits, SERVER_WRAP_KEK_SLOT, kekbits,
-            kwptype, NULL);
+            kwptype, NULL));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_import_wrapped_key_to_ka fail. check = %d \n", check);
         goto RET;
@@ -421,32 +474,27 @@ pufs_status_t ecdh_keys(packet_st *packet)
     }
 
     if (packet->type == CLIENT) {
-        STATISTICS_FUNC("pufs_ecp_set_curve_byname");
-        check = pufs_ecp_set_curve_byname(NISTB163);
+        OPSTAT(pufs_ecp_set_curve_byname, check = pufs_ecp_set_curve_byname(NISTB163));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_set_curve_byname failed, check = %d", check);
             goto RET;
         }
-        STATISTICS_FUNC("pufs_ecp_gen_eprk");
-        check = pufs_ecp_gen_eprk(CLIENT_EPHEMERAL_PRIVATE_SLOT);
+        OPSTAT(pufs_ecp_gen_eprk, check = pufs_ecp_gen_eprk(CLIENT_EPHEMERAL_PRIVATE_SLOT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_eprk failed, check = %d", check);
             goto RET;
         }
-        STATISTICS_FUNC("pufs_ecp_gen_sprk");
-
-        check = pufs_ecp_gen_sprk(CLIENT_STATIC_PRIVATE_SLOT,
+        OPSTAT(pufs_ecp_gen_sprk, check = pufs_ecp_gen_sprk(CLIENT_STATIC_PRIVATE_SLOT,
                 CLIENT_PUFSLOT_ECDH,
                 salt->out, salt->len,
                 info.out, info.len,
-                HASH_DEFAULT);
+                HASH_DEFAULT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_sprk failed, check = %d", check);
             goto RET;
         }
 
-        STATISTICS_FUNC("pufs_ecp_gen_puk");
-        check = pufs_ecp_gen_puk(&puk, PRKEY, CLIENT_EPHEMERAL_PRIVATE_SLOT);
+        OPSTAT(pufs_ecp_gen_puk, check = pufs_ecp_gen_puk(&puk, PRKEY, CLIENT_EPHEMERAL_PRIVATE_SLOT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_puk puk_ephemeral failed, check = %d", check);
             goto RET;
@@ -455,8 +503,7 @@ pufs_status_t ecdh_keys(packet_st *packet)
         memcpy(packet->puk_client_e.y_out, puk.y, puk.qlen);
         packet->puk_client_e.len = puk.qlen;
 
-        STATISTICS_FUNC("pufs_ecp_gen_puk");
-        check = pufs_ecp_gen_puk(&puk, PRKEY, CLIENT_STATIC_PRIVATE_SLOT);
+        OPSTAT(pufs_ecp_gen_puk, check = pufs_ecp_gen_puk(&puk, PRKEY, CLIENT_STATIC_PRIVATE_SLOT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_puk puk_static failed, check = %d", check);
             goto RET;
@@ -466,30 +513,26 @@ pufs_status_t ecdh_keys(packet_st *packet)
         packet->puk_client_s.len = puk.qlen;
     }
     else if (packet->type == SERVER) {
-        STATISTICS_FUNC("pufs_ecp_set_curve_byname");
-        check = pufs_ecp_set_curve_byname(NISTB163);
+        OPSTAT(pufs_ecp_set_curve_byname, check = pufs_ecp_set_curve_byname(NISTB163));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_set_curve_byname failed, check = %d", check);
             goto RET;
         }
-        STATISTICS_FUNC("pufs_ecp_gen_eprk");
-        check = pufs_ecp_gen_eprk(SERVER_EPHEMERAL_PRIVATE_SLOT);
+        OPSTAT(pufs_ecp_gen_eprk, check = pufs_ecp_gen_eprk(SERVER_EPHEMERAL_PRIVATE_SLOT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_eprk failed, check = %d", check);
             goto RET;
         }
-        STATISTICS_FUNC("pufs_ecp_gen_sprk");
-        check = pufs_ecp_gen_sprk(SERVER_STATIC_PRIVATE_SLOT,
+        OPSTAT(pufs_ecp_gen_sprk, check = pufs_ecp_gen_sprk(SERVER_STATIC_PRIVATE_SLOT,
                 SERVER_PUFSLOT_ECDH,
                 salt->out, salt->len,
                 info.out, info.len,
-                HASH_DEFAULT);
+                HASH_DEFAULT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_sprk failed, check = %d", check);
             goto RET;
         }
-        STATISTICS_FUNC("pufs_ecp_gen_puk");
-        check = pufs_ecp_gen_puk(&puk, PRKEY, SERVER_EPHEMERAL_PRIVATE_SLOT);
+        OPSTAT(pufs_ecp_gen_puk, check = pufs_ecp_gen_puk(&puk, PRKEY, SERVER_EPHEMERAL_PRIVATE_SLOT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_puk puk_ephemeral failed, check = %d", check);
             goto RET;
@@ -498,8 +541,7 @@ pufs_status_t ecdh_keys(packet_st *packet)
         memcpy(packet->puk_server_e.y_out, puk.y, puk.qlen);
         packet->puk_server_e.len = puk.qlen;
 
-        STATISTICS_FUNC("pufs_ecp_gen_puk");
-        check = pufs_ecp_gen_puk(&puk, PRKEY, SERVER_STATIC_PRIVATE_SLOT);
+        OPSTAT(pufs_ecp_gen_puk, check = pufs_ecp_gen_puk(&puk, PRKEY, SERVER_STATIC_PRIVATE_SLOT));
         if (check != PUFS_SUCCESS) {
             APP_ERR("pufs_ecp_gen_puk puk_static failed, check = %d", check);
             goto RET;
@@ -566,33 +608,29 @@ pufs_status_t generate_ecdh_kek(packet_st *packet)
         goto EXIT;
     }
 
-    STATISTICS_FUNC("pufs_ecp_set_curve_byname");
-    check = pufs_ecp_set_curve_byname(NISTB163);
+    OPSTAT(pufs_ecp_set_curve_byname, check = pufs_ecp_set_curve_byname(NISTB163));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_ecp_set_curve_byname failed, check = %d", check);
         goto RET;
     }
-    STATISTICS_FUNC("pufs_ecp_ecccdh_2e2s");
-    check = pufs_ecp_ecccdh_2e2s(puk_e, puk_s, prk_ephemeral->keyslot, prk_ephemeral->key_storage, prk_static->keyslot, NULL);
+    OPSTAT(pufs_ecp_ecccdh_2e2s, check = pufs_ecp_ecccdh_2e2s(puk_e, puk_s, prk_ephemeral->keyslot, prk_ephemeral->key_storage, prk_static->keyslot, NULL));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_ecp_ecccdh_2e2s failed, check = %d", check);
         goto RET;
     }
 
-    STATISTICS_FUNC("pufs_kdf");
-    check = pufs_kdf(SSKEY, kek_slot->keyslot, 256,
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, kek_slot->keyslot, 256,
             PRF_HMAC, PUFSE_SHA_256, false,
             NULL, 0, 1,
             SHARESEC, SHARESEC_0, 0,
             NULL, 0,  //salt
-            NULL, 0); //info
+            NULL, 0)); //info
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_kdf_hkdf fail. check = %d", check);
         goto RET;
     }
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&key_hmac, NULL, 0, PUFSE_SHA_256, SSKEY, kek_slot->keyslot, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&key_hmac, NULL, 0, PUFSE_SHA_256, SSKEY, kek_slot->keyslot, 256));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_hmac kek failed, ret = %d", check);
         goto RET;
@@ -605,57 +643,157 @@ EXIT:
 
 
 
-pufs_status_t pufs_start(const char *func __attribute__((unused)))
-{
+/* One device session at a time per process. Background workers (key store
+ * replication) run next to the foreground server loop and share the device. */
+typedef struct {
+    pthread_mutex_t lock;           ///< held from the outer pufs_start to its pufs_end
+#if MUTEX
+    devlock_st devlock;             ///< turn of this process among the others
+#endif
+    pthread_mutex_t call_lock;      ///< held around the device calls of a worker thread
+    pthread_mutex_t stats_lock;     ///< never held across a device call
+    pufs_session_stats_st stats;
+} pufs_session_st;
+
+static pufs_session_st session = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .call_lock = PTHREAD_MUTEX_INITIALIZER,
+    .stats_lock = PTHREAD_MUTEX_INITIALIZER,
 #if MUTEX
-    int mutex_lock;
+    .devlock = { .fd = -1 },
+#endif
+};
 
-    STATISTICS_FUNC("pufs_pal_mutex_create");
-    mutex = pufs_pal_mutex_create();
-    if (mutex == NULL) {
-        APP_ERR("%s", "Create mutex failed");
-        return -1;
-    }
+/* pufs_start calls of this thread not yet ended, non-zero only in the holder */
+static __thread int session_depth;
+
+/* wait_secs 0 when the device must be free right away */
+static pufs_status_t pufs_session_open(int wait_secs)
+{
+#if MUTEX
+    pufs_status_t lock;
 
-    STATISTICS_FUNC("pufs_pal_mutex_trylock");
-    mutex_lock = pufs_pal_mutex_trylock(mutex);
-    if (mutex_lock) {
-        PUFS_INFO("Some instance might be already running, ret = %d", mutex_lock);
-        return -1;
-    } else {
-        PUFS_INFO("Acquired Lock ret = %d", mutex_lock);
+    // other processes queue for the device in the order they asked for it
+    OPSTAT(devlock_acquire, lock = devlock_acquire(&session.devlock, wait_secs));
+    if (lock != PUFS_SUCCESS) {
+        APP_WARN("device busy in another instance, ret = %d\n", lock);
+        return lock;
     }
+#else
+    (void)wait_secs;
 #endif
     pufs_status_t ret = PUFS_SUCCESS;
     // First, init neccesary module
-    STATISTICS_FUNC("pufs_cmd_iface_init");
-    ret = pufs_cmd_iface_init();
+    OPSTAT(pufs_cmd_iface_init, ret = pufs_cmd_iface_init());
     if (ret != PUFS_SUCCESS) {
         APP_ERR("pufs_cmd_iface_init failed, ret = %d", ret);
+#if MUTEX
+        devlock_release(&session.devlock);
+#endif
     }
 
     return ret;
 }
 
+static void pufs_session_count(unsigned long *counter)
+{
+    pthread_mutex_lock(&session.stats_lock);
+    (*counter)++;
+    pthread_mutex_unlock(&session.stats_lock);
+}
+
+/* Called with session.lock held by this thread */
+static pufs_status_t pufs_session_enter(int wait_secs)
+{
+    pufs_status_t ret;
+
+    ret = pufs_session_open(wait_secs);
+    if (ret != PUFS_SUCCESS) {
+        pthread_mutex_unlock(&session.lock);
+        return ret;
+    }
+    pufs_session_count(&session.stats.sessions);
+    session_depth = 1;
+    return ret;
+}
+
+pufs_status_t pufs_start(const char *func __attribute__((unused)))
+{
+    // the holder nests without touching the lock
+    if (session_depth > 0) {
+        session_depth++;
+        pufs_session_count(&session.stats.nested);
+        return PUFS_SUCCESS;
+    }
+    // uncontended, a trylock is the whole cost
+    if (pthread_mutex_trylock(&session.lock) != 0) {
+        pufs_session_count(&session.stats.waiting);
+        pthread_mutex_lock(&session.lock);
+        pthread_mutex_lock(&session.stats_lock);
+        session.stats.waiting--;
+        session.stats.contended++;
+        pthread_mutex_unlock(&session.stats_lock);
+    }
+    return pufs_session_enter(devlock_wait_secs());
+}
+
+/* Like pufs_start, but returns E_BUSY instead of waiting for another thread or process. */
+pufs_status_t pufs_try_start(const char *func __attribute__((unused)))
+{
+    if (session_depth > 0) {
+        session_depth++;
+        pufs_session_count(&session.stats.nested);
+        return PUFS_SUCCESS;
+    }
+    if (pthread_mutex_trylock(&session.lock) != 0) {
+        return E_BUSY;
+    }
+    return pufs_session_enter(0);
+}
+
 pufs_status_t pufs_end(const char *func __attribute__((unused)))
 {
     pufs_status_t ret = PUFS_SUCCESS;
+
+    if (session_depth <= 0) {
+        APP_ERR("no session to end\n");
+        return PUFS_ERROR;
+    }
+    if (--session_depth > 0) {
+        return ret;
+    }
     // Last, release the modules
 
-    STATISTICS_FUNC("pufs_cmd_iface_deinit");
-    ret = pufs_cmd_iface_deinit();
+    OPSTAT(pufs_cmd_iface_deinit, ret = pufs_cmd_iface_deinit());
     if (ret != PUFS_SUCCESS) {
         APP_ERR("pufs_cmd_iface_deinit failed, ret = %d", ret);
     }
 #if MUTEX
-    STATISTICS_FUNC("pufs_pal_mutex_unlock");
-    pufs_pal_mutex_unlock(mutex);
-    STATISTICS_FUNC("pufs_pal_mutex_destroy");
-    pufs_pal_mutex_destroy(mutex);
+    OPSTAT(devlock_release, devlock_release(&session.devlock));
 #endif
+    pthread_mutex_unlock(&session.lock);
     return ret;
 }
 
+void pufs_session_stats(pufs_session_stats_st *stats)
+{
+    pthread_mutex_lock(&session.stats_lock);
+    *stats = session.stats;
+    pthread_mutex_unlock(&session.stats_lock);
+}
+
+/* Threads sharing one session take turns here for each device call. */
+void pufs_device_lock(void)
+{
+    pthread_mutex_lock(&session.call_lock);
+}
+
+void pufs_device_unlock(void)
+{
+    pthread_mutex_unlock(&session.call_lock);
+}
+
+
 int get_net_interface(char *interfaceNames)
 {
     FILE *file;
@@ -711,13 +849,12 @@ static pufs_status_t pufs_gen_aes_key(pufs_bytes_st *salt)
     pufs_status_t check = PUFS_SUCCESS;
 
     //salt->len = 64;	// Max salt length is 64
-    STATISTICS_FUNC("pufs_kdf");
-    check = pufs_kdf(SSKEY, CLIENT_KEY_SLOT, 256,
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, CLIENT_KEY_SLOT, 256,
             PRF_HMAC, PUFSE_SHA_256, false,
             NULL, 0, 1,
             PUFKEY, CLIENT_PUFSLOT_AESKEY, 256,
             salt->in, salt->len,  //salt
-            NULL, 0); //info
+            NULL, 0)); //info
     if (check != PUFS_SUCCESS) APP_ERR("pufs_kdf_hkdf fail, ret = %d", check);
 
     return check;
@@ -740,8 +877,7 @@ int generate_salt(pufs_bytes_st *salt)
     salt->out = salt->out + mac_length;
     //salt->len = salt->len - mac_length;
 
-    STATISTICS_FUNC("pufs_get_uid");
-    check = pufs_get_uid(&uid, CLIENT_PUFSLOT_UID);
+    OPSTAT(pufs_get_uid, check = pufs_get_uid(&uid, CLIENT_PUFSLOT_UID));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_get_uid, check = %d", check);
         goto RET;
@@ -765,8 +901,7 @@ int enroll(void)
         //APP_DBG("Enrolled. %s exist!!\n", enroll_lock_file);
     }
     else {
-        STATISTICS_FUNC("rt_write_enroll");
-        rt_write_enroll();
+        OPSTAT(rt_write_enroll, rt_write_enroll());
         sprintf(cmd, "touch %s", enroll_lock_file);
         ret = system(cmd);
     }
@@ -786,7 +921,7 @@ int generate_key(void)
         goto RET;
     }
 
-    check = pufs_gen_aes_key(salt);
+    OPSTAT(pufs_gen_aes_key, check = pufs_gen_aes_key(salt));
     if (check != PUFS_SUCCESS)
     {
         APP_ERR("pufs_gen_aes_key fail, check = %d\n", check);
@@ -798,58 +933,435 @@ RET:
 }
 
 
-pufs_status_t aes_enc(u8 *buf, uint32_t buf_size)
+/**
+ * Items run in order and each gets its own status, a failed item does not
+ * stop the ones after it. The derived IV of the single-shot calls costs an
+ * HMAC on the device, so it is made once per key for the whole batch
+ * instead of once per item.
+ */
+typedef struct {
+    pufs_dgst_st md;
+    pufs_ka_slot_t slot;
+    const char *key;            ///< named key the IV is of, NULL for the slot itself
+    int valid;
+} batch_iv_st;
+
+static int batch_iv_cached(const batch_iv_st *biv, pufs_ka_slot_t slot, const char *key)
+{
+    if (!biv->valid || biv->slot != slot) {
+        return 0;
+    }
+    if (biv->key == NULL || key == NULL) {
+        return biv->key == key;
+    }
+    return strcmp(biv->key, key) == 0;
+}
+
+static pufs_status_t batch_op(batch_item_st *item, pufs_ka_slot_t slot, batch_iv_st *biv)
 {
     pufs_status_t check = PUFS_SUCCESS;
-    pufs_bytes_st *out_ct = CREATE_PUFS_BYTES_OUT(buf, buf_size);
-    pufs_bytes_st *iv = PUFS_BYTES_ALLOC(64);
     pufs_dgst_st md;
+    const u8 *iv = item->iv;
+
+    switch (item->op) {
+        case BATCH_OP_HMAC:
+            if (item->outlen < 32) {
+                return E_INVALID;
+            }
+            OPSTAT(pufs_hmac, check = pufs_hmac(&md, item->in, item->inlen, PUFSE_SHA_256, SSKEY, slot, 256));
+            if (check != PUFS_SUCCESS) {
+                return check;
+            }
+            memcpy(item->out, md.dgst, md.dlen);
+            item->outlen = md.dlen;
+            return check;
+        case BATCH_OP_ENCRYPT:
+        case BATCH_OP_DECRYPT:
+            if (item->outlen < item->inlen) {
+                return E_INVALID;
+            }
+            if (iv == NULL) {
+                if (!batch_iv_cached(biv, slot, item->key)) {
+                    biv->valid = 0;
+                    OPSTAT(pufs_hmac, check = pufs_hmac(&biv->md, NULL, 0, PUFSE_SHA_256, SSKEY, slot, 256));
+                    if (check != PUFS_SUCCESS) {
+                        APP_ERR("pufs_hmac fail, check = %d\n", check);
+                        return check;
+                    }
+                    biv->slot = slot;
+                    biv->key = item->key;
+                    biv->valid = 1;
+                }
+                iv = biv->md.dgst;
+            }
+            if (item->op == BATCH_OP_ENCRYPT) {
+                OPSTAT(pufs_enc_ofb, check = pufs_enc_ofb(item->out, &item->outlen, item->in, item->inlen,
+                    AES, SSKEY, slot, 256, iv));
+            }
+            else {
+                OPSTAT(pufs_dec_ofb, check = pufs_dec_ofb(item->out, &item->outlen, item->in, item->inlen,
+                    AES, SSKEY, slot, 256, iv));
+            }
+            return check;
+        default:
+            return E_INVALID;
+    }
+}
+
+static pufs_status_t batch_item(batch_item_st *item, batch_iv_st *biv)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    pufs_ka_slot_t slot = item->slot;
+
+    if (item->out == NULL || (item->in == NULL && item->inlen > 0)) {
+        return E_INVALID;
+    }
+    // a named key stays loaded across items, loading it again is a hit
+    if (item->key != NULL) {
+        check = keyslot_acquire(item->key, &slot);
+        if (check != PUFS_SUCCESS) {
+            return check;
+        }
+    }
+    check = batch_op(item, slot, biv);
+    if (item->key != NULL) {
+        keyslot_release(slot);
+    }
+    return check;
+}
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256);
+/* Needs a device session, returns the first failed status */
+pufs_status_t batch_exec(batch_item_st *items, uint32_t count)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    batch_iv_st biv;
+    uint32_t i;
+
+    memset(&biv, 0, sizeof(biv));
+    for (i = 0; i < count; i++) {
+        items[i].status = batch_item(&items[i], &biv);
+        if (items[i].status != PUFS_SUCCESS && check == PUFS_SUCCESS) {
+            check = items[i].status;
+        }
+    }
+    return check;
+}
+
+/* batch_exec in a session of its own */
+pufs_status_t batch_run(batch_item_st *items, uint32_t count)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    uint32_t i;
+
+    check = pufs_start(__func__);
     if (check != PUFS_SUCCESS)
     {
-        goto RET;
+        APP_ERR("pufs_start fail, check = %d\n", check);
+        for (i = 0; i < count; i++) {
+            items[i].status = check;
+        }
+        goto EXIT;
     }
-    memcpy(iv->out, md.dgst, md.dlen);
-    iv->len = md.dlen;
-    STATISTICS_FUNC("pufs_enc_ofb");
-    check = pufs_enc_ofb(out_ct->out, (uint32_t *)&(out_ct->len),
-        buf, buf_size,
-        AES,
-        SSKEY, CLIENT_KEY_SLOT, 256,
-        iv->out);
-RET:
+    enroll();
+    check = batch_exec(items, count);
+    pufs_end(__func__);
 
+EXIT:
     return check;
 }
 
+pufs_status_t aes_enc(u8 *buf, uint32_t buf_size)
+{
+    batch_item_st item = {
+        .op = BATCH_OP_ENCRYPT, .slot = CLIENT_KEY_SLOT,
+        .in = buf, .inlen = buf_size, .out = buf, .outlen = buf_size,
+    };
+
+    return batch_exec(&item, 1);
+}
+
 
 pufs_status_t aes_dec(u8 *buf, uint32_t buf_size)
+{
+    batch_item_st item = {
+        .op = BATCH_OP_DECRYPT, .slot = CLIENT_KEY_SLOT,
+        .in = buf, .inlen = buf_size, .out = buf, .outlen = buf_size,
+    };
+
+    return batch_exec(&item, 1);
+}
+
+/* New header with a random nonce for a file about to be encrypted */
+pufs_status_t aes_file_header_new(aes_file_header_st *header)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, AES_FILE_MAGIC, sizeof(header->magic));
+    header->version = AES_FILE_VERSION;
+    OPSTAT(pufs_rand, check = pufs_rand(header->nonce, AES_NONCE_SIZE / 4));
+    if (check != PUFS_SUCCESS)
+    {
+        APP_ERR("pufs_rand fail, check = %d\n", check);
+    }
+    return check;
+}
+
+/**
+ * The IV is derived once per file from the nonce in its header, so the whole
+ * file is one OFB keystream and every update is a single device call. Update
+ * may hold back a partial block, the caller's out buffer must have room for
+ * inlen + 16 bytes.
+ */
+pufs_status_t aes_stream_init(aes_stream_st *stream, int decrypt, const aes_file_header_st *header)
 {
     pufs_status_t check = PUFS_SUCCESS;
-    pufs_bytes_st *out_pt = CREATE_PUFS_BYTES_OUT(buf, buf_size);
-    pufs_bytes_st *iv = PUFS_BYTES_ALLOC(64);
     pufs_dgst_st md;
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256);
+    memset(stream, 0, sizeof(*stream));
+    stream->decrypt = decrypt;
+
+    if (memcmp(header->magic, AES_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != AES_FILE_VERSION) {
+        APP_ERR("unknown file header\n");
+        check = PUFS_ERROR;
+        goto RET;
+    }
+
+    stream->sp38a_ctx = pufs_sp38a_ctx_new();
+    if (stream->sp38a_ctx == NULL) {
+        APP_ERR("pufs_sp38a_ctx_new fail\n");
+        check = PUFS_ERROR;
+        goto RET;
+    }
+
+    OPSTAT(pufs_hmac, check = pufs_hmac(&md, header->nonce, AES_NONCE_SIZE, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256));
     if (check != PUFS_SUCCESS)
     {
         APP_ERR("pufs_hmac fail, check = %d\n", check);
         goto RET;
     }
-    memcpy(iv->out, md.dgst, md.dlen);
-    iv->len = md.dlen;
 
-    STATISTICS_FUNC("pufs_dec_ofb");
-    check = pufs_dec_ofb(out_pt->out, (uint32_t *)&(out_pt->len),
-        buf, buf_size,
-        AES,
-        SSKEY, CLIENT_KEY_SLOT, 256,
-        iv->out);
+    if (decrypt) {
+        OPSTAT(pufs_dec_ofb_init, check = pufs_dec_ofb_init(stream->sp38a_ctx, AES,
+            SSKEY, CLIENT_KEY_SLOT, 256, md.dgst));
+    }
+    else {
+        OPSTAT(pufs_enc_ofb_init, check = pufs_enc_ofb_init(stream->sp38a_ctx, AES,
+            SSKEY, CLIENT_KEY_SLOT, 256, md.dgst));
+    }
+RET:
+    if (check != PUFS_SUCCESS) {
+        aes_stream_free(stream);
+    }
+    return check;
+}
+
+/**
+ * The old format encrypted every 16-byte chunk with a fresh OFB stream under
+ * the same IV, i.e. XORed it with the same keystream block. That block is
+ * computed once here and the data is then handled on the host.
+ */
+pufs_status_t aes_stream_init_legacy(aes_stream_st *stream)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    uint32_t len = AES_IV_SIZE;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->decrypt = 1;
+    stream->legacy = 1;
+
+    check = aes_enc(stream->keystream, len);
+    if (check != PUFS_SUCCESS)
+    {
+        APP_ERR("aes_enc fail, check = %d\n", check);
+    }
+    return check;
+}
+
+/**
+ * Moves the device side of an initialized stream to a producer thread that
+ * keeps depth keystream blocks of block_size bytes ready. Updates then only
+ * XOR on the host and hold nothing back, and the device session must stay
+ * open until the stream is finalized or freed. limit is the data size when
+ * known, 0 otherwise.
+ */
+pufs_status_t aes_stream_prefetch(aes_stream_st *stream, uint32_t block_size, int depth, uint64_t limit)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    if (stream->legacy || stream->sp38a_ctx == NULL || stream->prefetch != NULL) {
+        return PUFS_ERROR;
+    }
+    stream->prefetch = malloc(sizeof(*stream->prefetch));
+    if (stream->prefetch == NULL) {
+        return PUFS_ERROR;
+    }
+    check = keystream_start(stream->prefetch, stream->sp38a_ctx, stream->decrypt, block_size, depth, limit);
+    if (check != PUFS_SUCCESS) {
+        free(stream->prefetch);
+        stream->prefetch = NULL;
+    }
+    return check;
+}
+
+pufs_status_t aes_stream_update(aes_stream_st *stream, u8 *out, uint32_t *outlen,
+                                const u8 *in, uint32_t inlen)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    if (stream->legacy) {
+        // callers keep chunks on 16-byte boundaries, only the last one is short
+        for (uint32_t i = 0; i < inlen; i++) {
+            out[i] = in[i] ^ stream->keystream[i % AES_IV_SIZE];
+        }
+        *outlen = inlen;
+    }
+    else if (stream->prefetch != NULL) {
+        check = keystream_xor(stream->prefetch, out, in, inlen);
+        *outlen = inlen;
+    }
+    else if (stream->decrypt) {
+        OPSTAT(pufs_dec_ofb_update, check = pufs_dec_ofb_update(stream->sp38a_ctx, out, outlen, in, inlen));
+    }
+    else {
+        OPSTAT(pufs_enc_ofb_update, check = pufs_enc_ofb_update(stream->sp38a_ctx, out, outlen, in, inlen));
+    }
+    return check;
+}
+
+pufs_status_t aes_stream_final(aes_stream_st *stream, u8 *out, uint32_t *outlen)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    if (stream->legacy || stream->prefetch != NULL) {
+        // the producer only runs whole blocks, nothing is held back
+        *outlen = 0;
+    }
+    else if (stream->decrypt) {
+        OPSTAT(pufs_dec_ofb_final, check = pufs_dec_ofb_final(stream->sp38a_ctx, out, outlen));
+    }
+    else {
+        OPSTAT(pufs_enc_ofb_final, check = pufs_enc_ofb_final(stream->sp38a_ctx, out, outlen));
+    }
+    aes_stream_free(stream);
+    return check;
+}
+
+void aes_stream_free(aes_stream_st *stream)
+{
+    if (stream->prefetch != NULL) {
+        keystream_stop(stream->prefetch);
+        free(stream->prefetch);
+        stream->prefetch = NULL;
+    }
+    if (stream->sp38a_ctx != NULL) {
+        pufs_sp38a_ctx_free(stream->sp38a_ctx);
+        stream->sp38a_ctx = NULL;
+    }
+}
+
+/* New header with a random nonce for a CTR file about to be encrypted */
+pufs_status_t ctr_file_header_new(ctr_file_header_st *header)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CTR_FILE_MAGIC, sizeof(header->magic));
+    header->version = CTR_FILE_VERSION;
+    OPSTAT(pufs_rand, check = pufs_rand(header->nonce, CTR_NONCE_SIZE / 4));
+    if (check != PUFS_SUCCESS)
+    {
+        APP_ERR("pufs_rand fail, check = %d\n", check);
+    }
+    return check;
+}
 
+int ctr_file_header_valid(const ctr_file_header_st *header)
+{
+    return memcmp(header->magic, CTR_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == CTR_FILE_VERSION;
+}
+
+/**
+ * Encrypts or decrypts len bytes that sit at plaintext offset offset of a CTR
+ * file. The counter starts at the block holding offset, so the cost only
+ * depends on len; an offset inside a block runs the bytes before it as
+ * zeros and drops them. Each call is one init/update/final sequence, callers
+ * on several threads must serialize it.
+ */
+pufs_status_t ctr_crypt_at(const ctr_file_header_st *header, int decrypt, uint64_t offset,
+                           u8 *out, const u8 *in, uint32_t len)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    pufs_sp38a_ctx *ctx = NULL;
+    uint32_t skip = offset % CTR_BLOCK_SIZE;
+    uint64_t block = offset / CTR_BLOCK_SIZE;
+    uint32_t total = 0, n = 0;
+    u8 counter[CTR_BLOCK_SIZE];
+    u8 *work_in = NULL, *work_out = NULL;
+    const u8 *src = in;
+    u8 *dst = out;
+    int i;
+
+    memcpy(counter, header->nonce, CTR_NONCE_SIZE);
+    for (i = 0; i < 8; i++) {
+        counter[CTR_BLOCK_SIZE - 1 - i] = block >> (8 * i);
+    }
+
+    if (skip > 0) {
+        work_in = calloc(1, skip + len);
+        work_out = malloc(skip + len + CTR_BLOCK_SIZE);
+        if (work_in == NULL || work_out == NULL) {
+            check = PUFS_ERROR;
+            goto RET;
+        }
+        memcpy(work_in + skip, in, len);
+        src = work_in;
+        dst = work_out;
+    }
+    ctx = pufs_sp38a_ctx_new();
+    if (ctx == NULL) {
+        APP_ERR("pufs_sp38a_ctx_new fail\n");
+        check = PUFS_ERROR;
+        goto RET;
+    }
+
+    if (decrypt) {
+        OPSTAT(pufs_dec_ctr_init, check = pufs_dec_ctr_init(ctx, AES, SSKEY, CLIENT_KEY_SLOT, 256, counter, 64));
+        if (check == PUFS_SUCCESS && skip + len > 0) {
+            OPSTAT(pufs_dec_ctr_update, check = pufs_dec_ctr_update(ctx, dst, &total, src, skip + len));
+        }
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_dec_ctr_final, check = pufs_dec_ctr_final(ctx, dst + total, &n));
+        }
+    }
+    else {
+        OPSTAT(pufs_enc_ctr_init, check = pufs_enc_ctr_init(ctx, AES, SSKEY, CLIENT_KEY_SLOT, 256, counter, 64));
+        if (check == PUFS_SUCCESS && skip + len > 0) {
+            OPSTAT(pufs_enc_ctr_update, check = pufs_enc_ctr_update(ctx, dst, &total, src, skip + len));
+        }
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_enc_ctr_final, check = pufs_enc_ctr_final(ctx, dst + total, &n));
+        }
+    }
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("ctr at %llu fail, check = %d\n", (unsigned long long)offset, check);
+        goto RET;
+    }
+    if (total + n != skip + len) {
+        check = PUFS_ERROR;
+        goto RET;
+    }
+    if (skip > 0) {
+        memcpy(out, work_out + skip, len);
+    }
 RET:
+    if (ctx != NULL) {
+        pufs_sp38a_ctx_free(ctx);
+    }
+    free(work_in);
+    free(work_out);
     return check;
 }
 
@@ -858,12 +1370,92 @@ pufs_status_t hmac_key(u8 *buf, uint32_t buf_size)
     pufs_status_t check = PUFS_SUCCESS;
     pufs_dgst_st key_hmac;
 
-    STATISTICS_FUNC("pufs_hmac");
-    check = pufs_hmac(&key_hmac, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256);
+    OPSTAT(pufs_hmac, check = pufs_hmac(&key_hmac, NULL, 0, PUFSE_SHA_256, SSKEY, CLIENT_KEY_SLOT, 256));
     memcpy(buf, key_hmac.dgst, buf_size);
     return check;
 }
 
+/**
+ * Keyed HMAC of a message that arrives in pieces, e.g. a file read block by
+ * block. The context carries the state between updates, so several streams
+ * may be open at once; their device calls must still not overlap.
+ */
+pufs_status_t hmac_stream_init(hmac_stream_st *hs, pufs_hash_t hash, pufs_ka_slot_t slot)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    memset(hs, 0, sizeof(*hs));
+    hs->hash = hash;
+    hs->slot = slot;
+    hs->hmac_ctx = pufs_hmac_ctx_new();
+    if (hs->hmac_ctx == NULL) {
+        APP_ERR("pufs_hmac_ctx_new fail\n");
+        return PUFS_ERROR;
+    }
+    OPSTAT(pufs_hmac_init, check = pufs_hmac_init(hs->hmac_ctx, hash, SSKEY, slot, 256));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_hmac_init fail, check = %d\n", check);
+        hmac_stream_free(hs);
+    }
+    return check;
+}
+
+/* Under a named key, which stays loaded until the stream is freed */
+pufs_status_t hmac_stream_init_key(hmac_stream_st *hs, pufs_hash_t hash, const char *key)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    pufs_ka_slot_t slot;
+
+    memset(hs, 0, sizeof(*hs));
+    check = keyslot_acquire(key, &slot);
+    if (check != PUFS_SUCCESS) {
+        return check;
+    }
+    check = hmac_stream_init(hs, hash, slot);
+    if (check != PUFS_SUCCESS) {
+        keyslot_release(slot);
+        return check;
+    }
+    hs->named = 1;
+    return check;
+}
+
+pufs_status_t hmac_stream_update(hmac_stream_st *hs, const u8 *in, uint32_t inlen)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    OPSTAT(pufs_hmac_update, check = pufs_hmac_update(hs->hmac_ctx, in, inlen));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_hmac_update fail, check = %d\n", check);
+    }
+    return check;
+}
+
+/* Frees the stream whatever the result */
+pufs_status_t hmac_stream_final(hmac_stream_st *hs, pufs_dgst_st *md)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    OPSTAT(pufs_hmac_final, check = pufs_hmac_final(hs->hmac_ctx, md));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_hmac_final fail, check = %d\n", check);
+    }
+    hmac_stream_free(hs);
+    return check;
+}
+
+void hmac_stream_free(hmac_stream_st *hs)
+{
+    if (hs->hmac_ctx != NULL) {
+        pufs_hmac_ctx_free(hs->hmac_ctx);
+        hs->hmac_ctx = NULL;
+    }
+    if (hs->named) {
+        keyslot_release(hs->slot);
+        hs->named = 0;
+    }
+}
+
 pufs_status_t clear_key(void)
 {
     pufs_status_t check = PUFS_SUCCESS;
@@ -873,8 +1465,7 @@ pufs_status_t clear_key(void)
         APP_ERR("pufs_start fail, check = %d\n", check);
         goto EXIT;
     }
-    STATISTICS_FUNC("pufs_clear_key");
-    check = pufs_clear_key(SSKEY, CLIENT_KEY_SLOT, 256);
+    OPSTAT(pufs_clear_key, check = pufs_clear_key(SSKEY, CLIENT_KEY_SLOT, 256));
     pufs_end(__func__);
 
 EXIT:
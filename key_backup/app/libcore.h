@@ -34,12 +34,43 @@
 #define __GENERATEKEY_H__
 
 #include "common.h"
+#include "opstat.h"
 
 int generate_salt(pufs_bytes_st *salt);
 int generate_key(void);
 
+/*
+ * Thread safety: the state shared by all threads of a process is
+ *   - the device session, which pufs_start() locks for the calling thread
+ *     until the matching pufs_end(). Other threads wait in pufs_start() (or
+ *     get E_BUSY from pufs_try_start()), and a thread that already holds the
+ *     session may call pufs_start() again, e.g. through batch_run(), without
+ *     waiting or opening the device twice;
+ *   - the device call lock. Worker threads that use the session of another
+ *     thread (file workers, keystream producers, keyService clients) hold it
+ *     around their device calls with pufs_device_lock(), so the device runs
+ *     one operation at a time;
+ *   - the named key slot table of keyslot.c, under its own lock, which is
+ *     taken inside the device call lock and never around it;
+ *   - the opstat histograms, one block per thread, and their registry.
+ * Everything else, and every context object (hmac_stream_st, keystream_st,
+ * batch items), belongs to the caller and may be used from any one thread at
+ * a time.
+ */
 pufs_status_t pufs_start(const char *func);
+pufs_status_t pufs_try_start(const char *func);
 pufs_status_t pufs_end(const char *func);
+void pufs_device_lock(void);
+void pufs_device_unlock(void);
+
+typedef struct {
+    unsigned long sessions;     ///< device sessions opened
+    unsigned long nested;       ///< pufs_start of a thread already holding the session
+    unsigned long contended;    ///< pufs_start that had to wait for another thread
+    unsigned long waiting;      ///< threads waiting in pufs_start now
+} pufs_session_stats_st;
+
+void pufs_session_stats(pufs_session_stats_st *stats);
 pufs_status_t generate_ecdh_kek(packet_st *packet);
 pufs_status_t ecdh_keys(packet_st *packet);
 int get_macaddr(char *iface, char *mac_addr);
@@ -49,13 +80,98 @@ pufs_status_t client_require_wrap_packet(packet_st *packet);
 pufs_status_t server_wrap_packet(packet_st *packet);
 
 pufs_status_t server_import_wrap(packet_st *packet);
-pufs_pal_mutex *mutex;
 pufs_status_t server_export_to_file(packet_st *packet);
 pufs_status_t server_import_from_file(packet_st *packet);
 pufs_status_t client_import_wrap(packet_st *packet);
 pufs_status_t aes_enc(u8 *buf, uint32_t buf_size);
 pufs_status_t aes_dec(u8 *buf, uint32_t buf_size);
+
+/* Many single-shot operations back to back in one device session */
+typedef enum {
+    BATCH_OP_HMAC,          ///< out = HMAC-SHA256 of in under the slot key, 32 bytes
+    BATCH_OP_ENCRYPT,       ///< AES-256-OFB of in under the slot key, out may be in
+    BATCH_OP_DECRYPT,
+} batch_op_t;
+
+typedef struct {
+    batch_op_t op;
+    pufs_ka_slot_t slot;    ///< SK256 slot of the key, CLIENT_KEY_SLOT for the client key
+    const char *key;        ///< named key, see keyslot.h, or NULL to use slot
+    const u8 *iv;           ///< 16 bytes, NULL for the IV of aes_enc, HMAC of nothing under the key
+    const u8 *in;
+    uint32_t inlen;
+    u8 *out;
+    uint32_t outlen;        ///< size of out, then bytes written
+    pufs_status_t status;   ///< result of this item
+} batch_item_st;
+
+pufs_status_t batch_exec(batch_item_st *items, uint32_t count);
+pufs_status_t batch_run(batch_item_st *items, uint32_t count);
+
+/* One continuous OFB stream over CLIENT_KEY_SLOT per file */
+#define AES_FILE_MAGIC      "PKBE"
+#define AES_FILE_VERSION    1
+#define AES_NONCE_SIZE      16
+#define AES_IV_SIZE         16
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[11];
+    uint8_t nonce[AES_NONCE_SIZE];  ///< random per file, IV = HMAC(key, nonce)
+} aes_file_header_st;
+
+struct keystream_s;
+
+typedef struct {
+    pufs_sp38a_ctx *sp38a_ctx;
+    struct keystream_s *prefetch;   ///< keystream made ahead on another thread, see keystream.h
+    int decrypt;
+    int legacy;                     ///< 16-byte block format without a header
+    u8 keystream[AES_IV_SIZE];      ///< legacy: the block every 16 bytes were XORed with
+} aes_stream_st;
+
+pufs_status_t aes_file_header_new(aes_file_header_st *header);
+pufs_status_t aes_stream_init(aes_stream_st *stream, int decrypt, const aes_file_header_st *header);
+pufs_status_t aes_stream_init_legacy(aes_stream_st *stream);
+pufs_status_t aes_stream_prefetch(aes_stream_st *stream, uint32_t block_size, int depth, uint64_t limit);
+pufs_status_t aes_stream_update(aes_stream_st *stream, u8 *out, uint32_t *outlen,
+                                const u8 *in, uint32_t inlen);
+pufs_status_t aes_stream_final(aes_stream_st *stream, u8 *out, uint32_t *outlen);
+void aes_stream_free(aes_stream_st *stream);
+/* Seekable CTR file, the counter of a block is its offset / 16 under a random per-file nonce */
+#define CTR_FILE_MAGIC      "PKBR"
+#define CTR_FILE_VERSION    1
+#define CTR_NONCE_SIZE      8
+#define CTR_BLOCK_SIZE      16
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    uint8_t nonce[CTR_NONCE_SIZE];  ///< upper half of every counter block
+    uint8_t reserved2[16];
+} ctr_file_header_st;
+
+pufs_status_t ctr_file_header_new(ctr_file_header_st *header);
+int ctr_file_header_valid(const ctr_file_header_st *header);
+pufs_status_t ctr_crypt_at(const ctr_file_header_st *header, int decrypt, uint64_t offset,
+                           u8 *out, const u8 *in, uint32_t len);
 pufs_status_t hmac_key(u8 *buf, uint32_t buf_size);
+
+/* Keyed HMAC over a message fed in pieces, SHA-256, SHA-384 or SHA-512 */
+typedef struct {
+    pufs_hmac_ctx *hmac_ctx;
+    pufs_hash_t hash;
+    int named;                  ///< slot pinned by hmac_stream_init_key
+    pufs_ka_slot_t slot;
+} hmac_stream_st;
+
+pufs_status_t hmac_stream_init(hmac_stream_st *hs, pufs_hash_t hash, pufs_ka_slot_t slot);
+pufs_status_t hmac_stream_init_key(hmac_stream_st *hs, pufs_hash_t hash, const char *key);
+pufs_status_t hmac_stream_update(hmac_stream_st *hs, const u8 *in, uint32_t inlen);
+pufs_status_t hmac_stream_final(hmac_stream_st *hs, pufs_dgst_st *md);
+void hmac_stream_free(hmac_stream_st *hs);
 pufs_status_t clear_key(void);
 int enroll(void);
 
@@ -84,55 +200,6 @@ int enroll(void);
 
 
 #define MAX_PATH_LENGTH 128
-#define STATISTICS 0
-
-#if STATISTICS
-#define TABLE_MAX 128
-typedef struct {
-    char function_name[64];
-    unsigned int function_count;
-} statistics_table_st;
-
-statistics_table_st statistics_table[TABLE_MAX] = {0};
-
-#define STATISTICS_FUNC(func) { \
-    int i; \
-    for (i = 0; i < TABLE_MAX; i++) { \
-        if (statistics_table[i].function_count == 0) { \
-            strcpy(statistics_table[i].function_name, func); \
-            statistics_table[i].function_count++; \
-            break; \
-        } \
-        else if (strcmp(statistics_table[i].function_name, func) == 0) { \
-            statistics_table[i].function_count++; \
-            break; \
-        } \
-        else { \
-            continue; \
-        } \
-    } \
-    if (i == TABLE_MAX) { \
-        printf("%s(%d) i:[%d] %s ERROR!!\n", __func__, __LINE__, i, func); \
-    } \
-}
-
-#define STATISTICS_SHOW() { \
-    int i; \
-    printf("STATISTICS_SHOW:\n"); \
-    for (i = 0; i < TABLE_MAX; i++) { \
-        if (statistics_table[i].function_count != 0) { \
-            printf("%s,\t %d\n", statistics_table[i].function_name, statistics_table[i].function_count); \
-        } \
-        else { \
-            break; \
-        } \
-    } \
-}
-
-#else
-#define STATISTICS_FUNC(func)
-#define STATISTICS_SHOW()
-#endif // STATISTICS
 
 #endif /* __GENERATEKEY_H__ */
 
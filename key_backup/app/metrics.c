@@ -0,0 +1,468 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      metrics.c
+ * @brief     Server metrics in the Prometheus text exposition format
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "devlock.h"
+#include "metrics.h"
+
+/**
+ * Counters are kept here under one lock; the device and key store latencies
+ * come from the opstat histograms and are exported as summaries. One thread
+ * answers scrapes on the listen socket, one at a time, and rewrites the
+ * metrics file, through a temporary file and rename so a collector never
+ * reads half of it.
+ */
+#define METRICS_PATH_MAX        256
+#define METRICS_REQUEST_MAX     1024
+
+static const double metrics_bounds[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define METRICS_BOUNDS  (sizeof(metrics_bounds) / sizeof(metrics_bounds[0]))
+
+static const char *metrics_session_names[METRICS_SESSION_NUM] = { "ok", "error", "rejected" };
+static const char *metrics_request_names[METRICS_REQUEST_NUM] = {
+    "ecdh", "backup", "restore", "replicate", "bulk"
+};
+static const char *metrics_link_names[METRICS_LINK_NUM] = { "client", "replica" };
+
+typedef struct {
+    uint64_t buckets[METRICS_BOUNDS];   ///< not cumulative, the rest is above the last bound
+    uint64_t count;
+    uint64_t failed;
+    double sum;
+} metrics_hist_st;
+
+static struct {
+    pthread_mutex_t lock;
+    uint64_t sessions[METRICS_SESSION_NUM];
+    metrics_hist_st requests[METRICS_REQUEST_NUM];
+    uint64_t wire[METRICS_LINK_NUM][2];             ///< received, sent
+    int listen_fd;
+    char file[METRICS_PATH_MAX];
+    int running;
+    volatile int stop;
+    pthread_t thread;
+#if MUTEX
+    devlock_st devlock;
+#endif
+} metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .listen_fd = -1,
+#if MUTEX
+    .devlock = { .fd = -1 },
+#endif
+};
+
+void metrics_session(metrics_session_t outcome)
+{
+    pthread_mutex_lock(&metrics.lock);
+    metrics.sessions[outcome]++;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+void metrics_request(metrics_request_t request, uint64_t start_ns, int failed)
+{
+    double secs = (opstat_now() - start_ns) / 1e9;
+    metrics_hist_st *h = &metrics.requests[request];
+    uint32_t b;
+
+    for (b = 0; b < METRICS_BOUNDS && secs > metrics_bounds[b]; b++) {
+    }
+    pthread_mutex_lock(&metrics.lock);
+    if (b < METRICS_BOUNDS) {
+        h->buckets[b]++;
+    }
+    h->count++;
+    h->sum += secs;
+    if (failed) {
+        h->failed++;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+void metrics_wire(metrics_link_t link, int sent, long bytes)
+{
+    if (bytes <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&metrics.lock);
+    metrics.wire[link][sent ? 1 : 0] += (uint64_t)bytes;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+static void metrics_head(FILE *f, const char *name, const char *type, const char *help)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_render_server(FILE *f)
+{
+    metrics_hist_st *h;
+    uint64_t cumulative;
+    uint32_t i, b;
+
+    metrics_head(f, "keybackup_sessions_total", "counter", "Client connections by outcome.");
+    for (i = 0; i < METRICS_SESSION_NUM; i++) {
+        fprintf(f, "keybackup_sessions_total{outcome=\"%s\"} %llu\n",
+            metrics_session_names[i], (unsigned long long)metrics.sessions[i]);
+    }
+    metrics_head(f, "keybackup_request_duration_seconds", "histogram",
+        "Time to handle a client request, device work included.");
+    for (i = 0; i < METRICS_REQUEST_NUM; i++) {
+        h = &metrics.requests[i];
+        cumulative = 0;
+        for (b = 0; b < METRICS_BOUNDS; b++) {
+            cumulative += h->buckets[b];
+            fprintf(f, "keybackup_request_duration_seconds_bucket{request=\"%s\",le=\"%g\"} %llu\n",
+                metrics_request_names[i], metrics_bounds[b], (unsigned long long)cumulative);
+        }
+        fprintf(f, "keybackup_request_duration_seconds_bucket{request=\"%s\",le=\"+Inf\"} %llu\n",
+            metrics_request_names[i], (unsigned long long)h->count);
+        fprintf(f, "keybackup_request_duration_seconds_sum{request=\"%s\"} %.6f\n",
+            metrics_request_names[i], h->sum);
+        fprintf(f, "keybackup_request_duration_seconds_count{request=\"%s\"} %llu\n",
+            metrics_request_names[i], (unsigned long long)h->count);
+    }
+    metrics_head(f, "keybackup_request_failures_total", "counter", "Client requests that failed.");
+    for (i = 0; i < METRICS_REQUEST_NUM; i++) {
+        fprintf(f, "keybackup_request_failures_total{request=\"%s\"} %llu\n",
+            metrics_request_names[i], (unsigned long long)metrics.requests[i].failed);
+    }
+    metrics_head(f, "keybackup_wire_bytes_total", "counter", "TLS payload bytes by link and direction.");
+    for (i = 0; i < METRICS_LINK_NUM; i++) {
+        fprintf(f, "keybackup_wire_bytes_total{link=\"%s\",direction=\"rx\"} %llu\n",
+            metrics_link_names[i], (unsigned long long)metrics.wire[i][0]);
+        fprintf(f, "keybackup_wire_bytes_total{link=\"%s\",direction=\"tx\"} %llu\n",
+            metrics_link_names[i], (unsigned long long)metrics.wire[i][1]);
+    }
+}
+
+static void metrics_render_device(FILE *f)
+{
+    pufs_session_stats_st ss;
+#if MUTEX
+    devlock_stats_st ds;
+#endif
+
+    pufs_session_stats(&ss);
+    metrics_head(f, "keybackup_device_sessions_total", "counter", "Device sessions opened.");
+    fprintf(f, "keybackup_device_sessions_total %lu\n", ss.sessions);
+    metrics_head(f, "keybackup_device_contended_total", "counter",
+        "Device sessions that waited for another thread.");
+    fprintf(f, "keybackup_device_contended_total %lu\n", ss.contended);
+    metrics_head(f, "keybackup_device_waiting", "gauge", "Threads waiting for the device now.");
+    fprintf(f, "keybackup_device_waiting %lu\n", ss.waiting);
+#if MUTEX
+    if (devlock_stats(&metrics.devlock, &ds) == 0) {
+        metrics_head(f, "keybackup_device_queue", "gauge",
+            "Processes holding or waiting for the device now.");
+        fprintf(f, "keybackup_device_queue %llu\n", (unsigned long long)ds.queued);
+        metrics_head(f, "keybackup_device_queue_waits_total", "counter",
+            "Device grants of all processes that had to queue.");
+        fprintf(f, "keybackup_device_queue_waits_total %llu\n", (unsigned long long)ds.waits);
+        metrics_head(f, "keybackup_device_queue_wait_seconds_total", "counter",
+            "Time processes spent queued for the device.");
+        fprintf(f, "keybackup_device_queue_wait_seconds_total %.6f\n", ds.wait_us / 1e6);
+        metrics_head(f, "keybackup_device_queue_timeouts_total", "counter",
+            "Processes that gave up waiting for the device.");
+        fprintf(f, "keybackup_device_queue_timeouts_total %llu\n", (unsigned long long)ds.timeouts);
+    }
+#endif
+}
+
+static void metrics_render_ops(FILE *f)
+{
+    opstat_summary_st s;
+    uint32_t id;
+
+    metrics_head(f, "keybackup_operation_duration_seconds", "summary",
+        "Latency of device calls and key store I/O of this process.");
+    for (id = 0; id < OPSTAT_COUNT; id++) {
+        opstat_summary((opstat_id_t)id, &s);
+        if (s.count == 0) {
+            continue;
+        }
+        fprintf(f, "keybackup_operation_duration_seconds{op=\"%s\",quantile=\"0.5\"} %.9f\n",
+            opstat_name((opstat_id_t)id), s.p50_ns / 1e9);
+        fprintf(f, "keybackup_operation_duration_seconds{op=\"%s\",quantile=\"0.99\"} %.9f\n",
+            opstat_name((opstat_id_t)id), s.p99_ns / 1e9);
+        fprintf(f, "keybackup_operation_duration_seconds_sum{op=\"%s\"} %.9f\n",
+            opstat_name((opstat_id_t)id), s.sum_ns / 1e9);
+        fprintf(f, "keybackup_operation_duration_seconds_count{op=\"%s\"} %llu\n",
+            opstat_name((opstat_id_t)id), (unsigned long long)s.count);
+    }
+}
+
+char *metrics_render(size_t *len)
+{
+    char *buf = NULL;
+    FILE *f;
+
+    f = open_memstream(&buf, len);
+    if (f == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&metrics.lock);
+    metrics_render_server(f);
+    pthread_mutex_unlock(&metrics.lock);
+    metrics_render_device(f);
+    metrics_render_ops(f);
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static int metrics_send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* One scrape: GET /metrics, answered and closed */
+static void metrics_serve(int fd)
+{
+    char req[METRICS_REQUEST_MAX + 1], head[128];
+    struct timeval tv = { METRICS_HTTP_TIMEOUT, 0 };
+    size_t got = 0, len = 0;
+    ssize_t n;
+    char *body;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (got < METRICS_REQUEST_MAX) {
+        n = recv(fd, req + got, METRICS_REQUEST_MAX - got, 0);
+        if (n <= 0) {
+            return;
+        }
+        got += (size_t)n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+            break;
+        }
+    }
+    req[got] = '\0';
+    if (strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET /metrics?", 13) != 0) {
+        snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        metrics_send_all(fd, head, strlen(head));
+        return;
+    }
+    body = metrics_render(&len);
+    if (body == NULL) {
+        snprintf(head, sizeof(head), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        metrics_send_all(fd, head, strlen(head));
+        return;
+    }
+    snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (metrics_send_all(fd, head, strlen(head)) == 0) {
+        metrics_send_all(fd, body, len);
+    }
+    free(body);
+}
+
+static int metrics_write_file(const char *path)
+{
+    char tmp[METRICS_PATH_MAX + 8];
+    size_t len = 0;
+    char *body;
+    FILE *f;
+    int ret = 0;
+
+    body = metrics_render(&len);
+    if (body == NULL) {
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        APP_ERR("open %s fail, errno = %d\n", tmp, errno);
+        free(body);
+        return -1;
+    }
+    if (fwrite(body, 1, len, f) != len) {
+        ret = -1;
+    }
+    if (fclose(f) != 0 || ret != 0 || rename(tmp, path) != 0) {
+        APP_ERR("write %s fail, errno = %d\n", path, errno);
+        unlink(tmp);
+        ret = -1;
+    }
+    free(body);
+    return ret;
+}
+
+static void *metrics_main(void *arg __attribute__((unused)))
+{
+    struct pollfd pfd;
+    time_t next_write = 0;
+    int fd;
+
+    while (!metrics.stop) {
+        if (metrics.file[0] != '\0' && time(NULL) >= next_write) {
+            metrics_write_file(metrics.file);
+            next_write = time(NULL) + METRICS_FILE_INTERVAL;
+        }
+        if (metrics.listen_fd < 0) {
+            sleep(1);
+            continue;
+        }
+        // wake up every second to notice metrics_stop
+        pfd.fd = metrics.listen_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        fd = accept(metrics.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        metrics_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int metrics_listen(const char *listen_addr)
+{
+    char host[NI_MAXHOST] = "127.0.0.1";
+    struct addrinfo hints, *res, *p;
+    const char *port = listen_addr, *colon;
+    int fd = -1, on = 1, rv;
+
+    colon = strrchr(listen_addr, ':');
+    if (colon != NULL) {
+        if ((size_t)(colon - listen_addr) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, listen_addr, colon - listen_addr);
+        host[colon - listen_addr] = '\0';
+        port = colon + 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+        APP_ERR("metrics address %s: %s\n", listen_addr, gai_strerror(rv));
+        return -1;
+    }
+    for (p = res; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, 8) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        APP_ERR("metrics listen on %s fail, errno = %d\n", listen_addr, errno);
+    }
+    return fd;
+}
+
+int metrics_start(const char *listen_addr, const char *file)
+{
+    if (listen_addr == NULL && file == NULL) {
+        return 0;
+    }
+    if (file != NULL) {
+        if (strlen(file) >= sizeof(metrics.file)) {
+            APP_ERR("metrics file path too long\n");
+            return -1;
+        }
+        strcpy(metrics.file, file);
+    }
+    if (listen_addr != NULL) {
+        metrics.listen_fd = metrics_listen(listen_addr);
+        if (metrics.listen_fd < 0) {
+            return -1;
+        }
+    }
+    metrics.stop = 0;
+    if (pthread_create(&metrics.thread, NULL, metrics_main, NULL) != 0) {
+        APP_ERR("create metrics thread fail\n");
+        if (metrics.listen_fd >= 0) {
+            close(metrics.listen_fd);
+            metrics.listen_fd = -1;
+        }
+        return -1;
+    }
+    metrics.running = 1;
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (!metrics.running) {
+        return;
+    }
+    metrics.stop = 1;
+    pthread_join(metrics.thread, NULL);
+    metrics.running = 0;
+    if (metrics.listen_fd >= 0) {
+        close(metrics.listen_fd);
+        metrics.listen_fd = -1;
+    }
+    if (metrics.file[0] != '\0') {
+        metrics_write_file(metrics.file);
+    }
+}
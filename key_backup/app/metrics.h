@@ -0,0 +1,82 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      metrics.h
+ * @brief     Server metrics in the Prometheus text exposition format
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "libcore.h"
+
+#define METRICS_FILE_INTERVAL   15      /* seconds between rewrites of the metrics file */
+#define METRICS_HTTP_TIMEOUT    2       /* seconds a scrape may take to send its request */
+
+typedef enum {
+    METRICS_SESSION_OK,
+    METRICS_SESSION_ERROR,          ///< failed after the TLS handshake
+    METRICS_SESSION_REJECTED,       ///< unknown MAC address or failed handshake
+    METRICS_SESSION_NUM,
+} metrics_session_t;
+
+typedef enum {
+    METRICS_REQUEST_ECDH,
+    METRICS_REQUEST_BACKUP,
+    METRICS_REQUEST_RESTORE,
+    METRICS_REQUEST_REPLICATE,
+    METRICS_REQUEST_BULK,
+    METRICS_REQUEST_NUM,
+} metrics_request_t;
+
+typedef enum {
+    METRICS_LINK_CLIENT,            ///< clients, and the primary on a standby
+    METRICS_LINK_REPLICA,           ///< standbys and export targets
+    METRICS_LINK_NUM,
+} metrics_link_t;
+
+void metrics_session(metrics_session_t outcome);
+
+/* start_ns from opstat_now() */
+void metrics_request(metrics_request_t request, uint64_t start_ns, int failed);
+void metrics_wire(metrics_link_t link, int sent, long bytes);
+
+/* listen "[addr:]port" on loopback unless addr is given, file rewritten in place; either may be NULL */
+int metrics_start(const char *listen, const char *file);
+void metrics_stop(void);
+
+/* The whole exposition, malloc'd, NULL on failure */
+char *metrics_render(size_t *len);
+
+#endif /* __METRICS_H__ */
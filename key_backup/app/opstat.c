@@ -0,0 +1,373 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      opstat.c
+ * @brief     Latency histograms of the device operations
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "opstat.h"
+
+/**
+ * Each thread records into a block of its own, so OPSTAT takes no lock and
+ * only the owner writes a counter; readers use atomic loads. Blocks are
+ * never freed: when a thread ends its block goes back to the list and the
+ * next new thread takes it over, keeping what it had counted. So there are
+ * as many blocks as threads ever ran at the same time, and opstat_dump can
+ * walk the list from a signal handler. A histogram of an operation is only
+ * allocated when the thread first runs it.
+ *
+ * Latencies fall into 8 linear buckets per power of 2 nanoseconds, so a
+ * percentile is the upper bound of its bucket, at most 1/8 above the value.
+ */
+#define OPSTAT_SUB_BITS     3
+#define OPSTAT_SUB          (1 << OPSTAT_SUB_BITS)
+#define OPSTAT_BUCKETS      ((64 - OPSTAT_SUB_BITS + 1) * OPSTAT_SUB)
+#define OPSTAT_LINE_MAX     192
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t buckets[OPSTAT_BUCKETS];
+} opstat_hist_st;
+
+typedef struct opstat_block_s {
+    struct opstat_block_s *next;
+    int owned;                                  ///< by a running thread, under opstat_lock
+    opstat_hist_st *hist[OPSTAT_COUNT];
+} opstat_block_st;
+
+#define OPSTAT_NAME(op) #op,
+static const char *opstat_names[OPSTAT_COUNT] = {
+    OPSTAT_OPS(OPSTAT_NAME)
+};
+#undef OPSTAT_NAME
+
+static opstat_block_st *opstat_blocks;
+static pthread_mutex_t opstat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t opstat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t opstat_key;
+static int opstat_fd = -1;
+static __thread opstat_block_st *opstat_mine;
+static __thread opstat_trace_fn opstat_trace_cb;
+static __thread void *opstat_trace_arg;
+
+uint64_t opstat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+const char *opstat_name(opstat_id_t id)
+{
+    return id < OPSTAT_COUNT ? opstat_names[id] : "unknown";
+}
+
+static uint32_t opstat_bucket(uint64_t ns)
+{
+    uint32_t e;
+
+    if (ns < OPSTAT_SUB) {
+        return (uint32_t)ns;
+    }
+    e = 63 - (uint32_t)__builtin_clzll(ns);
+    return (e - OPSTAT_SUB_BITS + 1) * OPSTAT_SUB + (uint32_t)((ns >> (e - OPSTAT_SUB_BITS)) & (OPSTAT_SUB - 1));
+}
+
+/* Largest latency of the bucket */
+static uint64_t opstat_bucket_max(uint32_t b)
+{
+    uint32_t e;
+
+    if (b < OPSTAT_SUB) {
+        return b;
+    }
+    e = b / OPSTAT_SUB + OPSTAT_SUB_BITS - 1;
+    return ((uint64_t)(OPSTAT_SUB + b % OPSTAT_SUB + 1) << (e - OPSTAT_SUB_BITS)) - 1;
+}
+
+static void opstat_thread_end(void *arg)
+{
+    opstat_block_st *block = arg;
+
+    pthread_mutex_lock(&opstat_lock);
+    block->owned = 0;
+    pthread_mutex_unlock(&opstat_lock);
+}
+
+static void opstat_exit(void)
+{
+    opstat_dump();
+}
+
+static void opstat_signal(int sig __attribute__((unused)))
+{
+    int saved = errno;
+
+    opstat_dump();
+    errno = saved;
+}
+
+static void opstat_setup(void)
+{
+    const char *target = getenv(OPSTAT_ENV);
+    struct sigaction sa;
+
+    pthread_key_create(&opstat_key, opstat_thread_end);
+    if (target == NULL || *target == '\0') {
+        return;
+    }
+    if (strcmp(target, "-") == 0) {
+        opstat_fd = STDERR_FILENO;
+    }
+    else {
+        opstat_fd = open(target, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (opstat_fd < 0) {
+            APP_WARN("open %s fail, errno = %d, latencies are not written\n", target, errno);
+            return;
+        }
+    }
+    atexit(opstat_exit);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = opstat_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(OPSTAT_SIGNAL, &sa, NULL);
+}
+
+/* At load, so OPSTAT_SIGNAL dumps instead of killing a process that has not timed anything yet */
+__attribute__((constructor)) static void opstat_init(void)
+{
+    pthread_once(&opstat_once, opstat_setup);
+}
+
+/* First operation of this thread: take over a block of an ended thread or add one */
+static opstat_block_st *opstat_claim(void)
+{
+    opstat_block_st *block;
+
+    pthread_once(&opstat_once, opstat_setup);
+    pthread_mutex_lock(&opstat_lock);
+    for (block = opstat_blocks; block != NULL; block = block->next) {
+        if (!block->owned) {
+            break;
+        }
+    }
+    if (block == NULL) {
+        block = calloc(1, sizeof(*block));
+        if (block == NULL) {
+            pthread_mutex_unlock(&opstat_lock);
+            return NULL;
+        }
+        block->next = opstat_blocks;
+        __atomic_store_n(&opstat_blocks, block, __ATOMIC_RELEASE);
+    }
+    block->owned = 1;
+    pthread_mutex_unlock(&opstat_lock);
+    pthread_setspecific(opstat_key, block);
+    return block;
+}
+
+void opstat_trace(opstat_trace_fn fn, void *arg)
+{
+    opstat_trace_cb = fn;
+    opstat_trace_arg = arg;
+}
+
+void opstat_record(opstat_id_t id, uint64_t start_ns)
+{
+    uint64_t end_ns = opstat_now(), ns = end_ns - start_ns;
+    opstat_hist_st *h;
+    uint32_t b;
+
+    if (opstat_trace_cb != NULL) {
+        opstat_trace_cb(opstat_trace_arg, id, start_ns, end_ns);
+    }
+
+    if (opstat_mine == NULL && (opstat_mine = opstat_claim()) == NULL) {
+        return;
+    }
+    h = opstat_mine->hist[id];
+    if (h == NULL) {
+        h = calloc(1, sizeof(*h));
+        if (h == NULL) {
+            return;
+        }
+        h->min_ns = UINT64_MAX;
+        __atomic_store_n(&opstat_mine->hist[id], h, __ATOMIC_RELEASE);
+    }
+    // the only writer, stores are atomic for opstat_summary of other threads
+    b = opstat_bucket(ns);
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    if (ns < h->min_ns) {
+        __atomic_store_n(&h->min_ns, ns, __ATOMIC_RELAXED);
+    }
+    if (ns > h->max_ns) {
+        __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+/* Allocates nothing and takes no lock, called from the signal handler */
+static void opstat_collect(opstat_id_t id, opstat_summary_st *summary, uint64_t *buckets)
+{
+    opstat_block_st *block;
+    opstat_hist_st *h;
+    uint64_t n, min, max;
+    uint32_t b;
+
+    memset(summary, 0, sizeof(*summary));
+    summary->min_ns = UINT64_MAX;
+    memset(buckets, 0, OPSTAT_BUCKETS * sizeof(*buckets));
+    block = __atomic_load_n(&opstat_blocks, __ATOMIC_ACQUIRE);
+    for (; block != NULL; block = block->next) {
+        h = __atomic_load_n(&block->hist[id], __ATOMIC_ACQUIRE);
+        if (h == NULL) {
+            continue;
+        }
+        for (b = 0; b < OPSTAT_BUCKETS; b++) {
+            n = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            buckets[b] += n;
+            summary->count += n;
+        }
+        summary->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+        min = __atomic_load_n(&h->min_ns, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+        summary->min_ns = min < summary->min_ns ? min : summary->min_ns;
+        summary->max_ns = max > summary->max_ns ? max : summary->max_ns;
+    }
+    if (summary->count == 0) {
+        summary->min_ns = 0;
+    }
+}
+
+static uint64_t opstat_percentile(const uint64_t *buckets, uint64_t count, uint64_t max_ns, uint32_t pct)
+{
+    uint64_t rank = (count * pct + 99) / 100, seen = 0, ns;
+    uint32_t b;
+
+    for (b = 0; b < OPSTAT_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank && seen > 0) {
+            ns = opstat_bucket_max(b);
+            return ns < max_ns ? ns : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+void opstat_summary(opstat_id_t id, opstat_summary_st *summary)
+{
+    uint64_t buckets[OPSTAT_BUCKETS];
+
+    opstat_collect(id, summary, buckets);
+    summary->p50_ns = opstat_percentile(buckets, summary->count, summary->max_ns, 50);
+    summary->p99_ns = opstat_percentile(buckets, summary->count, summary->max_ns, 99);
+}
+
+/* snprintf is not async-signal-safe, these are */
+static size_t opstat_put_str(char *line, size_t pos, const char *s)
+{
+    while (*s != '\0' && pos < OPSTAT_LINE_MAX - 1) {
+        line[pos++] = *s++;
+    }
+    return pos;
+}
+
+static size_t opstat_put_u64(char *line, size_t pos, uint64_t v)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0 && pos < OPSTAT_LINE_MAX - 1) {
+        line[pos++] = digits[--n];
+    }
+    return pos;
+}
+
+/* " <label> 12.3us" */
+static size_t opstat_put_us(char *line, size_t pos, const char *label, uint64_t ns)
+{
+    char tenth[2] = { (char)('0' + ns % 1000 / 100), '\0' };
+
+    pos = opstat_put_str(line, pos, label);
+    pos = opstat_put_u64(line, pos, ns / 1000);
+    pos = opstat_put_str(line, pos, ".");
+    pos = opstat_put_str(line, pos, tenth);
+    return opstat_put_str(line, pos, "us");
+}
+
+void opstat_dump(void)
+{
+    opstat_summary_st s;
+    char line[OPSTAT_LINE_MAX];
+    size_t pos;
+    uint32_t id;
+
+    if (opstat_fd < 0) {
+        return;
+    }
+    for (id = 0; id < OPSTAT_COUNT; id++) {
+        opstat_summary((opstat_id_t)id, &s);
+        if (s.count == 0) {
+            continue;
+        }
+        pos = opstat_put_str(line, 0, "opstat pid ");
+        pos = opstat_put_u64(line, pos, (uint64_t)getpid());
+        pos = opstat_put_str(line, pos, " ");
+        pos = opstat_put_str(line, pos, opstat_names[id]);
+        pos = opstat_put_str(line, pos, " count ");
+        pos = opstat_put_u64(line, pos, s.count);
+        pos = opstat_put_us(line, pos, " min ", s.min_ns);
+        pos = opstat_put_us(line, pos, " p50 ", s.p50_ns);
+        pos = opstat_put_us(line, pos, " p99 ", s.p99_ns);
+        pos = opstat_put_us(line, pos, " max ", s.max_ns);
+        line[pos++] = '\n';
+        if (write(opstat_fd, line, pos) < 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      opstat.h
+ * @brief     Latency histograms of the device operations
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __OPSTAT_H__
+#define __OPSTAT_H__
+
+#include <signal.h>
+#include <stdint.h>
+
+/* Where the histograms are written: unset for nowhere, "-" for stderr, else a file appended to */
+#define OPSTAT_ENV              "KEYBACKUP_OPSTAT"
+#define OPSTAT_SIGNAL           SIGUSR1     /* dumps while running, when OPSTAT_ENV is set */
+
+/* Every timed operation, a new one only needs a line here. Histograms are kept
+ * per operation, so the call sites of one operation share its histogram. */
+#define OPSTAT_OPS(X) \
+    X(devlock_acquire) \
+    X(devlock_release) \
+    X(pufs_clear_key) \
+    X(pufs_cmd_iface_deinit) \
+    X(pufs_cmd_iface_init) \
+    X(pufs_dec_ctr_final) \
+    X(pufs_dec_ctr_init) \
+    X(pufs_dec_ctr_update) \
+    X(pufs_dec_gcm_final) \
+    X(pufs_dec_gcm_init) \
+    X(pufs_dec_gcm_update) \
+    X(pufs_dec_ofb) \
+    X(pufs_dec_ofb_final) \
+    X(pufs_dec_ofb_init) \
+    X(pufs_dec_ofb_update) \
+    X(pufs_dec_xts_final) \
+    X(pufs_dec_xts_init) \
+    X(pufs_dec_xts_update) \
+    X(pufs_ecp_ecccdh_2e2s) \
+    X(pufs_ecp_gen_eprk) \
+    X(pufs_ecp_gen_puk) \
+    X(pufs_ecp_gen_sprk) \
+    X(pufs_ecp_set_curve_byname) \
+    X(pufs_enc_ctr_final) \
+    X(pufs_enc_ctr_init) \
+    X(pufs_enc_ctr_update) \
+    X(pufs_enc_gcm_final) \
+    X(pufs_enc_gcm_init) \
+    X(pufs_enc_gcm_update) \
+    X(pufs_enc_ofb) \
+    X(pufs_enc_ofb_final) \
+    X(pufs_enc_ofb_init) \
+    X(pufs_enc_ofb_update) \
+    X(pufs_enc_xts_final) \
+    X(pufs_enc_xts_init) \
+    X(pufs_enc_xts_update) \
+    X(pufs_export_wrapped_key) \
+    X(pufs_gen_aes_key) \
+    X(pufs_get_uid) \
+    X(pufs_hmac) \
+    X(pufs_hmac_final) \
+    X(pufs_hmac_init) \
+    X(pufs_hmac_update) \
+    X(pufs_import_plaintext_key) \
+    X(pufs_import_wrapped_key) \
+    X(pufs_kdf) \
+    X(pufs_rand) \
+    X(rt_write_enroll) \
+    X(keystore_read) \
+    X(keystore_write) \
+    X(keystore_sync)
+
+#define OPSTAT_ID(op) OPSTAT_##op,
+typedef enum {
+    OPSTAT_OPS(OPSTAT_ID)
+    OPSTAT_COUNT
+} opstat_id_t;
+#undef OPSTAT_ID
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} opstat_summary_st;
+
+uint64_t opstat_now(void);
+void opstat_record(opstat_id_t id, uint64_t start_ns);
+
+/* Times the statement, e.g. OPSTAT(pufs_rand, check = pufs_rand(buf, 1)); */
+#define OPSTAT(op, ...) do { \
+    uint64_t opstat_start = opstat_now(); \
+    __VA_ARGS__; \
+    opstat_record(OPSTAT_##op, opstat_start); \
+} while (0)
+
+const char *opstat_name(opstat_id_t id);
+
+/* Also hands every operation of the calling thread to fn, until opstat_trace(NULL, NULL) */
+typedef void (*opstat_trace_fn)(void *arg, opstat_id_t id, uint64_t start_ns, uint64_t end_ns);
+void opstat_trace(opstat_trace_fn fn, void *arg);
+
+/* Histograms of all threads, live and ended, added up; percentiles within 1/8 of a power of 2 */
+void opstat_summary(opstat_id_t id, opstat_summary_st *summary);
+
+/* One line per operation that ran, to the OPSTAT_ENV target; does nothing when it is unset */
+void opstat_dump(void);
+
+#endif /* __OPSTAT_H__ */
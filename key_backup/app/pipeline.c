@@ -0,0 +1,326 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      pipeline.c
+ * @brief     Reader, crypto and writer stages over blockio
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <time.h>
+#include "pipeline.h"
+
+/**
+ * A reader thread fills blocks, the calling thread runs them through the
+ * device and a writer thread stores the results, so disk I/O overlaps with
+ * device time. The blocks form one ring of depth slots; a block moves from
+ * stage to stage by the stage's sequence number passing it, and the reader
+ * only reuses a slot once the writer has finished with it.
+ *
+ * In place, output may be longer than input (the prefix), so a block is only
+ * written once the block after it has been read.
+ */
+
+static double pipeline_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int pipeline_write_prefix(pipeline_st *pl)
+{
+    int ret = 0;
+
+    if (pl->prefix_len > 0) {
+        ret = blockio_write(pl->bio, pl->prefix, pl->prefix_len);
+        pl->prefix_len = 0;
+    }
+    return ret;
+}
+
+static void pipeline_fail(pipeline_st *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->error = 1;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void *pipeline_reader(void *arg)
+{
+    pipeline_st *pl = arg;
+    pipeline_slot_st *slot;
+    ssize_t len;
+
+    for (;;) {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->error && pl->read_seq - pl->write_seq >= (unsigned long)pl->depth) {
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        }
+        if (pl->error) {
+            pthread_mutex_unlock(&pl->lock);
+            break;
+        }
+        slot = &pl->slots[pl->read_seq % pl->depth];
+        pthread_mutex_unlock(&pl->lock);
+
+        len = blockio_read(pl->bio, slot->in);
+
+        pthread_mutex_lock(&pl->lock);
+        if (len < 0) {
+            pl->error = 1;
+        }
+        else if (len == 0) {
+            pl->read_done = 1;
+        }
+        else {
+            slot->len = len;
+            pl->read_seq++;
+        }
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->lock);
+        if (len <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int pipeline_writable(pipeline_st *pl)
+{
+    if (pl->write_seq >= pl->crypt_seq) {
+        return 0;
+    }
+    return !pl->bio->same_io || pl->read_done || pl->write_seq + 1 < pl->read_seq;
+}
+
+static void *pipeline_writer(void *arg)
+{
+    pipeline_st *pl = arg;
+    pipeline_slot_st *slot;
+
+    for (;;) {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->error && !pipeline_writable(pl) &&
+               !(pl->crypt_done && pl->write_seq == pl->crypt_seq)) {
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        }
+        if (pl->error || !pipeline_writable(pl)) {
+            pthread_mutex_unlock(&pl->lock);
+            break;
+        }
+        slot = &pl->slots[pl->write_seq % pl->depth];
+        pthread_mutex_unlock(&pl->lock);
+
+        if (pipeline_write_prefix(pl) != 0 ||
+            blockio_write(pl->bio, slot->out, slot->out_len) != 0) {
+            pipeline_fail(pl);
+            break;
+        }
+
+        pthread_mutex_lock(&pl->lock);
+        pl->write_seq++;
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->lock);
+    }
+    return NULL;
+}
+
+static pufs_status_t pipeline_threaded(pipeline_st *pl, pipeline_fn fn, void *arg)
+{
+    pufs_status_t ret = PUFS_SUCCESS;
+    pipeline_slot_st *slot;
+    pthread_t reader, writer;
+    double start;
+
+    if (pthread_create(&reader, NULL, pipeline_reader, pl) != 0) {
+        APP_ERR("pthread_create fail\n");
+        return PUFS_ERROR;
+    }
+    if (pthread_create(&writer, NULL, pipeline_writer, pl) != 0) {
+        APP_ERR("pthread_create fail\n");
+        pipeline_fail(pl);
+        pthread_join(reader, NULL);
+        return PUFS_ERROR;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->error && pl->crypt_seq == pl->read_seq && !pl->read_done) {
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        }
+        if (pl->error || pl->crypt_seq == pl->read_seq) {
+            pl->crypt_done = 1;
+            pthread_cond_broadcast(&pl->cond);
+            pthread_mutex_unlock(&pl->lock);
+            break;
+        }
+        slot = &pl->slots[pl->crypt_seq % pl->depth];
+        pthread_mutex_unlock(&pl->lock);
+
+        start = pipeline_now();
+        slot->out_len = pl->bio->block_size + BLOCKIO_SLACK;
+        ret = fn(arg, slot->out, &slot->out_len, slot->in, slot->len);
+        pl->crypt_secs += pipeline_now() - start;
+        if (ret != PUFS_SUCCESS) {
+            pipeline_fail(pl);
+            break;
+        }
+
+        pthread_mutex_lock(&pl->lock);
+        pl->crypt_seq++;
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    // the writer leaves the prefix alone when there were no blocks at all
+    if (ret == PUFS_SUCCESS && !pl->error && pipeline_write_prefix(pl) != 0) {
+        pl->error = 1;
+    }
+    if (ret == PUFS_SUCCESS && pl->error) {
+        ret = PUFS_ERROR;
+    }
+    return ret;
+}
+
+/* Same order of operations in one thread, the next block is read ahead */
+static pufs_status_t pipeline_serial(pipeline_st *pl, pipeline_fn fn, void *arg)
+{
+    pufs_status_t ret = PUFS_SUCCESS;
+    pipeline_slot_st *cur = &pl->slots[0], *next = &pl->slots[1], *tmp;
+    ssize_t len, next_len;
+    double start;
+
+    len = blockio_read(pl->bio, cur->in);
+    while (len > 0) {
+        next_len = blockio_read(pl->bio, next->in);
+        if (next_len < 0) {
+            len = next_len;
+            break;
+        }
+
+        start = pipeline_now();
+        cur->out_len = pl->bio->block_size + BLOCKIO_SLACK;
+        ret = fn(arg, cur->out, &cur->out_len, cur->in, len);
+        pl->crypt_secs += pipeline_now() - start;
+        if (ret != PUFS_SUCCESS) {
+            return ret;
+        }
+
+        if (pipeline_write_prefix(pl) != 0 ||
+            blockio_write(pl->bio, cur->out, cur->out_len) != 0) {
+            return PUFS_ERROR;
+        }
+
+        tmp = cur;
+        cur = next;
+        next = tmp;
+        len = next_len;
+    }
+    if (len < 0 || pipeline_write_prefix(pl) != 0) {
+        return PUFS_ERROR;
+    }
+    return ret;
+}
+
+int pipeline_init(pipeline_st *pl, blockio_st *bio, int depth)
+{
+    int i, num;
+
+    memset(pl, 0, sizeof(*pl));
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+
+    if (depth < PIPELINE_DEPTH_MIN || depth > PIPELINE_DEPTH_MAX) {
+        APP_ERR("pipeline depth %d is out of [%d, %d]\n", depth, PIPELINE_DEPTH_MIN, PIPELINE_DEPTH_MAX);
+        return -1;
+    }
+    pl->bio = bio;
+    pl->depth = depth;
+
+    // the serial loop still needs a block to read ahead into
+    num = depth < 2 ? 2 : depth;
+    pl->slots = calloc(num, sizeof(pipeline_slot_st));
+    if (pl->slots == NULL) {
+        APP_ERR("calloc fail\n");
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        pl->slots[i].in = blockio_alloc(bio);
+        pl->slots[i].out = blockio_alloc(bio);
+        if (pl->slots[i].in == NULL || pl->slots[i].out == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void pipeline_deinit(pipeline_st *pl)
+{
+    int i, num = pl->depth < 2 ? 2 : pl->depth;
+
+    if (pl->slots != NULL) {
+        for (i = 0; i < num; i++) {
+            free(pl->slots[i].in);
+            free(pl->slots[i].out);
+        }
+        free(pl->slots);
+        pl->slots = NULL;
+    }
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->cond);
+}
+
+pufs_status_t pipeline_run(pipeline_st *pl, const u8 *prefix, size_t prefix_len,
+                           pipeline_fn fn, void *arg)
+{
+    pufs_status_t ret;
+    double start = pipeline_now();
+
+    pl->prefix = prefix;
+    pl->prefix_len = prefix_len;
+
+    if (pl->depth == 1) {
+        ret = pipeline_serial(pl, fn, arg);
+    }
+    else {
+        ret = pipeline_threaded(pl, fn, arg);
+    }
+    pl->run_secs = pipeline_now() - start;
+    return ret;
+}
@@ -0,0 +1,88 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      pipeline.h
+ * @brief     Reader, crypto and writer stages over blockio
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <pthread.h>
+#include "libcore.h"
+#include "blockio.h"
+
+#define PIPELINE_DEPTH_MIN      1       /* 1 runs the stages in turn in the calling thread */
+#define PIPELINE_DEPTH_MAX      16
+#define PIPELINE_DEPTH_DEFAULT  4       /* blocks in flight between the three stages */
+
+/* Crypto stage, called in the calling thread so it can use its device session */
+typedef pufs_status_t (*pipeline_fn)(void *arg, u8 *out, uint32_t *outlen, const u8 *in, uint32_t inlen);
+
+typedef struct {
+    u8 *in;
+    u8 *out;
+    uint32_t len;
+    uint32_t out_len;
+} pipeline_slot_st;
+
+typedef struct {
+    blockio_st *bio;
+    int depth;
+    pipeline_slot_st *slots;
+
+    // sequence numbers of blocks that finished each stage, slot = seq % depth
+    unsigned long read_seq;
+    unsigned long crypt_seq;
+    unsigned long write_seq;
+    int read_done;
+    int crypt_done;
+    int error;
+
+    const u8 *prefix;           ///< written ahead of the first block, e.g. a file header
+    size_t prefix_len;
+
+    double run_secs;
+    double crypt_secs;          ///< time spent in the crypto stage, device busy = crypt / run
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pipeline_st;
+
+int pipeline_init(pipeline_st *pl, blockio_st *bio, int depth);
+void pipeline_deinit(pipeline_st *pl);
+pufs_status_t pipeline_run(pipeline_st *pl, const u8 *prefix, size_t prefix_len,
+                           pipeline_fn fn, void *arg);
+
+#endif /* __PIPELINE_H__ */
@@ -0,0 +1,652 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      replica.c
+ * @brief     Key store replication to standby servers
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include "keystore.h"
+#include "replica.h"
+#include "metrics.h"
+#include <errno.h>
+#include <time.h>
+
+/*
+ * A single shipper thread on the primary pushes committed backups to every
+ * standby. The queue only holds references (mac address, cipher, generation);
+ * the record itself is read back from the key store when it is shipped. For
+ * each standby and batch the shipper
+ *   1. opens a mutual TLS connection, which needs no device,
+ *   2. takes the device once no foreground session holds it just to create
+ *      the ECDH keys, and swaps public keys with the standby without it,
+ *   3. takes the device again to derive the KEK and rewrap the whole batch
+ *      under it, then gives the device back,
+ *   4. streams the batch and collects one ack per record.
+ * A foreground session between 2 and 3 replaces the ECDH private keys; the
+ * shipper notices and retries the batch later on a new connection.
+ * Standbys store replicated records under the primary's generation, so a
+ * client restores the same generation from either server.
+ */
+
+void replica_packet_init(packet_st *packet, keystore_st *ks)
+{
+    memset(packet, 0, sizeof(packet_st));
+    packet->type = SERVER;
+    packet->keystore = ks;
+    packet->send_ecdh_packet = (ecdh_packet_st *)(packet->send_buf);
+    packet->send_ecdh_packet->event = ECDH_EXCHANGE;
+    packet->send_ecdh_packet->key_num = 2;
+    packet->send_ecdh_packet->ecdh_key_ephemeral.key_type = ECDH_EPHEMERAL_KEY;
+    packet->send_ecdh_packet->ecdh_key_ephemeral.key_len = sizeof(pufs_tuple_bytes_array_st);
+    packet->send_ecdh_packet->ecdh_key_static.key_type = ECDH_STATIC_KEY;
+    packet->send_ecdh_packet->ecdh_key_static.key_len = sizeof(pufs_tuple_bytes_array_st);
+    PUFS_TUPLE_BYTES_ARRAY_TO_POINT(packet->send_ecdh_packet->puk_ephemeral, &(packet->puk_server_e));
+    PUFS_TUPLE_BYTES_ARRAY_TO_POINT(packet->send_ecdh_packet->puk_static, &(packet->puk_server_s));
+
+    packet->recv_ecdh_packet = (ecdh_packet_st *)(packet->recv_buf);
+    PUFS_TUPLE_BYTES_ARRAY_TO_POINT(packet->recv_ecdh_packet->puk_ephemeral, &(packet->puk_client_e));
+    PUFS_TUPLE_BYTES_ARRAY_TO_POINT(packet->recv_ecdh_packet->puk_static, &(packet->puk_client_s));
+}
+
+int replica_connect(replica_st *rp, replica_standby_st *sb, SSL **ssl)
+{
+    struct addrinfo hints, *servinfo, *p;
+    int rv, sockfd = -1;
+
+    struct timeval tv = { REPLICA_IO_TIMEOUT, 0 };
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(sb->host, sb->port, &hints, &servinfo)) != 0) {
+        APP_ERR("getaddrinfo %s: %s\n", sb->host, gai_strerror(rv));
+        goto EXIT;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            continue;
+        }
+        // bounds connect, the TLS handshake and every later send and receive
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (sockfd < 0) {
+        APP_ERR("connect %s:%s fail, errno = %d\n", sb->host, sb->port, errno);
+        goto EXIT;
+    }
+
+    *ssl = SSL_new(rp->ctx);
+    SSL_set_fd(*ssl, sockfd);
+    if (SSL_connect(*ssl) <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(*ssl);
+        *ssl = NULL;
+        close(sockfd);
+        sockfd = -1;
+    }
+EXIT:
+    return sockfd;
+}
+
+void replica_close(SSL *ssl, int sockfd)
+{
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(sockfd);
+}
+
+int replica_send(packet_st *packet)
+{
+    int len = SSL_write(packet->ssl, packet->send_buf, packet->send_buf_size);
+
+    metrics_wire(METRICS_LINK_REPLICA, 1, len);
+    return (len == packet->send_buf_size) ? 0 : 1;
+}
+
+int replica_recv(packet_st *packet)
+{
+    packet->recv_buf_size = SSL_read(packet->ssl, packet->recv_buf, RECV_BUF_MAX);
+    metrics_wire(METRICS_LINK_REPLICA, 0, packet->recv_buf_size);
+    return (packet->recv_buf_size > 0) ? 0 : 1;
+}
+
+/* ECDH with the standby; the primary plays the client side of the exchange
+ * with its own server slots, leaving the shared KEK in SERVER_KEK_SLOT. The
+ * caller holds the device throughout. */
+pufs_status_t replica_handshake(packet_st *packet)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    check = replica_handshake_keys(packet);
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    check = replica_handshake_exchange(packet);
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+    check = replica_handshake_kek(packet);
+RET:
+    return check;
+}
+
+/* Step 1, device: fresh ECDH key pairs in the server private key slots. */
+pufs_status_t replica_handshake_keys(packet_st *packet)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    check = ecdh_keys(packet);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("ecdh_keys failed, check = %d", check);
+    }
+    return check;
+}
+
+/* Step 2, network only: swap public keys with the standby. */
+pufs_status_t replica_handshake_exchange(packet_st *packet)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    strncpy(packet->send_ecdh_packet->packet_name, "ECDH_REPLICA", 13);
+    packet->send_ecdh_packet->puk_ephemeral.len = packet->puk_server_e.len;
+    packet->send_ecdh_packet->puk_static.len = packet->puk_server_s.len;
+    packet->send_buf_size = sizeof(ecdh_packet_st);
+
+    if (replica_send(packet) || replica_recv(packet)) {
+        APP_ERR("ecdh exchange with standby fail\n");
+        check = PUFS_ERROR;
+        goto RET;
+    }
+    if (packet->recv_ecdh_packet->event != ECDH_EXCHANGE) {
+        APP_ERR("(%d) Incorrect event:[%d]\n", __LINE__, packet->recv_ecdh_packet->event);
+        check = PUFS_ERROR;
+        goto RET;
+    }
+    packet->puk_client_e.len = packet->recv_ecdh_packet->puk_ephemeral.len;
+    packet->puk_client_s.len = packet->recv_ecdh_packet->puk_static.len;
+RET:
+    return check;
+}
+
+/* 0 when the private key in the slot still belongs to the public key sent */
+static int replica_prk_held(pufs_ka_slot_t slot, const pufs_tuple_bytes_st *sent)
+{
+    pufs_ec_point_st puk;
+    pufs_status_t check;
+
+    OPSTAT(pufs_ecp_gen_puk, check = pufs_ecp_gen_puk(&puk, PRKEY, slot));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_ecp_gen_puk failed, check = %d\n", check);
+        return 1;
+    }
+    return ((puk.qlen != sent->len) || (memcmp(puk.x, sent->x_out, puk.qlen) != 0) ||
+            (memcmp(puk.y, sent->y_out, puk.qlen) != 0));
+}
+
+/* Step 3, device: derive the KEK, unless a session that ran since step 1
+ * replaced the private keys, in which case the standby would derive another
+ * KEK and the caller has to start over. */
+pufs_status_t replica_handshake_kek(packet_st *packet)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    OPSTAT(pufs_ecp_set_curve_byname, check = pufs_ecp_set_curve_byname(NISTB163));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_ecp_set_curve_byname failed, check = %d\n", check);
+        goto RET;
+    }
+    if (replica_prk_held(SERVER_EPHEMERAL_PRIVATE_SLOT, &packet->puk_server_e) ||
+            replica_prk_held(SERVER_STATIC_PRIVATE_SLOT, &packet->puk_server_s)) {
+        APP_WARN("ECDH keys replaced during the exchange, retrying later\n");
+        check = PUFS_ERROR;
+        goto RET;
+    }
+    check = generate_ecdh_kek(packet);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("generate_ecdh_kek failed, check = %d", check);
+    }
+RET:
+    return check;
+}
+
+/* Unwrap a stored record with the local export key and wrap it again under the
+ * session KEK. Returns 1 when the generation has already left the key store. */
+static int replica_rewrap(packet_st *packet, const replica_entry_st *entry, wrap_packet_st *out)
+{
+    wrap_packet_st *req = (wrap_packet_st *)(packet->recv_buf);
+    wrap_key_st probe;
+    uint32_t generation = entry->generation;
+    pufs_status_t check;
+
+    memset(&probe, 0, sizeof(wrap_key_st));
+    memcpy(probe.cipher, entry->cipher, sizeof(entry->cipher));
+    if (keystore_get(packet->keystore, entry->macaddr, &probe, &generation) != 0) {
+        return 1;
+    }
+
+    memset(req, 0, sizeof(wrap_packet_st));
+    strncpy((char *)req->wrap_key.macaddr, entry->macaddr, sizeof(req->wrap_key.macaddr) - 1);
+    memcpy(req->wrap_key.cipher, entry->cipher, sizeof(entry->cipher));
+    req->wrap_key.cipher_size = sizeof(entry->cipher);
+    req->generation = entry->generation;
+
+    check = server_import_from_file(packet);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("server_import_from_file fail. check = %d\n", check);
+        return 2;
+    }
+    check = server_wrap_packet(packet);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("server_wrap_packet fail. check = %d\n", check);
+        return 2;
+    }
+    memcpy(out, packet->send_buf, sizeof(wrap_packet_st));
+    out->event = REPLICATE_KEY;
+    out->generation = entry->generation;
+    sprintf(out->wrap_key.packet_name, "REPLICA_SERVER");
+    return 0;
+}
+
+static void replica_advance(replica_st *rp, replica_standby_st *sb, uint64_t seq, int shipped)
+{
+    uint64_t low;
+    int i;
+
+    pthread_mutex_lock(&rp->lock);
+    if (sb->acked < seq) {
+        sb->acked = seq;
+    }
+    sb->shipped += shipped;
+    low = rp->head;
+    for (i = 0; i < rp->standby_num; i++) {
+        if (rp->standbys[i].acked < low) {
+            low = rp->standbys[i].acked;
+        }
+    }
+    if (rp->tail < low + 1) {
+        rp->tail = low + 1;
+    }
+    pthread_cond_broadcast(&rp->acked);
+    pthread_mutex_unlock(&rp->lock);
+}
+
+/* Foreground sessions always win the device. */
+static pufs_status_t replica_device_start(replica_st *rp)
+{
+    pufs_status_t check;
+
+    while ((check = pufs_try_start("replica_ship")) == E_BUSY) {
+        if (rp->stop) {
+            return check;
+        }
+        usleep(REPLICA_DEVICE_BACKOFF_US);
+    }
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_try_start fail, check = %d\n", check);
+    }
+    return check;
+}
+
+static int replica_ship(replica_st *rp, replica_standby_st *sb)
+{
+    replica_entry_st entries[REPLICA_BATCH_MAX];
+    wrap_packet_st batch[REPLICA_BATCH_MAX];
+    uint64_t seqs[REPLICA_BATCH_MAX], first, done;
+    result_packet_st *result;
+    packet_st packet;
+    pufs_status_t check;
+    int i, j, num = 0, sent = 0, acks = 0, sockfd, ret = 0;
+
+    pthread_mutex_lock(&rp->lock);
+    first = (sb->acked + 1 > rp->tail) ? sb->acked + 1 : rp->tail;
+    for (done = first; (done <= rp->head) && (num < REPLICA_BATCH_MAX); done++) {
+        entries[num++] = rp->queue[done % REPLICA_QUEUE_MAX];
+    }
+    pthread_mutex_unlock(&rp->lock);
+    if (num == 0) {
+        goto EXIT;
+    }
+
+    replica_packet_init(&packet, rp->keystore);
+    sockfd = replica_connect(rp, sb, &packet.ssl);
+    if (sockfd < 0) {
+        ret = 1;
+        goto EXIT;
+    }
+
+    // the device is only held for device calls, never across the network
+    check = replica_device_start(rp);
+    if (check != PUFS_SUCCESS) {
+        ret = 1;
+        goto CLOSE;
+    }
+    check = replica_handshake_keys(&packet);
+    pufs_end(__func__);
+    if ((check != PUFS_SUCCESS) || (replica_handshake_exchange(&packet) != PUFS_SUCCESS)) {
+        ret = 1;
+        goto CLOSE;
+    }
+    check = replica_device_start(rp);
+    if (check != PUFS_SUCCESS) {
+        ret = 1;
+        goto CLOSE;
+    }
+    check = replica_handshake_kek(&packet);
+    for (i = 0; (check == PUFS_SUCCESS) && (i < num); i++) {
+        ret = replica_rewrap(&packet, &entries[i], &batch[sent]);
+        if (ret == 1) {
+            APP_WARN("%s generation:[%u] expired before replication\n", entries[i].macaddr, entries[i].generation);
+            ret = 0;
+            continue;
+        }
+        if (ret != 0) {
+            break;
+        }
+        seqs[sent++] = entries[i].seq;
+    }
+    pufs_end(__func__);
+    if ((check != PUFS_SUCCESS) || (ret != 0)) {
+        ret = 1;
+        goto CLOSE;
+    }
+
+    // pipeline the batch, then collect the acks in order
+    packet.send_buf_size = sizeof(wrap_packet_st);
+    for (i = 0; i < sent; i++) {
+        memcpy(packet.send_buf, &batch[i], sizeof(wrap_packet_st));
+        if (replica_send(&packet) != 0) {
+            APP_ERR("send to %s:%s fail\n", sb->host, sb->port);
+            sent = i;
+            ret = 1;
+            break;
+        }
+    }
+    result = (result_packet_st *)(packet.recv_buf);
+    for (acks = 0; acks < sent; acks++) {
+        if ((replica_recv(&packet) != 0) || (result->event != REPLICATE_KEY) ||
+                (result->result != SERVER_SUCCESS)) {
+            APP_ERR("%s:%s rejected %s generation:[%u]\n", sb->host, sb->port,
+                    batch[acks].wrap_key.macaddr, batch[acks].generation);
+            ret = 1;
+            break;
+        }
+    }
+    // advance over acked and expired records, up to the first failure
+    done = first - 1;
+    for (i = 0, j = 0; i < num; i++) {
+        if ((j < sent) && (entries[i].seq == seqs[j])) {
+            if (j >= acks) {
+                break;
+            }
+            j++;
+        }
+        done = entries[i].seq;
+    }
+    if (ret == 0) {
+        result = (result_packet_st *)(packet.send_buf);
+        memset(result, 0, sizeof(result_packet_st));
+        result->event = FINAL_RESULT;
+        result->result = SERVER_SUCCESS;
+        strncpy(result->packet_name, "RESULT_REPLICA", 15);
+        packet.send_buf_size = sizeof(result_packet_st);
+        replica_send(&packet);
+    }
+    replica_advance(rp, sb, done, acks);
+CLOSE:
+    replica_close(packet.ssl, sockfd);
+EXIT:
+    return ret;
+}
+
+static int replica_pending(replica_st *rp, replica_standby_st *sb, time_t now)
+{
+    return (sb->acked < rp->head) && (sb->retry_at <= now);
+}
+
+static void *replica_shipper(void *arg)
+{
+    replica_st *rp = (replica_st *)arg;
+    replica_standby_st *sb;
+    struct timespec ts;
+    int i, pending;
+
+    pthread_mutex_lock(&rp->lock);
+    while (!rp->stop) {
+        for (i = 0, pending = 0; i < rp->standby_num; i++) {
+            pending |= replica_pending(rp, &rp->standbys[i], time(NULL));
+        }
+        if (!pending) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&rp->cond, &rp->lock, &ts);
+            continue;
+        }
+        pthread_mutex_unlock(&rp->lock);
+
+        // let concurrent commits join the batch
+        usleep(REPLICA_BATCH_DELAY_MS * 1000);
+        for (i = 0; (i < rp->standby_num) && !rp->stop; i++) {
+            sb = &rp->standbys[i];
+            pthread_mutex_lock(&rp->lock);
+            pending = replica_pending(rp, sb, time(NULL));
+            pthread_mutex_unlock(&rp->lock);
+            if (pending && (replica_ship(rp, sb) != 0)) {
+                pthread_mutex_lock(&rp->lock);
+                sb->failures++;
+                sb->retry_at = time(NULL) + REPLICA_RETRY_INTERVAL;
+                pthread_mutex_unlock(&rp->lock);
+                APP_WARN("standby %s:%s unavailable, %lu records behind\n", sb->host, sb->port,
+                        (unsigned long)(rp->head - sb->acked));
+            }
+        }
+        pthread_mutex_lock(&rp->lock);
+    }
+    pthread_mutex_unlock(&rp->lock);
+    return NULL;
+}
+
+int replica_init(replica_st *rp, keystore_st *ks, int quorum)
+{
+    int ret = 0;
+
+    memset(rp, 0, sizeof(replica_st));
+    rp->keystore = ks;
+    rp->quorum = quorum;
+    rp->tail = 1;
+    pthread_mutex_init(&rp->lock, NULL);
+    pthread_cond_init(&rp->cond, NULL);
+    pthread_cond_init(&rp->acked, NULL);
+
+    // the primary authenticates to standbys with its server certificate
+    rp->ctx = SSL_CTX_new(TLS_client_method());
+    if (rp->ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        ret = 1;
+        goto EXIT;
+    }
+    if (SSL_CTX_use_certificate_file(rp->ctx, "server.crt", SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        ret = 2;
+        goto EXIT;
+    }
+    if (SSL_CTX_use_PrivateKey_file(rp->ctx, "server.key", SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        ret = 3;
+        goto EXIT;
+    }
+    if (!SSL_CTX_load_verify_locations(rp->ctx, "ca.crt", NULL)) {
+        ERR_print_errors_fp(stderr);
+        ret = 4;
+        goto EXIT;
+    }
+    SSL_CTX_set_verify(rp->ctx, SSL_VERIFY_PEER, NULL);
+EXIT:
+    return ret;
+}
+
+void replica_deinit(replica_st *rp)
+{
+    replica_stop(rp);
+    if (rp->ctx) {
+        SSL_CTX_free(rp->ctx);
+        rp->ctx = NULL;
+    }
+    pthread_cond_destroy(&rp->acked);
+    pthread_cond_destroy(&rp->cond);
+    pthread_mutex_destroy(&rp->lock);
+}
+
+int replica_add_standby(replica_st *rp, const char *addr)
+{
+    replica_standby_st *sb;
+    const char *colon = strrchr(addr, ':');
+    size_t len = colon ? (size_t)(colon - addr) : strlen(addr);
+
+    if (rp->standby_num >= REPLICA_STANDBY_MAX) {
+        APP_ERR("too many standbys, max %d\n", REPLICA_STANDBY_MAX);
+        return 1;
+    }
+    if ((len == 0) || (len >= sizeof(sb->host)) || (colon && (strlen(colon + 1) >= sizeof(sb->port)))) {
+        APP_ERR("bad standby address:[%s]\n", addr);
+        return 2;
+    }
+    sb = &rp->standbys[rp->standby_num++];
+    memset(sb, 0, sizeof(replica_standby_st));
+    memcpy(sb->host, addr, len);
+    strcpy(sb->port, colon ? colon + 1 : SERVER_PORT);
+    return 0;
+}
+
+int replica_start(replica_st *rp)
+{
+    int ret;
+
+    if (rp->standby_num == 0) {
+        return 0;
+    }
+    ret = pthread_create(&rp->shipper, NULL, replica_shipper, rp);
+    if (ret != 0) {
+        APP_ERR("pthread_create fail, ret = %d\n", ret);
+        return ret;
+    }
+    rp->running = 1;
+    return 0;
+}
+
+void replica_stop(replica_st *rp)
+{
+    if (!rp->running) {
+        return;
+    }
+    pthread_mutex_lock(&rp->lock);
+    rp->stop = 1;
+    pthread_cond_broadcast(&rp->cond);
+    pthread_cond_broadcast(&rp->acked);
+    pthread_mutex_unlock(&rp->lock);
+    pthread_join(rp->shipper, NULL);
+    rp->running = 0;
+}
+
+/* Queue a committed backup. Never blocks on the network: when a standby lags
+ * by more than REPLICA_QUEUE_MAX records the oldest ones are dropped for it
+ * and it has to be re-seeded. */
+uint64_t replica_commit(replica_st *rp, const char *macaddr, const uint8_t *cipher, uint32_t generation)
+{
+    replica_entry_st *entry;
+    uint64_t seq;
+    int i;
+
+    pthread_mutex_lock(&rp->lock);
+    seq = ++rp->head;
+    if (rp->head - rp->tail + 1 > REPLICA_QUEUE_MAX) {
+        for (i = 0; i < rp->standby_num; i++) {
+            if (rp->standbys[i].acked < rp->tail) {
+                rp->standbys[i].acked = rp->tail;
+                rp->standbys[i].lost++;
+                APP_WARN("standby %s:%s lost a record, re-seed it\n", rp->standbys[i].host, rp->standbys[i].port);
+            }
+        }
+        rp->tail++;
+    }
+    entry = &rp->queue[seq % REPLICA_QUEUE_MAX];
+    memset(entry, 0, sizeof(replica_entry_st));
+    entry->seq = seq;
+    strncpy(entry->macaddr, macaddr, sizeof(entry->macaddr) - 1);
+    memcpy(entry->cipher, cipher, sizeof(entry->cipher));
+    entry->generation = generation;
+    pthread_cond_signal(&rp->cond);
+    pthread_mutex_unlock(&rp->lock);
+    return seq;
+}
+
+/* Quorum mode: wait until enough standbys acked seq. The caller must not hold
+ * the device, the shipper needs it to rewrap the record. */
+int replica_wait(replica_st *rp, uint64_t seq)
+{
+    struct timespec ts;
+    int i, acked, ret = 0;
+
+    if (rp->quorum == REPLICA_ASYNC) {
+        return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += REPLICA_QUORUM_TIMEOUT;
+
+    pthread_mutex_lock(&rp->lock);
+    while (1) {
+        for (i = 0, acked = 0; i < rp->standby_num; i++) {
+            if (rp->standbys[i].acked >= seq) {
+                acked++;
+            }
+        }
+        if (acked >= rp->quorum) {
+            break;
+        }
+        if (rp->stop || (pthread_cond_timedwait(&rp->acked, &rp->lock, &ts) == ETIMEDOUT)) {
+            APP_ERR("seq:[%llu] acked by %d of %d standbys\n", (unsigned long long)seq, acked, rp->quorum);
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rp->lock);
+    return ret;
+}
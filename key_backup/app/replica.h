@@ -0,0 +1,109 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      replica.h
+ * @brief     Key store replication to standby servers
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __REPLICA_H__
+#define __REPLICA_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define REPLICA_STANDBY_MAX          4
+#define REPLICA_PRIMARY_MAX          4       /* primaries a standby accepts records from */
+#define REPLICA_QUEUE_MAX            1024    /* committed records not yet shipped to every standby */
+#define REPLICA_BATCH_MAX            32      /* records shipped per connection */
+#define REPLICA_BATCH_DELAY_MS       20      /* wait for more commits before shipping a batch */
+#define REPLICA_RETRY_INTERVAL       5       /* seconds before an unreachable standby is retried */
+#define REPLICA_QUORUM_TIMEOUT       10      /* seconds a backup waits for standby acks */
+#define REPLICA_DEVICE_BACKOFF_US    2000    /* retry interval while a foreground session owns the device */
+#define REPLICA_IO_TIMEOUT           10      /* seconds a standby may take to accept, send or receive */
+#define REPLICA_ASYNC                0       /* quorum 0: never wait for standbys */
+
+typedef struct {
+    uint64_t seq;
+    char macaddr[32];
+    uint8_t cipher[32];
+    uint32_t generation;
+} replica_entry_st;
+
+typedef struct {
+    char host[64];
+    char port[8];
+    uint64_t acked;                     ///< highest sequence the standby has stored
+    time_t retry_at;
+    unsigned long shipped;
+    unsigned long failures;
+    unsigned long lost;                 ///< records dropped from the queue before shipping
+} replica_standby_st;
+
+typedef struct replica {
+    keystore_st *keystore;
+    int quorum;                         ///< standby acks a backup waits for, REPLICA_ASYNC for none
+    replica_standby_st standbys[REPLICA_STANDBY_MAX];
+    int standby_num;
+    replica_entry_st queue[REPLICA_QUEUE_MAX];  ///< ring indexed by seq
+    uint64_t head;                      ///< last sequence committed
+    uint64_t tail;                      ///< oldest sequence still queued
+    SSL_CTX *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                ///< new commits for the shipper
+    pthread_cond_t acked;               ///< standby progress for quorum waiters
+    pthread_t shipper;
+    int running;
+    int stop;
+} replica_st;
+
+int replica_init(replica_st *rp, keystore_st *ks, int quorum);
+void replica_deinit(replica_st *rp);
+int replica_add_standby(replica_st *rp, const char *addr);
+int replica_start(replica_st *rp);
+void replica_stop(replica_st *rp);
+uint64_t replica_commit(replica_st *rp, const char *macaddr, const uint8_t *cipher, uint32_t generation);
+int replica_wait(replica_st *rp, uint64_t seq);
+
+// connection helpers, shared with the bulk export
+void replica_packet_init(packet_st *packet, keystore_st *ks);
+int replica_connect(replica_st *rp, replica_standby_st *sb, SSL **ssl);
+void replica_close(SSL *ssl, int sockfd);
+int replica_send(packet_st *packet);
+int replica_recv(packet_st *packet);
+pufs_status_t replica_handshake(packet_st *packet);
+pufs_status_t replica_handshake_keys(packet_st *packet);
+pufs_status_t replica_handshake_exchange(packet_st *packet);
+pufs_status_t replica_handshake_kek(packet_st *packet);
+
+#endif /* __REPLICA_H__ */
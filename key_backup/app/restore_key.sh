@@ -39,8 +39,12 @@ if [[ $SERVER_IP != "" ]] && [[ $CLIENT_IP != "" ]] && [[ $SERVER_PORT != "" ]]
         CLIENT_MAC=`ip link show $IF | awk 'NR==2 {print $2}' | tr -d ':'`
     fi
     #echo CLIENT_MAC = $CLIENT_MAC
-    echo ./client -a $SERVER_IP -p $SERVER_PORT -c $CLIENT_KEY_PASSWD -m $CLIENT_MAC -r
-    ./client -a $SERVER_IP -p $SERVER_PORT -c $CLIENT_KEY_PASSWD -m $CLIENT_MAC -r
+    # optional first argument selects a key generation, latest by default
+    if [[ $1 != "" ]]; then
+        GENERATION="-v $1"
+    fi
+    echo ./client -a $SERVER_IP -p $SERVER_PORT -c $CLIENT_KEY_PASSWD -m $CLIENT_MAC -r $GENERATION
+    ./client -a $SERVER_IP -p $SERVER_PORT -c $CLIENT_KEY_PASSWD -m $CLIENT_MAC -r $GENERATION
 else
     echo SERVER_IP = $SERVER_IP
     echo CLIENT_IP = $CLIENT_IP
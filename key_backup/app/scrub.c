@@ -0,0 +1,569 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      scrub.c
+ * @brief     Background integrity scrubber for the server key store
+ * @copyright 2023 PUFsecurity
+ *
+ * Every pass walks all key store segments and legacy .bin files on a pool of
+ * worker threads. Each record is checked for its checksum and the sizes of
+ * its wrap_key_st fields; live records are also unwrapped by the PUFse and
+ * compared with their stored HMAC. Reads are limited by a shared KiB/s
+ * budget and device work by a ms-per-second budget. Workers stand back while
+ * a client session is in flight and only take the device when it is free,
+ * so foreground requests never wait for the scrubber.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "scrub.h"
+
+static double scrub_elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void scrub_report(scrub_st *sc, int orphan, const char *where, const char *reason)
+{
+    pthread_mutex_lock(&sc->lock);
+    if (orphan) {
+        sc->orphaned++;
+    }
+    else {
+        sc->corrupt++;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    APP_WARN("%s %s: %s", orphan ? "orphaned" : "corrupt", where, reason);
+}
+
+// stand back while a client session is in flight; returns non-zero on stop
+static int scrub_yield(scrub_st *sc)
+{
+    while (keystore_busy(sc->keystore)) {
+        if (sc->stop) {
+            return 1;
+        }
+        usleep(SCRUB_BACKOFF_US);
+    }
+    return sc->stop;
+}
+
+static int scrub_io_wait(scrub_st *sc, size_t bytes)
+{
+    struct timespec now;
+    double rate = sc->io_kbps * 1024.0, wait;
+
+    while (1) {
+        if (scrub_yield(sc)) {
+            return 1;
+        }
+        pthread_mutex_lock(&sc->lock);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sc->io_tokens += rate * scrub_elapsed(&sc->io_stamp, &now);
+        if (sc->io_tokens > rate) {
+            sc->io_tokens = rate;       // at most one second of burst
+        }
+        sc->io_stamp = now;
+        if ((sc->io_tokens >= bytes) || (bytes > rate)) {
+            sc->io_tokens -= bytes;
+            sc->bytes += bytes;
+            pthread_mutex_unlock(&sc->lock);
+            return 0;
+        }
+        wait = (bytes - sc->io_tokens) / rate;
+        pthread_mutex_unlock(&sc->lock);
+        usleep((useconds_t)(wait * 1e6) + 1);
+    }
+}
+
+// microseconds of device time left in the current one second window
+static long scrub_device_wait(scrub_st *sc)
+{
+    struct timespec now;
+    double passed;
+    long left;
+
+    while (!sc->stop) {
+        pthread_mutex_lock(&sc->lock);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        passed = scrub_elapsed(&sc->device_window, &now);
+        if (passed >= 1.0) {
+            sc->device_window = now;
+            sc->device_used_us = 0;
+            passed = 0;
+        }
+        left = sc->device_ms * 1000L - sc->device_used_us;
+        pthread_mutex_unlock(&sc->lock);
+        if (left > 0) {
+            return left;
+        }
+        usleep((useconds_t)((1.0 - passed) * 1e6) + 1);
+    }
+    return 0;
+}
+
+static const char *scrub_check_wrap(const wrap_key_st *wrap_key)
+{
+    int i;
+
+    if (wrap_key->cipher_size != 32) {
+        return "bad cipher size";
+    }
+    if (wrap_key->export_key_size != 40) {
+        return "bad wrapped key size";
+    }
+    if (wrap_key->hmac_key_size != 32) {
+        return "bad hmac size";
+    }
+    if (memchr(wrap_key->packet_name, 0, sizeof(wrap_key->packet_name)) == NULL) {
+        return "packet name not terminated";
+    }
+    for (i = 0; (i < (int)sizeof(wrap_key->macaddr)) && wrap_key->macaddr[i]; i++) {
+        if (!((wrap_key->macaddr[i] >= '0' && wrap_key->macaddr[i] <= '9') ||
+              (wrap_key->macaddr[i] >= 'a' && wrap_key->macaddr[i] <= 'f') ||
+              (wrap_key->macaddr[i] >= 'A' && wrap_key->macaddr[i] <= 'F'))) {
+            return "bad mac address";
+        }
+    }
+    if (i == (int)sizeof(wrap_key->macaddr)) {
+        return "mac address not terminated";
+    }
+    return NULL;
+}
+
+/* Unwrap every record with the export key and compare the key's HMAC with the
+ * stored one. Each record gets a device session of its own, started only when
+ * no foreground thread waits for the device and the time budget of the
+ * current window allows, so a client waits behind one record at most. */
+static void scrub_verify(scrub_st *sc, scrub_item_st *items, int num)
+{
+    pufs_session_stats_st stats;
+    pufs_status_t check = PUFS_SUCCESS, result;
+    struct timespec start, now;
+    pufs_dgst_st md;
+    int i;
+
+    for (i = 0; (i < num) && !sc->stop; i++) {
+        scrub_item_st *item = &items[i];
+
+        scrub_device_wait(sc);
+        while (1) {
+            if (scrub_yield(sc)) {
+                return;
+            }
+            pufs_session_stats(&stats);
+            if (stats.waiting == 0) {
+                check = pufs_try_start(__func__);
+                if (check != E_BUSY) {
+                    break;
+                }
+            }
+            usleep(SCRUB_BACKOFF_US);
+        }
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("pufs_try_start fail, check = %d\n", check);
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, SERVER_WRAP_KEK_SLOT, 256,
+                PRF_HMAC, PUFSE_SHA_256, false,
+                NULL, 0, 1,
+                PUFKEY, SERVER_PUFSLOT_EXPORT, 256,
+                NULL, 0,  //salt
+                NULL, 0)); //info
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_import_wrapped_key, result = pufs_import_wrapped_key(SSKEY, SERVER_KEY_SLOT,
+                    item->wrap_key.export_key, 256, SERVER_WRAP_KEK_SLOT, 256, AES_KW, NULL));
+            if (result != PUFS_SUCCESS) {
+                scrub_report(sc, 0, item->where, "wrapped key does not unwrap");
+            }
+            else {
+                OPSTAT(pufs_hmac, result = pufs_hmac(&md, NULL, 0, PUFSE_SHA_256, SSKEY, SERVER_KEY_SLOT, 256));
+                if ((result != PUFS_SUCCESS) || (memcmp(md.dgst, item->wrap_key.hmac_key, 32) != 0)) {
+                    scrub_report(sc, 0, item->where, "key does not match its hmac");
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pufs_end(__func__);
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("pufs_kdf fail, check = %d\n", check);
+            return;
+        }
+        pthread_mutex_lock(&sc->lock);
+        sc->verified++;
+        sc->device_used_us += (long)(scrub_elapsed(&start, &now) * 1e6);
+        pthread_mutex_unlock(&sc->lock);
+    }
+}
+
+static void scrub_queue(scrub_st *sc, scrub_item_st *items, int *num, const wrap_key_st *wrap_key,
+        uint32_t generation, const char *where)
+{
+    if (sc->device_ms == 0) {
+        return;
+    }
+    memcpy(&items[*num].wrap_key, wrap_key, sizeof(wrap_key_st));
+    items[*num].generation = generation;
+    snprintf(items[*num].where, sizeof(items[*num].where), "%s", where);
+    if (++(*num) == SCRUB_DEVICE_BATCH) {
+        scrub_verify(sc, items, *num);
+        *num = 0;
+    }
+}
+
+static void scrub_segment(scrub_st *sc, const keystore_segment_st *seg, scrub_item_st *items)
+{
+    char path[KEYSTORE_SEGMENT_PATH_MAX], where[64], reason[64];
+    keystore_record_st *recs;
+    struct stat st;
+    uint32_t index = 0;
+    int fd, n, k, num = 0;
+    ssize_t len;
+
+    recs = malloc(sizeof(keystore_record_st) * KEYSTORE_SCAN_RECORDS);
+    if (recs == NULL) {
+        APP_ERR("malloc fail\n");
+        return;
+    }
+    keystore_segment_path(sc->keystore, seg->id, path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (keystore_segment_known(sc->keystore, seg->id)) {
+            scrub_report(sc, 0, path, "segment file is missing");
+        }
+        goto EXIT;  // otherwise compacted away since the pass started
+    }
+    if (fstat(fd, &st) == 0) {
+        if ((uint64_t)st.st_size < (uint64_t)seg->records * sizeof(keystore_record_st)) {
+            snprintf(reason, sizeof(reason), "truncated, %u records expected",
+                    seg->records);
+            scrub_report(sc, 0, path, reason);
+        }
+        else if (st.st_size % sizeof(keystore_record_st)) {
+            scrub_report(sc, 0, path, "partial record at the end");
+        }
+    }
+
+    while (1) {
+        if (scrub_io_wait(sc, sizeof(keystore_record_st) * KEYSTORE_SCAN_RECORDS)) {
+            break;
+        }
+        len = read(fd, recs, sizeof(keystore_record_st) * KEYSTORE_SCAN_RECORDS);
+        if (len <= 0) {
+            break;
+        }
+        n = len / sizeof(keystore_record_st);
+        for (k = 0; k < n; k++, index++) {
+            const char *bad = NULL;
+
+            snprintf(where, sizeof(where), "segment %u record %u", seg->id, index);
+            if (!keystore_record_valid(&recs[k])) {
+                bad = (recs[k].magic != KEYSTORE_MAGIC) ? "bad magic" : "checksum mismatch";
+            }
+            else if (recs[k].generation == 0) {
+                bad = "generation 0";
+            }
+            else {
+                bad = scrub_check_wrap(&recs[k].wrap_key);
+            }
+            if (bad != NULL) {
+                scrub_report(sc, 0, where, bad);
+            }
+            else if (keystore_record_is_live(sc->keystore, &recs[k], seg->id, index)) {
+                scrub_queue(sc, items, &num, &recs[k].wrap_key, recs[k].generation, where);
+            }
+        }
+        pthread_mutex_lock(&sc->lock);
+        sc->records += n;
+        pthread_mutex_unlock(&sc->lock);
+    }
+    close(fd);
+    if (num > 0) {
+        scrub_verify(sc, items, num);
+    }
+EXIT:
+    free(recs);
+}
+
+/* Legacy .bin files and segment files the index does not know. */
+static void scrub_directory(scrub_st *sc, scrub_item_st *items)
+{
+    keystore_st *ks = sc->keystore;
+    char path[KEY_FILE_PATH_MAX + 256], macaddr[32], cipher[72], hex[72], suffix[8];
+    struct dirent *entry;
+    wrap_key_st wrap_key, probe;
+    uint32_t id, generation;
+    const char *bad;
+    DIR *dir;
+    FILE *fp;
+    int i, ret, num = 0;
+
+    dir = opendir(ks->path[0] ? ks->path : ".");
+    if (dir == NULL) {
+        APP_ERR("opendir %s fail, errno = %d\n", ks->path, errno);
+        return;
+    }
+    while (((entry = readdir(dir)) != NULL) && !sc->stop) {
+        if ((sscanf(entry->d_name, "keystore_%8u%7s", &id, suffix) == 2) && (strcmp(suffix, ".seg") == 0)) {
+            if (!keystore_segment_known(ks, id) && (sc->orphan_num < SCRUB_ORPHAN_MAX)) {
+                sc->orphans[sc->orphan_num++] = id;
+            }
+            continue;
+        }
+        if ((strlen(entry->d_name) < 4) || (strcmp(entry->d_name + strlen(entry->d_name) - 4, ".bin") != 0)) {
+            continue;
+        }
+        if ((sscanf(entry->d_name, "%31[0-9a-fA-F]_%64[0-9a-f]%7s", macaddr, cipher, suffix) != 3) ||
+            (strlen(cipher) != 64) || (strcmp(suffix, ".bin") != 0)) {
+            scrub_report(sc, 1, entry->d_name, "not a key backup file name");
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s%s", ks->path, entry->d_name);
+        if (scrub_io_wait(sc, sizeof(wrap_key_st))) {
+            break;
+        }
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        ret = fread(&wrap_key, sizeof(wrap_key_st), 1, fp);
+        if ((ret == 1) && (fgetc(fp) != EOF)) {
+            ret = 0;
+        }
+        fclose(fp);
+        pthread_mutex_lock(&sc->lock);
+        sc->records++;
+        pthread_mutex_unlock(&sc->lock);
+        if (ret != 1) {
+            scrub_report(sc, 0, entry->d_name, "bad file size");
+            continue;
+        }
+        bad = scrub_check_wrap(&wrap_key);
+        if (bad == NULL) {
+            for (i = 0; i < 32; i++) {
+                sprintf(&hex[i * 2], "%02x", wrap_key.cipher[i]);
+            }
+            if (strcmp(hex, cipher) != 0) {
+                bad = "content does not match the file name";
+            }
+        }
+        if (bad != NULL) {
+            scrub_report(sc, 0, entry->d_name, bad);
+            continue;
+        }
+        memset(&probe, 0, sizeof(wrap_key_st));
+        memcpy(probe.cipher, wrap_key.cipher, sizeof(probe.cipher));
+        generation = KEYSTORE_LATEST;
+        if (keystore_get(ks, macaddr, &probe, &generation) == 0) {
+            scrub_report(sc, 1, entry->d_name, "superseded by the key store");
+            continue;
+        }
+        scrub_queue(sc, items, &num, &wrap_key, 0, entry->d_name);
+    }
+    closedir(dir);
+    if (num > 0) {
+        scrub_verify(sc, items, num);
+    }
+}
+
+static void *scrub_worker(void *arg)
+{
+    scrub_st *sc = (scrub_st *)arg;
+    scrub_item_st *items;
+    int item;
+
+    items = malloc(sizeof(scrub_item_st) * SCRUB_DEVICE_BATCH);
+    if (items == NULL) {
+        APP_ERR("malloc fail\n");
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&sc->lock);
+        item = (sc->stop || (sc->next > sc->seg_num)) ? -1 : sc->next++;
+        pthread_mutex_unlock(&sc->lock);
+        if (item < 0) {
+            break;
+        }
+        if (item == sc->seg_num) {
+            scrub_directory(sc, items);
+        }
+        else {
+            scrub_segment(sc, &sc->segs[item], items);
+        }
+    }
+    free(items);
+    return NULL;
+}
+
+int scrub_pass(scrub_st *sc)
+{
+    pthread_t workers[SCRUB_THREADS_MAX];
+    char path[KEYSTORE_SEGMENT_PATH_MAX];
+    struct timespec start, end;
+    int i, num = 0, ret = 0, compacting;
+
+    // records move while the compactor merges, the next pass sees them in place
+    pthread_mutex_lock(&sc->keystore->lock);
+    compacting = (sc->keystore->compacting != 0);
+    pthread_mutex_unlock(&sc->keystore->lock);
+    if (compacting) {
+        APP_INFO("compaction running, pass skipped");
+        return 0;
+    }
+    sc->seg_num = keystore_segments(sc->keystore, &sc->segs);
+    if (sc->seg_num < 0) {
+        return 1;
+    }
+    sc->next = 0;
+    sc->orphan_num = 0;
+    sc->records = sc->bytes = sc->verified = sc->corrupt = sc->orphaned = 0;
+    pthread_mutex_lock(&sc->keystore->lock);
+    sc->reclaimed = sc->keystore->reclaimed;
+    pthread_mutex_unlock(&sc->keystore->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sc->io_stamp = sc->device_window = start;
+    for (i = 0; i < sc->threads; i++) {
+        if (pthread_create(&workers[num], NULL, scrub_worker, sc) != 0) {
+            APP_ERR("pthread_create fail\n");
+            ret = 2;
+            break;
+        }
+        num++;
+    }
+    for (i = 0; i < num; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // a merge that finished during the pass explains vanished or new files
+    pthread_mutex_lock(&sc->keystore->lock);
+    if (sc->keystore->reclaimed != sc->reclaimed) {
+        sc->orphan_num = 0;
+    }
+    pthread_mutex_unlock(&sc->keystore->lock);
+    for (i = 0; i < sc->orphan_num; i++) {
+        keystore_segment_path(sc->keystore, sc->orphans[i], path);
+        if (!keystore_segment_known(sc->keystore, sc->orphans[i]) && (access(path, F_OK) == 0)) {
+            scrub_report(sc, 1, path, "segment not referenced by the key store");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(sc->segs);
+    sc->segs = NULL;
+
+    sc->pass_secs = scrub_elapsed(&start, &end);
+    sc->passes++;
+    APP_INFO("pass %lu: %lu records, %lu KiB read, %lu unwrapped, %lu corrupt, %lu orphaned in %.1f s",
+            sc->passes, sc->records, sc->bytes / 1024, sc->verified, sc->corrupt, sc->orphaned, sc->pass_secs);
+    return ret;
+}
+
+static void *scrub_scheduler(void *arg)
+{
+    scrub_st *sc = (scrub_st *)arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&sc->lock);
+    while (!sc->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += sc->interval;
+        pthread_cond_timedwait(&sc->cond, &sc->lock, &ts);
+        if (sc->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&sc->lock);
+        scrub_pass(sc);
+        pthread_mutex_lock(&sc->lock);
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return NULL;
+}
+
+int scrub_init(scrub_st *sc, keystore_st *ks, int interval, int threads, int io_kbps, int device_ms)
+{
+    memset(sc, 0, sizeof(scrub_st));
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_cond_init(&sc->cond, NULL);
+    sc->keystore = ks;
+    sc->interval = interval;
+    sc->threads = threads;
+    sc->io_kbps = io_kbps;
+    sc->device_ms = device_ms;
+    if ((interval < 0) || (threads < 1) || (threads > SCRUB_THREADS_MAX) ||
+        (io_kbps < 1) || (device_ms < 0) || (device_ms > 1000)) {
+        APP_ERR("bad scrubber settings\n");
+        return 1;
+    }
+    return 0;
+}
+
+void scrub_deinit(scrub_st *sc)
+{
+    scrub_stop(sc);
+    pthread_cond_destroy(&sc->cond);
+    pthread_mutex_destroy(&sc->lock);
+}
+
+int scrub_start(scrub_st *sc)
+{
+    int ret;
+
+    if (sc->interval == 0) {
+        return 0;
+    }
+    ret = pthread_create(&sc->scheduler, NULL, scrub_scheduler, sc);
+    if (ret != 0) {
+        APP_ERR("pthread_create fail, ret = %d\n", ret);
+        return ret;
+    }
+    sc->running = 1;
+    return 0;
+}
+
+void scrub_stop(scrub_st *sc)
+{
+    if (!sc->running) {
+        return;
+    }
+    pthread_mutex_lock(&sc->lock);
+    sc->stop = 1;
+    pthread_cond_signal(&sc->cond);
+    pthread_mutex_unlock(&sc->lock);
+    pthread_join(sc->scheduler, NULL);
+    sc->running = 0;
+}
@@ -0,0 +1,104 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      scrub.h
+ * @brief     Background integrity scrubber for the server key store
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __SCRUB_H__
+#define __SCRUB_H__
+
+#include <pthread.h>
+#include "libcore.h"
+#include "keystore.h"
+
+#define SCRUB_INTERVAL_DEFAULT       3600    /* seconds between passes, 0 disables the scrubber */
+#define SCRUB_THREADS_DEFAULT        2
+#define SCRUB_THREADS_MAX            8
+#define SCRUB_IO_DEFAULT             256     /* KiB read per second, shared by all threads */
+#define SCRUB_DEVICE_DEFAULT         20      /* ms of device time per second, 0 skips unwrap checks */
+#define SCRUB_DEVICE_BATCH           16      /* records queued before they are verified */
+#define SCRUB_BACKOFF_US             10000   /* retry interval while a foreground session runs */
+#define SCRUB_ORPHAN_MAX             64
+
+typedef struct {
+    wrap_key_st wrap_key;
+    uint32_t generation;
+    char where[64];                     ///< segment/index or file name, for the report
+} scrub_item_st;
+
+typedef struct {
+    keystore_st *keystore;
+    int interval;
+    int threads;
+    int io_kbps;
+    int device_ms;
+
+    // work of the current pass
+    keystore_segment_st *segs;
+    int seg_num;
+    int next;                           ///< next work item, seg_num is the legacy directory
+    uint32_t orphans[SCRUB_ORPHAN_MAX]; ///< unknown segment files, confirmed at the end of the pass
+    int orphan_num;
+    unsigned long reclaimed;            ///< compactor progress when the pass started
+
+    // budgets
+    double io_tokens;
+    struct timespec io_stamp;
+    struct timespec device_window;
+    long device_used_us;
+
+    // totals of the last pass
+    unsigned long passes;
+    unsigned long records;
+    unsigned long bytes;
+    unsigned long verified;
+    unsigned long corrupt;
+    unsigned long orphaned;
+    double pass_secs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t scheduler;
+    int running;
+    int stop;
+} scrub_st;
+
+int scrub_init(scrub_st *sc, keystore_st *ks, int interval, int threads, int io_kbps, int device_ms);
+void scrub_deinit(scrub_st *sc);
+int scrub_start(scrub_st *sc);
+void scrub_stop(scrub_st *sc);
+int scrub_pass(scrub_st *sc);
+
+#endif /* __SCRUB_H__ */
@@ -37,17 +37,36 @@
  */
 
 #include "libcore.h"
+#include "keystore.h"
+#include "replica.h"
+#include "bulk.h"
+#include "scrub.h"
+#include "metrics.h"
+#include "trace.h"
 
 server_state_t g_server_state = INIT;
+keystore_st g_keystore;
+replica_st g_replica;
+scrub_st g_scrub;
+int g_standby = 0;              // accept records replicated from a primary
+char *g_primaries[REPLICA_PRIMARY_MAX];  // certificate common names allowed to replicate
+int g_primary_num = 0;
+uint64_t g_replica_seq = 0;     // backup of this session waiting for a standby quorum
+unsigned long g_bulk_records = 0;
+trace_st g_trace;               // phases of the current session
 
 // send message to server
 void send_to_client(packet_st *packet) {
-    SSL_write(packet->ssl, packet->send_buf, packet->send_buf_size);
+    int ret;
+
+    TRACE(&g_trace, send, ret = SSL_write(packet->ssl, packet->send_buf, packet->send_buf_size));
+    metrics_wire(METRICS_LINK_CLIENT, 1, ret);
 }
 
 // receive message from server
 int recv_from_client(packet_st *packet) {
-    packet->recv_buf_size = SSL_read(packet->ssl, packet->recv_buf, RECV_BUF_MAX);
+    TRACE(&g_trace, recv, packet->recv_buf_size = SSL_read(packet->ssl, packet->recv_buf, RECV_BUF_MAX));
+    metrics_wire(METRICS_LINK_CLIENT, 0, packet->recv_buf_size);
     return packet->recv_buf_size;
 }
 
@@ -77,11 +96,81 @@ static pufs_status_t ecdh_exchange_handle(packet_st *packet)
     return check;
 }
 
-int server_event_handle(packet_st *packet)
+static void server_result(packet_st *packet, server_event_t event, server_resp_t result)
+{
+    result_packet_st *result_packet = (result_packet_st*)(packet->send_buf);
+    result_packet->event = event;
+    result_packet->result = result;
+    strncpy(result_packet->packet_name, "RESULT_SERVER", 14);
+    packet->send_buf_size = sizeof(result_packet_st);
+}
+
+/* Records carry their own MAC and generation, so only a configured primary,
+ * authenticated by a certificate verified against ca.crt, may send them. */
+static int primary_check(packet_st *packet)
+{
+    X509 *cert = NULL;
+    char name[256];
+    int i, ret = 1;
+
+    if (!g_standby) {
+        APP_ERR("replication not enabled, start the standby with -s\n");
+        goto EXIT;
+    }
+    cert = SSL_get_peer_certificate(packet->ssl);
+    if ((cert == NULL) || (SSL_get_verify_result(packet->ssl) != X509_V_OK)) {
+        APP_ERR("replication needs a verified peer certificate\n");
+        goto EXIT;
+    }
+    if (X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, name, sizeof(name)) < 0) {
+        APP_ERR("peer certificate without a common name\n");
+        goto EXIT;
+    }
+    for (i = 0; i < g_primary_num; i++) {
+        if (strcmp(name, g_primaries[i]) == 0) {
+            ret = 0;
+            goto EXIT;
+        }
+    }
+    APP_ERR("peer:[%s] is not an allowed primary\n", name);
+EXIT:
+    if (cert) {
+        X509_free(cert);
+    }
+    return ret;
+}
+
+/* Store a record shipped by the primary under the primary's generation. The
+ * client MAC comes with the record, not from the ARP table. */
+static pufs_status_t replicate_handle(packet_st *packet)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+    wrap_packet_st *wrap_packet = (wrap_packet_st *)(packet->recv_buf);
+    char macaddr[32];
+
+    check = server_import_wrap(packet);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("server_import_wrap fail. check = %d", check);
+        goto RET;
+    }
+    memcpy(macaddr, packet->macaddress, sizeof(macaddr));
+    memset(packet->macaddress, 0, sizeof(packet->macaddress));
+    memcpy(packet->macaddress, wrap_packet->wrap_key.macaddr, sizeof(packet->macaddress) - 1);
+    check = server_export_to_file(packet);
+    memcpy(packet->macaddress, macaddr, sizeof(macaddr));
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("server_export_to_file fail. check = %d", check);
+        goto RET;
+    }
+    APP_DBG("(%d) replicated %s generation:[%u]\n", __LINE__, wrap_packet->wrap_key.macaddr, packet->generation);
+RET:
+    return check;
+}
+
+static int server_event_dispatch(packet_st *packet, server_state_t event)
 {
     int ret = 0;
     pufs_status_t check = PUFS_SUCCESS;
-    server_state_t event = (server_state_t)packet->recv_ecdh_packet->event;
     g_server_state = ERROR;
     switch (event) {
         case ECDH_EXCHANGE:
@@ -94,6 +183,7 @@ int server_event_handle(packet_st *packet)
             }
             break;
         case BACKUP_KEY:
+            ((wrap_packet_st *)packet->recv_buf)->generation = KEYSTORE_LATEST;
             check = server_import_wrap(packet);
             if (check != PUFS_SUCCESS) {
                 APP_ERR("server_import_wrap fail. check = %d", check);
@@ -108,6 +198,11 @@ int server_event_handle(packet_st *packet)
                 g_server_state = ERROR;
                 break;
             }
+            printf("Key generation: %u\n", packet->generation);
+            if (g_replica.standby_num) {
+                g_replica_seq = replica_commit(&g_replica, packet->macaddress,
+                        ((wrap_packet_st *)packet->recv_buf)->wrap_key.cipher, packet->generation);
+            }
             result_packet_st *result_packet = (result_packet_st*)(packet->send_buf);
             result_packet->event = FINAL_RESULT;
             result_packet->result = SERVER_SUCCESS;
@@ -133,8 +228,53 @@ int server_event_handle(packet_st *packet)
             packet->send_buf_size = sizeof(wrap_packet_st);
             g_server_state = SERVER_HANDLER;
             break;
+        case REPLICATE_KEY:
+            if (primary_check(packet) != 0) {
+                server_result(packet, REPLICATE_KEY, SERVER_ERROR);
+                ret = 1;
+                g_server_state = ERROR;
+                break;
+            }
+            check = replicate_handle(packet);
+            if (check != PUFS_SUCCESS) {
+                server_result(packet, REPLICATE_KEY, SERVER_ERROR);
+                ret = 1;
+                g_server_state = ERROR;
+                break;
+            }
+            server_result(packet, REPLICATE_KEY, SERVER_SUCCESS);
+            g_server_state = ECDH_SHARED;
+            break;
+        case BULK_KEY:
+            if (primary_check(packet) != 0) {
+                ret = 1;
+                g_server_state = ERROR;
+                break;
+            }
+            if (!packet->keystore->bulk && (keystore_bulk_begin(packet->keystore) != 0)) {
+                ret = 1;
+                g_server_state = ERROR;
+                break;
+            }
+            check = replicate_handle(packet);
+            if (check != PUFS_SUCCESS) {
+                APP_ERR("import stopped after %lu records\n", g_bulk_records);
+                ret = 1;
+                g_server_state = ERROR;
+                break;
+            }
+            g_bulk_records++;
+            g_server_state = ECDH_SHARED;
+            break;
         case FINAL_RESULT:
             APP_DBG("(%d) event:[%d]\n", __LINE__, event);
+            if (packet->keystore->bulk) {
+                ret = keystore_bulk_end(packet->keystore);
+                printf("Imported %lu records\n", g_bulk_records);
+                server_result(packet, FINAL_RESULT, ret ? SERVER_ERROR : SERVER_SUCCESS);
+                send_to_client(packet);
+            }
+            g_server_state = FINISH;
             break;
         default:
             APP_ERR("(%d) event:[%d]\n", __LINE__, event);
@@ -143,6 +283,46 @@ int server_event_handle(packet_st *packet)
     return ret;
 }
 
+// every request is timed, FINAL_RESULT only closes the session
+int server_event_handle(packet_st *packet)
+{
+    server_state_t event = (server_state_t)packet->recv_ecdh_packet->event;
+    uint64_t start = opstat_now();
+    int ret, failed;
+
+    ret = server_event_dispatch(packet, event);
+    failed = (g_server_state == ERROR);
+    switch ((int)event) {
+        case ECDH_EXCHANGE:
+            metrics_request(METRICS_REQUEST_ECDH, start, failed);
+            trace_phase(&g_trace, TRACE_ecdh, start);
+            break;
+        case BACKUP_KEY:
+            metrics_request(METRICS_REQUEST_BACKUP, start, failed);
+            trace_phase(&g_trace, TRACE_backup, start);
+            trace_kind(&g_trace, "backup");
+            break;
+        case RESTORE_KEY:
+            metrics_request(METRICS_REQUEST_RESTORE, start, failed);
+            trace_phase(&g_trace, TRACE_restore, start);
+            trace_kind(&g_trace, "restore");
+            break;
+        case REPLICATE_KEY:
+            metrics_request(METRICS_REQUEST_REPLICATE, start, failed);
+            trace_phase(&g_trace, TRACE_replicate, start);
+            trace_kind(&g_trace, "replicate");
+            break;
+        case BULK_KEY:
+            metrics_request(METRICS_REQUEST_BULK, start, failed);
+            trace_phase(&g_trace, TRACE_bulk, start);
+            trace_kind(&g_trace, "bulk");
+            break;
+        default:
+            break;
+    }
+    return ret;
+}
+
 void server_packet_init(packet_st *server_packet)
 {
     server_packet->type = SERVER;
@@ -158,25 +338,28 @@ void server_packet_init(packet_st *server_packet)
 
 void server_state_handle(packet_st *packet)
 {
-    int ret = 0;
+    int ret = 0, device = 0;
     g_server_state = CONNECTED;
     server_event_t event;
     result_packet_st *result_packet = (result_packet_st*)(packet->send_buf);
     pufs_status_t check = PUFS_SUCCESS;
 
-    check = pufs_start(__func__);
+    keystore_session_begin(packet->keystore);
+    TRACE(&g_trace, device_wait, check = pufs_start(__func__));
     if (check != PUFS_SUCCESS) {
         APP_ERR("pufs_module_init failed, check = %d", check);
         goto EXIT;
     }
+    device = 1;
     enroll();
     while (1) {
         switch (g_server_state) {
             case CONNECTED:
                 ret = recv_from_client(packet);
-                if (ret < 0) {
+                if (ret <= 0) {
                     APP_ERR("recv_from_client fail. \n");
                     g_server_state = ERROR;
+                    break;
                 }
                 event = (server_event_t)packet->recv_ecdh_packet->event;
 
@@ -193,9 +376,10 @@ void server_state_handle(packet_st *packet)
                 break;
             case ECDH_SHARED:
                 ret = recv_from_client(packet);
-                if (ret < 0) {
+                if (ret <= 0) {
                     APP_ERR("recv_from_client fail. \n");
                     g_server_state = ERROR;
+                    break;
                 }
                 event = (server_event_t)packet->recv_ecdh_packet->event;
                 if ((event == BACKUP_KEY) || (event == RESTORE_KEY)) {
@@ -204,6 +388,18 @@ void server_state_handle(packet_st *packet)
                         g_server_state = ERROR;
                     }
                 }
+                else if (event == REPLICATE_KEY) {
+                    // ack every record, the primary keeps streaming the batch
+                    ret = server_event_handle(packet);
+                    send_to_client(packet);
+                }
+                else if (event == BULK_KEY) {
+                    // no per-record ack, FINAL_RESULT commits the archive
+                    ret = server_event_handle(packet);
+                }
+                else if (event == FINAL_RESULT) {
+                    ret = server_event_handle(packet);
+                }
                 else {
                     APP_ERR("(%d) Incorrect event:[%d] state:[%d]\n", __LINE__, event, g_server_state);
                     g_server_state = ERROR;
@@ -211,6 +407,17 @@ void server_state_handle(packet_st *packet)
                 break;
             case SERVER_HANDLER:
                 event = result_packet->event;
+                if (g_replica_seq) {
+                    // the reply needs no device, hand it to the replication shipper
+                    pufs_end(__func__);
+                    device = 0;
+                    TRACE(&g_trace, replica_wait, ret = replica_wait(&g_replica, g_replica_seq));
+                    if (ret != 0) {
+                        APP_ERR("standby quorum not reached\n");
+                        result_packet->result = SERVER_ERROR;
+                    }
+                    g_replica_seq = 0;
+                }
                 send_to_client(packet);
                 g_server_state = FINISH;
                 break;
@@ -223,14 +430,22 @@ void server_state_handle(packet_st *packet)
         if ((g_server_state == ERROR) || (g_server_state == FINISH)) {
             break;
         }
-        usleep(1000);
     }
-    check = pufs_end(__func__);
-    if (check != PUFS_SUCCESS) {
-        APP_ERR("pufs_end failed, check = %d", check);
-        goto EXIT;
+    if (device) {
+        check = pufs_end(__func__);
+        if (check != PUFS_SUCCESS) {
+            APP_ERR("pufs_end failed, check = %d", check);
+            goto EXIT;
+        }
     }
 EXIT:
+    if (packet->keystore->bulk) {
+        // keep what an interrupted import already wrote
+        keystore_bulk_end(packet->keystore);
+    }
+    g_replica_seq = 0;
+    g_bulk_records = 0;
+    keystore_session_end(packet->keystore);
     return;
 }
 
@@ -268,7 +483,21 @@ EXIT:
 
 void usage(char *argv0)
 {
-    printf("Usage: %s [-p SERVER_PORT] [-d key_file_path] [-m]\n", argv0);
+    printf("Usage: %s [-p SERVER_PORT] [-d key_file_path] [-n generations] [-r host:port]... [-q quorum] [-s -P name]... [-E host:port]\n"
+           "           [-S interval] [-j threads] [-b KiB/s] [-t ms] [-M [addr:]port] [-F file] [-T file] [-m]\n", argv0);
+    printf("           -n: key generations kept per client (default %d, max %d)\n", KEYSTORE_RETENTION_DEFAULT, KEYSTORE_RETENTION_MAX);
+    printf("           -r: replicate backups to a standby server (up to %d)\n", REPLICA_STANDBY_MAX);
+    printf("           -q: standby acks a backup waits for (default 0, asynchronous)\n");
+    printf("           -s: standby, accept records replicated from a primary (implies -m)\n");
+    printf("           -P: common name of a primary certificate allowed to replicate (up to %d)\n", REPLICA_PRIMARY_MAX);
+    printf("           -E: export the whole key store to another server (started with -s) and exit\n");
+    printf("           -S: seconds between integrity scrubs (default %d, 0 disables)\n", SCRUB_INTERVAL_DEFAULT);
+    printf("           -j: scrubber threads (default %d, max %d)\n", SCRUB_THREADS_DEFAULT, SCRUB_THREADS_MAX);
+    printf("           -b: scrubber read budget in KiB/s (default %d)\n", SCRUB_IO_DEFAULT);
+    printf("           -t: scrubber device budget in ms per second (default %d, 0 skips unwrap checks)\n", SCRUB_DEVICE_DEFAULT);
+    printf("           -M: serve Prometheus metrics at http://addr:port/metrics (addr defaults to 127.0.0.1)\n");
+    printf("           -F: rewrite the Prometheus metrics to file every %d seconds\n", METRICS_FILE_INTERVAL);
+    printf("           -T: append a JSON line with the phase timings of every session to file\n");
     printf("           -m: mutual TLS\n\n");
 }
 
@@ -380,6 +609,14 @@ void handle_ssl_error(SSL* ssl, int ret) {
 int main(int argc, char *argv[])
 {
     int opt, sockfd, new_fd, path_len, ret = 0, mutual = 0;
+    int retention = KEYSTORE_RETENTION_DEFAULT;
+    int quorum = REPLICA_ASYNC;
+    char *standbys[REPLICA_STANDBY_MAX];
+    int standby_num = 0, i;
+    char *export_addr = NULL;
+    char *metrics_listen = NULL, *metrics_file = NULL, *trace_file = NULL;
+    int scrub_interval = SCRUB_INTERVAL_DEFAULT, scrub_threads = SCRUB_THREADS_DEFAULT;
+    int scrub_io = SCRUB_IO_DEFAULT, scrub_device = SCRUB_DEVICE_DEFAULT;
     char *port = SERVER_PORT;
     struct addrinfo hints, *servinfo, *p;
     struct sockaddr_storage their_addr;
@@ -393,7 +630,7 @@ int main(int argc, char *argv[])
 
     memset(&server_packet, 0, sizeof(packet_st));
 
-    while ((opt = getopt(argc, argv, "p:d:m")) != -1) {
+    while ((opt = getopt(argc, argv, "p:d:n:r:q:sP:E:S:j:b:t:M:F:T:m")) != -1) {
         switch (opt) {
             case 'p':
                 port = optarg;
@@ -422,6 +659,57 @@ int main(int argc, char *argv[])
                     server_packet.key_file_path[path_len] = '/';
                 }
                 break;
+            case 'n':
+                retention = atoi(optarg);
+                if ((retention < 1) || (retention > KEYSTORE_RETENTION_MAX)) {
+                    APP_ERR("generations:[%d] out of range!!\n", retention);
+                    goto EXIT;
+                }
+                break;
+            case 'r':
+                if (standby_num >= REPLICA_STANDBY_MAX) {
+                    APP_ERR("too many standbys, max %d!!\n", REPLICA_STANDBY_MAX);
+                    goto EXIT;
+                }
+                standbys[standby_num++] = optarg;
+                break;
+            case 'q':
+                quorum = atoi(optarg);
+                break;
+            case 's':
+                g_standby = 1;
+                break;
+            case 'P':
+                if (g_primary_num >= REPLICA_PRIMARY_MAX) {
+                    APP_ERR("too many primaries, max %d!!\n", REPLICA_PRIMARY_MAX);
+                    goto EXIT;
+                }
+                g_primaries[g_primary_num++] = optarg;
+                break;
+            case 'E':
+                export_addr = optarg;
+                break;
+            case 'S':
+                scrub_interval = atoi(optarg);
+                break;
+            case 'j':
+                scrub_threads = atoi(optarg);
+                break;
+            case 'b':
+                scrub_io = atoi(optarg);
+                break;
+            case 't':
+                scrub_device = atoi(optarg);
+                break;
+            case 'M':
+                metrics_listen = optarg;
+                break;
+            case 'F':
+                metrics_file = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
             case 'm':
                 mutual = 1;
                 break;
@@ -430,12 +718,75 @@ int main(int argc, char *argv[])
                 goto EXIT;
         }
     }
+    if (g_standby) {
+        if (g_primary_num == 0) {
+            APP_ERR("a standby needs the primaries allowed to replicate, -P name!!\n");
+            goto EXIT;
+        }
+        // primaries present server.crt, clients client.crt
+        mutual = 1;
+    }
+    if ((quorum < 0) || (quorum > standby_num)) {
+        APP_ERR("quorum:[%d] needs as many standbys!!\n", quorum);
+        goto EXIT;
+    }
     server_packet_init(&server_packet);
 
+    ret = keystore_init(&g_keystore, server_packet.key_file_path, retention);
+    if (ret != 0) {
+        APP_ERR("keystore_init fail, ret = %d\n", ret);
+        goto EXIT;
+    }
+    server_packet.keystore = &g_keystore;
+
     // initial OpenSSL library
     SSL_library_init();
     SSL_load_error_strings();
 
+    ret = replica_init(&g_replica, &g_keystore, quorum);
+    if (ret != 0) {
+        APP_ERR("replica_init fail, ret = %d\n", ret);
+        goto EXIT;
+    }
+    if (export_addr) {
+        ret = bulk_export(&g_replica, &g_keystore, export_addr);
+        replica_deinit(&g_replica);
+        keystore_deinit(&g_keystore);
+        goto EXIT;
+    }
+    ret = keystore_compactor_start(&g_keystore);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    ret = scrub_init(&g_scrub, &g_keystore, scrub_interval, scrub_threads, scrub_io, scrub_device);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    ret = scrub_start(&g_scrub);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    for (i = 0; i < standby_num; i++) {
+        ret = replica_add_standby(&g_replica, standbys[i]);
+        if (ret != 0) {
+            goto EXIT;
+        }
+    }
+    ret = replica_start(&g_replica);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    ret = metrics_start(metrics_listen, metrics_file);
+    if (ret != 0) {
+        goto EXIT;
+    }
+    if (trace_file) {
+        ret = trace_open(trace_file);
+        if (ret != 0) {
+            goto EXIT;
+        }
+    }
+
     printf("argc:[%d] argv[0]:[%s] port:[%s]\n", argc, argv[0], port);
 
     // create TCP socket
@@ -486,27 +837,38 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        trace_begin(&g_trace);
         inet_ntop(their_addr.ss_family,
                 &(((struct sockaddr_in *)&their_addr)->sin_addr),
                 ipstr, sizeof ipstr);
-        ret = query_arp(ipstr, server_packet.macaddress);
+        TRACE(&g_trace, lookup, ret = query_arp(ipstr, server_packet.macaddress));
         if (ret) {
             APP_ERR("Unknown client MAC address!!. query_arp ret:[%d]\n", ret);
+            metrics_session(METRICS_SESSION_REJECTED);
+            trace_client(&g_trace, ipstr);
+            trace_end(&g_trace, "rejected");
             continue;
         }
+        trace_client(&g_trace, server_packet.macaddress);
+        APP_DBG("(%d) session:[%016llx]\n", __LINE__, (unsigned long long)g_trace.id);
         printf("Server %s got connection from %s %s\n", SERVER_ADDR, ipstr, server_packet.macaddress);
 
         // SSL connection
         server_packet.ssl = SSL_new(ctx);
         SSL_set_fd(server_packet.ssl, new_fd);
-        if (SSL_accept(server_packet.ssl) <= 0) {
+        TRACE(&g_trace, tls, ret = SSL_accept(server_packet.ssl));
+        if (ret <= 0) {
             ERR_print_errors_fp(stderr);
             close(new_fd);
+            metrics_session(METRICS_SESSION_REJECTED);
+            trace_end(&g_trace, "rejected");
             continue;
         }
         print_cert_info(server_packet.ssl);
 
         server_state_handle(&server_packet);
+        metrics_session(g_server_state == FINISH ? METRICS_SESSION_OK : METRICS_SESSION_ERROR);
+        trace_end(&g_trace, g_server_state == FINISH ? "ok" : "error");
 
         // close SSL
         do {
@@ -533,7 +895,7 @@ int main(int argc, char *argv[])
             handle_ssl_error(server_packet.ssl, shutdownResult);
             APP_ERR("(%d) ssl close fail, ERR_get_error return:[%ld]!!!\n", __LINE__, err);
         }
-        STATISTICS_SHOW();
+        opstat_dump();
     }
 
     if (ctx) {
@@ -541,6 +903,11 @@ int main(int argc, char *argv[])
         SSL_CTX_free(ctx);
         ctx = NULL;
     }
+    metrics_stop();
+    trace_close();
+    scrub_deinit(&g_scrub);
+    replica_deinit(&g_replica);
+    keystore_deinit(&g_keystore);
 
 EXIT:
     return ret;
@@ -0,0 +1,207 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      trace.c
+ * @brief     Per-session traces of the server with phase timings
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include "trace.h"
+
+/**
+ * A session gets an ID from the wall clock second it started and a counter,
+ * so IDs stay unique across restarts. Phases and operations that repeat
+ * within a session, like recv or pufs_hmac, are added up, keeping the start
+ * of the first one. Every operation recorded by OPSTAT on the session thread
+ * is traced too, through opstat_trace. The line is written with a single
+ * write() on a file opened with O_APPEND, so lines of several servers
+ * sharing the file do not mix.
+ */
+#define TRACE_NAME(phase) #phase,
+static const char *trace_phase_names[TRACE_PHASE_NUM] = {
+    TRACE_PHASES(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+static int trace_fd = -1;
+static uint32_t trace_seq;
+
+int trace_open(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (trace_fd < 0) {
+        APP_ERR("open %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+    return 0;
+}
+
+void trace_close(void)
+{
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+static void trace_span(trace_st *t, trace_span_st *span, uint64_t start_ns, uint64_t end_ns)
+{
+    if (span->count++ == 0) {
+        span->first_ns = start_ns - t->start_ns;
+    }
+    span->total_ns += end_ns - start_ns;
+}
+
+static void trace_op(void *arg, opstat_id_t id, uint64_t start_ns, uint64_t end_ns)
+{
+    trace_st *t = arg;
+
+    trace_span(t, &t->ops[id], start_ns, end_ns);
+}
+
+void trace_begin(trace_st *t)
+{
+    struct timespec ts;
+
+    memset(t, 0, sizeof(*t));
+    if (trace_fd < 0) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->wall_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    t->id = ((uint64_t)ts.tv_sec << 24) | (++trace_seq & 0xffffff);
+    t->start_ns = opstat_now();
+    t->active = 1;
+    opstat_trace(trace_op, t);
+}
+
+void trace_client(trace_st *t, const char *client)
+{
+    size_t i, n = 0;
+
+    // only what is safe in a JSON string without escapes
+    for (i = 0; client[i] != '\0' && n < sizeof(t->client) - 1; i++) {
+        if (client[i] >= 0x20 && client[i] != '"' && client[i] != '\\') {
+            t->client[n++] = client[i];
+        }
+    }
+    t->client[n] = '\0';
+}
+
+void trace_kind(trace_st *t, const char *kind)
+{
+    if (t->kind == NULL) {
+        t->kind = kind;
+    }
+}
+
+void trace_phase(trace_st *t, trace_phase_t phase, uint64_t start_ns)
+{
+    if (!t->active) {
+        return;
+    }
+    trace_span(t, &t->phases[phase], start_ns, opstat_now());
+}
+
+static size_t trace_put(char *line, size_t pos, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (pos >= TRACE_LINE_MAX) {
+        return pos;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(line + pos, TRACE_LINE_MAX - pos, fmt, ap);
+    va_end(ap);
+    return n < 0 ? TRACE_LINE_MAX : pos + (size_t)n;
+}
+
+static size_t trace_put_spans(char *line, size_t pos, const char *key, const trace_span_st *spans,
+                              uint32_t num, const char *(*name)(uint32_t))
+{
+    const char *sep = "";
+    uint32_t i;
+
+    pos = trace_put(line, pos, ",\"%s\":{", key);
+    for (i = 0; i < num; i++) {
+        if (spans[i].count == 0) {
+            continue;
+        }
+        pos = trace_put(line, pos, "%s\"%s\":{\"n\":%u,\"at_us\":%llu,\"us\":%llu}", sep, name(i),
+            spans[i].count, (unsigned long long)(spans[i].first_ns / 1000),
+            (unsigned long long)(spans[i].total_ns / 1000));
+        sep = ",";
+    }
+    return trace_put(line, pos, "}");
+}
+
+static const char *trace_phase_name(uint32_t i)
+{
+    return trace_phase_names[i];
+}
+
+static const char *trace_op_name(uint32_t i)
+{
+    return opstat_name((opstat_id_t)i);
+}
+
+void trace_end(trace_st *t, const char *outcome)
+{
+    char line[TRACE_LINE_MAX];
+    size_t pos;
+
+    if (!t->active) {
+        return;
+    }
+    opstat_trace(NULL, NULL);
+    t->active = 0;
+    pos = trace_put(line, 0, "{\"id\":\"%016llx\",\"time_ms\":%llu,\"client\":\"%s\",\"kind\":\"%s\","
+        "\"outcome\":\"%s\",\"total_us\":%llu", (unsigned long long)t->id, (unsigned long long)t->wall_ms,
+        t->client, t->kind != NULL ? t->kind : "none", outcome,
+        (unsigned long long)((opstat_now() - t->start_ns) / 1000));
+    pos = trace_put_spans(line, pos, "phases", t->phases, TRACE_PHASE_NUM, trace_phase_name);
+    pos = trace_put_spans(line, pos, "ops", t->ops, OPSTAT_COUNT, trace_op_name);
+    pos = trace_put(line, pos, "}\n");
+    if (pos >= TRACE_LINE_MAX) {
+        APP_WARN("trace of session %016llx too long, dropped\n", (unsigned long long)t->id);
+        return;
+    }
+    if (write(trace_fd, line, pos) != (ssize_t)pos) {
+        APP_WARN("write trace fail, errno = %d\n", errno);
+    }
+}
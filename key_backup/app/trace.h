@@ -0,0 +1,101 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      trace.h
+ * @brief     Per-session traces of the server with phase timings
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "libcore.h"
+
+#define TRACE_LINE_MAX      8192
+
+/* Phases of a session, in the order they usually happen */
+#define TRACE_PHASES(X) \
+    X(lookup)           /* client MAC address from the ARP table */ \
+    X(tls)              /* TLS handshake */ \
+    X(device_wait)      /* pufs_start, waiting for other users of the device */ \
+    X(recv)             /* waiting for and reading a client packet */ \
+    X(ecdh) \
+    X(backup) \
+    X(restore) \
+    X(replicate) \
+    X(bulk) \
+    X(replica_wait)     /* standby quorum of a backup */ \
+    X(send)
+
+#define TRACE_ID(phase) TRACE_##phase,
+typedef enum {
+    TRACE_PHASES(TRACE_ID)
+    TRACE_PHASE_NUM
+} trace_phase_t;
+#undef TRACE_ID
+
+typedef struct {
+    uint32_t count;
+    uint64_t first_ns;          ///< first start, from the session start
+    uint64_t total_ns;
+} trace_span_st;
+
+typedef struct {
+    uint64_t id;
+    uint64_t start_ns;          ///< monotonic
+    uint64_t wall_ms;           ///< realtime of the start, to match the logs
+    char client[32];
+    const char *kind;           ///< first request after the ECDH exchange
+    int active;
+    trace_span_st phases[TRACE_PHASE_NUM];
+    trace_span_st ops[OPSTAT_COUNT];    ///< device calls and key store I/O of the session thread
+} trace_st;
+
+/* One JSON line per session is appended to path; without trace_open sessions are not traced */
+int trace_open(const char *path);
+void trace_close(void);
+
+void trace_begin(trace_st *t);
+void trace_client(trace_st *t, const char *client);
+void trace_kind(trace_st *t, const char *kind);
+void trace_phase(trace_st *t, trace_phase_t phase, uint64_t start_ns);
+void trace_end(trace_st *t, const char *outcome);
+
+/* Times the statement as a phase, e.g. TRACE(t, tls, ret = SSL_accept(ssl)); */
+#define TRACE(t, phase, ...) do { \
+    uint64_t trace_start = opstat_now(); \
+    __VA_ARGS__; \
+    trace_phase(t, TRACE_##phase, trace_start); \
+} while (0)
+
+#endif /* __TRACE_H__ */
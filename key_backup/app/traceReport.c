@@ -0,0 +1,309 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      traceReport.c
+ * @brief     Per-phase latency breakdown of the session traces of the server
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include "trace.h"
+
+#define REPORT_NAME_MAX     64
+#define REPORT_NAMES_MAX    (TRACE_PHASE_NUM + OPSTAT_COUNT)
+
+// time of one phase or operation over the sessions it showed up in
+typedef struct {
+    char name[REPORT_NAME_MAX];
+    int op;                     ///< a device call or key store I/O, not a phase
+    uint64_t calls;
+    uint64_t total_us;
+    uint64_t *us;               ///< per session
+    size_t num, cap;
+} report_entry_st;
+
+typedef struct {
+    const char *kind;
+    const char *outcome;
+    report_entry_st total;
+    report_entry_st entries[REPORT_NAMES_MAX];
+    size_t entry_num;
+    unsigned long skipped;
+} report_st;
+
+static int report_add(report_entry_st *entry, uint64_t calls, uint64_t us)
+{
+    uint64_t *grown;
+
+    if (entry->num == entry->cap) {
+        entry->cap = entry->cap ? entry->cap * 2 : 256;
+        grown = realloc(entry->us, entry->cap * sizeof(*grown));
+        if (grown == NULL) {
+            APP_ERR("realloc fail\n");
+            return -1;
+        }
+        entry->us = grown;
+    }
+    entry->us[entry->num++] = us;
+    entry->calls += calls;
+    entry->total_us += us;
+    return 0;
+}
+
+static report_entry_st *report_entry(report_st *report, const char *name, size_t len, int op)
+{
+    report_entry_st *entry;
+    size_t i;
+
+    if (len >= REPORT_NAME_MAX) {
+        return NULL;
+    }
+    for (i = 0; i < report->entry_num; i++) {
+        entry = &report->entries[i];
+        if (entry->op == op && strncmp(entry->name, name, len) == 0 && entry->name[len] == '\0') {
+            return entry;
+        }
+    }
+    if (report->entry_num == REPORT_NAMES_MAX) {
+        return NULL;
+    }
+    entry = &report->entries[report->entry_num++];
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->op = op;
+    return entry;
+}
+
+// the string value of "key":"..." in line, NULL without it
+static const char *report_string(const char *line, const char *key, size_t *len)
+{
+    char pattern[32];
+    const char *p, *end;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    p = strstr(line, pattern);
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(pattern);
+    end = strchr(p, '"');
+    if (end == NULL) {
+        return NULL;
+    }
+    *len = (size_t)(end - p);
+    return p;
+}
+
+static int report_match(const char *line, const char *key, const char *want)
+{
+    const char *value;
+    size_t len;
+
+    if (want == NULL) {
+        return 1;
+    }
+    value = report_string(line, key, &len);
+    return value != NULL && strlen(want) == len && strncmp(value, want, len) == 0;
+}
+
+// "key":{"name":{"n":1,"at_us":2,"us":3},...}
+static int report_spans(report_st *report, const char *line, const char *key, int op)
+{
+    char pattern[32];
+    const char *p, *name;
+    unsigned long long calls, us;
+    report_entry_st *entry;
+    size_t len;
+    int used;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":{", key);
+    p = strstr(line, pattern);
+    if (p == NULL) {
+        return -1;
+    }
+    p += strlen(pattern);
+    while (*p == '"') {
+        name = ++p;
+        p = strchr(p, '"');
+        if (p == NULL) {
+            return -1;
+        }
+        len = (size_t)(p - name);
+        if (sscanf(p, "\":{\"n\":%llu,\"at_us\":%*u,\"us\":%llu}%n", &calls, &us, &used) != 2) {
+            return -1;
+        }
+        p += used;
+        entry = report_entry(report, name, len, op);
+        if (entry == NULL || report_add(entry, calls, us) != 0) {
+            return -1;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return *p == '}' ? 0 : -1;
+}
+
+static int report_line(report_st *report, const char *line)
+{
+    unsigned long long total_us;
+    const char *p;
+
+    if (!report_match(line, "kind", report->kind) || !report_match(line, "outcome", report->outcome)) {
+        return 0;
+    }
+    p = strstr(line, "\"total_us\":");
+    if (p == NULL || sscanf(p, "\"total_us\":%llu", &total_us) != 1) {
+        return -1;
+    }
+    if (report_spans(report, line, "phases", 0) != 0 || report_spans(report, line, "ops", 1) != 0) {
+        return -1;
+    }
+    return report_add(&report->total, 1, total_us);
+}
+
+static int report_file(report_st *report, FILE *fp, const char *path)
+{
+    char line[TRACE_LINE_MAX];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(fp)) {
+            APP_ERR("%s: line too long\n", path);
+            return -1;
+        }
+        if (report_line(report, line) != 0) {
+            report->skipped++;
+        }
+    }
+    return 0;
+}
+
+static int report_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// sessions without the phase count for the share, not for the percentiles
+static void report_print(report_entry_st *entry, uint64_t total_us)
+{
+    qsort(entry->us, entry->num, sizeof(*entry->us), report_cmp);
+    printf("%-32s %8zu %8llu %10.3f %10.3f %10.3f %6.1f%%\n", entry->name, entry->num,
+        (unsigned long long)entry->calls,
+        entry->us[(entry->num - 1) / 2] / 1000.0,
+        entry->us[(entry->num - 1) * 99 / 100] / 1000.0,
+        entry->us[entry->num - 1] / 1000.0,
+        total_us ? 100.0 * entry->total_us / total_us : 0.0);
+}
+
+static void report_show(report_st *report)
+{
+    size_t i;
+    int op;
+
+    if (report->skipped) {
+        APP_WARN("%lu lines skipped, not traces of this server\n", report->skipped);
+    }
+    if (report->total.num == 0) {
+        printf("no sessions\n");
+        return;
+    }
+    printf("%-32s %8s %8s %10s %10s %10s %7s\n", "", "sessions", "calls", "p50 ms", "p99 ms", "max ms", "share");
+    strcpy(report->total.name, "session");
+    report_print(&report->total, report->total.total_us);
+    // phases split the session, operations are timed inside them
+    for (op = 0; op <= 1; op++) {
+        printf("%s\n", op ? "operations:" : "phases:");
+        for (i = 0; i < report->entry_num; i++) {
+            if (report->entries[i].op == op) {
+                report_print(&report->entries[i], report->total.total_us);
+            }
+        }
+    }
+}
+
+void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-k kind] [-o outcome] [file]...\n", argv0);
+    fprintf(stderr, "   read the traces a server appends with -T (default stdin)\n");
+    fprintf(stderr, "   -k  only sessions of kind: backup, restore, replicate, bulk or none\n");
+    fprintf(stderr, "   -o  only sessions with outcome: ok, error or rejected\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    report_st report;
+    FILE *fp;
+    int opt, ret = 0;
+    size_t i;
+
+    memset(&report, 0, sizeof(report));
+    while ((opt = getopt(argc, argv, "k:o:")) != -1) {
+        switch (opt) {
+            case 'k':
+                report.kind = optarg;
+                break;
+            case 'o':
+                report.outcome = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind == argc) {
+        ret = report_file(&report, stdin, "stdin");
+    }
+    for (; optind < argc && ret == 0; optind++) {
+        fp = fopen(argv[optind], "r");
+        if (fp == NULL) {
+            APP_ERR("open %s fail, errno = %d\n", argv[optind], errno);
+            ret = -1;
+            goto EXIT;
+        }
+        ret = report_file(&report, fp, argv[optind]);
+        fclose(fp);
+    }
+    if (ret == 0) {
+        report_show(&report);
+    }
+
+EXIT:
+    free(report.total.us);
+    for (i = 0; i < report.entry_num; i++) {
+        free(report.entries[i].us);
+    }
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,381 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      treecrypt.c
+ * @brief     Recursive directory encryption over a pool of file workers
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "blockio.h"
+#include "gcmfile.h"
+#include "treecrypt.h"
+
+/**
+ * The tree is walked once up front: directories are mirrored under out_dir
+ * and regular files are dealt round robin to the workers. Each worker turns
+ * whole files into chunked GCM files, one at a time, and steals from the
+ * other workers when its own files run out, so a few large files do not
+ * leave the rest of the pool idle. All workers share the caller's device
+ * session; gcmfile serializes the device calls between them.
+ */
+
+static double treecrypt_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int treecrypt_join(char *buf, const char *root, const char *rel)
+{
+    int n = snprintf(buf, PATH_MAX, "%s%s%s", root, rel[0] ? "/" : "", rel);
+
+    if (n < 0 || n >= PATH_MAX) {
+        APP_ERR("path %s/%s is too long\n", root, rel);
+        return -1;
+    }
+    return 0;
+}
+
+static int treecrypt_add(treecrypt_st *tc, const char *rel, uint64_t size)
+{
+    treecrypt_file_st *files;
+
+    if (tc->nfiles == tc->cap) {
+        tc->cap = tc->cap ? tc->cap * 2 : 256;
+        files = realloc(tc->files, tc->cap * sizeof(*files));
+        if (files == NULL) {
+            APP_ERR("file list alloc fail\n");
+            return -1;
+        }
+        tc->files = files;
+    }
+    tc->files[tc->nfiles].path = strdup(rel);
+    if (tc->files[tc->nfiles].path == NULL) {
+        return -1;
+    }
+    tc->files[tc->nfiles].size = size;
+    tc->nfiles++;
+    tc->total_bytes += size;
+    return 0;
+}
+
+/* Mirrors directory rel and collects its files, symlinks and special files are skipped */
+static int treecrypt_walk(treecrypt_st *tc, const char *rel)
+{
+    char path[PATH_MAX], child[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int ret = -1;
+
+    if (treecrypt_join(path, tc->in_dir, rel) != 0 || stat(path, &st) != 0) {
+        APP_ERR("stat %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+    if (treecrypt_join(child, tc->out_dir, rel) != 0) {
+        return -1;
+    }
+    if (mkdir(child, st.st_mode & 07777) != 0 && errno != EEXIST) {
+        APP_ERR("mkdir %s fail, errno = %d\n", child, errno);
+        return -1;
+    }
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        APP_ERR("opendir %s fail, errno = %d\n", path, errno);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name) >= PATH_MAX ||
+            treecrypt_join(path, tc->in_dir, child) != 0) {
+            goto EXIT;
+        }
+        if (lstat(path, &st) != 0) {
+            APP_ERR("stat %s fail, errno = %d\n", path, errno);
+            goto EXIT;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (treecrypt_walk(tc, child) != 0) {
+                goto EXIT;
+            }
+        }
+        else if (S_ISREG(st.st_mode)) {
+            if (treecrypt_add(tc, child, st.st_size) != 0) {
+                goto EXIT;
+            }
+        }
+        else {
+            APP_WARN("%s is not a regular file, skipped\n", path);
+        }
+    }
+    ret = 0;
+EXIT:
+    closedir(dir);
+    return ret;
+}
+
+/**
+ * Walks in_dir and creates the mirrored directories under out_dir. out_dir
+ * must not lie inside in_dir, or the walk would pick up its own output.
+ */
+int treecrypt_open(treecrypt_st *tc, const char *in_dir, const char *out_dir, int decrypt,
+                   int envelope, uint32_t chunk_size, int workers)
+{
+    char in_real[PATH_MAX], out_real[PATH_MAX];
+    size_t len;
+    uint32_t i;
+    int w;
+
+    memset(tc, 0, sizeof(*tc));
+    tc->in_dir = in_dir;
+    tc->out_dir = out_dir;
+    tc->decrypt = decrypt;
+    tc->envelope = envelope;
+    tc->chunk_size = chunk_size;
+    tc->workers = workers;
+    pthread_mutex_init(&tc->lock, NULL);
+    pthread_cond_init(&tc->cond, NULL);
+    for (w = 0; w < TREECRYPT_WORKERS_MAX; w++) {
+        pthread_mutex_init(&tc->deques[w].lock, NULL);
+    }
+
+    if (workers < 1 || workers > TREECRYPT_WORKERS_MAX) {
+        APP_ERR("workers %d is out of [1, %d]\n", workers, TREECRYPT_WORKERS_MAX);
+        return -1;
+    }
+    if (!decrypt && !blockio_block_valid(chunk_size)) {
+        return -1;
+    }
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        APP_ERR("mkdir %s fail, errno = %d\n", out_dir, errno);
+        return -1;
+    }
+    if (realpath(in_dir, in_real) == NULL || realpath(out_dir, out_real) == NULL) {
+        APP_ERR("%s or %s is not a directory\n", in_dir, out_dir);
+        return -1;
+    }
+    len = strlen(in_real);
+    if (strncmp(in_real, out_real, len) == 0 && (out_real[len] == '\0' || out_real[len] == '/')) {
+        APP_ERR("output tree %s is inside the input tree %s\n", out_dir, in_dir);
+        return -1;
+    }
+
+    if (treecrypt_walk(tc, "") != 0) {
+        return -1;
+    }
+
+    for (w = 0; w < workers; w++) {
+        tc->deques[w].items = malloc((tc->nfiles / workers + 1) * sizeof(uint32_t));
+        if (tc->deques[w].items == NULL) {
+            APP_ERR("work queue alloc fail\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < tc->nfiles; i++) {
+        treecrypt_deque_st *dq = &tc->deques[i % workers];
+
+        dq->items[dq->tail++] = i;
+    }
+    return 0;
+}
+
+void treecrypt_close(treecrypt_st *tc)
+{
+    uint32_t i;
+    int w;
+
+    for (i = 0; i < tc->nfiles; i++) {
+        free(tc->files[i].path);
+    }
+    free(tc->files);
+    for (w = 0; w < TREECRYPT_WORKERS_MAX; w++) {
+        free(tc->deques[w].items);
+        pthread_mutex_destroy(&tc->deques[w].lock);
+    }
+    pthread_cond_destroy(&tc->cond);
+    pthread_mutex_destroy(&tc->lock);
+    memset(tc, 0, sizeof(*tc));
+}
+
+/* Next file for worker self: its own newest one, else the oldest of another worker */
+static int treecrypt_take(treecrypt_st *tc, int self, uint32_t *index)
+{
+    treecrypt_deque_st *dq = &tc->deques[self];
+    int w, found = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *index = dq->items[--dq->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    for (w = 1; !found && w < tc->workers; w++) {
+        dq = &tc->deques[(self + w) % tc->workers];
+        pthread_mutex_lock(&dq->lock);
+        if (dq->head < dq->tail) {
+            *index = dq->items[dq->head++];
+            found = 1;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (found) {
+            pthread_mutex_lock(&tc->lock);
+            tc->stolen++;
+            pthread_mutex_unlock(&tc->lock);
+        }
+    }
+    return found;
+}
+
+static pufs_status_t treecrypt_file(treecrypt_st *tc, const treecrypt_file_st *file)
+{
+    char in_path[PATH_MAX], out_path[PATH_MAX];
+    pufs_status_t check = PUFS_ERROR;
+    gcmfile_st gf;
+
+    if (treecrypt_join(in_path, tc->in_dir, file->path) != 0 ||
+        treecrypt_join(out_path, tc->out_dir, file->path) != 0) {
+        return PUFS_ERROR;
+    }
+    if (gcmfile_open(&gf, in_path, out_path, tc->decrypt, tc->chunk_size, 1, tc->envelope) == 0) {
+        check = gcmfile_run(&gf);
+    }
+    gcmfile_close(&gf);
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("%s failed, check = %d\n", in_path, check);
+        // nothing unauthenticated or half written is left behind
+        unlink(out_path);
+    }
+    return check;
+}
+
+typedef struct {
+    treecrypt_st *tc;
+    int self;
+} treecrypt_worker_st;
+
+static void *treecrypt_worker(void *arg)
+{
+    treecrypt_worker_st *w = arg;
+    treecrypt_st *tc = w->tc;
+    pufs_status_t check;
+    uint32_t index;
+
+    while (treecrypt_take(tc, w->self, &index)) {
+        check = treecrypt_file(tc, &tc->files[index]);
+        pthread_mutex_lock(&tc->lock);
+        tc->done_files++;
+        if (check == PUFS_SUCCESS) {
+            tc->done_bytes += tc->files[index].size;
+        }
+        else {
+            tc->failed_files++;
+        }
+        pthread_mutex_unlock(&tc->lock);
+    }
+    return NULL;
+}
+
+/* One progress line per TREECRYPT_REPORT_SECS until the workers are done */
+static void *treecrypt_report(void *arg)
+{
+    treecrypt_st *tc = arg;
+    struct timespec until;
+    double start = treecrypt_now(), secs;
+
+    pthread_mutex_lock(&tc->lock);
+    while (tc->running) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += TREECRYPT_REPORT_SECS;
+        if (pthread_cond_timedwait(&tc->cond, &tc->lock, &until) != ETIMEDOUT) {
+            continue;
+        }
+        secs = treecrypt_now() - start;
+        printf("%u/%u files, %llu/%llu bytes, %.2f MB/s, %u failed\n",
+            tc->done_files, tc->nfiles, (unsigned long long)tc->done_bytes,
+            (unsigned long long)tc->total_bytes, secs > 0 ? tc->done_bytes / secs / 1e6 : 0.0,
+            tc->failed_files);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&tc->lock);
+    return NULL;
+}
+
+/* Every file of the tree, a failed file does not stop the others. Needs a device session */
+pufs_status_t treecrypt_run(treecrypt_st *tc)
+{
+    treecrypt_worker_st workers[TREECRYPT_WORKERS_MAX];
+    pthread_t tids[TREECRYPT_WORKERS_MAX], reporter;
+    double start = treecrypt_now();
+    int i, started = 0, reporting;
+
+    tc->running = 1;
+    reporting = pthread_create(&reporter, NULL, treecrypt_report, tc) == 0;
+    for (i = 0; i < tc->workers; i++) {
+        workers[i].tc = tc;
+        workers[i].self = i;
+        if (pthread_create(&tids[i], NULL, treecrypt_worker, &workers[i]) != 0) {
+            APP_ERR("treecrypt worker %d fail\n", i);
+            break;
+        }
+        started++;
+    }
+    // any files a failed start left behind are stolen by the started workers
+    if (started == 0) {
+        treecrypt_worker(&(treecrypt_worker_st){ tc, 0 });
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    pthread_mutex_lock(&tc->lock);
+    tc->running = 0;
+    pthread_cond_signal(&tc->cond);
+    pthread_mutex_unlock(&tc->lock);
+    if (reporting) {
+        pthread_join(reporter, NULL);
+    }
+    tc->run_secs = treecrypt_now() - start;
+    return tc->failed_files == 0 ? PUFS_SUCCESS : PUFS_ERROR;
+}
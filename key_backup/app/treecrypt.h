@@ -0,0 +1,93 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      treecrypt.h
+ * @brief     Recursive directory encryption over a pool of file workers
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __TREECRYPT_H__
+#define __TREECRYPT_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define TREECRYPT_WORKERS_DEFAULT   4
+#define TREECRYPT_WORKERS_MAX       16
+#define TREECRYPT_REPORT_SECS       1
+
+typedef struct {
+    char *path;                 ///< relative to the tree roots
+    uint64_t size;
+} treecrypt_file_st;
+
+/* Files of one worker, it takes from the tail and others steal from the head */
+typedef struct {
+    uint32_t *items;
+    uint32_t head;
+    uint32_t tail;
+    pthread_mutex_t lock;
+} treecrypt_deque_st;
+
+typedef struct {
+    const char *in_dir;
+    const char *out_dir;
+    int decrypt;
+    int envelope;
+    int workers;
+    uint32_t chunk_size;
+
+    treecrypt_file_st *files;
+    uint32_t nfiles;
+    uint32_t cap;
+    uint64_t total_bytes;
+    treecrypt_deque_st deques[TREECRYPT_WORKERS_MAX];
+
+    // progress, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t done_files;
+    uint32_t failed_files;
+    uint32_t stolen;
+    uint64_t done_bytes;        ///< input bytes of the files done without error
+    int running;
+
+    double run_secs;
+} treecrypt_st;
+
+int treecrypt_open(treecrypt_st *tc, const char *in_dir, const char *out_dir, int decrypt,
+                   int envelope, uint32_t chunk_size, int workers);
+void treecrypt_close(treecrypt_st *tc);
+pufs_status_t treecrypt_run(treecrypt_st *tc);
+
+#endif /* __TREECRYPT_H__ */
@@ -0,0 +1,367 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      xts.c
+ * @brief     XTS sector encryption for disk images and block devices
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#include "libcore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "blockio.h"
+#include "xts.h"
+#include "keyslot.h"
+
+/**
+ * Sectors are encrypted with AES-256-XTS (IEEE 1619): key 1 is the client
+ * key, key 2 is derived from it into CLIENT_XTS_SLOT, and the tweak is the
+ * little-endian sector number. Every sector stands alone and keeps its size,
+ * so any range can be converted in place, and workers take batches of
+ * sectors in any order. Device calls take turns on pufs_device_lock.
+ */
+
+typedef struct {
+    xts_st *xs;
+    pufs_sp38e_ctx *ctx;
+    u8 *in;
+    u8 *out;
+} xts_worker_st;
+
+static double xts_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Claims CLIENT_XTS_SLOT from the named keys, released by xts_run */
+static pufs_status_t xts_tweak_key(void)
+{
+    pufs_status_t check = PUFS_SUCCESS;
+
+    check = keyslot_claim(CLIENT_XTS_SLOT);
+    if (check != PUFS_SUCCESS) {
+        return check;
+    }
+    OPSTAT(pufs_kdf, check = pufs_kdf(SSKEY, CLIENT_XTS_SLOT, 256,
+            PRF_HMAC, PUFSE_SHA_256, false,
+            NULL, 0, 1,
+            SSKEY, CLIENT_KEY_SLOT, 256,
+            NULL, 0,  //salt
+            (const uint8_t *)XTS_TWEAK_INFO, strlen(XTS_TWEAK_INFO))); //info
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("pufs_kdf fail. check = %d \n", check);
+        keyslot_release(CLIENT_XTS_SLOT);
+    }
+    return check;
+}
+
+static pufs_status_t xts_sector(xts_worker_st *w, uint64_t sector, const u8 *in, u8 *out)
+{
+    xts_st *xs = w->xs;
+    pufs_status_t check = PUFS_SUCCESS;
+    u8 tweak[16] = {0};
+    uint32_t n, total;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        tweak[i] = sector >> (8 * i);
+    }
+
+    if (xs->decrypt) {
+        OPSTAT(pufs_dec_xts_init, check = pufs_dec_xts_init(w->ctx, AES, SSKEY, CLIENT_KEY_SLOT, 256,
+            SSKEY, CLIENT_XTS_SLOT, tweak, 0));
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_dec_xts_update, check = pufs_dec_xts_update(w->ctx, out, &total, in, xs->sector_size));
+        }
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_dec_xts_final, check = pufs_dec_xts_final(w->ctx, out + total, &n));
+            total += n;
+        }
+    }
+    else {
+        OPSTAT(pufs_enc_xts_init, check = pufs_enc_xts_init(w->ctx, AES, SSKEY, CLIENT_KEY_SLOT, 256,
+            SSKEY, CLIENT_XTS_SLOT, tweak, 0));
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_enc_xts_update, check = pufs_enc_xts_update(w->ctx, out, &total, in, xs->sector_size));
+        }
+        if (check == PUFS_SUCCESS) {
+            OPSTAT(pufs_enc_xts_final, check = pufs_enc_xts_final(w->ctx, out + total, &n));
+            total += n;
+        }
+    }
+    if (check == PUFS_SUCCESS && total != xs->sector_size) {
+        check = PUFS_ERROR;
+    }
+    return check;
+}
+
+static pufs_status_t xts_batch(xts_worker_st *w, uint64_t batch)
+{
+    xts_st *xs = w->xs;
+    pufs_status_t check = PUFS_SUCCESS;
+    uint64_t sector = xs->first + batch * xs->batch_sectors;
+    uint64_t num = xs->first + xs->count - sector;
+    off_t off = sector * xs->sector_size;
+    size_t len, done;
+    ssize_t n;
+    double start;
+
+    if (num > xs->batch_sectors) {
+        num = xs->batch_sectors;
+    }
+    len = num * xs->sector_size;
+
+    for (done = 0; done < len; done += n) {
+        n = pread(xs->fd_in, w->in + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            APP_ERR("read sector %llu fail, errno = %d\n", (unsigned long long)sector, errno);
+            return PUFS_ERROR;
+        }
+    }
+
+    // one lock for the batch, the device is busy with it anyway
+    pufs_device_lock();
+    start = xts_now();
+    for (done = 0; done < num && check == PUFS_SUCCESS; done++) {
+        check = xts_sector(w, sector + done, w->in + done * xs->sector_size,
+            w->out + done * xs->sector_size);
+    }
+    xs->device_secs += xts_now() - start;
+    pufs_device_unlock();
+    if (check != PUFS_SUCCESS) {
+        APP_ERR("sector %llu fail, check = %d\n", (unsigned long long)(sector + done - 1), check);
+        return check;
+    }
+
+    for (done = 0; done < len; done += n) {
+        n = pwrite(xs->fd_out, w->out + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n < 0) {
+            APP_ERR("write sector %llu fail, errno = %d\n", (unsigned long long)sector, errno);
+            return PUFS_ERROR;
+        }
+    }
+    return PUFS_SUCCESS;
+}
+
+static void *xts_worker(void *arg)
+{
+    xts_worker_st *w = arg;
+    xts_st *xs = w->xs;
+    pufs_status_t check;
+    uint64_t batch;
+
+    for (;;) {
+        pthread_mutex_lock(&xs->lock);
+        if (xs->error != PUFS_SUCCESS || xs->next >= xs->batches) {
+            pthread_mutex_unlock(&xs->lock);
+            break;
+        }
+        batch = xs->next++;
+        pthread_mutex_unlock(&xs->lock);
+
+        check = xts_batch(w, batch);
+        if (check != PUFS_SUCCESS) {
+            pthread_mutex_lock(&xs->lock);
+            if (xs->error == PUFS_SUCCESS) {
+                xs->error = check;
+                xs->bad_sector = xs->first + batch * xs->batch_sectors;
+            }
+            pthread_mutex_unlock(&xs->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Bytes on a regular file or a block device */
+static int xts_size(int fd, uint64_t *size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        return ioctl(fd, BLKGETSIZE64, size);
+    }
+    *size = st.st_size;
+    return 0;
+}
+
+/**
+ * count 0 means up to the last whole sector. The output is neither created
+ * empty nor truncated, so a range can be rewritten inside an existing image.
+ */
+int xts_open(xts_st *xs, const char *read_file, const char *write_file, int decrypt,
+             uint32_t sector_size, size_t batch_size, int threads, uint64_t first, uint64_t count)
+{
+    uint64_t size;
+
+    memset(xs, 0, sizeof(*xs));
+    xs->fd_in = xs->fd_out = -1;
+    xs->decrypt = decrypt;
+    xs->threads = threads;
+    xs->sector_size = sector_size;
+    pthread_mutex_init(&xs->lock, NULL);
+
+    if (sector_size < XTS_SECTOR_MIN || sector_size > XTS_SECTOR_MAX ||
+        (sector_size & (sector_size - 1)) != 0) {
+        APP_ERR("sector size %u is not a power of two in [%d, %d]\n",
+            sector_size, XTS_SECTOR_MIN, XTS_SECTOR_MAX);
+        return -1;
+    }
+    if (threads < 1 || threads > XTS_THREADS_MAX) {
+        APP_ERR("threads %d is out of [1, %d]\n", threads, XTS_THREADS_MAX);
+        return -1;
+    }
+    if (!blockio_block_valid(batch_size)) {
+        return -1;
+    }
+    xs->batch_sectors = batch_size / sector_size;
+
+    if (blockio_same_file(read_file, write_file)) {
+        xs->fd_in = xs->fd_out = open(read_file, O_RDWR);
+    }
+    else {
+        xs->fd_in = open(read_file, O_RDONLY);
+        if (xs->fd_in >= 0) {
+            xs->fd_out = open(write_file, O_WRONLY | O_CREAT, 0644);
+        }
+    }
+    if (xs->fd_in < 0 || xs->fd_out < 0) {
+        APP_ERR("open %s fail, errno = %d\n", xs->fd_in < 0 ? read_file : write_file, errno);
+        return -1;
+    }
+    if (xts_size(xs->fd_in, &size) != 0) {
+        APP_ERR("size of %s fail, errno = %d\n", read_file, errno);
+        return -1;
+    }
+    xs->sectors = size / sector_size;
+    if (size % sector_size != 0) {
+        APP_WARN("%s ends with %llu bytes short of a sector, they are neither converted nor copied\n",
+            read_file, (unsigned long long)(size % sector_size));
+    }
+
+    if (count == 0 && first <= xs->sectors) {
+        count = xs->sectors - first;
+    }
+    if (first > xs->sectors || count > xs->sectors - first) {
+        APP_ERR("sectors %llu+%llu are beyond the %llu sectors of %s\n", (unsigned long long)first,
+            (unsigned long long)count, (unsigned long long)xs->sectors, read_file);
+        return -1;
+    }
+    xs->first = first;
+    xs->count = count;
+    xs->batches = (count + xs->batch_sectors - 1) / xs->batch_sectors;
+    return 0;
+}
+
+void xts_close(xts_st *xs)
+{
+    if (xs->fd_out >= 0 && xs->fd_out != xs->fd_in) {
+        close(xs->fd_out);
+    }
+    if (xs->fd_in >= 0) {
+        close(xs->fd_in);
+    }
+    xs->fd_in = xs->fd_out = -1;
+    pthread_mutex_destroy(&xs->lock);
+}
+
+/* Converts the sector range, batches spread over the workers. Needs a device session */
+pufs_status_t xts_run(xts_st *xs)
+{
+    xts_worker_st workers[XTS_THREADS_MAX];
+    pthread_t tids[XTS_THREADS_MAX];
+    pufs_status_t check = PUFS_SUCCESS;
+    double start = xts_now();
+    size_t size = (size_t)xs->batch_sectors * xs->sector_size;
+    int i, started = 0;
+
+    memset(workers, 0, sizeof(workers));
+    check = xts_tweak_key();
+    if (check != PUFS_SUCCESS) {
+        goto RET;
+    }
+
+    for (i = 0; i < xs->threads; i++) {
+        workers[i].xs = xs;
+        workers[i].ctx = pufs_sp38e_ctx_new();
+        workers[i].in = malloc(size);
+        workers[i].out = malloc(size);
+        if (workers[i].ctx == NULL || workers[i].in == NULL || workers[i].out == NULL ||
+            pthread_create(&tids[i], NULL, xts_worker, &workers[i]) != 0) {
+            APP_ERR("xts worker %d fail\n", i);
+            pthread_mutex_lock(&xs->lock);
+            xs->error = PUFS_ERROR;
+            pthread_mutex_unlock(&xs->lock);
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    for (i = 0; i < xs->threads; i++) {
+        if (workers[i].ctx != NULL) {
+            pufs_sp38e_ctx_free(workers[i].ctx);
+        }
+        free(workers[i].in);
+        free(workers[i].out);
+    }
+    keyslot_release(CLIENT_XTS_SLOT);
+
+    check = xs->error;
+    if (check == PUFS_SUCCESS && fsync(xs->fd_out) != 0 && errno != EINVAL) {
+        APP_ERR("fsync fail, errno = %d\n", errno);
+        check = PUFS_ERROR;
+    }
+RET:
+    xs->run_secs = xts_now() - start;
+    return check;
+}
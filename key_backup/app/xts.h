@@ -0,0 +1,79 @@
+/***********************************************************************************
+ *
+ *  Copyright (c) 2023-2024, PUFsecurity
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  3. Neither the name of PUFsecurity nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ *  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ *  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************************/
+/**
+ * @file      xts.h
+ * @brief     XTS sector encryption for disk images and block devices
+ * @copyright 2023 PUFsecurity
+ *
+ */
+
+#ifndef __XTS_H__
+#define __XTS_H__
+
+#include <pthread.h>
+#include "libcore.h"
+
+#define XTS_SECTOR_MIN          512
+#define XTS_SECTOR_MAX          4096
+#define XTS_SECTOR_DEFAULT      4096
+#define XTS_THREADS_DEFAULT     4
+#define XTS_THREADS_MAX         16
+#define XTS_TWEAK_INFO          "keybackup xts tweak key"
+
+typedef struct {
+    int fd_in;
+    int fd_out;                 ///< same as fd_in when rewriting in place
+    int decrypt;
+    int threads;
+    uint32_t sector_size;
+    uint32_t batch_sectors;     ///< sectors a worker reads, converts and writes at once
+    uint64_t first;             ///< sector range
+    uint64_t count;
+    uint64_t sectors;           ///< whole sectors on the input
+
+    // shared by the workers
+    uint64_t next;              ///< next batch
+    uint64_t batches;
+    pufs_status_t error;
+    uint64_t bad_sector;
+    pthread_mutex_t lock;
+
+    double run_secs;
+    double device_secs;
+} xts_st;
+
+int xts_open(xts_st *xs, const char *read_file, const char *write_file, int decrypt,
+             uint32_t sector_size, size_t batch_size, int threads, uint64_t first, uint64_t count);
+void xts_close(xts_st *xs);
+pufs_status_t xts_run(xts_st *xs);
+
+#endif /* __XTS_H__ */